@@ -1,7 +1,1094 @@
+#include <immintrin.h>
+#include <intrin.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
 
 #include "Base.h"
+#include "Regex.h"
+
+static const wchar_t emptyLine[] = L"";
+
+static size_t CountChars(const wchar_t * chars, size_t length, wchar_t c) {
+    size_t count = 0;
+    for (size_t i = 0; i != length; i++) {
+        if (chars[i] == c) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static size_t CountBytes(const char * bytes, size_t count, char c) {
+    size_t found = 0;
+    const char * end = bytes + count;
+    while (true) {
+        bytes = static_cast<const char *>(memchr(bytes, c, end - bytes));
+        if (!bytes) {
+            return found;
+        }
+        found++;
+        bytes++;
+    }
+}
+
+static ulong CharColCount(wchar_t c) {
+    return c == L'\t' ? config.tabWidth : 1;
+}
+
+//-----------
+// UTF-8
+
+static bool IsUtf8Continuation(char b) {
+    return (static_cast<unsigned char>(b) & 0xC0) == 0x80;
+}
+
+static size_t Utf8SequenceLength(char b) {
+    unsigned char lead = static_cast<unsigned char>(b);
+    return lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+}
+
+static size_t SumBytes(__m128i sums) {
+    sums = _mm_sad_epu8(sums, _mm_setzero_si128());
+    return static_cast<size_t>(_mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums)));
+}
+
+// Counts the UTF-16 units, line breaks and tabs of UTF-8 text, sixteen bytes at a time. Every byte
+// but a continuation byte starts a unit, and the lead byte of a four byte sequence starts two.
+static void CountUtf8(const char * bytes, size_t count, size_t * length, size_t * lineBreakCount, size_t * tabCount) {
+    const __m128i lineBreak = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i lastContinuation = _mm_set1_epi8(static_cast<char>(0xBF));
+    const __m128i lastThreeByteLead = _mm_set1_epi8(static_cast<char>(0xEF));
+    const __m128i zero = _mm_setzero_si128();
+
+    *length = 0;
+    *lineBreakCount = 0;
+    *tabCount = 0;
+    size_t i = 0;
+    while (count - i >= 16) {
+        // The comparisons yield -1 per matching byte, so subtracting them counts in bytes. A unit
+        // count grows by up to two per block and must be summed up before it overflows.
+        size_t blockCount = (count - i) / 16 < 127 ? (count - i) / 16 : 127;
+        __m128i unitSums = zero;
+        __m128i lineBreakSums = zero;
+        __m128i tabSums = zero;
+        for (size_t j = 0; j != blockCount; j++, i += 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+            unitSums = _mm_sub_epi8(unitSums, _mm_cmpgt_epi8(block, lastContinuation));
+            unitSums = _mm_sub_epi8(unitSums, _mm_and_si128(_mm_cmpgt_epi8(block, lastThreeByteLead), _mm_cmplt_epi8(block, zero)));
+            lineBreakSums = _mm_sub_epi8(lineBreakSums, _mm_cmpeq_epi8(block, lineBreak));
+            tabSums = _mm_sub_epi8(tabSums, _mm_cmpeq_epi8(block, tab));
+        }
+        *length += SumBytes(unitSums);
+        *lineBreakCount += SumBytes(lineBreakSums);
+        *tabCount += SumBytes(tabSums);
+    }
+
+    for (; i != count; i++) {
+        unsigned char b = static_cast<unsigned char>(bytes[i]);
+        if (!IsUtf8Continuation(bytes[i])) {
+            *length += b >= 0xF0 ? 2 : 1;
+        }
+        if (b == '\n') {
+            (*lineBreakCount)++;
+        } else if (b == '\t') {
+            (*tabCount)++;
+        }
+    }
+}
+
+// Returns the number of UTF-16 units of UTF-8 text. With crlf, the text is that of a piece holding
+// a CR in front of each LF, and a CR LF counts as one unit.
+static size_t Utf8Length(const char * bytes, size_t count, bool crlf) {
+    size_t length;
+    size_t lineBreakCount;
+    size_t tabCount;
+    CountUtf8(bytes, count, &length, &lineBreakCount, &tabCount);
+    return crlf ? length - lineBreakCount : length;
+}
+
+// Returns the byte offset of the sequence holding a UTF-16 position of UTF-8 text, and whether the
+// position falls between the two units of a surrogate pair. With crlf, a CR LF is one sequence.
+static size_t Utf8Offset(const char * bytes, size_t count, size_t pos, bool * midPair, bool crlf) {
+    size_t i = 0;
+    *midPair = false;
+    while (i != count) {
+        size_t sequenceLength = Utf8SequenceLength(bytes[i]);
+        if (crlf && bytes[i] == '\r' && i + 1 != count && bytes[i + 1] == '\n') {
+            sequenceLength = 2;
+        }
+        size_t units = sequenceLength == 4 ? 2 : 1;
+        if (pos < units) {
+            *midPair = pos != 0;
+            return i;
+        }
+        pos -= units;
+        i += sequenceLength;
+    }
+    return i;
+}
+
+// Decodes length UTF-16 units of UTF-8 text, starting at a UTF-16 position. With crlf, the CR of
+// each CR LF is skipped.
+static void DecodeUtf8(const char * bytes, size_t count, size_t pos, size_t length, wchar_t * chars, bool crlf) {
+    bool midPair;
+    const unsigned char * next = reinterpret_cast<const unsigned char *>(bytes) + Utf8Offset(bytes, count, pos, &midPair, crlf);
+    const unsigned char * end = reinterpret_cast<const unsigned char *>(bytes) + count;
+    size_t i = 0;
+    while (i != length) {
+        unsigned char lead = *next++;
+        if (lead < 0x80) {
+            if (!(crlf && lead == '\r' && next != end && *next == '\n')) {
+                chars[i++] = lead;
+            }
+            continue;
+        }
+
+        ulong codePoint;
+        if (lead < 0xE0) {
+            codePoint = (lead & 0x1F) << 6 | (next[0] & 0x3F);
+            next += 1;
+        } else if (lead < 0xF0) {
+            codePoint = (lead & 0x0F) << 12 | (next[0] & 0x3F) << 6 | (next[1] & 0x3F);
+            next += 2;
+        } else {
+            codePoint = (lead & 0x07) << 18 | (next[0] & 0x3F) << 12 | (next[1] & 0x3F) << 6 | (next[2] & 0x3F);
+            next += 3;
+        }
+
+        if (codePoint < 0x10000) {
+            chars[i++] = static_cast<wchar_t>(codePoint);
+        } else {
+            codePoint -= 0x10000;
+            if (!midPair) {
+                chars[i++] = static_cast<wchar_t>(0xD800 | codePoint >> 10);
+            }
+            if (i != length) {
+                chars[i++] = static_cast<wchar_t>(0xDC00 | (codePoint & 0x3FF));
+            }
+        }
+        midPair = false;
+    }
+}
+
+// Checks the sequence starting UTF-8 text and returns its length, or 0 if it is malformed. Then
+// the number of bytes to replace with a single U+FFFD is set, following MkUtf8Read: a sequence
+// spans as many bytes as its lead byte tells, as far as continuation bytes follow. It is replaced
+// as a whole if it is cut short, overlong, a surrogate or beyond U+10FFFF. A continuation byte
+// without a lead byte and a byte that cannot lead a sequence are replaced on their own.
+static size_t CheckUtf8Sequence(const unsigned char * next, size_t count, size_t * malformedCount) {
+    unsigned char lead = next[0];
+    if (lead < 0x80) {
+        return 1;
+    }
+
+    size_t sequenceLength;
+    ulong codePoint;
+    ulong minCodePoint;
+    if (lead < 0xC0 || lead > 0xF7) {
+        *malformedCount = 1;
+        return 0;
+    } else if (lead < 0xE0) {
+        sequenceLength = 2;
+        codePoint = lead & 0x1F;
+        minCodePoint = 0x80;
+    } else if (lead < 0xF0) {
+        sequenceLength = 3;
+        codePoint = lead & 0x0F;
+        minCodePoint = 0x800;
+    } else {
+        sequenceLength = 4;
+        codePoint = lead & 0x07;
+        minCodePoint = 0x10000;
+    }
+
+    for (size_t i = 1; i != sequenceLength; i++) {
+        if (i == count || !IsUtf8Continuation(static_cast<char>(next[i]))) {
+            *malformedCount = i;
+            return 0;
+        }
+        codePoint = codePoint << 6 | (next[i] & 0x3F);
+    }
+    if (codePoint < minCodePoint || (codePoint >= 0xD800 && codePoint <= 0xDFFF) || codePoint > 0x10FFFF) {
+        *malformedCount = sequenceLength;
+        return 0;
+    }
+    return sequenceLength;
+}
+
+bool IsDocUtf8(const char * bytes, size_t count) {
+    const unsigned char * next = reinterpret_cast<const unsigned char *>(bytes);
+    const unsigned char * end = next + count;
+    while (next != end) {
+        // skip ASCII sixteen bytes at a time
+        while (end - next >= 16 && _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(next))) == 0) {
+            next += 16;
+        }
+        if (next == end) {
+            break;
+        }
+
+        size_t malformedCount;
+        size_t sequenceLength = CheckUtf8Sequence(next, end - next, &malformedCount);
+        if (sequenceLength == 0) {
+            return false;
+        }
+        next += sequenceLength;
+    }
+    return true;
+}
+
+//---------------
+// Transcoding
+
+// The transcoders hand runs of ASCII to block functions, which convert whole blocks as long as
+// they hold nothing else and return how much they converted. Everything else goes through the
+// scalar code. The widest block functions the processor supports are picked on first use.
+
+struct AsciiBlockFunctions {
+    size_t (*decode)(const char * bytes, size_t count, wchar_t * chars);
+    size_t (*encode)(const wchar_t * chars, size_t length, char * bytes);
+};
+
+static size_t DecodeAsciiSse2(const char * bytes, size_t count, wchar_t * chars) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    while (count - i >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+        if (_mm_movemask_epi8(block) != 0) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(chars + i), _mm_unpacklo_epi8(block, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(chars + i + 8), _mm_unpackhi_epi8(block, zero));
+        i += 16;
+    }
+    return i;
+}
+
+static size_t EncodeAsciiSse2(const wchar_t * chars, size_t length, char * bytes) {
+    const __m128i nonAscii = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    while (length - i >= 16) {
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chars + i));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chars + i + 8));
+        __m128i bits = _mm_and_si128(_mm_or_si128(low, high), nonAscii);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(bits, zero)) != 0xFFFF) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(bytes + i), _mm_packus_epi16(low, high));
+        i += 16;
+    }
+    return i;
+}
+
+static size_t DecodeAsciiAvx2(const char * bytes, size_t count, wchar_t * chars) {
+    size_t i = 0;
+    while (count - i >= 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bytes + i));
+        if (_mm256_movemask_epi8(block) != 0) {
+            break;
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(chars + i), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(block)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(chars + i + 16), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(block, 1)));
+        i += 32;
+    }
+    return i + DecodeAsciiSse2(bytes + i, count - i, chars + i);
+}
+
+static size_t EncodeAsciiAvx2(const wchar_t * chars, size_t length, char * bytes) {
+    const __m256i nonAscii = _mm256_set1_epi16(static_cast<short>(0xFF80));
+    size_t i = 0;
+    while (length - i >= 32) {
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(chars + i));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(chars + i + 16));
+        __m256i bits = _mm256_and_si256(_mm256_or_si256(low, high), nonAscii);
+        if (!_mm256_testz_si256(bits, bits)) {
+            break;
+        }
+        // packing works within 128-bit lanes, which leaves the quarters in the order 0, 2, 1, 3
+        __m256i packed = _mm256_packus_epi16(low, high);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(bytes + i), _mm256_permute4x64_epi64(packed, 0xD8));
+        i += 32;
+    }
+    return i + EncodeAsciiSse2(chars + i, length - i, bytes + i);
+}
+
+static const AsciiBlockFunctions sse2Functions = { DecodeAsciiSse2, EncodeAsciiSse2 };
+static const AsciiBlockFunctions avx2Functions = { DecodeAsciiAvx2, EncodeAsciiAvx2 };
+
+// Checks for AVX2 support by both the processor and the operating system, which must save the
+// upper halves of the registers on context switches.
+static bool HasAvx2() {
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & 1 << 27) != 0;
+    bool avx = (info[2] & 1 << 28) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & 1 << 5) != 0;
+}
+
+static const AsciiBlockFunctions * GetAsciiBlockFunctions() {
+    static const AsciiBlockFunctions * functions = HasAvx2() ? &avx2Functions : &sse2Functions;
+    return functions;
+}
+
+size_t TranscodeUtf8ToUtf16(const char * bytes, size_t count, wchar_t * chars) {
+    const AsciiBlockFunctions * functions = GetAsciiBlockFunctions();
+    const unsigned char * next = reinterpret_cast<const unsigned char *>(bytes);
+    size_t i = 0;
+    size_t length = 0;
+    while (i != count) {
+        size_t asciiCount = functions->decode(bytes + i, count - i, chars + length);
+        i += asciiCount;
+        length += asciiCount;
+        if (i == count) {
+            break;
+        }
+
+        unsigned char lead = next[i];
+        if (lead < 0x80) {
+            chars[length++] = lead;
+            i++;
+            continue;
+        }
+
+        size_t malformedCount;
+        size_t sequenceLength = CheckUtf8Sequence(next + i, count - i, &malformedCount);
+        if (sequenceLength == 0) {
+            chars[length++] = 0xFFFD;
+            i += malformedCount;
+            continue;
+        }
+
+        const unsigned char * sequence = next + i;
+        ulong codePoint;
+        if (sequenceLength == 2) {
+            codePoint = (lead & 0x1F) << 6 | (sequence[1] & 0x3F);
+        } else if (sequenceLength == 3) {
+            codePoint = (lead & 0x0F) << 12 | (sequence[1] & 0x3F) << 6 | (sequence[2] & 0x3F);
+        } else {
+            codePoint = (lead & 0x07) << 18 | (sequence[1] & 0x3F) << 12 | (sequence[2] & 0x3F) << 6 | (sequence[3] & 0x3F);
+        }
+        i += sequenceLength;
+
+        if (codePoint < 0x10000) {
+            chars[length++] = static_cast<wchar_t>(codePoint);
+        } else {
+            codePoint -= 0x10000;
+            chars[length++] = static_cast<wchar_t>(0xD800 | codePoint >> 10);
+            chars[length++] = static_cast<wchar_t>(0xDC00 | (codePoint & 0x3FF));
+        }
+    }
+    return length;
+}
+
+size_t TranscodeUtf16ToUtf8(const wchar_t * chars, size_t length, char * bytes) {
+    const AsciiBlockFunctions * functions = GetAsciiBlockFunctions();
+    size_t i = 0;
+    size_t count = 0;
+    while (i != length) {
+        size_t asciiCount = functions->encode(chars + i, length - i, bytes + count);
+        i += asciiCount;
+        count += asciiCount;
+        if (i == length) {
+            break;
+        }
+
+        ulong codePoint = chars[i++];
+        if (codePoint >= 0xD800 && codePoint <= 0xDFFF) {
+            if (codePoint <= 0xDBFF && i != length && chars[i] >= 0xDC00 && chars[i] <= 0xDFFF) {
+                codePoint = 0x10000 + ((codePoint - 0xD800) << 10 | (chars[i++] - 0xDC00));
+            } else {
+                codePoint = 0xFFFD; // unpaired surrogate
+            }
+        }
+
+        if (codePoint < 0x80) {
+            bytes[count++] = static_cast<char>(codePoint);
+        } else if (codePoint < 0x800) {
+            bytes[count++] = static_cast<char>(0xC0 | codePoint >> 6);
+            bytes[count++] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        } else if (codePoint < 0x10000) {
+            bytes[count++] = static_cast<char>(0xE0 | codePoint >> 12);
+            bytes[count++] = static_cast<char>(0x80 | (codePoint >> 6 & 0x3F));
+            bytes[count++] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        } else {
+            bytes[count++] = static_cast<char>(0xF0 | codePoint >> 18);
+            bytes[count++] = static_cast<char>(0x80 | (codePoint >> 12 & 0x3F));
+            bytes[count++] = static_cast<char>(0x80 | (codePoint >> 6 & 0x3F));
+            bytes[count++] = static_cast<char>(0x80 | (codePoint & 0x3F));
+        }
+    }
+    return count;
+}
+
+size_t GetTranscodedUtf8Count(const wchar_t * chars, size_t length) {
+    size_t count = 0;
+    for (size_t i = 0; i != length; i++) {
+        wchar_t c = chars[i];
+        if (c < 0x80) {
+            count += 1;
+        } else if (c < 0x800) {
+            count += 2;
+        } else if (c >= 0xD800 && c <= 0xDBFF && i + 1 != length && chars[i + 1] >= 0xDC00 && chars[i + 1] <= 0xDFFF) {
+            count += 4;
+            i++;
+        } else {
+            count += 3; // including unpaired surrogates
+        }
+    }
+    return count;
+}
+
+// Copies text with the CR of every CR LF dropped, sixteen bytes at a time. Each block is stored
+// whole, then the bytes behind each dropped CR are stored again one place further back. The stores
+// reach up to sixteen bytes past the block, so the vector loop stops two blocks before the end.
+size_t StripCarriageReturns(const char * bytes, size_t count, char * out, bool * bareLineFeeds) {
+    const __m128i carriageReturn = _mm_set1_epi8('\r');
+    const __m128i lineBreak = _mm_set1_epi8('\n');
+
+    size_t outCount = 0;
+    uint bare = 0;
+    uint carry = 0; // the last block ended with a dropped CR
+    size_t i = 0;
+    for (; count - i >= 32; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + 1));
+        uint lineFeeds = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lineBreak));
+        uint drops = _mm_movemask_epi8(_mm_cmpeq_epi8(block, carriageReturn)) & _mm_movemask_epi8(_mm_cmpeq_epi8(next, lineBreak));
+        bare |= lineFeeds & ~(drops << 1 | carry);
+        carry = drops >> 15;
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + outCount), block);
+        uint dropCount = 0;
+        unsigned long bit;
+        while (_BitScanForward(&bit, drops)) {
+            dropCount++;
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i *>(out + outCount + bit + 1 - dropCount),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + bit + 1)));
+            drops &= drops - 1;
+        }
+        outCount += 16 - dropCount;
+    }
+
+    for (; i != count; i++) {
+        if (bytes[i] == '\r' && i + 1 != count && bytes[i + 1] == '\n') {
+            continue;
+        }
+        if (bytes[i] == '\n' && (i == 0 || bytes[i - 1] != '\r')) {
+            bare = 1;
+        }
+        out[outCount++] = bytes[i];
+    }
+    *bareLineFeeds = bare != 0;
+    return outCount;
+}
+
+//-----------
+// Pieces
+
+// Sets the line break and tab counts of a piece.
+static void CountPiece(DocPiece * piece) {
+    if (piece->bytes) {
+        size_t length;
+        CountUtf8(piece->bytes, piece->byteCount, &length, &piece->lineBreakCount, &piece->tabCount);
+    } else {
+        piece->lineBreakCount = CountChars(piece->chars, piece->length, L'\n');
+        piece->tabCount = CountChars(piece->chars, piece->length, L'\t');
+    }
+}
+
+// Counts a character among the first pos units of a piece. It must not be part of a surrogate pair.
+static size_t CountPieceChars(const DocPiece * piece, size_t pos, wchar_t c) {
+    if (piece->bytes) {
+        bool midPair;
+        size_t byteOffset = Utf8Offset(piece->bytes, piece->byteCount, pos, &midPair, piece->crlf);
+        return CountBytes(piece->bytes, byteOffset, static_cast<char>(c));
+    }
+    return CountChars(piece->chars, pos, c);
+}
+
+// Copies a range of a piece, decoding it if needed.
+static void CopyPieceChars(const DocPiece * piece, size_t pos, size_t length, wchar_t * chars) {
+    if (piece->bytes) {
+        DecodeUtf8(piece->bytes, piece->byteCount, pos, length, chars, piece->crlf);
+    } else {
+        memcpy(chars, piece->chars + pos, length * sizeof(wchar_t));
+    }
+}
+
+// Returns the offset just behind the n-th line break (counting from 1) of a piece, or the end of the
+// piece if it has fewer, which its counts rule out.
+static size_t FindLineBreakEnd(const DocPiece * piece, size_t n) {
+    if (piece->bytes) {
+        const char * bytes = piece->bytes;
+        size_t i = 0;
+        while (n != 0) {
+            const char * lineBreak = static_cast<const char *>(memchr(bytes + i, '\n', piece->byteCount - i));
+            if (!lineBreak) {
+                return piece->length;
+            }
+            i = lineBreak - bytes + 1;
+            n--;
+        }
+        return Utf8Length(bytes, i, piece->crlf);
+    }
+
+    const wchar_t * chars = piece->chars;
+    size_t i = 0;
+    while (n != 0 && i != piece->length) {
+        if (chars[i++] == L'\n') {
+            n--;
+        }
+    }
+    return i;
+}
+
+//--------------
+// Piece Tree
+
+static size_t TreeLength(DocNode * tree) {
+    return tree ? tree->length : 0;
+}
+
+static size_t TreeLineBreakCount(DocNode * tree) {
+    return tree ? tree->lineBreakCount : 0;
+}
+
+static size_t TreeTabCount(DocNode * tree) {
+    return tree ? tree->tabCount : 0;
+}
+
+// Returns the column count of a subtree, with line breaks counting as one column.
+static size_t TreeColCount(DocNode * tree) {
+    return tree ? tree->length + tree->tabCount * (config.tabWidth - 1) : 0;
+}
+
+static uint TreeHeight(DocNode * tree) {
+    return tree ? tree->height : 0;
+}
+
+static void UpdateNode(DocNode * node) {
+    node->length = TreeLength(node->left) + node->piece.length + TreeLength(node->right);
+    node->lineBreakCount = TreeLineBreakCount(node->left) + node->piece.lineBreakCount + TreeLineBreakCount(node->right);
+    node->tabCount = TreeTabCount(node->left) + node->piece.tabCount + TreeTabCount(node->right);
+
+    uint leftHeight = TreeHeight(node->left);
+    uint rightHeight = TreeHeight(node->right);
+    node->height = (leftHeight > rightHeight ? leftHeight : rightHeight) + 1;
+}
+
+static void FreeNode(Doc * doc, DocNode * node) {
+    if (node) {
+        node->left = doc->freeNodes;
+        doc->freeNodes = node;
+    }
+}
+
+// Makes sure the current slab has room for at least count more nodes.
+static bool ReserveNodes(Doc * doc, size_t count) {
+    if (doc->nodeSlabFree >= count) {
+        return true;
+    }
+
+    size_t slabCount = count > DOCNODE_SLAB_COUNT ? count : DOCNODE_SLAB_COUNT;
+    DocNode * slab = (DocNode *)malloc(slabCount * sizeof(DocNode));
+    if (!slab) {
+        return false;
+    }
+    DocNode ** newSlab = doc->nodeSlabs.Insert(SIZE_MAX, 1);
+    if (!newSlab) {
+        free(slab);
+        return false;
+    }
+    *newSlab = slab;
+
+    while (doc->nodeSlabFree != 0) {
+        FreeNode(doc, doc->nodeSlabNext++);
+        doc->nodeSlabFree--;
+    }
+    doc->nodeSlabNext = slab;
+    doc->nodeSlabFree = slabCount;
+    return true;
+}
+
+static DocNode * AllocNode(Doc * doc) {
+    DocNode * node;
+    if (doc->freeNodes) {
+        node = doc->freeNodes;
+        doc->freeNodes = node->left;
+    } else {
+        if (!ReserveNodes(doc, 1)) {
+            return nullptr;
+        }
+        node = doc->nodeSlabNext++;
+        doc->nodeSlabFree--;
+    }
+    node->left = nullptr;
+    node->right = nullptr;
+    node->refCount = 1;
+    return node;
+}
+
+static DocNode * CreateNode(Doc * doc, const wchar_t * chars, size_t length) {
+    DocNode * node = AllocNode(doc);
+    if (!node) {
+        return nullptr;
+    }
+    node->piece.chars = chars;
+    node->piece.bytes = nullptr;
+    node->piece.byteCount = 0;
+    node->piece.length = length;
+    node->piece.crlf = false;
+    CountPiece(&node->piece);
+    UpdateNode(node);
+    return node;
+}
+
+static DocNode * CreateUtf8Node(Doc * doc, const char * bytes, size_t count) {
+    DocNode * node = AllocNode(doc);
+    if (!node) {
+        return nullptr;
+    }
+    node->piece.chars = nullptr;
+    node->piece.bytes = bytes;
+    node->piece.byteCount = count;
+    node->piece.crlf = false;
+    CountUtf8(bytes, count, &node->piece.length, &node->piece.lineBreakCount, &node->piece.tabCount);
+    UpdateNode(node);
+    return node;
+}
+
+// Drops a reference to a tree, freeing the nodes no snapshot holds on to.
+static void DestroyTree(Doc * doc, DocNode * tree) {
+    if (tree && --tree->refCount == 0) {
+        DestroyTree(doc, tree->left);
+        DestroyTree(doc, tree->right);
+        FreeNode(doc, tree);
+    }
+}
+
+// Snapshots share nodes with the document, so a node referenced more than once must be copied
+// before it is changed. Nothing is shared while there are no snapshots, and then this costs only
+// the check of the reference count.
+
+// Reserves nodes for a change while snapshots exist: a number of new nodes plus the copies a number
+// of joins, splits and concatenations may need. Each copies at most a few nodes per level.
+static bool ReserveCopyNodes(Doc * doc, size_t nodeCount, size_t operationCount) {
+    return doc->snapshotCount == 0 || ReserveNodes(doc, nodeCount + operationCount * 8 * (TreeHeight(doc->root) + 2));
+}
+
+// Returns a node that can be changed in place, copying it if it is shared. The reference the
+// caller held moves to the copy. The nodes must have been reserved.
+static DocNode * OwnNode(Doc * doc, DocNode * node) {
+    if (node->refCount == 1) {
+        return node;
+    }
+
+    DocNode * copy = AllocNode(doc);
+    *copy = *node;
+    copy->refCount = 1;
+    if (copy->left) {
+        copy->left->refCount++;
+    }
+    if (copy->right) {
+        copy->right->refCount++;
+    }
+    node->refCount--;
+    return copy;
+}
+
+static DocNode * RotateLeft(Doc * doc, DocNode * node) {
+    DocNode * right = OwnNode(doc, node->right);
+    node->right = right->left;
+    right->left = node;
+    UpdateNode(node);
+    UpdateNode(right);
+    return right;
+}
+
+static DocNode * RotateRight(Doc * doc, DocNode * node) {
+    DocNode * left = OwnNode(doc, node->left);
+    node->left = left->right;
+    left->right = node;
+    UpdateNode(node);
+    UpdateNode(left);
+    return left;
+}
+
+// Rebalances a node that can be changed in place.
+static DocNode * Rebalance(Doc * doc, DocNode * node) {
+    UpdateNode(node);
+
+    uint leftHeight = TreeHeight(node->left);
+    uint rightHeight = TreeHeight(node->right);
+    if (leftHeight > rightHeight + 1) {
+        if (TreeHeight(node->left->left) < TreeHeight(node->left->right)) {
+            node->left = RotateLeft(doc, OwnNode(doc, node->left));
+        }
+        return RotateRight(doc, node);
+    }
+    if (rightHeight > leftHeight + 1) {
+        if (TreeHeight(node->right->right) < TreeHeight(node->right->left)) {
+            node->right = RotateRight(doc, OwnNode(doc, node->right));
+        }
+        return RotateLeft(doc, node);
+    }
+    return node;
+}
+
+// Concatenates two trees with a single node between them, which must be changeable in place.
+static DocNode * JoinTrees(Doc * doc, DocNode * left, DocNode * middle, DocNode * right) {
+    uint leftHeight = TreeHeight(left);
+    uint rightHeight = TreeHeight(right);
+    if (leftHeight > rightHeight + 1) {
+        left = OwnNode(doc, left);
+        left->right = JoinTrees(doc, left->right, middle, right);
+        return Rebalance(doc, left);
+    }
+    if (rightHeight > leftHeight + 1) {
+        right = OwnNode(doc, right);
+        right->left = JoinTrees(doc, left, middle, right->left);
+        return Rebalance(doc, right);
+    }
+
+    middle->left = left;
+    middle->right = right;
+    UpdateNode(middle);
+    return middle;
+}
+
+static DocNode * RemoveFirstNode(Doc * doc, DocNode * tree, DocNode ** first) {
+    tree = OwnNode(doc, tree);
+    if (!tree->left) {
+        *first = tree;
+        return tree->right;
+    }
+    tree->left = RemoveFirstNode(doc, tree->left, first);
+    return Rebalance(doc, tree);
+}
+
+static DocNode * ConcatTrees(Doc * doc, DocNode * left, DocNode * right) {
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+    DocNode * first;
+    right = RemoveFirstNode(doc, right, &first);
+    return JoinTrees(doc, left, first, right);
+}
+
+// Splits a tree into the first pos characters and the rest. If pos falls inside a piece, the
+// spare node takes the second half of it and is set to NULL.
+static void SplitTree(Doc * doc, DocNode * tree, size_t pos, DocNode ** spare, DocNode ** left, DocNode ** right) {
+    if (!tree) {
+        *left = nullptr;
+        *right = nullptr;
+        return;
+    }
+    tree = OwnNode(doc, tree);
+
+    size_t leftLength = TreeLength(tree->left);
+    DocNode * treeRight = tree->right;
+    if (pos <= leftLength) {
+        DocNode * splitRight;
+        SplitTree(doc, tree->left, pos, spare, left, &splitRight);
+        *right = JoinTrees(doc, splitRight, tree, treeRight);
+    } else if (pos >= leftLength + tree->piece.length) {
+        DocNode * splitLeft;
+        SplitTree(doc, treeRight, pos - leftLength - tree->piece.length, spare, &splitLeft, right);
+        *left = JoinTrees(doc, tree->left, tree, splitLeft);
+    } else {
+        size_t offset = pos - leftLength;
+        DocNode * second = *spare;
+        *spare = nullptr;
+        if (tree->piece.bytes) {
+            bool midPair;
+            size_t byteOffset = Utf8Offset(tree->piece.bytes, tree->piece.byteCount, offset, &midPair, tree->piece.crlf);
+            second->piece.chars = nullptr;
+            second->piece.bytes = tree->piece.bytes + byteOffset;
+            second->piece.byteCount = tree->piece.byteCount - byteOffset;
+            tree->piece.byteCount = byteOffset;
+        } else {
+            second->piece.chars = tree->piece.chars + offset;
+            second->piece.bytes = nullptr;
+            second->piece.byteCount = 0;
+        }
+        second->piece.crlf = tree->piece.crlf;
+        second->piece.length = tree->piece.length - offset;
+        CountPiece(&second->piece);
+        tree->piece.length = offset;
+        tree->piece.lineBreakCount -= second->piece.lineBreakCount;
+        tree->piece.tabCount -= second->piece.tabCount;
+
+        *left = JoinTrees(doc, tree->left, tree, nullptr);
+        *right = JoinTrees(doc, nullptr, second, treeRight);
+    }
+}
+
+// Returns the node containing a position and the offset into its piece.
+// Returns NULL for the end of the document.
+static DocNode * FindPiece(DocNode * tree, size_t pos, size_t * offset) {
+    while (tree) {
+        size_t leftLength = TreeLength(tree->left);
+        if (pos < leftLength) {
+            tree = tree->left;
+        } else if (pos < leftLength + tree->piece.length) {
+            *offset = pos - leftLength;
+            return tree;
+        } else {
+            pos -= leftLength + tree->piece.length;
+            tree = tree->right;
+        }
+    }
+    *offset = 0;
+    return nullptr;
+}
+
+// Returns the node containing a position like FindPiece, copying the shared nodes on the way so it
+// can be changed in place. The nodes must have been reserved.
+static DocNode * FindOwnedPiece(Doc * doc, size_t pos, size_t * offset) {
+    DocNode ** link = &doc->root;
+    while (*link) {
+        DocNode * tree = OwnNode(doc, *link);
+        *link = tree;
+        size_t leftLength = TreeLength(tree->left);
+        if (pos < leftLength) {
+            link = &tree->left;
+        } else if (pos < leftLength + tree->piece.length) {
+            *offset = pos - leftLength;
+            return tree;
+        } else {
+            pos -= leftLength + tree->piece.length;
+            link = &tree->right;
+        }
+    }
+    *offset = 0;
+    return nullptr;
+}
+
+static bool AddBlock(Doc * doc) {
+    wchar_t * block = (wchar_t *)malloc(DOCADD_BLOCK_LENGTH * sizeof(wchar_t));
+    if (!block) {
+        return false;
+    }
+    wchar_t ** newBlock = doc->addBlocks.Insert(SIZE_MAX, 1);
+    if (!newBlock) {
+        free(block);
+        return false;
+    }
+    *newBlock = block;
+    doc->addBlockLength = 0;
+    return true;
+}
+
+// UTF-8 cannot be cut between the two units of a surrogate pair. If a position falls there, the
+// piece holding it is decoded into the add buffer first. The rest of the block is left unused if
+// the piece does not fit.
+static ResultCode WidenPairPiece(Doc * doc, size_t pos) {
+    size_t offset;
+    DocNode * node = FindPiece(doc->root, pos, &offset);
+    if (!node || !node->piece.bytes || offset == 0) {
+        return RESULT_OK;
+    }
+    bool midPair;
+    Utf8Offset(node->piece.bytes, node->piece.byteCount, offset, &midPair, node->piece.crlf);
+    if (!midPair) {
+        return RESULT_OK;
+    }
+
+    if (DOCADD_BLOCK_LENGTH - doc->addBlockLength < node->piece.length && !AddBlock(doc)) {
+        return RESULT_MEMORY_ERROR;
+    }
+    node = FindOwnedPiece(doc, pos, &offset);
+    wchar_t * addEnd = doc->addBlocks.elems[doc->addBlocks.count - 1] + doc->addBlockLength;
+    CopyPieceChars(&node->piece, 0, node->piece.length, addEnd);
+    doc->addBlockLength += node->piece.length;
+
+    node->piece.chars = addEnd;
+    node->piece.bytes = nullptr;
+    node->piece.byteCount = 0;
+    node->piece.crlf = false;
+    return RESULT_OK;
+}
+
+// Cuts a range out of the tree, leaving the text before and after it in two more trees. Enough
+// nodes are reserved for the caller to concatenate the trees twice.
+static ResultCode CutTree(Doc * doc, size_t pos, size_t length, DocNode ** left, DocNode ** middle, DocNode ** right) {
+    if (!ReserveCopyNodes(doc, 2, 6)) { // the spares, widening, splitting and concatenating
+        return RESULT_MEMORY_ERROR;
+    }
+
+    ResultCode result = WidenPairPiece(doc, pos);
+    if (result == RESULT_OK && length != 0) {
+        result = WidenPairPiece(doc, pos + length);
+    }
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    DocNode * spares[2];
+    spares[0] = CreateNode(doc, nullptr, 0);
+    spares[1] = CreateNode(doc, nullptr, 0);
+    if (!spares[0] || !spares[1]) {
+        FreeNode(doc, spares[0]);
+        FreeNode(doc, spares[1]);
+        return RESULT_MEMORY_ERROR;
+    }
+
+    SplitTree(doc, doc->root, pos, &spares[0], left, right);
+    *middle = nullptr;
+    if (length != 0) {
+        SplitTree(doc, *right, length, &spares[1], middle, right);
+    }
+
+    FreeNode(doc, spares[0]);
+    FreeNode(doc, spares[1]);
+    return RESULT_OK;
+}
+
+// Builds a balanced tree over consecutive chunks of a buffer. The nodes must have been reserved.
+static DocNode * BuildTree(Doc * doc, wchar_t * chars, size_t length, size_t firstPiece, size_t pieceCount) {
+    if (pieceCount == 0) {
+        return nullptr;
+    }
+
+    size_t middlePiece = firstPiece + pieceCount / 2;
+    size_t start = middlePiece * DOCPIECE_MAX_LENGTH;
+    size_t pieceLength = length - start;
+    if (pieceLength > DOCPIECE_MAX_LENGTH) {
+        pieceLength = DOCPIECE_MAX_LENGTH;
+    }
+
+    DocNode * node = CreateNode(doc, chars + start, pieceLength);
+    node->left = BuildTree(doc, chars, length, firstPiece, middlePiece - firstPiece);
+    node->right = BuildTree(doc, chars, length, middlePiece + 1, firstPiece + pieceCount - middlePiece - 1);
+    UpdateNode(node);
+    return node;
+}
+
+// Returns where a piece of UTF-8 text starts: every DOCPIECE_MAX_LENGTH bytes, moved back to the
+// start of a sequence, and in front of the CR of a CR LF.
+static size_t Utf8PieceStart(const char * bytes, size_t count, size_t pieceIndex) {
+    size_t start = pieceIndex * DOCPIECE_MAX_LENGTH;
+    if (start >= count) {
+        return count;
+    }
+    while (start != 0 && IsUtf8Continuation(bytes[start])) {
+        start--;
+    }
+    if (start != 0 && bytes[start] == '\n' && bytes[start - 1] == '\r') {
+        start--;
+    }
+    return start;
+}
+
+// Builds a balanced tree over consecutive chunks of a UTF-8 buffer. The nodes must have been
+// reserved.
+static DocNode * BuildUtf8Tree(Doc * doc, const char * bytes, size_t count, size_t firstPiece, size_t pieceCount) {
+    if (pieceCount == 0) {
+        return nullptr;
+    }
+
+    size_t middlePiece = firstPiece + pieceCount / 2;
+    size_t start = Utf8PieceStart(bytes, count, middlePiece);
+    size_t end = Utf8PieceStart(bytes, count, middlePiece + 1);
+
+    DocNode * node = CreateUtf8Node(doc, bytes + start, end - start);
+    node->left = BuildUtf8Tree(doc, bytes, count, firstPiece, middlePiece - firstPiece);
+    node->right = BuildUtf8Tree(doc, bytes, count, middlePiece + 1, firstPiece + pieceCount - middlePiece - 1);
+    UpdateNode(node);
+    return node;
+}
+
+// Returns the column count of the text before a position.
+static size_t FindColCount(DocNode * tree, size_t pos) {
+    size_t colCount = 0;
+    while (tree) {
+        size_t leftLength = TreeLength(tree->left);
+        if (pos < leftLength) {
+            tree = tree->left;
+            continue;
+        }
+
+        colCount += TreeColCount(tree->left);
+        pos -= leftLength;
+        if (pos < tree->piece.length) {
+            return colCount + pos + CountPieceChars(&tree->piece, pos, L'\t') * (config.tabWidth - 1);
+        }
+        colCount += tree->piece.length + tree->piece.tabCount * (config.tabWidth - 1);
+        pos -= tree->piece.length;
+        tree = tree->right;
+    }
+    return colCount;
+}
+
+// Returns the first position where the column count of the text before it reaches a value, and
+// that column count.
+static size_t FindColPos(DocNode * tree, size_t colCount, size_t * foundColCount) {
+    size_t pos = 0;
+    *foundColCount = 0;
+    while (tree) {
+        size_t leftColCount = TreeColCount(tree->left);
+        if (colCount <= leftColCount) {
+            tree = tree->left;
+            continue;
+        }
+
+        pos += TreeLength(tree->left);
+        colCount -= leftColCount;
+        *foundColCount += leftColCount;
+        const wchar_t * chars = tree->piece.chars;
+        wchar_t decoded[DOCPIECE_MAX_LENGTH];
+        if (tree->piece.bytes) {
+            CopyPieceChars(&tree->piece, 0, tree->piece.length, decoded);
+            chars = decoded;
+        }
+        for (size_t i = 0; i != tree->piece.length; i++) {
+            ulong charColCount = CharColCount(chars[i]);
+            *foundColCount += charColCount;
+            if (charColCount >= colCount) {
+                return pos + i + 1;
+            }
+            colCount -= charColCount;
+        }
+        pos += tree->piece.length;
+        tree = tree->right;
+    }
+    return pos;
+}
+
+//-------------
+// Documents
+
+static void UpdateDocCounts(Doc * doc) {
+    doc->charCount = TreeLength(doc->root);
+    doc->lineCount = TreeLineBreakCount(doc->root) + 1;
+}
+
+// Adds a change of the text to the log, in place of the oldest one once it is full.
+static void LogChange(Doc * doc, size_t pos, size_t removedLength, size_t insertedLength) {
+    if (removedLength == 0 && insertedLength == 0) {
+        return;
+    }
+    DocChange * change = &doc->changeLog[doc->changeCount % DOCCHANGE_LOG_COUNT];
+    change->pos = pos;
+    change->removedLength = removedLength;
+    change->insertedLength = insertedLength;
+    doc->changeCount++;
+}
 
 Doc * CreateEmptyDoc() {
     Doc * doc = (Doc *)malloc(sizeof(Doc));
@@ -9,125 +1096,2207 @@ Doc * CreateEmptyDoc() {
         return nullptr;
     }
 
-    doc->lines.Init(DOCLINES_GROW_COUNT);
-    MkDynArray<wchar_t> * line = doc->lines.Insert(SIZE_MAX, 1);
-    if (!line) {
-        free(doc);
-        return nullptr;
+    doc->original = nullptr;
+    doc->releaseOriginal = nullptr;
+    doc->addBlocks.Init(16);
+    doc->addBlockLength = DOCADD_BLOCK_LENGTH;
+    doc->nodeSlabs.Init(16);
+    doc->nodeSlabNext = nullptr;
+    doc->nodeSlabFree = 0;
+    doc->freeNodes = nullptr;
+    doc->root = nullptr;
+    doc->charCount = 0;
+    doc->lineCount = 1;
+    doc->snapshotCount = 0;
+
+    doc->lineBuffer.Init(DOCLINEBUFFER_GROW_COUNT);
+    doc->gapLine.chars = nullptr;
+    doc->gapLine.capacity = 0;
+    doc->gapLine.active = false;
+
+    doc->undoRecords.Init(DOCUNDO_GROW_COUNT);
+    doc->undoPieces.Init(DOCUNDO_GROW_COUNT);
+    doc->undoCount = 0;
+    doc->undoGroupOpen = false;
+
+    doc->cursorLineIndex = 0;
+    doc->cursorCharIndex = 0;
+    doc->lastCursorColIndex = 0;
+    doc->topPaintLineIndex = 0;
+    doc->leftPaintCharIndex = 0;
+    doc->lastPaintLineCount = 0;
+    doc->modified = false;
+    doc->timestamp = 0;
+    doc->savedSnapshot = nullptr;
+    doc->savedByteCount = 0;
+    doc->crlf = false;
+    doc->changeCount = 0;
+    doc->title[0] = L'\0';
+
+    return doc;
+}
+
+ResultCode CreateDocFromBuffer(wchar_t * chars, size_t length, Doc ** doc) {
+    Doc * newDoc = CreateEmptyDoc();
+    if (!newDoc) {
+        free(chars);
+        return RESULT_MEMORY_ERROR;
+    }
+    newDoc->original = chars;
+
+    size_t lineLength = 0;
+    for (size_t i = 0; i != length; i++) {
+        if (chars[i] == L'\n') {
+            lineLength = 0;
+        } else if (lineLength == MAX_LINE_LENGTH) {
+            DestroyDoc(newDoc);
+            return RESULT_LIMIT_REACHED;
+        } else {
+            lineLength++;
+        }
+    }
+
+    size_t pieceCount = (length + DOCPIECE_MAX_LENGTH - 1) / DOCPIECE_MAX_LENGTH;
+    if (!ReserveNodes(newDoc, pieceCount)) {
+        DestroyDoc(newDoc);
+        return RESULT_MEMORY_ERROR;
+    }
+    newDoc->root = BuildTree(newDoc, chars, length, 0, pieceCount);
+    UpdateDocCounts(newDoc);
+
+    *doc = newDoc;
+    return RESULT_OK;
+}
+
+ResultCode CreateDocFromUtf8(char * bytes, size_t count, Doc ** doc) {
+    Doc * newDoc = CreateEmptyDoc();
+    if (!newDoc) {
+        free(bytes);
+        return RESULT_MEMORY_ERROR;
+    }
+    newDoc->original = bytes;
+
+    // A line never has more UTF-16 units than bytes, so short buffers need no check.
+    if (count > MAX_LINE_LENGTH) {
+        size_t lineLength = 0;
+        for (size_t i = 0; i != count; i++) {
+            if (bytes[i] == '\n') {
+                lineLength = 0;
+            } else if (!IsUtf8Continuation(bytes[i])) {
+                lineLength += static_cast<unsigned char>(bytes[i]) >= 0xF0 ? 2 : 1;
+                if (lineLength > MAX_LINE_LENGTH) {
+                    DestroyDoc(newDoc);
+                    return RESULT_LIMIT_REACHED;
+                }
+            }
+        }
+    }
+
+    size_t pieceCount = (count + DOCPIECE_MAX_LENGTH - 1) / DOCPIECE_MAX_LENGTH;
+    if (!ReserveNodes(newDoc, pieceCount)) {
+        DestroyDoc(newDoc);
+        return RESULT_MEMORY_ERROR;
+    }
+    newDoc->root = BuildUtf8Tree(newDoc, bytes, count, 0, pieceCount);
+    UpdateDocCounts(newDoc);
+
+    *doc = newDoc;
+    return RESULT_OK;
+}
+
+size_t SplitDocUtf8(const char * bytes, size_t count, bool crlf, DocPiece * pieces) {
+    size_t pieceCount = (count + DOCPIECE_MAX_LENGTH - 1) / DOCPIECE_MAX_LENGTH;
+    for (size_t i = 0; i != pieceCount; i++) {
+        size_t start = Utf8PieceStart(bytes, count, i);
+        size_t end = Utf8PieceStart(bytes, count, i + 1);
+        DocPiece * piece = &pieces[i];
+        piece->chars = nullptr;
+        piece->bytes = bytes + start;
+        piece->byteCount = end - start;
+        piece->crlf = crlf;
+        CountUtf8(piece->bytes, piece->byteCount, &piece->length, &piece->lineBreakCount, &piece->tabCount);
+        if (crlf) {
+            piece->length -= piece->lineBreakCount;
+        }
+    }
+    return pieceCount;
+}
+
+size_t SplitDocUtf16(const wchar_t * chars, size_t length, DocPiece * pieces) {
+    size_t pieceCount = (length + DOCPIECE_MAX_LENGTH - 1) / DOCPIECE_MAX_LENGTH;
+    for (size_t i = 0; i != pieceCount; i++) {
+        size_t start = i * DOCPIECE_MAX_LENGTH;
+        DocPiece * piece = &pieces[i];
+        piece->chars = chars + start;
+        piece->bytes = nullptr;
+        piece->byteCount = 0;
+        piece->length = length - start < DOCPIECE_MAX_LENGTH ? length - start : DOCPIECE_MAX_LENGTH;
+        piece->crlf = false;
+        CountPiece(piece);
+    }
+    return pieceCount;
+}
+
+void DestroyDoc(Doc * doc) {
+    if (doc) {
+        free(doc->savedSnapshot); // its nodes go with the slabs
+        for (size_t i = 0; i != doc->nodeSlabs.count; i++) {
+            free(doc->nodeSlabs.elems[i]);
+        }
+        doc->nodeSlabs.Clear();
+        if (doc->releaseOriginal) {
+            doc->releaseOriginal(doc->original);
+        } else {
+            free(doc->original);
+        }
+        for (size_t i = 0; i != doc->addBlocks.count; i++) {
+            free(doc->addBlocks.elems[i]);
+        }
+        doc->addBlocks.Clear();
+        doc->lineBuffer.Clear();
+        free(doc->gapLine.chars);
+        doc->undoRecords.Clear();
+        doc->undoPieces.Clear();
+        free(doc);
+    }
+}
+
+static void InitTreePieceIterator(DocNode * tree, DocPieceIterator * iterator) {
+    iterator->depth = 0;
+    for (DocNode * node = tree; node; node = node->left) {
+        iterator->stack[iterator->depth++] = node;
+    }
+}
+
+void InitDocPieceIterator(Doc * doc, DocPieceIterator * iterator) {
+    InitTreePieceIterator(doc->root, iterator);
+}
+
+const DocPiece * NextDocPiece(DocPieceIterator * iterator) {
+    if (iterator->depth == 0) {
+        return nullptr;
+    }
+
+    DocNode * node = iterator->stack[--iterator->depth];
+    for (DocNode * child = node->right; child; child = child->left) {
+        iterator->stack[iterator->depth++] = child;
+    }
+    return &node->piece;
+}
+
+//-----------------
+// Line Lookup
+
+// Returns the position of the first character of a line.
+static size_t FindLineStart(Doc * doc, size_t lineIndex) {
+    if (lineIndex == 0) {
+        return 0;
+    }
+
+    DocNode * tree = doc->root;
+    size_t start = 0;
+    while (true) {
+        size_t leftLineBreakCount = TreeLineBreakCount(tree->left);
+        if (lineIndex <= leftLineBreakCount) {
+            tree = tree->left;
+        } else if (lineIndex <= leftLineBreakCount + tree->piece.lineBreakCount) {
+            start += TreeLength(tree->left);
+            return start + FindLineBreakEnd(&tree->piece, lineIndex - leftLineBreakCount);
+        } else {
+            lineIndex -= leftLineBreakCount + tree->piece.lineBreakCount;
+            start += TreeLength(tree->left) + tree->piece.length;
+            tree = tree->right;
+        }
+    }
+}
+
+// Returns the position of the first character of a line and its length.
+static size_t FindLine(Doc * doc, size_t lineIndex, size_t * length) {
+    size_t start = FindLineStart(doc, lineIndex);
+    if (lineIndex + 1 == doc->lineCount) {
+        *length = doc->charCount - start;
+    } else {
+        *length = FindLineStart(doc, lineIndex + 1) - start - 1;
+    }
+    return start;
+}
+
+// Returns the line containing a position and the index of the position within it.
+static size_t FindPosLine(Doc * doc, size_t pos, size_t * charIndex) {
+    DocNode * tree = doc->root;
+    size_t lineIndex = 0;
+    size_t offset = pos;
+    while (tree) {
+        size_t leftLength = TreeLength(tree->left);
+        if (offset < leftLength) {
+            tree = tree->left;
+            continue;
+        }
+
+        lineIndex += TreeLineBreakCount(tree->left);
+        offset -= leftLength;
+        if (offset < tree->piece.length) {
+            lineIndex += CountPieceChars(&tree->piece, offset, L'\n');
+            break;
+        }
+        lineIndex += tree->piece.lineBreakCount;
+        offset -= tree->piece.length;
+        tree = tree->right;
+    }
+
+    *charIndex = pos - FindLineStart(doc, lineIndex);
+    return lineIndex;
+}
+
+static size_t GapLineLength(DocGapLine * gapLine) {
+    return gapLine->capacity - (gapLine->gapEnd - gapLine->gapStart);
+}
+
+static void MoveGap(DocGapLine * gapLine, size_t pos) {
+    if (pos < gapLine->gapStart) {
+        size_t count = gapLine->gapStart - pos;
+        for (size_t i = pos; i != gapLine->gapStart; i++) {
+            gapLine->gapColIndex -= CharColCount(gapLine->chars[i]);
+        }
+        memmove(gapLine->chars + gapLine->gapEnd - count, gapLine->chars + pos, count * sizeof(wchar_t));
+        gapLine->gapStart -= count;
+        gapLine->gapEnd -= count;
+    } else if (pos > gapLine->gapStart) {
+        size_t count = pos - gapLine->gapStart;
+        for (size_t i = 0; i != count; i++) {
+            gapLine->gapColIndex += CharColCount(gapLine->chars[gapLine->gapEnd + i]);
+        }
+        memmove(gapLine->chars + gapLine->gapStart, gapLine->chars + gapLine->gapEnd, count * sizeof(wchar_t));
+        gapLine->gapStart += count;
+        gapLine->gapEnd += count;
+    }
+}
+
+static bool IsGapLine(Doc * doc, size_t lineIndex) {
+    return doc->gapLine.active && doc->gapLine.lineIndex == lineIndex;
+}
+
+// Returns a range of text, pointing into a piece if it lies within one and copying it into the
+// line buffer otherwise. UTF-8 pieces are always decoded into the line buffer.
+static const wchar_t * ReadDocText(Doc * doc, size_t start, size_t length) {
+    if (length == 0) {
+        return emptyLine;
+    }
+
+    size_t offset;
+    DocNode * node = FindPiece(doc->root, start, &offset);
+    if (!node->piece.bytes && offset + length <= node->piece.length) {
+        return node->piece.chars + offset;
+    }
+
+    if (doc->lineBuffer.capacity < length && !doc->lineBuffer.SetCapacity(length)) {
+        return nullptr;
+    }
+
+    size_t copied = 0;
+    while (true) {
+        size_t count = node->piece.length - offset;
+        if (count > length - copied) {
+            count = length - copied;
+        }
+        CopyPieceChars(&node->piece, offset, count, doc->lineBuffer.elems + copied);
+        copied += count;
+        if (copied == length) {
+            break;
+        }
+        node = FindPiece(doc->root, start + copied, &offset);
+    }
+    return doc->lineBuffer.elems;
+}
+
+const wchar_t * GetDocLine(Doc * doc, size_t lineIndex, size_t * length) {
+    if (IsGapLine(doc, lineIndex)) {
+        *length = GapLineLength(&doc->gapLine);
+        MoveGap(&doc->gapLine, *length);
+        return doc->gapLine.chars;
+    }
+
+    size_t lineLength;
+    size_t start = FindLine(doc, lineIndex, &lineLength);
+    const wchar_t * chars = ReadDocText(doc, start, lineLength);
+    *length = chars ? lineLength : 0;
+    return chars;
+}
+
+const wchar_t * GetDocLineSlice(Doc * doc, size_t lineIndex, size_t charIndex, size_t maxLength, size_t * length) {
+    if (IsGapLine(doc, lineIndex)) {
+        DocGapLine * gapLine = &doc->gapLine;
+        size_t lineLength = GapLineLength(gapLine);
+        if (charIndex > lineLength) {
+            charIndex = lineLength;
+        }
+        if (maxLength > lineLength - charIndex) {
+            maxLength = lineLength - charIndex;
+        }
+        *length = maxLength;
+
+        // Only move the gap if it splits the slice, and then to the nearer end of it.
+        size_t end = charIndex + maxLength;
+        if (charIndex < gapLine->gapStart && end > gapLine->gapStart) {
+            MoveGap(gapLine, gapLine->gapStart - charIndex < end - gapLine->gapStart ? charIndex : end);
+        }
+        if (end <= gapLine->gapStart) {
+            return gapLine->chars + charIndex;
+        }
+        return gapLine->chars + gapLine->gapEnd + (charIndex - gapLine->gapStart);
+    }
+
+    size_t lineLength;
+    size_t start = FindLine(doc, lineIndex, &lineLength);
+    if (charIndex > lineLength) {
+        charIndex = lineLength;
+    }
+    if (maxLength > lineLength - charIndex) {
+        maxLength = lineLength - charIndex;
+    }
+    const wchar_t * chars = ReadDocText(doc, start + charIndex, maxLength);
+    *length = chars ? maxLength : 0;
+    return chars;
+}
+
+size_t GetDocLineLength(Doc * doc, size_t lineIndex) {
+    if (IsGapLine(doc, lineIndex)) {
+        return GapLineLength(&doc->gapLine);
+    }
+
+    size_t length;
+    FindLine(doc, lineIndex, &length);
+    return length;
+}
+
+size_t GetDocPos(Doc * doc, size_t lineIndex, size_t charIndex) {
+    return FindLineStart(doc, lineIndex) + charIndex;
+}
+
+size_t GetDocPosLine(Doc * doc, size_t pos, size_t * charIndex) {
+    return FindPosLine(doc, pos, charIndex);
+}
+
+void GetDocCursorCols(Doc * doc, ulong * cursorColIndex, ulong * lineColCount) {
+    if (IsGapLine(doc, doc->cursorLineIndex)) {
+        DocGapLine * gapLine = &doc->gapLine;
+        MoveGap(gapLine, doc->cursorCharIndex);
+        *cursorColIndex = gapLine->gapColIndex;
+        *lineColCount = static_cast<ulong>(GapLineLength(gapLine) + gapLine->tabCount * (config.tabWidth - 1));
+        return;
+    }
+
+    size_t length;
+    size_t start = FindLine(doc, doc->cursorLineIndex, &length);
+    size_t cursorCharIndex = doc->cursorCharIndex < length ? doc->cursorCharIndex : length;
+    size_t startColCount = FindColCount(doc->root, start);
+    *cursorColIndex = static_cast<ulong>(FindColCount(doc->root, start + cursorCharIndex) - startColCount);
+    *lineColCount = static_cast<ulong>(FindColCount(doc->root, start + length) - startColCount);
+}
+
+//-----------------
+// Undo Journal
+
+// The journal holds the changes as records of pieces, so its size does not depend on how much
+// text changed. config.undoMemoryLimit bounds it in KiB, 0 turning it off.
+
+static size_t GetUndoMemory(Doc * doc) {
+    return doc->undoRecords.count * sizeof(DocUndoRecord) + doc->undoPieces.count * sizeof(DocPiece);
+}
+
+// Drops the undone records, which a new change makes unreachable.
+static void DropRedoRecords(Doc * doc) {
+    if (doc->undoCount == doc->undoRecords.count) {
+        return;
+    }
+
+    size_t pieceCount = doc->undoRecords.elems[doc->undoCount].pieceIndex;
+    doc->undoPieces.Remove(pieceCount, doc->undoPieces.count - pieceCount);
+    doc->undoRecords.Remove(doc->undoCount, doc->undoRecords.count - doc->undoCount);
+}
+
+// Drops the oldest groups once the memory limit is exceeded, down to three quarters of it so this
+// does not happen on every change. The newest group is always kept.
+static void TrimUndoRecords(Doc * doc) {
+    size_t memory = GetUndoMemory(doc);
+    size_t limit = static_cast<size_t>(config.undoMemoryLimit) * 1024;
+    if (memory <= limit) {
+        return;
+    }
+    limit = limit / 4 * 3;
+
+    size_t dropCount = 0;
+    for (size_t i = 1; i != doc->undoRecords.count && memory > limit; i++) {
+        DocUndoRecord * record = &doc->undoRecords.elems[i - 1];
+        memory -= sizeof(DocUndoRecord) + (record->removedPieceCount + record->insertedPieceCount) * sizeof(DocPiece);
+        if (doc->undoRecords.elems[i].groupStart) {
+            dropCount = i;
+        }
+    }
+    if (dropCount == 0) {
+        return;
+    }
+
+    size_t pieceDropCount = doc->undoRecords.elems[dropCount].pieceIndex;
+    doc->undoRecords.Remove(0, dropCount);
+    doc->undoPieces.Remove(0, pieceDropCount);
+    for (size_t i = 0; i != doc->undoRecords.count; i++) {
+        doc->undoRecords.elems[i].pieceIndex -= pieceDropCount;
+    }
+    doc->undoCount -= dropCount;
+}
+
+// Starts a record for replacing the text of a tree, copying its pieces. Room for the pieces of the
+// inserted text is reserved, so finishing the record cannot fail.
+static bool BeginUndoRecord(Doc * doc, size_t pos, DocNode * removed, size_t insertPieceCount) {
+    DropRedoRecords(doc);
+
+    if (doc->undoRecords.capacity == doc->undoRecords.count && !doc->undoRecords.SetCapacity(doc->undoRecords.count + DOCUNDO_GROW_COUNT)) {
+        return false;
+    }
+
+    size_t pieceIndex = doc->undoPieces.count;
+    DocPieceIterator pieces;
+    InitTreePieceIterator(removed, &pieces);
+    for (const DocPiece * piece = NextDocPiece(&pieces); piece; piece = NextDocPiece(&pieces)) {
+        DocPiece * newPiece = doc->undoPieces.Insert(SIZE_MAX, 1);
+        if (!newPiece) {
+            doc->undoPieces.Remove(pieceIndex, doc->undoPieces.count - pieceIndex);
+            return false;
+        }
+        *newPiece = *piece;
+    }
+    if (doc->undoPieces.capacity - doc->undoPieces.count < insertPieceCount) {
+        if (!doc->undoPieces.SetCapacity(doc->undoPieces.count + insertPieceCount + DOCUNDO_GROW_COUNT)) {
+            doc->undoPieces.Remove(pieceIndex, doc->undoPieces.count - pieceIndex);
+            return false;
+        }
+    }
+
+    DocUndoRecord * record = doc->undoRecords.Insert(SIZE_MAX, 1);
+    record->pos = pos;
+    record->removedLength = TreeLength(removed);
+    record->insertedLength = 0;
+    record->pieceIndex = pieceIndex;
+    record->removedPieceCount = doc->undoPieces.count - pieceIndex;
+    record->insertedPieceCount = 0;
+    record->groupStart = !doc->undoGroupOpen;
+    doc->undoGroupOpen = true;
+    return true;
+}
+
+// Finishes the last record with the text added to the add buffer since a block and offset.
+static void EndUndoRecord(Doc * doc, size_t blockIndex, size_t offset) {
+    DocUndoRecord * record = &doc->undoRecords.elems[doc->undoRecords.count - 1];
+    for (; blockIndex < doc->addBlocks.count; blockIndex++, offset = 0) {
+        size_t end = blockIndex + 1 == doc->addBlocks.count ? doc->addBlockLength : DOCADD_BLOCK_LENGTH;
+        while (offset != end) {
+            size_t length = end - offset < DOCPIECE_MAX_LENGTH ? end - offset : DOCPIECE_MAX_LENGTH;
+            DocPiece * piece = doc->undoPieces.Insert(SIZE_MAX, 1);
+            piece->chars = doc->addBlocks.elems[blockIndex] + offset;
+            piece->bytes = nullptr;
+            piece->byteCount = 0;
+            piece->length = length;
+            piece->crlf = false;
+            CountPiece(piece);
+            record->insertedLength += length;
+            record->insertedPieceCount++;
+            offset += length;
+        }
+    }
+    doc->undoCount = doc->undoRecords.count;
+
+    TrimUndoRecords(doc);
+}
+
+// Finishes the last record with a list of inserted pieces.
+static void EndUndoRecordPieces(Doc * doc, const DocPiece * pieces, size_t pieceCount) {
+    DocUndoRecord * record = &doc->undoRecords.elems[doc->undoRecords.count - 1];
+    if (pieceCount != 0) {
+        DocPiece * newPieces = doc->undoPieces.Insert(SIZE_MAX, pieceCount);
+        memcpy(newPieces, pieces, pieceCount * sizeof(DocPiece));
+    }
+    for (size_t i = 0; i != pieceCount; i++) {
+        record->insertedLength += pieces[i].length;
+    }
+    record->insertedPieceCount = pieceCount;
+    doc->undoCount = doc->undoRecords.count;
+
+    TrimUndoRecords(doc);
+}
+
+//-----------
+// Editing
+
+// Grows the last piece of a tree, updating the totals along the right edge.
+static DocNode * ExtendLastPiece(Doc * doc, DocNode * tree, size_t length, size_t lineBreakCount, size_t tabCount) {
+    tree = OwnNode(doc, tree);
+    tree->length += length;
+    tree->lineBreakCount += lineBreakCount;
+    tree->tabCount += tabCount;
+    if (tree->right) {
+        tree->right = ExtendLastPiece(doc, tree->right, length, lineBreakCount, tabCount);
+    } else {
+        tree->piece.length += length;
+        tree->piece.lineBreakCount += lineBreakCount;
+        tree->piece.tabCount += tabCount;
+    }
+    return tree;
+}
+
+// Copies text into the add buffer and appends pieces for it to a tree. Text directly following
+// the last piece in the add buffer extends that piece instead.
+static ResultCode AppendPieces(Doc * doc, DocNode ** tree, const wchar_t * text, size_t length) {
+    size_t done = 0;
+    while (done != length) {
+        if (!ReserveCopyNodes(doc, 1, 3)) { // the new node, joining it and a concatenation left for the caller
+            return RESULT_MEMORY_ERROR;
+        }
+        if (doc->addBlockLength == DOCADD_BLOCK_LENGTH && !AddBlock(doc)) {
+            return RESULT_MEMORY_ERROR;
+        }
+
+        wchar_t * addEnd = doc->addBlocks.elems[doc->addBlocks.count - 1] + doc->addBlockLength;
+        size_t count = length - done;
+        if (count > DOCADD_BLOCK_LENGTH - doc->addBlockLength) {
+            count = DOCADD_BLOCK_LENGTH - doc->addBlockLength;
+        }
+
+        DocPiece * lastPiece = nullptr;
+        if (*tree && doc->addBlockLength != 0) {
+            DocNode * lastNode = *tree;
+            while (lastNode->right) {
+                lastNode = lastNode->right;
+            }
+            if (lastNode->piece.chars && lastNode->piece.chars + lastNode->piece.length == addEnd && lastNode->piece.length != DOCPIECE_MAX_LENGTH) {
+                lastPiece = &lastNode->piece;
+            }
+        }
+
+        if (lastPiece) {
+            if (count > DOCPIECE_MAX_LENGTH - lastPiece->length) {
+                count = DOCPIECE_MAX_LENGTH - lastPiece->length;
+            }
+            memcpy(addEnd, text + done, count * sizeof(wchar_t));
+            *tree = ExtendLastPiece(doc, *tree, count, CountChars(addEnd, count, L'\n'), CountChars(addEnd, count, L'\t'));
+        } else {
+            if (count > DOCPIECE_MAX_LENGTH) {
+                count = DOCPIECE_MAX_LENGTH;
+            }
+            memcpy(addEnd, text + done, count * sizeof(wchar_t));
+            DocNode * node = CreateNode(doc, addEnd, count);
+            if (!node) {
+                return RESULT_MEMORY_ERROR;
+            }
+            *tree = JoinTrees(doc, *tree, node, nullptr);
+        }
+
+        doc->addBlockLength += count;
+        done += count;
+    }
+
+    return RESULT_OK;
+}
+
+// Replaces a range of text with new text in one pass over the tree, recording the change.
+static ResultCode ReplaceText(Doc * doc, size_t pos, size_t removeLength, const wchar_t * text, size_t length) {
+    if (removeLength == 0 && length == 0) {
+        return RESULT_OK;
+    }
+
+    DocNode * left;
+    DocNode * middle;
+    DocNode * right;
+    ResultCode result = CutTree(doc, pos, removeLength, &left, &middle, &right);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    size_t charCount = doc->charCount;
+    bool record = config.undoMemoryLimit != 0;
+    size_t insertPieceCount = length / DOCPIECE_MAX_LENGTH + length / DOCADD_BLOCK_LENGTH + 2;
+    if (record && !BeginUndoRecord(doc, pos, middle, insertPieceCount)) {
+        doc->root = ConcatTrees(doc, ConcatTrees(doc, left, middle), right);
+        return RESULT_MEMORY_ERROR;
+    }
+    DestroyTree(doc, middle);
+
+    // where the inserted text starts in the add buffer
+    size_t addBlockIndex = doc->addBlocks.count;
+    size_t addOffset = 0;
+    if (doc->addBlockLength != DOCADD_BLOCK_LENGTH) {
+        addBlockIndex--;
+        addOffset = doc->addBlockLength;
+    }
+
+    result = AppendPieces(doc, &left, text, length);
+    doc->root = ConcatTrees(doc, left, right);
+    UpdateDocCounts(doc);
+    LogChange(doc, pos, removeLength, doc->charCount + removeLength - charCount);
+
+    if (record) {
+        EndUndoRecord(doc, addBlockIndex, addOffset);
+    }
+    return result;
+}
+
+// Builds a balanced tree over a list of pieces. The nodes must have been reserved.
+static DocNode * BuildPieceTree(Doc * doc, const DocPiece * pieces, size_t pieceCount) {
+    if (pieceCount == 0) {
+        return nullptr;
+    }
+
+    size_t middlePiece = pieceCount / 2;
+    DocNode * node = AllocNode(doc);
+    node->piece = pieces[middlePiece];
+    node->left = BuildPieceTree(doc, pieces, middlePiece);
+    node->right = BuildPieceTree(doc, pieces + middlePiece + 1, pieceCount - middlePiece - 1);
+    UpdateNode(node);
+    return node;
+}
+
+// Replaces a range of text with a list of pieces, as done by undo and redo.
+static ResultCode ReplacePieces(Doc * doc, size_t pos, size_t removeLength, const DocPiece * pieces, size_t pieceCount) {
+    // one node per piece and the spares of the cut
+    if (!ReserveNodes(doc, pieceCount + 2) || !ReserveCopyNodes(doc, pieceCount + 2, 6)) {
+        return RESULT_MEMORY_ERROR;
+    }
+    DocNode * inserted = BuildPieceTree(doc, pieces, pieceCount);
+
+    DocNode * left;
+    DocNode * middle;
+    DocNode * right;
+    ResultCode result = CutTree(doc, pos, removeLength, &left, &middle, &right);
+    if (result != RESULT_OK) {
+        DestroyTree(doc, inserted);
+        return result;
+    }
+    DestroyTree(doc, middle);
+
+    size_t charCount = doc->charCount;
+    doc->root = ConcatTrees(doc, ConcatTrees(doc, left, inserted), right);
+    UpdateDocCounts(doc);
+    LogChange(doc, pos, removeLength, doc->charCount + removeLength - charCount);
+    return RESULT_OK;
+}
+
+ResultCode InsertDocText(Doc * doc, size_t lineIndex, size_t charIndex, const wchar_t * text, size_t length) {
+    ResultCode result = EndDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+    result = ReplaceText(doc, FindLineStart(doc, lineIndex) + charIndex, 0, text, length);
+    doc->undoGroupOpen = false;
+    return result;
+}
+
+ResultCode RemoveDocText(Doc * doc, size_t lineIndex, size_t charIndex, size_t length) {
+    ResultCode result = EndDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+    result = ReplaceText(doc, FindLineStart(doc, lineIndex) + charIndex, length, nullptr, 0);
+    doc->undoGroupOpen = false;
+    return result;
+}
+
+ResultCode RemoveDocLines(Doc * doc, size_t lineIndex, size_t count) {
+    ResultCode result = EndDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    size_t start = FindLineStart(doc, lineIndex);
+    size_t end;
+    if (count >= doc->lineCount - lineIndex) {
+        end = doc->charCount;
+        if (lineIndex != 0) {
+            start--; // line break of the previous line
+        }
+    } else {
+        end = FindLineStart(doc, lineIndex + count);
+    }
+    result = ReplaceText(doc, start, end - start, nullptr, 0);
+    doc->undoGroupOpen = false;
+    return result;
+}
+
+static void SetCursorPos(Doc * doc, size_t pos) {
+    size_t charIndex;
+    doc->cursorLineIndex = FindPosLine(doc, pos, &charIndex);
+    doc->cursorCharIndex = static_cast<uint>(charIndex);
+}
+
+ResultCode UndoDocChange(Doc * doc) {
+    ResultCode result = EndDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+    if (doc->undoCount == 0) {
+        return RESULT_LIMIT_REACHED;
+    }
+
+    while (true) {
+        DocUndoRecord * record = &doc->undoRecords.elems[doc->undoCount - 1];
+        result = ReplacePieces(
+            doc,
+            record->pos,
+            record->insertedLength,
+            doc->undoPieces.elems + record->pieceIndex,
+            record->removedPieceCount);
+        if (result != RESULT_OK) {
+            return result;
+        }
+
+        doc->undoCount--;
+        SetCursorPos(doc, record->pos);
+        doc->modified = true;
+        if (record->groupStart) {
+            break;
+        }
+    }
+    return RESULT_OK;
+}
+
+ResultCode RedoDocChange(Doc * doc) {
+    ResultCode result = EndDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+    if (doc->undoCount == doc->undoRecords.count) {
+        return RESULT_LIMIT_REACHED;
+    }
+
+    do {
+        DocUndoRecord * record = &doc->undoRecords.elems[doc->undoCount];
+        result = ReplacePieces(
+            doc,
+            record->pos,
+            record->removedLength,
+            doc->undoPieces.elems + record->pieceIndex + record->removedPieceCount,
+            record->insertedPieceCount);
+        if (result != RESULT_OK) {
+            return result;
+        }
+
+        doc->undoCount++;
+        SetCursorPos(doc, record->pos);
+        doc->modified = true;
+    } while (doc->undoCount != doc->undoRecords.count && !doc->undoRecords.elems[doc->undoCount].groupStart);
+    return RESULT_OK;
+}
+
+//----------------------
+// Insert Gap Buffer
+
+// Makes room for at least count more characters in the gap.
+static bool GrowGap(DocGapLine * gapLine, size_t count) {
+    if (gapLine->gapEnd - gapLine->gapStart >= count) {
+        return true;
+    }
+
+    size_t length = GapLineLength(gapLine);
+    size_t newCapacity = gapLine->capacity != 0 ? gapLine->capacity : DOCGAPLINE_INIT_CAPACITY;
+    while (newCapacity - length < count) {
+        newCapacity *= 2;
+    }
+    wchar_t * newChars = (wchar_t *)realloc(gapLine->chars, newCapacity * sizeof(wchar_t));
+    if (!newChars) {
+        return false;
+    }
+
+    size_t afterLength = gapLine->capacity - gapLine->gapEnd;
+    memmove(newChars + newCapacity - afterLength, newChars + gapLine->gapEnd, afterLength * sizeof(wchar_t));
+    gapLine->chars = newChars;
+    gapLine->gapEnd = newCapacity - afterLength;
+    gapLine->capacity = newCapacity;
+    return true;
+}
+
+// Records that the characters around the gap are about to change.
+static void MarkGapEdit(DocGapLine * gapLine, size_t editStart) {
+    if (editStart < gapLine->editStart) {
+        gapLine->editStart = editStart;
+    }
+    size_t tailLength = gapLine->capacity - gapLine->gapEnd;
+    if (tailLength < gapLine->editTailLength) {
+        gapLine->editTailLength = tailLength;
+    }
+}
+
+// Writes the gap buffer back into the document, as part of the open undo group.
+static ResultCode FlushGapLine(Doc * doc) {
+    DocGapLine * gapLine = &doc->gapLine;
+    if (!gapLine->active) {
+        return RESULT_OK;
+    }
+
+    if (gapLine->editStart != SIZE_MAX) {
+        size_t editEnd = GapLineLength(gapLine) - gapLine->editTailLength;
+        MoveGap(gapLine, editEnd);
+
+        ResultCode result = ReplaceText(
+            doc,
+            FindLineStart(doc, gapLine->lineIndex) + gapLine->editStart,
+            gapLine->originalLength - gapLine->editTailLength - gapLine->editStart,
+            gapLine->chars + gapLine->editStart,
+            editEnd - gapLine->editStart);
+        if (result != RESULT_OK) {
+            return result;
+        }
+    }
+
+    gapLine->active = false;
+    return RESULT_OK;
+}
+
+ResultCode EndDocInsert(Doc * doc) {
+    ResultCode result = FlushGapLine(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+    doc->undoGroupOpen = false;
+    return RESULT_OK;
+}
+
+ResultCode BeginDocInsert(Doc * doc) {
+    DocGapLine * gapLine = &doc->gapLine;
+    if (gapLine->active) {
+        if (gapLine->lineIndex == doc->cursorLineIndex) {
+            return RESULT_OK;
+        }
+        ResultCode result = FlushGapLine(doc);
+        if (result != RESULT_OK) {
+            return result;
+        }
+    }
+
+    size_t length;
+    const wchar_t * chars = GetDocLine(doc, doc->cursorLineIndex, &length);
+    if (!chars) {
+        return RESULT_MEMORY_ERROR;
+    }
+
+    gapLine->gapStart = 0;
+    gapLine->gapEnd = gapLine->capacity;
+    if (!GrowGap(gapLine, length + 1)) { // room for the first character typed
+        return RESULT_MEMORY_ERROR;
+    }
+
+    size_t afterLength = length - doc->cursorCharIndex;
+    memcpy(gapLine->chars, chars, doc->cursorCharIndex * sizeof(wchar_t));
+    memcpy(gapLine->chars + gapLine->capacity - afterLength, chars + doc->cursorCharIndex, afterLength * sizeof(wchar_t));
+    gapLine->gapStart = doc->cursorCharIndex;
+    gapLine->gapEnd = gapLine->capacity - afterLength;
+
+    gapLine->lineIndex = doc->cursorLineIndex;
+    gapLine->originalLength = length;
+    gapLine->editStart = SIZE_MAX;
+    gapLine->editTailLength = length;
+    gapLine->tabCount = 0;
+    gapLine->gapColIndex = 0;
+    for (size_t i = 0; i != length; i++) {
+        if (chars[i] == L'\t') {
+            gapLine->tabCount++;
+        }
+        if (i < doc->cursorCharIndex) {
+            gapLine->gapColIndex += CharColCount(chars[i]);
+        }
+    }
+
+    gapLine->active = true;
+    return RESULT_OK;
+}
+
+static ResultCode InsertGapText(Doc * doc, const wchar_t * text, size_t length) {
+    ResultCode result = BeginDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    DocGapLine * gapLine = &doc->gapLine;
+    MoveGap(gapLine, doc->cursorCharIndex);
+    if (!GrowGap(gapLine, length)) {
+        return RESULT_MEMORY_ERROR;
+    }
+    MarkGapEdit(gapLine, gapLine->gapStart);
+
+    for (size_t i = 0; i != length; i++) {
+        gapLine->chars[gapLine->gapStart++] = text[i];
+        gapLine->gapColIndex += CharColCount(text[i]);
+        if (text[i] == L'\t') {
+            gapLine->tabCount++;
+        }
+    }
+    doc->cursorCharIndex += static_cast<uint>(length);
+    doc->lastCursorColIndex = gapLine->gapColIndex;
+    doc->modified = true;
+    return RESULT_OK;
+}
+
+static ResultCode RemoveGapChar(Doc * doc) {
+    ResultCode result = BeginDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    DocGapLine * gapLine = &doc->gapLine;
+    MoveGap(gapLine, doc->cursorCharIndex);
+    MarkGapEdit(gapLine, gapLine->gapStart - 1);
+
+    gapLine->gapStart--;
+    gapLine->gapColIndex -= CharColCount(gapLine->chars[gapLine->gapStart]);
+    if (gapLine->chars[gapLine->gapStart] == L'\t') {
+        gapLine->tabCount--;
+    }
+    doc->cursorCharIndex--;
+    doc->lastCursorColIndex = gapLine->gapColIndex;
+    doc->modified = true;
+    return RESULT_OK;
+}
+
+//-------------
+// Snapshots
+
+ResultCode CreateDocSnapshot(Doc * doc, DocSnapshot ** snapshot) {
+    DocSnapshot * newSnapshot = (DocSnapshot *)malloc(sizeof(DocSnapshot));
+    if (!newSnapshot) {
+        return RESULT_MEMORY_ERROR;
+    }
+    ResultCode result = FlushGapLine(doc);
+    if (result != RESULT_OK) {
+        free(newSnapshot);
+        return result;
+    }
+
+    newSnapshot->doc = doc;
+    newSnapshot->root = doc->root;
+    newSnapshot->charCount = doc->charCount;
+    newSnapshot->lineCount = doc->lineCount;
+    if (doc->root) {
+        doc->root->refCount++;
+    }
+    doc->snapshotCount++;
+
+    *snapshot = newSnapshot;
+    return RESULT_OK;
+}
+
+void DestroyDocSnapshot(DocSnapshot * snapshot) {
+    if (snapshot) {
+        DestroyTree(snapshot->doc, snapshot->root);
+        snapshot->doc->snapshotCount--;
+        free(snapshot);
+    }
+}
+
+void InitDocSnapshotPieceIterator(DocSnapshot * snapshot, DocPieceIterator * iterator) {
+    InitTreePieceIterator(snapshot->root, iterator);
+}
+
+// The snapshot keeps its root alive, and a change copies every node on its path, so the document
+// gets a new root with the first change.
+bool IsDocSnapshotCurrent(DocSnapshot * snapshot) {
+    Doc * doc = snapshot->doc;
+    return doc->root == snapshot->root && !(doc->gapLine.active && doc->gapLine.editStart != SIZE_MAX);
+}
+
+//-----------
+// Loading
+
+// Text loaded in the background goes behind everything else, so it never moves what is already
+// there. The gap buffer is written back first if it holds the last line, which the text extends.
+static ResultCode PrepareAppend(Doc * doc) {
+    if (doc->gapLine.active && doc->gapLine.lineIndex == doc->lineCount - 1) {
+        return FlushGapLine(doc);
+    }
+    return RESULT_OK;
+}
+
+ResultCode AppendDocPieces(Doc * doc, const DocPiece * pieces, size_t pieceCount) {
+    ResultCode result = PrepareAppend(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+    if (!ReserveNodes(doc, pieceCount) || !ReserveCopyNodes(doc, pieceCount, 2)) {
+        return RESULT_MEMORY_ERROR;
+    }
+
+    size_t charCount = doc->charCount;
+    DocNode * appended = BuildPieceTree(doc, pieces, pieceCount);
+    doc->root = ConcatTrees(doc, doc->root, appended);
+    UpdateDocCounts(doc);
+    LogChange(doc, charCount, 0, doc->charCount - charCount);
+    return RESULT_OK;
+}
+
+//----------
+// Search
+
+// Text is searched for piece by piece, in the encoding of each piece. The first unit of the text is
+// looked for sixteen bytes at a time, and each hit is then compared in full. In UTF-8 pieces, the
+// lead byte of its sequence is looked for together with the last byte of the text, which rules out
+// most hits on common letters. Only a hit running into the next piece needs decoding.
+
+bool InitDocSearch(DocSearch * search, const wchar_t * text, size_t length) {
+    if (length == 0 || length > DOCSEARCH_MAX_LENGTH) {
+        return false;
+    }
+    for (size_t i = 0; i != length; i++) {
+        wchar_t c = text[i];
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 != length && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF) {
+            i++;
+        } else if (c >= 0xD800 && c <= 0xDFFF) {
+            return false; // UTF-8 pieces could not hold it
+        }
+    }
+
+    memcpy(search->text, text, length * sizeof(wchar_t));
+    search->length = length;
+    search->byteCount = TranscodeUtf16ToUtf8(text, length, search->bytes);
+    search->lineBreaks = wmemchr(text, L'\r', length) || wmemchr(text, L'\n', length);
+    return true;
+}
+
+// Starts iterating over the pieces of a tree with the piece containing a position, and returns the
+// offset of the position into it.
+static size_t InitTreePieceIteratorAt(DocNode * tree, size_t pos, DocPieceIterator * iterator) {
+    iterator->depth = 0;
+    while (tree) {
+        size_t leftLength = TreeLength(tree->left);
+        if (pos < leftLength) {
+            iterator->stack[iterator->depth++] = tree;
+            tree = tree->left;
+        } else if (pos < leftLength + tree->piece.length) {
+            iterator->stack[iterator->depth++] = tree;
+            return pos - leftLength;
+        } else {
+            pos -= leftLength + tree->piece.length;
+            tree = tree->right;
+        }
+    }
+    return 0;
+}
+
+// Compares the text with a match starting at an offset into a piece and running into the pieces
+// still left to the iterator.
+static bool MatchesAcrossPieces(const DocPiece * piece, size_t offset, DocPieceIterator pieces, const DocSearch * search) {
+    wchar_t chars[DOCSEARCH_MAX_LENGTH];
+    const wchar_t * text = search->text;
+    size_t length = search->length;
+    while (true) {
+        size_t count = piece->length - offset;
+        if (count > length) {
+            count = length;
+        }
+        CopyPieceChars(piece, offset, count, chars);
+        if (memcmp(chars, text, count * sizeof(wchar_t)) != 0) {
+            return false;
+        }
+        text += count;
+        length -= count;
+        if (length == 0) {
+            return true;
+        }
+        piece = NextDocPiece(&pieces);
+        if (!piece) {
+            return false;
+        }
+        offset = 0;
+    }
+}
+
+// Returns whether the text starts at an offset into a UTF-16 piece.
+static bool MatchesUtf16(const DocPiece * piece, size_t offset, const DocPieceIterator * pieces, const DocSearch * search) {
+    if (piece->length - offset >= search->length) {
+        return memcmp(piece->chars + offset, search->text, search->length * sizeof(wchar_t)) == 0;
+    }
+    return MatchesAcrossPieces(piece, offset, *pieces, search);
+}
+
+// Finds the matches starting between two positions of a tree, in order, up to a maximum count.
+// They may overlap, and may end behind the end position.
+// Returns the number of matches found.
+static size_t ScanTree(DocNode * tree, const DocSearch * search, size_t start, size_t end, size_t * found, size_t maxCount) {
+    DocPieceIterator pieces;
+    size_t offset = InitTreePieceIteratorAt(tree, start, &pieces);
+    size_t pieceStart = start - offset;
+    size_t count = 0;
+    const DocPiece * piece;
+    while (count != maxCount && pieceStart < end && (piece = NextDocPiece(&pieces))) {
+        size_t scanEnd = end - pieceStart < piece->length ? end - pieceStart : piece->length;
+        if (!piece->bytes) {
+            const wchar_t * chars = piece->chars;
+            const __m128i first = _mm_set1_epi16(static_cast<short>(search->text[0]));
+            size_t i = offset;
+            for (; scanEnd - i >= 8; i += 8) {
+                uint hits = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(chars + i)), first));
+                unsigned long bit;
+                while (_BitScanForward(&bit, hits)) {
+                    if (MatchesUtf16(piece, i + bit / 2, &pieces, search)) {
+                        found[count++] = pieceStart + i + bit / 2;
+                        if (count == maxCount) {
+                            return count;
+                        }
+                    }
+                    hits &= ~(3u << bit);
+                }
+            }
+            for (; i < scanEnd; i++) {
+                if (chars[i] == search->text[0] && MatchesUtf16(piece, i, &pieces, search)) {
+                    found[count++] = pieceStart + i;
+                    if (count == maxCount) {
+                        return count;
+                    }
+                }
+            }
+        } else {
+            // Hits are converted to unit offsets by counting the units since the last one, but only
+            // where needed: for a match, a hit running into the next piece, or a piece reaching
+            // past the end position. Where the bytes hold CRs the text does not, text with line
+            // breaks is compared decoded, starting at the CR of a hit on an LF.
+            const char * bytes = piece->bytes;
+            const __m128i first = _mm_set1_epi8(search->bytes[0]);
+            const size_t lastOffset = search->byteCount - 1;
+            const __m128i last = _mm_set1_epi8(search->bytes[lastOffset]);
+            bool limited = scanEnd != piece->length;
+            bool decoded = piece->crlf && search->lineBreaks;
+            bool midPair;
+            size_t i = Utf8Offset(bytes, piece->byteCount, offset, &midPair, piece->crlf);
+            if (midPair) { // no match starts in the middle of a pair
+                i += 4;
+                offset++;
+            }
+            size_t unitByteOffset = i;
+            size_t unitOffset = offset;
+            while (i < piece->byteCount) {
+                uint hits;
+                size_t blockStart = i;
+                if (!decoded && piece->byteCount - i >= 15 + search->byteCount) {
+                    hits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i)), first))
+                        & _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + lastOffset)), last));
+                    i += 16;
+                } else if (piece->byteCount - i >= 16) {
+                    hits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i)), first));
+                    i += 16;
+                } else {
+                    hits = bytes[i] == search->bytes[0];
+                    i++;
+                }
+
+                unsigned long bit;
+                while (_BitScanForward(&bit, hits)) {
+                    hits &= hits - 1;
+                    size_t byteOffset = blockStart + bit;
+                    if (decoded && bytes[byteOffset] == '\n') {
+                        byteOffset--;
+                    }
+                    bool inPiece = !decoded && piece->byteCount - byteOffset >= search->byteCount;
+                    if (!decoded && !inPiece && memcmp(bytes + byteOffset, search->bytes, piece->byteCount - byteOffset) != 0) {
+                        continue; // the part in this piece differs already, so nothing needs decoding
+                    }
+                    if (limited || !inPiece) {
+                        unitOffset += Utf8Length(bytes + unitByteOffset, byteOffset - unitByteOffset, piece->crlf);
+                        unitByteOffset = byteOffset;
+                        if (unitOffset >= scanEnd) {
+                            i = piece->byteCount;
+                            break;
+                        }
+                    }
+                    bool match;
+                    if (inPiece) {
+                        match = memcmp(bytes + byteOffset, search->bytes, search->byteCount) == 0;
+                    } else {
+                        match = MatchesAcrossPieces(piece, unitOffset, pieces, search);
+                    }
+                    if (match) {
+                        unitOffset += Utf8Length(bytes + unitByteOffset, byteOffset - unitByteOffset, piece->crlf);
+                        unitByteOffset = byteOffset;
+                        found[count++] = pieceStart + unitOffset;
+                        if (count == maxCount) {
+                            return count;
+                        }
+                    }
+                }
+            }
+        }
+        pieceStart += piece->length;
+        offset = 0;
+    }
+    return count;
+}
+
+// Finds the last match starting between two positions of a tree, scanning blocks from the end.
+static bool ScanTreeBackward(DocNode * tree, const DocSearch * search, size_t start, size_t end, size_t * found) {
+    size_t positions[64];
+    while (end > start) {
+        size_t blockStart = end - start > DOCSEARCH_BLOCK_LENGTH ? end - DOCSEARCH_BLOCK_LENGTH : start;
+        bool any = false;
+        size_t count;
+        size_t scanStart = blockStart;
+        do {
+            count = ScanTree(tree, search, scanStart, end, positions, 64);
+            if (count != 0) {
+                *found = positions[count - 1];
+                any = true;
+                scanStart = *found + 1;
+            }
+        } while (count == 64);
+        if (any) {
+            return true;
+        }
+        end = blockStart;
+    }
+    return false;
+}
+
+size_t FindDocSnapshotText(DocSnapshot * snapshot, const DocSearch * search, size_t start, size_t end, size_t * found, size_t maxCount) {
+    return ScanTree(snapshot->root, search, start, end, found, maxCount);
+}
+
+size_t FilterDocSnapshotText(DocSnapshot * snapshot, const DocSearch * search, const size_t * positions, size_t count, size_t * kept) {
+    // The positions are sorted, so each piece is walked once, from position to position.
+    DocPieceIterator pieces;
+    const DocPiece * piece = nullptr;
+    size_t pieceStart = 0;
+    size_t unitOffset = 0; // of the sequence at byteOffset, in a UTF-8 piece
+    size_t byteOffset = 0;
+    size_t keptCount = 0;
+    for (size_t i = 0; i != count; i++) {
+        size_t pos = positions[i];
+        if (!piece || pos >= pieceStart + piece->length) {
+            size_t offset = InitTreePieceIteratorAt(snapshot->root, pos, &pieces);
+            piece = NextDocPiece(&pieces);
+            if (!piece) {
+                break;
+            }
+            pieceStart = pos - offset;
+            unitOffset = 0;
+            byteOffset = 0;
+        }
+
+        size_t offset = pos - pieceStart;
+        bool match;
+        if (!piece->bytes) {
+            match = MatchesUtf16(piece, offset, &pieces, search);
+        } else {
+            bool midPair;
+            byteOffset += Utf8Offset(piece->bytes + byteOffset, piece->byteCount - byteOffset, offset - unitOffset, &midPair, piece->crlf);
+            unitOffset = midPair ? offset - 1 : offset;
+            if (midPair) {
+                match = false;
+            } else if (!(piece->crlf && search->lineBreaks) && piece->byteCount - byteOffset >= search->byteCount) {
+                match = memcmp(piece->bytes + byteOffset, search->bytes, search->byteCount) == 0;
+            } else {
+                match = MatchesAcrossPieces(piece, offset, pieces, search);
+            }
+        }
+        if (match) {
+            kept[keptCount++] = pos;
+        }
+    }
+    return keptCount;
+}
+
+ResultCode FindDocText(Doc * doc, const DocSearch * search, bool backward, size_t * lineIndex, size_t * charIndex, bool * wrapped) {
+    ResultCode result = FlushGapLine(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    size_t pos = FindLineStart(doc, *lineIndex) + *charIndex;
+    size_t found;
+    bool success;
+    if (backward) {
+        *wrapped = !ScanTreeBackward(doc->root, search, 0, pos, &found);
+        success = !*wrapped || ScanTreeBackward(doc->root, search, pos, doc->charCount, &found);
+    } else {
+        *wrapped = ScanTree(doc->root, search, pos + 1, doc->charCount, &found, 1) == 0;
+        success = !*wrapped || ScanTree(doc->root, search, 0, pos + 1, &found, 1) != 0;
+    }
+    if (!success) {
+        return RESULT_LIMIT_REACHED;
+    }
+    *lineIndex = FindPosLine(doc, found, charIndex);
+    return RESULT_OK;
+}
+
+// Regexes are matched in UTF-8. Runs of lines are scanned for the first one holding a match
+// without splitting them up, reading UTF-8 pieces in place and transcoding UTF-16 ones in chunks.
+// Only a line found that way is read as a whole and matched to find where the match starts.
+
+#define DOCREGEX_CHUNK_LENGTH 1024
+
+// Returns the UTF-8 text of a line, pointing into a piece if it lies within a UTF-8 one and
+// transcoding it into a buffer otherwise.
+// Returns NULL on memory allocation failure.
+static const char * ReadLineUtf8(Doc * doc, size_t lineIndex, MkDynArray<char> * buffer, size_t * count) {
+    size_t length;
+    size_t start = FindLine(doc, lineIndex, &length);
+    *count = 0;
+    if (length == 0) {
+        return "";
+    }
+
+    size_t offset;
+    DocNode * node = FindPiece(doc->root, start, &offset);
+    if (node->piece.bytes && offset + length <= node->piece.length) {
+        bool midPair;
+        size_t first = Utf8Offset(node->piece.bytes, node->piece.byteCount, offset, &midPair, node->piece.crlf);
+        *count = Utf8Offset(node->piece.bytes + first, node->piece.byteCount - first, length, &midPair, node->piece.crlf);
+        return node->piece.bytes + first;
+    }
+
+    const wchar_t * chars = ReadDocText(doc, start, length);
+    if (!chars || (buffer->capacity < 3 * length && !buffer->SetCapacity(3 * length))) {
+        return nullptr;
+    }
+    *count = TranscodeUtf16ToUtf8(chars, length, buffer->elems);
+    return buffer->elems;
+}
+
+// Scans bytes of a UTF-8 piece with a regex, leaving out the CR in front of each LF if the piece
+// holds them. The end of a match is set as an offset into the bytes, in front of the CR if it falls
+// between the two.
+static bool ScanPieceRegex(Regex * regex, uint * state, const char * bytes, size_t count, bool crlf, size_t * matchEnd) {
+    size_t done = 0;
+    size_t searched = 0;
+    while (true) {
+        const char * lineBreak = crlf ? static_cast<const char *>(memchr(bytes + searched, '\n', count - searched)) : nullptr;
+        size_t end = lineBreak ? lineBreak - 1 - bytes : count;
+        if (ScanRegex(regex, state, bytes + done, end - done, matchEnd)) {
+            *matchEnd += done;
+            if (crlf && *matchEnd != count && bytes[*matchEnd] == '\n') {
+                (*matchEnd)--;
+            }
+            return true;
+        }
+        if (!lineBreak) {
+            return false;
+        }
+        done = end + 1; // at the LF
+        searched = done + 1;
+    }
+}
+
+// Finds the first line from firstLine up to endLine that a match ends in.
+static bool FindRegexLine(Doc * doc, Regex * regex, size_t firstLine, size_t endLine, size_t * lineIndex) {
+    size_t start = FindLineStart(doc, firstLine);
+    size_t end = endLine == doc->lineCount ? doc->charCount : FindLineStart(doc, endLine);
+    uint state = StartRegexScan(regex);
+    DocPieceIterator pieces;
+    size_t offset = InitTreePieceIteratorAt(doc->root, start, &pieces);
+    size_t pieceStart = start - offset;
+    const DocPiece * piece;
+    while (pieceStart < end && (piece = NextDocPiece(&pieces))) {
+        size_t scanEnd = end - pieceStart < piece->length ? end - pieceStart : piece->length;
+        size_t matchPos = SIZE_MAX;
+        if (piece->bytes) {
+            bool midPair;
+            size_t first = Utf8Offset(piece->bytes, piece->byteCount, offset, &midPair, piece->crlf);
+            size_t count = piece->byteCount - first;
+            if (scanEnd != piece->length) {
+                count = Utf8Offset(piece->bytes + first, count, scanEnd - offset, &midPair, piece->crlf);
+            }
+            size_t matchEnd;
+            if (ScanPieceRegex(regex, &state, piece->bytes + first, count, piece->crlf, &matchEnd)) {
+                matchPos = pieceStart + offset + Utf8Length(piece->bytes + first, matchEnd, piece->crlf);
+            }
+        } else {
+            char bytes[3 * DOCREGEX_CHUNK_LENGTH];
+            while (offset != scanEnd) {
+                // A chunk ending between the units of a pair would transcode them apart.
+                size_t length = scanEnd - offset < DOCREGEX_CHUNK_LENGTH ? scanEnd - offset : DOCREGEX_CHUNK_LENGTH;
+                wchar_t last = piece->chars[offset + length - 1];
+                if (length > 1 && offset + length != scanEnd && last >= 0xD800 && last <= 0xDBFF) {
+                    length--;
+                }
+                size_t count = TranscodeUtf16ToUtf8(piece->chars + offset, length, bytes);
+                size_t matchEnd;
+                if (ScanRegex(regex, &state, bytes, count, &matchEnd)) {
+                    matchPos = pieceStart + offset + Utf8Length(bytes, matchEnd, false);
+                    break;
+                }
+                offset += length;
+            }
+        }
+        if (matchPos != SIZE_MAX) {
+            if (matchPos == end && endLine != doc->lineCount) {
+                return false; // at the start of endLine
+            }
+            size_t charIndex;
+            *lineIndex = FindPosLine(doc, matchPos, &charIndex);
+            return true;
+        }
+        pieceStart += piece->length;
+        offset = 0;
+    }
+
+    if (endLine == doc->lineCount && EndRegexScan(regex, state)) {
+        *lineIndex = doc->lineCount - 1;
+        return true;
     }
-    line->Init(DOCLINE_INIT_CAPACITY);
-    if (!line->SetCapacity(line->growCount)) {
-        doc->lines.Clear();
-        free(doc);
-        return nullptr;
+    return false;
+}
+
+// Finds the first match in the lines from firstLine up to endLine.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if there is no match
+static ResultCode FindRegexForward(Doc * doc, Regex * regex, MkDynArray<char> * buffer, size_t firstLine, size_t endLine, size_t * lineIndex, size_t * charIndex) {
+    size_t line;
+    while (firstLine < endLine && FindRegexLine(doc, regex, firstLine, endLine, &line)) {
+        size_t count;
+        const char * bytes = ReadLineUtf8(doc, line, buffer, &count);
+        if (!bytes) {
+            return RESULT_MEMORY_ERROR;
+        }
+        size_t start;
+        size_t end;
+        if (MatchRegexLine(regex, bytes, count, 0, &start, &end)) {
+            *lineIndex = line;
+            *charIndex = Utf8Length(bytes, start, false);
+            return RESULT_OK;
+        }
+        firstLine = line + 1; // a pair split between pieces made the scan see a match
     }
+    return RESULT_LIMIT_REACHED;
+}
 
-    doc->cursorLineIndex = 0;
-    doc->cursorCharIndex = 0;
-    doc->lastCursorColIndex = 0;
-    doc->topPaintLineIndex = 0;
-    doc->lastPaintLineCount = 0;
-    doc->modified = false;
-    doc->timestamp = 0;
-    doc->title[0] = L'\0';
+// Finds the last match in the lines from firstLine up to endLine, scanning blocks of lines from the
+// end.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if there is no match
+static ResultCode FindRegexBackward(Doc * doc, Regex * regex, MkDynArray<char> * buffer, size_t firstLine, size_t endLine, size_t * lineIndex, size_t * charIndex) {
+    if (firstLine >= endLine) {
+        return RESULT_LIMIT_REACHED;
+    }
 
-    return doc;
+    size_t firstStart = FindLineStart(doc, firstLine);
+    while (endLine > firstLine) {
+        size_t end = endLine == doc->lineCount ? doc->charCount : FindLineStart(doc, endLine);
+        size_t blockLine = firstLine;
+        if (end - firstStart > DOCSEARCH_BLOCK_LENGTH) {
+            size_t blockCharIndex;
+            blockLine = FindPosLine(doc, end - DOCSEARCH_BLOCK_LENGTH, &blockCharIndex);
+        }
+
+        bool any = false;
+        size_t line;
+        size_t nextLine = blockLine;
+        while (nextLine < endLine && FindRegexLine(doc, regex, nextLine, endLine, &line)) {
+            size_t count;
+            const char * bytes = ReadLineUtf8(doc, line, buffer, &count);
+            if (!bytes) {
+                return RESULT_MEMORY_ERROR;
+            }
+            size_t start;
+            if (MatchRegexLineBackward(regex, bytes, count, count + 1, &start)) {
+                *lineIndex = line;
+                *charIndex = Utf8Length(bytes, start, false);
+                any = true;
+            }
+            nextLine = line + 1;
+        }
+        if (any) {
+            return RESULT_OK;
+        }
+        endLine = blockLine;
+    }
+    return RESULT_LIMIT_REACHED;
 }
 
-void DestroyDoc(Doc * doc) {
-    if (doc) {
-        if (doc->lines.elems) {
-            for (size_t i = 0; i != doc->lines.count; i++) {
-                doc->lines.elems[i].Clear();
+size_t FindDocLineText(Doc * doc, const DocSearch * search, size_t lineIndex, size_t charIndex, size_t length, DocMatch * matches, size_t maxCount) {
+    if (FlushGapLine(doc) != RESULT_OK) {
+        return 0;
+    }
+
+    size_t lineLength;
+    size_t lineStart = FindLine(doc, lineIndex, &lineLength);
+    if (charIndex >= lineLength) {
+        return 0;
+    }
+    size_t start = lineStart + (charIndex > search->length - 1 ? charIndex - (search->length - 1) : 0);
+    size_t end = lineStart + (lineLength - charIndex > length ? charIndex + length : lineLength);
+    size_t count = 0;
+    while (count != maxCount && start < end) {
+        size_t found[64];
+        size_t foundCount = ScanTree(doc->root, search, start, end, found, 64);
+        for (size_t i = 0; i != foundCount && count != maxCount; i++) {
+            if (found[i] + search->length > lineStart + lineLength) {
+                return count; // running into the next line
             }
-            doc->lines.Clear();
+            matches[count].charIndex = found[i] - lineStart;
+            matches[count].length = search->length;
+            count++;
         }
-        free(doc);
+        if (foundCount != 64) {
+            break;
+        }
+        start = found[63] + 1;
     }
+    return count;
 }
 
-void ResetColIndex(Doc * doc) {
-    wchar_t * chars = doc->lines.elems[doc->cursorLineIndex].elems;
-    doc->lastCursorColIndex = 0;
-    for (ushort i = 0; i != doc->cursorCharIndex; i++) {
-        if (chars[i] == L'\t') {
-            doc->lastCursorColIndex += config.tabWidth;
+size_t FindDocLineRegex(Doc * doc, Regex * regex, size_t lineIndex, size_t charIndex, size_t length, DocMatch * matches, size_t maxCount) {
+    if (FlushGapLine(doc) != RESULT_OK) {
+        return 0;
+    }
+
+    MkDynArray<char> buffer;
+    buffer.Init(DOCLINEBUFFER_GROW_COUNT);
+    size_t byteCount;
+    const char * bytes = ReadLineUtf8(doc, lineIndex, &buffer, &byteCount);
+    size_t count = 0;
+    size_t from = 0;
+    size_t fromIndex = 0;
+    size_t start;
+    size_t end;
+    while (bytes && count != maxCount && MatchRegexLine(regex, bytes, byteCount, from, &start, &end)) {
+        size_t startIndex = fromIndex + Utf8Length(bytes + from, start - from, false);
+        if (startIndex - charIndex >= length && startIndex >= charIndex) {
+            break;
+        }
+        size_t matchLength = Utf8Length(bytes + start, end - start, false);
+        if (startIndex + matchLength > charIndex || (matchLength == 0 && startIndex == charIndex)) {
+            matches[count].charIndex = startIndex;
+            matches[count].length = matchLength;
+            count++;
+        }
+
+        // The next match starts behind this one, and behind the next character after an empty one.
+        from = end;
+        fromIndex = startIndex + matchLength;
+        if (end == start) {
+            if (end == byteCount) {
+                break;
+            }
+            from += Utf8SequenceLength(bytes[end]);
+            fromIndex += Utf8Length(bytes + end, from - end, false);
+        }
+    }
+    buffer.Clear();
+    return count;
+}
+
+ResultCode FindDocRegex(Doc * doc, Regex * regex, bool backward, size_t * lineIndex, size_t * charIndex, bool * wrapped) {
+    ResultCode result = FlushGapLine(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    MkDynArray<char> buffer;
+    buffer.Init(DOCLINEBUFFER_GROW_COUNT);
+    size_t cursorLineIndex = *lineIndex;
+    size_t count;
+    const char * bytes = ReadLineUtf8(doc, cursorLineIndex, &buffer, &count);
+    if (!bytes) {
+        buffer.Clear();
+        return RESULT_MEMORY_ERROR;
+    }
+    bool midPair;
+    size_t cursor = Utf8Offset(bytes, count, *charIndex, &midPair, false);
+    size_t start;
+    size_t end;
+    *wrapped = false;
+    if (backward) {
+        if (MatchRegexLineBackward(regex, bytes, count, midPair ? cursor + 1 : cursor, &start)) {
+            *charIndex = Utf8Length(bytes, start, false);
+        } else {
+            result = FindRegexBackward(doc, regex, &buffer, 0, cursorLineIndex, lineIndex, charIndex);
+            if (result == RESULT_LIMIT_REACHED) {
+                *wrapped = true;
+                result = FindRegexBackward(doc, regex, &buffer, cursorLineIndex + 1, doc->lineCount, lineIndex, charIndex);
+            }
+            if (result == RESULT_LIMIT_REACHED) {
+                bytes = ReadLineUtf8(doc, cursorLineIndex, &buffer, &count);
+                if (!bytes) {
+                    result = RESULT_MEMORY_ERROR;
+                } else if (MatchRegexLineBackward(regex, bytes, count, count + 1, &start)) {
+                    *lineIndex = cursorLineIndex;
+                    *charIndex = Utf8Length(bytes, start, false);
+                    result = RESULT_OK;
+                }
+            }
+        }
+    } else {
+        // Matches start behind the character under the cursor.
+        size_t from = cursor + (cursor == count ? 1 : Utf8SequenceLength(bytes[cursor]));
+        if (MatchRegexLine(regex, bytes, count, from, &start, &end)) {
+            *charIndex = Utf8Length(bytes, start, false);
+        } else {
+            result = FindRegexForward(doc, regex, &buffer, cursorLineIndex + 1, doc->lineCount, lineIndex, charIndex);
+            if (result == RESULT_LIMIT_REACHED) {
+                *wrapped = true;
+                result = FindRegexForward(doc, regex, &buffer, 0, cursorLineIndex, lineIndex, charIndex);
+            }
+            if (result == RESULT_LIMIT_REACHED) {
+                bytes = ReadLineUtf8(doc, cursorLineIndex, &buffer, &count);
+                if (!bytes) {
+                    result = RESULT_MEMORY_ERROR;
+                } else if (MatchRegexLine(regex, bytes, count, 0, &start, &end)) {
+                    *lineIndex = cursorLineIndex;
+                    *charIndex = Utf8Length(bytes, start, false);
+                    result = RESULT_OK;
+                }
+            }
+        }
+    }
+    buffer.Clear();
+    return result;
+}
+
+//----------------
+// Substitution
+
+// Unchanged text between two changed lines shorter than this is rebuilt along with them, so dense
+// changes end up as few long pieces rather than two short ones per line.
+#define DOCEDIT_MAX_GAP_LENGTH DOCPIECE_MAX_LENGTH
+
+// Reads the lines of a tree one after another in UTF-8.
+struct DocLineReader {
+    DocPieceIterator pieces;
+    const DocPiece * piece; // NULL at the end of the text
+    size_t offset; // into the piece
+    size_t byteOffset; // into the piece if it is UTF-8
+    size_t pos; // of the next line
+    MkDynArray<wchar_t> chars; // a line not within one UTF-8 piece
+    MkDynArray<char> bytes; // the same transcoded
+};
+
+static void InitLineReader(DocLineReader * reader, DocNode * tree, size_t pos) {
+    reader->offset = InitTreePieceIteratorAt(tree, pos, &reader->pieces);
+    reader->piece = NextDocPiece(&reader->pieces);
+    reader->byteOffset = 0;
+    if (reader->piece && reader->piece->bytes) {
+        bool midPair;
+        reader->byteOffset = Utf8Offset(reader->piece->bytes, reader->piece->byteCount, reader->offset, &midPair, reader->piece->crlf);
+    }
+    reader->pos = pos;
+    reader->chars.Init(DOCLINEBUFFER_GROW_COUNT);
+    reader->bytes.Init(DOCLINEBUFFER_GROW_COUNT);
+}
+
+// Moves the reader along its piece, and on to the next one at the end of it.
+static void AdvanceLineReader(DocLineReader * reader, size_t length, size_t byteCount) {
+    reader->offset += length;
+    reader->byteOffset += byteCount;
+    if (reader->offset == reader->piece->length) {
+        reader->piece = NextDocPiece(&reader->pieces);
+        reader->offset = 0;
+        reader->byteOffset = 0;
+    }
+}
+
+// Returns the next line without the line break, pointing into a piece if it lies within a UTF-8
+// one and transcoding it into a buffer otherwise, together with its position and length. A line
+// transcoded comes with its UTF-16 text as well, which may hold unpaired surrogates UTF-8 cannot.
+// The CR in front of a line break is left out if the piece holds one.
+// Returns NULL on memory allocation failure.
+static const char * ReadNextLine(DocLineReader * reader, size_t * count, const wchar_t ** chars, size_t * lineStart, size_t * length) {
+    *lineStart = reader->pos;
+    *chars = nullptr;
+    const DocPiece * piece = reader->piece;
+    if (piece && piece->bytes) {
+        const char * start = piece->bytes + reader->byteOffset;
+        size_t rest = piece->byteCount - reader->byteOffset;
+        const char * lineBreak = static_cast<const char *>(memchr(start, '\n', rest));
+        if (lineBreak || reader->pieces.depth == 0) {
+            size_t breakCount = lineBreak ? 1 : 0;
+            size_t breakByteCount = lineBreak && piece->crlf ? 2 : breakCount;
+            *count = lineBreak ? lineBreak + 1 - breakByteCount - start : rest;
+            *length = Utf8Length(start, *count, false);
+            AdvanceLineReader(reader, *length + breakCount, *count + breakByteCount);
+            reader->pos += *length + breakCount;
+            return start;
+        }
+    }
+
+    reader->chars.Remove(0, reader->chars.count);
+    bool lineBreak = false;
+    while (!lineBreak && reader->piece) {
+        piece = reader->piece;
+        size_t length;
+        size_t byteCount = 0;
+        size_t breakByteCount = 1;
+        if (piece->bytes) {
+            const char * start = piece->bytes + reader->byteOffset;
+            size_t rest = piece->byteCount - reader->byteOffset;
+            const char * found = static_cast<const char *>(memchr(start, '\n', rest));
+            breakByteCount = piece->crlf ? 2 : 1;
+            byteCount = found ? found + 1 - breakByteCount - start : rest;
+            length = Utf8Length(start, byteCount, false);
+            lineBreak = found != nullptr;
         } else {
-            doc->lastCursorColIndex++;
+            length = 0;
+            while (reader->offset + length != piece->length && piece->chars[reader->offset + length] != L'\n') {
+                length++;
+            }
+            lineBreak = reader->offset + length != piece->length;
+        }
+
+        if (length != 0) {
+            if (reader->chars.capacity - reader->chars.count < length) {
+                size_t capacity = 2 * reader->chars.capacity > reader->chars.count + length ? 2 * reader->chars.capacity : reader->chars.count + length;
+                if (!reader->chars.SetCapacity(capacity)) {
+                    return nullptr;
+                }
+            }
+            wchar_t * lineChars = reader->chars.Insert(SIZE_MAX, length);
+            if (piece->bytes) {
+                DecodeUtf8(piece->bytes + reader->byteOffset, byteCount, 0, length, lineChars, false);
+            } else {
+                memcpy(lineChars, piece->chars + reader->offset, length * sizeof(wchar_t));
+            }
+        }
+        size_t breakCount = lineBreak ? 1 : 0;
+        AdvanceLineReader(reader, length + breakCount, byteCount + breakCount * breakByteCount);
+    }
+
+    *length = reader->chars.count;
+    reader->pos += *length + (lineBreak ? 1 : 0);
+    if (*length == 0) {
+        *count = 0;
+        return "";
+    }
+    if (reader->bytes.capacity < 3 * *length && !reader->bytes.SetCapacity(3 * *length)) {
+        return nullptr;
+    }
+    *count = TranscodeUtf16ToUtf8(reader->chars.elems, *length, reader->bytes.elems);
+    *chars = reader->chars.elems;
+    return reader->bytes.elems;
+}
+
+// Makes room for more text in a list, doubling its capacity as needed.
+// Returns NULL on memory allocation failure.
+static wchar_t * AppendEditText(DocEditList * edits, size_t length) {
+    MkDynArray<wchar_t> * text = &edits->text;
+    if (text->capacity - text->count < length) {
+        size_t capacity = 2 * text->capacity > text->count + length ? 2 * text->capacity : text->count + length;
+        if (!text->SetCapacity(capacity)) {
+            return nullptr;
+        }
+    }
+    return text->Insert(SIZE_MAX, length);
+}
+
+// Adds the part of a line between two byte offsets to the text of a list, copying the UTF-16 text
+// of the line if there is any and decoding the UTF-8 otherwise. Each unpaired surrogate became one
+// three byte sequence, so the offsets translate the same either way. The index of the part in the
+// line is moved behind it.
+static bool AppendEditLine(DocEditList * edits, const char * line, const wchar_t * chars, size_t start, size_t end, size_t * index) {
+    size_t length = Utf8Length(line + start, end - start, false);
+    if (length == 0) {
+        return true;
+    }
+    wchar_t * text = AppendEditText(edits, length);
+    if (!text) {
+        return false;
+    }
+    if (chars) {
+        memcpy(text, chars + *index, length * sizeof(wchar_t));
+    } else {
+        DecodeUtf8(line + start, end - start, 0, length, text, false);
+    }
+    *index += length;
+    return true;
+}
+
+// Adds the replacement for a match to the text of a list.
+static bool AppendReplacement(DocEditList * edits, const wchar_t * replacement, size_t replacementLength, const char * line, const wchar_t * chars, size_t start, size_t end, size_t index) {
+    for (size_t i = 0; i != replacementLength; i++) {
+        wchar_t c = replacement[i];
+        if (c == L'&') {
+            size_t matchIndex = index;
+            if (!AppendEditLine(edits, line, chars, start, end, &matchIndex)) {
+                return false;
+            }
+            continue;
+        }
+        if (c == L'\\' && i + 1 != replacementLength) {
+            i++;
+            c = replacement[i] == L'n' ? L'\n' : replacement[i] == L't' ? L'\t' : replacement[i];
+        }
+        wchar_t * chars = AppendEditText(edits, 1);
+        if (!chars) {
+            return false;
+        }
+        *chars = c;
+    }
+    return true;
+}
+
+// Adds a line to the text of a list with the matches of a regex replaced, if it holds any. The
+// offsets matches start at are marked in a buffer first, so long lines with many matches are not
+// gone through once for each. As in vi, an empty match directly behind the last match is skipped.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if a line would grow too long
+static ResultCode SubstituteLine(DocEditList * edits, Regex * regex, const char * line, size_t count, const wchar_t * chars, const wchar_t * replacement, size_t replacementLength, bool global, MkDynArray<char> * starts, bool * changed) {
+    *changed = false;
+    if (starts->capacity < count + 1 && !starts->SetCapacity(count + 1)) {
+        return RESULT_MEMORY_ERROR;
+    }
+    if (!MarkRegexLineStarts(regex, line, count, starts->elems)) {
+        return RESULT_OK;
+    }
+
+    size_t textCount = edits->text.count;
+    size_t copied = 0; // bytes of the line added so far
+    size_t copiedIndex = 0;
+    size_t from = 0;
+    while (from <= count) {
+        const char * next = static_cast<const char *>(memchr(starts->elems + from, true, count + 1 - from));
+        if (!next) {
+            break;
+        }
+        size_t start = next - starts->elems;
+        size_t end = MatchRegexLineAt(regex, line, count, start);
+        if (start != end || !*changed || start != copied) {
+            if (!AppendEditLine(edits, line, chars, copied, start, &copiedIndex)
+                || !AppendReplacement(edits, replacement, replacementLength, line, chars, start, end, copiedIndex))
+            {
+                return RESULT_MEMORY_ERROR;
+            }
+            copied = end;
+            copiedIndex += Utf8Length(line + start, end - start, false);
+            *changed = true;
+            edits->matchCount++;
+            if (!global) {
+                break;
+            }
+        }
+
+        from = end;
+        if (end == start) {
+            if (end == count) {
+                break;
+            }
+            from += Utf8SequenceLength(line[end]);
+        }
+    }
+    if (!*changed) {
+        return RESULT_OK;
+    }
+    if (!AppendEditLine(edits, line, chars, copied, count, &copiedIndex)) {
+        return RESULT_MEMORY_ERROR;
+    }
+
+    // No line can be longer than all the text added for it.
+    if (edits->text.count - textCount > MAX_LINE_LENGTH) {
+        size_t lineLength = 0;
+        for (size_t i = textCount; i != edits->text.count; i++) {
+            lineLength = edits->text.elems[i] == L'\n' ? 0 : lineLength + 1;
+            if (lineLength > MAX_LINE_LENGTH) {
+                return RESULT_LIMIT_REACHED;
+            }
+        }
+    }
+    return RESULT_OK;
+}
+
+ResultCode SubstituteDocSnapshot(DocSnapshot * snapshot, Regex * regex, size_t pos, size_t lineCount, const wchar_t * replacement, size_t replacementLength, bool global, DocEditList * edits) {
+    edits->edits.Init(DOCUNDO_GROW_COUNT);
+    edits->text.Init(DOCLINEBUFFER_GROW_COUNT);
+    edits->matchCount = 0;
+
+    DocLineReader reader;
+    InitLineReader(&reader, snapshot->root, pos);
+    MkDynArray<char> starts;
+    starts.Init(DOCLINEBUFFER_GROW_COUNT);
+    ResultCode result = RESULT_OK;
+    bool open = false; // the last edit takes in the lines read since, until the gap grows too long
+    size_t gapLength = 0;
+    for (size_t i = 0; i != lineCount; i++) {
+        size_t count;
+        size_t lineStart;
+        size_t length;
+        const wchar_t * chars;
+        const char * line = ReadNextLine(&reader, &count, &chars, &lineStart, &length);
+        if (!line) {
+            result = RESULT_MEMORY_ERROR;
+            break;
+        }
+
+        size_t textCount = edits->text.count;
+        if (open) {
+            wchar_t * lineBreak = AppendEditText(edits, 1);
+            if (!lineBreak) {
+                result = RESULT_MEMORY_ERROR;
+                break;
+            }
+            *lineBreak = L'\n';
+        }
+        bool changed;
+        result = SubstituteLine(edits, regex, line, count, chars, replacement, replacementLength, global, &starts, &changed);
+        if (result != RESULT_OK) {
+            break;
+        }
+
+        if (changed) {
+            DocEdit * edit;
+            if (open) {
+                edit = &edits->edits.elems[edits->edits.count - 1];
+            } else {
+                edit = edits->edits.Insert(SIZE_MAX, 1);
+                if (!edit) {
+                    result = RESULT_MEMORY_ERROR;
+                    break;
+                }
+                edit->pos = lineStart;
+                edit->textStart = textCount;
+            }
+            edit->removedLength = lineStart + length - edit->pos;
+            edit->textLength = edits->text.count - edit->textStart;
+            open = true;
+            gapLength = 0;
+        } else if (open) {
+            gapLength += 1 + length;
+            if (gapLength < DOCEDIT_MAX_GAP_LENGTH) {
+                size_t index = 0;
+                if (!AppendEditLine(edits, line, chars, 0, count, &index)) {
+                    result = RESULT_MEMORY_ERROR;
+                    break;
+                }
+            } else {
+                DocEdit * edit = &edits->edits.elems[edits->edits.count - 1];
+                edits->text.Remove(edit->textStart + edit->textLength, edits->text.count - edit->textStart - edit->textLength);
+                open = false;
+            }
+        }
+    }
+
+    // The gap behind the last edit is not needed.
+    if (result == RESULT_OK && open) {
+        DocEdit * edit = &edits->edits.elems[edits->edits.count - 1];
+        edits->text.Remove(edit->textStart + edit->textLength, edits->text.count - edit->textStart - edit->textLength);
+    }
+    reader.chars.Clear();
+    reader.bytes.Clear();
+    starts.Clear();
+    return result;
+}
+
+void ClearDocEditList(DocEditList * edits) {
+    edits->edits.Clear();
+    edits->text.Clear();
+}
+
+// Copies text into the add buffer and adds pieces for it to a list. Text directly following the
+// last piece of the list in the add buffer extends that piece instead.
+static bool AppendAddPieces(Doc * doc, MkDynArray<DocPiece> * pieces, const wchar_t * text, size_t length) {
+    size_t done = 0;
+    while (done != length) {
+        if (doc->addBlockLength == DOCADD_BLOCK_LENGTH && !AddBlock(doc)) {
+            return false;
+        }
+
+        wchar_t * addEnd = doc->addBlocks.elems[doc->addBlocks.count - 1] + doc->addBlockLength;
+        DocPiece * piece = pieces->count != 0 ? &pieces->elems[pieces->count - 1] : nullptr;
+        if (!(piece
+            && doc->addBlockLength != 0
+            && piece->chars
+            && piece->chars + piece->length == addEnd
+            && piece->length != DOCPIECE_MAX_LENGTH))
+        {
+            piece = pieces->Insert(SIZE_MAX, 1);
+            if (!piece) {
+                return false;
+            }
+            piece->chars = addEnd;
+            piece->bytes = nullptr;
+            piece->byteCount = 0;
+            piece->length = 0;
+            piece->lineBreakCount = 0;
+            piece->tabCount = 0;
+            piece->crlf = false;
+        }
+
+        size_t count = length - done;
+        if (count > DOCADD_BLOCK_LENGTH - doc->addBlockLength) {
+            count = DOCADD_BLOCK_LENGTH - doc->addBlockLength;
+        }
+        if (count > DOCPIECE_MAX_LENGTH - piece->length) {
+            count = DOCPIECE_MAX_LENGTH - piece->length;
+        }
+        memcpy(addEnd, text + done, count * sizeof(wchar_t));
+        piece->length += count;
+        piece->lineBreakCount += CountChars(addEnd, count, L'\n');
+        piece->tabCount += CountChars(addEnd, count, L'\t');
+
+        doc->addBlockLength += count;
+        done += count;
+    }
+    return true;
+}
+
+// Adds the pieces of a range of a tree to a list, cutting the first and the last one to size. The
+// range must not start or end within a surrogate pair.
+static bool AppendTreePieces(DocNode * tree, size_t start, size_t end, MkDynArray<DocPiece> * pieces) {
+    DocPieceIterator iterator;
+    size_t offset = InitTreePieceIteratorAt(tree, start, &iterator);
+    const DocPiece * piece;
+    while (start != end && (piece = NextDocPiece(&iterator))) {
+        size_t length = piece->length - offset < end - start ? piece->length - offset : end - start;
+        DocPiece * slice = pieces->Insert(SIZE_MAX, 1);
+        if (!slice) {
+            return false;
+        }
+        *slice = *piece;
+        if (length != piece->length) {
+            if (piece->bytes) {
+                bool midPair;
+                size_t first = Utf8Offset(piece->bytes, piece->byteCount, offset, &midPair, piece->crlf);
+                slice->bytes = piece->bytes + first;
+                slice->byteCount = Utf8Offset(slice->bytes, piece->byteCount - first, length, &midPair, piece->crlf);
+            } else {
+                slice->chars = piece->chars + offset;
+            }
+            slice->length = length;
+            CountPiece(slice);
+        }
+        start += length;
+        offset = 0;
+    }
+    return true;
+}
+
+ResultCode ApplyDocEdits(Doc * doc, const DocEditList * lists, size_t listCount) {
+    ResultCode result = EndDocInsert(doc);
+    if (result != RESULT_OK) {
+        return result;
+    }
+
+    const DocEdit * first = nullptr;
+    const DocEdit * last = nullptr;
+    for (size_t i = 0; i != listCount; i++) {
+        if (lists[i].edits.count != 0) {
+            if (!first) {
+                first = &lists[i].edits.elems[0];
+            }
+            last = &lists[i].edits.elems[lists[i].edits.count - 1];
+        }
+    }
+    if (!first) {
+        return RESULT_OK;
+    }
+    size_t start = first->pos;
+    size_t end = last->pos + last->removedLength;
+
+    // The new text of the whole range as pieces: the text kept between the edits where it was, and
+    // the text of the edits copied into the add buffer.
+    MkDynArray<DocPiece> pieces;
+    pieces.Init(DOCUNDO_GROW_COUNT);
+    size_t gapStart = start;
+    bool failed = false;
+    for (size_t i = 0; i != listCount && !failed; i++) {
+        const DocEditList * list = &lists[i];
+        for (size_t j = 0; j != list->edits.count; j++) {
+            const DocEdit * edit = &list->edits.elems[j];
+            if (!AppendTreePieces(doc->root, gapStart, edit->pos, &pieces)
+                || !AppendAddPieces(doc, &pieces, list->text.elems + edit->textStart, edit->textLength))
+            {
+                failed = true;
+                break;
+            }
+            gapStart = edit->pos + edit->removedLength;
         }
     }
+    if (failed
+        || !ReserveNodes(doc, pieces.count + 2)
+        || !ReserveCopyNodes(doc, pieces.count + 2, 6))
+    {
+        pieces.Clear();
+        return RESULT_MEMORY_ERROR;
+    }
+    DocNode * inserted = BuildPieceTree(doc, pieces.elems, pieces.count);
+
+    DocNode * left;
+    DocNode * middle;
+    DocNode * right;
+    result = CutTree(doc, start, end - start, &left, &middle, &right);
+    if (result != RESULT_OK) {
+        DestroyTree(doc, inserted);
+        pieces.Clear();
+        return result;
+    }
+
+    bool record = config.undoMemoryLimit != 0;
+    if (record && !BeginUndoRecord(doc, start, middle, pieces.count)) {
+        doc->root = ConcatTrees(doc, ConcatTrees(doc, left, middle), right);
+        DestroyTree(doc, inserted);
+        pieces.Clear();
+        return RESULT_MEMORY_ERROR;
+    }
+    DestroyTree(doc, middle);
+
+    size_t charCount = doc->charCount;
+    doc->root = ConcatTrees(doc, ConcatTrees(doc, left, inserted), right);
+    UpdateDocCounts(doc);
+    size_t insertedLength = doc->charCount + (end - start) - charCount;
+    LogChange(doc, start, end - start, insertedLength);
+    if (record) {
+        EndUndoRecordPieces(doc, pieces.elems, pieces.count);
+    }
+    doc->undoGroupOpen = false;
+    pieces.Clear();
+
+    SetCursorPos(doc, start + insertedLength);
+    doc->cursorCharIndex = 0;
+    return RESULT_OK;
+}
+
+//--------------
+// Char Input
+
+void ResetColIndex(Doc * doc) {
+    if (IsGapLine(doc, doc->cursorLineIndex)) {
+        MoveGap(&doc->gapLine, doc->cursorCharIndex);
+        doc->lastCursorColIndex = doc->gapLine.gapColIndex;
+        return;
+    }
+
+    size_t start = FindLineStart(doc, doc->cursorLineIndex);
+    doc->lastCursorColIndex = static_cast<ulong>(FindColCount(doc->root, start + doc->cursorCharIndex) - FindColCount(doc->root, start));
 }
 
 ResultCode ProcessDocCharInput(Doc * doc, wchar_t c) {
     switch (c) {
         case L'\t':
         {
-            MkDynArray<wchar_t> * line = &doc->lines.elems[doc->cursorLineIndex];
+            size_t lineLength = GetDocLineLength(doc, doc->cursorLineIndex);
             if (config.expandTabs) {
-                if (line->count > MAX_LINE_LENGTH - config.tabWidth) {
+                if (lineLength > MAX_LINE_LENGTH - config.tabWidth) {
                     return RESULT_LIMIT_REACHED;
                 }
-
-                ushort newLength = static_cast<ushort>(line->count + config.tabWidth);
-                ushort newCapacity = static_cast<ushort>(line->capacity);
-                bool grow = false;
-                while (newCapacity < newLength) {
-                    newCapacity *= 2;
-                    grow = true;
-                }
-                if (grow && !line->SetCapacity(newCapacity)) {
-                    return RESULT_MEMORY_ERROR;
-                }
-
-                wchar_t * chars = line->Insert(doc->cursorCharIndex, config.tabWidth);
-                for (ushort i = 0; i != config.tabWidth; i++) {
-                    chars[i] = L' ';
-                }
-                doc->cursorCharIndex += static_cast<ushort>(config.tabWidth);
+                return InsertGapText(doc, tabSpaces, config.tabWidth);
             } else {
-                if (line->count == MAX_LINE_LENGTH) {
+                if (lineLength == MAX_LINE_LENGTH) {
                     return RESULT_LIMIT_REACHED;
                 }
-
-                if (line->count == line->capacity && !line->SetCapacity(line->capacity * 2)) {
-                    return RESULT_MEMORY_ERROR;
-                }
-                wchar_t * newChar = line->Insert(doc->cursorCharIndex++, 1);
-                *newChar = L'\t';
+                return InsertGapText(doc, L"\t", 1);
             }
-
-            ResetColIndex(doc);
-            doc->modified = true;
-            break;
         }
 
         case L'\r':
         {
-            if (doc->lines.count == MAX_LINE_COUNT) {
+            if (doc->lineCount == MAX_LINE_COUNT) {
                 return RESULT_LIMIT_REACHED;
             }
 
-            MkDynArray<wchar_t> * newLine = doc->lines.Insert(doc->cursorLineIndex + 1, 1);
-            if (!newLine) {
-                return RESULT_MEMORY_ERROR;
-            }
-            newLine->Init(DOCLINE_INIT_CAPACITY);
-            MkDynArray<wchar_t> * curLine = newLine - 1;
-
-            ushort newLineLength = static_cast<ushort>(curLine->count) - doc->cursorCharIndex;
-            ushort newLineCapacity = static_cast<ushort>(newLine->growCount);
-            while (newLineLength < newLineCapacity) {
-                newLineCapacity *= 2;
+            ResultCode result = FlushGapLine(doc);
+            if (result != RESULT_OK) {
+                return result;
             }
-            if (!newLine->SetCapacity(newLineCapacity)) {
-                curLine->Remove(doc->cursorLineIndex + 1, 1);
-                return RESULT_MEMORY_ERROR;
+            result = ReplaceText(doc, FindLineStart(doc, doc->cursorLineIndex) + doc->cursorCharIndex, 0, L"\n", 1);
+            if (result != RESULT_OK) {
+                return result;
             }
-            newLine->count = newLineLength;
 
-            for (ushort i = 0; i != newLineLength; i++) {
-                newLine->elems[i] = curLine->elems[doc->cursorCharIndex + i];
-            }
             doc->cursorLineIndex++;
             doc->cursorCharIndex = 0;
             doc->lastCursorColIndex = 0;
@@ -137,42 +3306,28 @@ ResultCode ProcessDocCharInput(Doc * doc, wchar_t c) {
 
         case L'\b':
         {
-            if (doc->cursorCharIndex == 0) {
-                if (doc->cursorLineIndex != 0) {
-                    MkDynArray<wchar_t> * curLine = &doc->lines.elems[doc->cursorLineIndex];
-                    MkDynArray<wchar_t> * prevLine = curLine - 1;
-
-                    if (curLine->count > MAX_LINE_LENGTH - prevLine->count) {
-                        return RESULT_LIMIT_REACHED;
-                    }
-
-                    ushort newLength = static_cast<ushort>(prevLine->count + curLine->count);
-                    ushort newCapacity = static_cast<ushort>(prevLine->capacity);
-                    bool grow = false;
-                    while (newCapacity < newLength) {
-                        newCapacity *= 2;
-                        grow = true;
-                    }
-                    if (grow && !prevLine->SetCapacity(newCapacity)) {
-                        return RESULT_MEMORY_ERROR;
-                    }
-
-                    doc->cursorLineIndex--;
-                    doc->cursorCharIndex = static_cast<ushort>(prevLine->count);
-                    prevLine->count = newLength;
-                    for (ushort i = 0; i != curLine->count; i++) {
-                        prevLine->elems[doc->cursorCharIndex + i] = curLine->elems[i];
-                    }
+            if (doc->cursorCharIndex != 0) {
+                return RemoveGapChar(doc);
+            }
 
-                    curLine->Clear();
-                    doc->lines.Remove(doc->cursorLineIndex + 1, 1);
+            if (doc->cursorLineIndex != 0) {
+                size_t prevLineLength = GetDocLineLength(doc, doc->cursorLineIndex - 1);
+                size_t curLineLength = GetDocLineLength(doc, doc->cursorLineIndex);
+                if (curLineLength > MAX_LINE_LENGTH - prevLineLength) {
+                    return RESULT_LIMIT_REACHED;
+                }
 
-                    ResetColIndex(doc);
-                    doc->modified = true;
+                ResultCode result = FlushGapLine(doc);
+                if (result != RESULT_OK) {
+                    return result;
                 }
-            } else {
-                doc->cursorCharIndex--;
-                doc->lines.elems[doc->cursorLineIndex].Remove(doc->cursorCharIndex, 1);
+                result = ReplaceText(doc, FindLineStart(doc, doc->cursorLineIndex) - 1, 1, nullptr, 0);
+                if (result != RESULT_OK) {
+                    return result;
+                }
+
+                doc->cursorLineIndex--;
+                doc->cursorCharIndex = static_cast<uint>(prevLineLength);
                 ResetColIndex(doc);
                 doc->modified = true;
             }
@@ -185,47 +3340,132 @@ ResultCode ProcessDocCharInput(Doc * doc, wchar_t c) {
                 return RESULT_OK;
             }
 
-            MkDynArray<wchar_t> * line = &doc->lines.elems[doc->cursorLineIndex];
-            if (line->count == MAX_LINE_LENGTH) {
+            if (GetDocLineLength(doc, doc->cursorLineIndex) == MAX_LINE_LENGTH) {
                 return RESULT_LIMIT_REACHED;
             }
+            return InsertGapText(doc, &c, 1);
+        }
+    }
 
-            if (line->count == line->capacity && !line->SetCapacity(line->capacity * 2)) {
-                return RESULT_MEMORY_ERROR;
+    return RESULT_OK;
+}
+
+ResultCode ProcessDocTextInput(Doc * doc, const wchar_t * text, size_t length) {
+    if (length == 0) {
+        return RESULT_OK;
+    }
+    wchar_t * chars = (wchar_t *)malloc(length * sizeof(wchar_t));
+    if (!chars) {
+        return RESULT_MEMORY_ERROR;
+    }
+
+    // Normalize the line breaks and find the length of the first and the last line.
+    size_t charCount = 0;
+    size_t lineBreakCount = 0;
+    size_t firstLineLength = 0;
+    size_t lineLength = 0;
+    for (size_t i = 0; i != length; i++) {
+        wchar_t c = text[i];
+        if (c == L'\r' || c == L'\n') {
+            if (c == L'\r' && i + 1 != length && text[i + 1] == L'\n') {
+                i++;
             }
-            
-            wchar_t * newChar = line->Insert(doc->cursorCharIndex++, 1);
-            *newChar = c;
+            if (lineBreakCount == 0) {
+                firstLineLength = lineLength;
+            }
+            chars[charCount++] = L'\n';
+            lineBreakCount++;
+            lineLength = 0;
+        } else if (c == L'\t' || !iswcntrl(c)) {
+            if (lineLength == MAX_LINE_LENGTH) {
+                free(chars);
+                return RESULT_LIMIT_REACHED;
+            }
+            chars[charCount++] = c;
+            lineLength++;
+        }
+    }
+    if (lineBreakCount == 0) {
+        firstLineLength = lineLength;
+    }
+
+    size_t cursorLineLength = GetDocLineLength(doc, doc->cursorLineIndex);
+    size_t afterLength = cursorLineLength - doc->cursorCharIndex;
+    if (firstLineLength > MAX_LINE_LENGTH - doc->cursorCharIndex
+        || lineLength > MAX_LINE_LENGTH - afterLength
+        || (lineBreakCount == 0 && firstLineLength > MAX_LINE_LENGTH - cursorLineLength)
+        || lineBreakCount > MAX_LINE_COUNT - doc->lineCount) {
+        free(chars);
+        return RESULT_LIMIT_REACHED;
+    }
+
+    ResultCode result = RESULT_OK;
+    if (charCount == 0) {
+        // only control characters
+    } else if (lineBreakCount == 0) {
+        result = InsertGapText(doc, chars, charCount);
+    } else {
+        result = FlushGapLine(doc);
+        if (result == RESULT_OK) {
+            result = ReplaceText(doc, FindLineStart(doc, doc->cursorLineIndex) + doc->cursorCharIndex, 0, chars, charCount);
+        }
+        if (result == RESULT_OK) {
+            doc->cursorLineIndex += lineBreakCount;
+            doc->cursorCharIndex = static_cast<uint>(lineLength);
             ResetColIndex(doc);
             doc->modified = true;
-            break;
         }
     }
 
-    return RESULT_OK;
+    free(chars);
+    return result;
 }
 
 void ApplyColIndex(Doc * doc, bool plusOne) {
-    MkDynArray<wchar_t> * line = &doc->lines.elems[doc->cursorLineIndex];
+    size_t end;
+    if (!IsGapLine(doc, doc->cursorLineIndex)) {
+        size_t start = FindLine(doc, doc->cursorLineIndex, &end);
+        if (!plusOne && end != 0) {
+            end--;
+        }
+
+        size_t startColCount = FindColCount(doc->root, start);
+        size_t foundColCount;
+        size_t charIndex = FindColPos(doc->root, startColCount + doc->lastCursorColIndex, &foundColCount) - start;
+        if (charIndex >= end) {
+            charIndex = end;
+        } else if (foundColCount - startColCount > doc->lastCursorColIndex) {
+            charIndex--;
+        }
+        doc->cursorCharIndex = static_cast<uint>(charIndex);
+        return;
+    }
 
-    ushort end = static_cast<ushort>(line->count);
+    end = GetDocLineLength(doc, doc->cursorLineIndex);
     if (!plusOne && end != 0) {
         end--;
     }
 
     ulong paintIndex = 0;
-    for (doc->cursorCharIndex = 0; doc->cursorCharIndex != end; doc->cursorCharIndex++) {
-        if (paintIndex >= doc->lastCursorColIndex) {
-            if (paintIndex > doc->lastCursorColIndex) {
-                doc->cursorCharIndex--;
-            }
+    size_t charIndex = 0;
+    while (charIndex != end) {
+        size_t length;
+        const wchar_t * chars = GetDocLineSlice(doc, doc->cursorLineIndex, charIndex, end - charIndex < DOCPIECE_MAX_LENGTH ? end - charIndex : DOCPIECE_MAX_LENGTH, &length);
+        if (!chars) {
             break;
         }
 
-        if (line->elems[doc->cursorCharIndex] == L'\t') {
-            paintIndex += config.tabWidth;
-        } else {
-            paintIndex++;
+        for (size_t i = 0; i != length; i++) {
+            if (paintIndex >= doc->lastCursorColIndex) {
+                if (paintIndex > doc->lastCursorColIndex) {
+                    charIndex--;
+                }
+                doc->cursorCharIndex = static_cast<uint>(charIndex);
+                return;
+            }
+            paintIndex += CharColCount(chars[i]);
+            charIndex++;
         }
     }
+    doc->cursorCharIndex = static_cast<uint>(charIndex);
 }
\ No newline at end of file
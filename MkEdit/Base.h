@@ -9,7 +9,7 @@ typedef unsigned int uint;
 typedef unsigned short ushort;
 typedef unsigned long ulong;
 
-#define MAX_LINE_LENGTH USHRT_MAX
+#define MAX_LINE_LENGTH UINT_MAX
 #define MAX_LINE_COUNT SIZE_MAX
 #define MAX_PATH_COUNT 260
 
@@ -21,32 +21,407 @@ enum ResultCode {
     RESULT_FILE_NOT_FOUND,
     RESULT_FILE_ERROR,
     RESULT_FILE_EXISTS,
+    RESULT_SYNTAX_ERROR,
 };
 
 extern Config config;
+extern wchar_t * tabSpaces;
 
+// A span of text in either the original or the add buffer of a document.
+// Line breaks are stored as L'\n' inside the span.
+// Text loaded from a valid UTF-8 file stays UTF-8: such pieces have bytes set instead of chars and
+// are decoded only when read. Lengths and positions always count UTF-16 units. A UTF-8 piece of a
+// large file breaking its lines with CR LF keeps the CRs, which are no part of the text. Each LF in
+// it follows a CR, and it never starts or ends between the two.
+struct DocPiece {
+    const wchar_t * chars;
+    const char * bytes;
+    size_t byteCount;
+    size_t length;
+    size_t lineBreakCount;
+    size_t tabCount;
+    bool crlf; // the bytes hold a CR in front of each LF
+};
+
+// A node of the balanced piece tree. Each node holds one piece plus the totals of its subtree, so
+// positions, line starts and columns can be found by descending from the root.
+// Snapshots share nodes with the document. A node referenced from more than one place is copied
+// before it is changed.
+struct DocNode {
+    DocNode * left;
+    DocNode * right;
+    DocPiece piece;
+    size_t length;
+    size_t lineBreakCount;
+    size_t tabCount;
+    uint height;
+    uint refCount; // parents and roots pointing here
+};
+
+// The cursor line while typing in insert mode, held as a gap buffer with the gap at the cursor.
+// Changes are written back to the piece tree as one replacement when the line is left.
+struct DocGapLine {
+    wchar_t * chars;
+    size_t capacity;
+    size_t gapStart;
+    size_t gapEnd;
+    size_t lineIndex;
+    size_t originalLength;
+    size_t editStart; // characters before this are unchanged, SIZE_MAX if nothing changed
+    size_t editTailLength; // characters this far from the end are unchanged
+    size_t tabCount;
+    ulong gapColIndex; // column at the start of the gap
+    bool active;
+};
+
+// One change in the undo journal: the text removed at a position and the text inserted there,
+// both kept as pieces. The pieces stay valid because the buffers they point into never change.
+struct DocUndoRecord {
+    size_t pos;
+    size_t removedLength;
+    size_t insertedLength;
+    size_t pieceIndex; // removed pieces first, then the inserted ones
+    size_t removedPieceCount;
+    size_t insertedPieceCount;
+    bool groupStart;
+};
+
+// A change of the text: a length of text removed at a position and another length inserted there.
+struct DocChange {
+    size_t pos;
+    size_t removedLength;
+    size_t insertedLength;
+};
+
+#define DOCCHANGE_LOG_COUNT 64
+
+struct DocSnapshot;
+
+// The text is a piece table: the pieces in order make up the document, and each one points into
+// either the read-only original buffer (filled once when loading) or the append-only add buffer
+// (filled by edits). Neither buffer ever moves or changes existing text. The pieces are kept in an
+// AVL tree, so finding, inserting and removing lines are all logarithmic in the piece count.
+// Tree nodes are carved out of slabs owned by the document. Nodes dropped by edits go on a free
+// list for reuse, and destroying the document releases the slabs without walking the tree.
 struct Doc {
-    MkDynArray<MkDynArray<wchar_t>> lines;
+    void * original; // UTF-16 or UTF-8
+    void (* releaseOriginal)(void * original); // frees the original buffer if malloc did not allocate it
+    MkDynArray<wchar_t *> addBlocks;
+    size_t addBlockLength;
+    MkDynArray<DocNode *> nodeSlabs;
+    DocNode * nodeSlabNext;
+    size_t nodeSlabFree;
+    DocNode * freeNodes;
+    DocNode * root;
+    size_t charCount;
+    size_t lineCount;
+    size_t snapshotCount;
+
+    MkDynArray<wchar_t> lineBuffer;
+    DocGapLine gapLine;
+
+    MkDynArray<DocUndoRecord> undoRecords;
+    MkDynArray<DocPiece> undoPieces;
+    size_t undoCount; // records before this are done, the rest were undone
+    bool undoGroupOpen;
+
     size_t cursorLineIndex;
-    ushort cursorCharIndex;
+    uint cursorCharIndex;
     bool modified;
     ulong lastCursorColIndex;
     size_t topPaintLineIndex;
+    size_t leftPaintCharIndex;
     size_t lastPaintLineCount;
     uint64_t timestamp;
+    DocSnapshot * savedSnapshot; // the text the file holds, if known, so saving can skip what it shares
+    uint64_t savedByteCount;
+    bool crlf; // line breaks are written as CR LF
+    DocChange changeLog[DOCCHANGE_LOG_COUNT]; // the last changes, so positions kept elsewhere can follow them
+    size_t changeCount; // ever made, the last one being changeLog[(changeCount - 1) % DOCCHANGE_LOG_COUNT]
     wchar_t title[MAX_PATH_COUNT];
 };
 
-#define DOCLINE_INIT_CAPACITY 4
-#define DOCLINES_GROW_COUNT 16
+#define DOCPIECE_MAX_LENGTH 4096
+#define DOCTREE_MAX_HEIGHT 96
+#define DOCADD_BLOCK_LENGTH 65536
+#define DOCNODE_SLAB_COUNT 1024
+#define DOCLINEBUFFER_GROW_COUNT 256
+#define DOCGAPLINE_INIT_CAPACITY 256
+#define DOCUNDO_GROW_COUNT 256
 
 // Creates a document containing one empty line.
 // Returns NULL on memory allocation failure.
 Doc * CreateEmptyDoc();
 
-// Frees a document.
+// Creates a document over a buffer of loaded text, taking ownership of the buffer.
+// The buffer must have been allocated with malloc and is freed with the document.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+ResultCode CreateDocFromBuffer(wchar_t * chars, size_t length, Doc ** doc);
+
+// Checks whether a buffer holds valid UTF-8 that can be kept as the original buffer of a document.
+bool IsDocUtf8(const char * bytes, size_t count);
+
+// Converts UTF-8 to UTF-16, replacing each malformed sequence with U+FFFD the way MkUtf8Read
+// does. The output needs room for one unit per byte.
+// Returns the number of units written.
+size_t TranscodeUtf8ToUtf16(const char * bytes, size_t count, wchar_t * chars);
+
+// Converts UTF-16 to UTF-8, replacing unpaired surrogates with U+FFFD. The output needs room for
+// three bytes per unit.
+// Returns the number of bytes written.
+size_t TranscodeUtf16ToUtf8(const wchar_t * chars, size_t length, char * bytes);
+
+// Returns the number of bytes TranscodeUtf16ToUtf8 writes for UTF-16 text.
+size_t GetTranscodedUtf8Count(const wchar_t * chars, size_t length);
+
+// Copies text with the CR of every CR LF dropped, and tells whether any LF lacks a CR before it.
+// The output needs room for count bytes.
+// Returns the number of bytes written.
+size_t StripCarriageReturns(const char * bytes, size_t count, char * out, bool * bareLineFeeds);
+
+// Creates a document over a buffer of UTF-8 text, taking ownership of the buffer. The text is
+// kept as it is and decoded only when read. It must have passed IsDocUtf8.
+// The buffer must have been allocated with malloc and is freed with the document.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+ResultCode CreateDocFromUtf8(char * bytes, size_t count, Doc ** doc);
+
+// Splits valid UTF-8 text into pieces and counts them, one piece per DOCPIECE_MAX_LENGTH bytes
+// rounded up. No document is involved, so this can run on a loading thread. With crlf, every LF
+// must follow a CR, and the CRs are left in the pieces but not in their text.
+// Returns the number of pieces.
+size_t SplitDocUtf8(const char * bytes, size_t count, bool crlf, DocPiece * pieces);
+
+// Splits UTF-16 text into pieces like SplitDocUtf8, one piece per DOCPIECE_MAX_LENGTH units.
+// Returns the number of pieces.
+size_t SplitDocUtf16(const wchar_t * chars, size_t length, DocPiece * pieces);
+
+// Frees a document. Its snapshots must have been destroyed, except the saved one, which goes with it.
 void DestroyDoc(Doc * doc);
 
+// Walks the pieces of a document in order.
+struct DocPieceIterator {
+    DocNode * stack[DOCTREE_MAX_HEIGHT];
+    uint depth;
+};
+
+// Starts iterating over the pieces of a document.
+void InitDocPieceIterator(Doc * doc, DocPieceIterator * iterator);
+
+// Returns the next piece, or NULL after the last one.
+const DocPiece * NextDocPiece(DocPieceIterator * iterator);
+
+// A frozen copy of the text of a document. It shares the piece tree and the buffers with the
+// document, and later edits copy the few nodes they change, so taking one costs next to nothing.
+// Snapshots are taken and destroyed on the thread editing the document, but may be read from any
+// thread. They must be destroyed before the document.
+struct DocSnapshot {
+    Doc * doc;
+    DocNode * root;
+    size_t charCount;
+    size_t lineCount;
+};
+
+// Takes a snapshot of the text of a document, including what is being typed in insert mode.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode CreateDocSnapshot(Doc * doc, DocSnapshot ** snapshot);
+
+// Frees a snapshot.
+void DestroyDocSnapshot(DocSnapshot * snapshot);
+
+// Starts iterating over the pieces of a snapshot.
+void InitDocSnapshotPieceIterator(DocSnapshot * snapshot, DocPieceIterator * iterator);
+
+// Returns whether a document still holds the text of a snapshot. Any change made since counts, even
+// if it was undone again.
+bool IsDocSnapshotCurrent(DocSnapshot * snapshot);
+
+// Appends pieces to the end of a document, as done while a file is loaded in the background. This
+// is no change to undo and does not mark the document modified. The text of the pieces must stay
+// valid as long as the document.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode AppendDocPieces(Doc * doc, const DocPiece * pieces, size_t pieceCount);
+
+#define DOCSEARCH_MAX_LENGTH 512
+#define DOCSEARCH_BLOCK_LENGTH (1024 * 1024)
+
+// Text to search a document for, prepared for pieces in either encoding.
+struct DocSearch {
+    wchar_t text[DOCSEARCH_MAX_LENGTH];
+    size_t length;
+    char bytes[3 * DOCSEARCH_MAX_LENGTH];
+    size_t byteCount;
+    bool lineBreaks; // the text holds a CR or an LF
+};
+
+// Prepares a search for text.
+// Returns false if the text is empty, longer than DOCSEARCH_MAX_LENGTH or holds unpaired surrogates.
+bool InitDocSearch(DocSearch * search, const wchar_t * text, size_t length);
+
+// Finds the matches of a search starting between two positions of a snapshot, in order, up to a
+// maximum count. Matches may overlap and may end behind the end position. This can run on any
+// thread.
+// Returns the number of matches found.
+size_t FindDocSnapshotText(DocSnapshot * snapshot, const DocSearch * search, size_t start, size_t end, size_t * found, size_t maxCount);
+
+// Keeps those of a list of sorted positions of a snapshot that a search matches at, in order. The
+// kept positions may be written over the list. This can run on any thread.
+// Returns the number of positions kept.
+size_t FilterDocSnapshotText(DocSnapshot * snapshot, const DocSearch * search, const size_t * positions, size_t count, size_t * kept);
+
+// Finds the first match behind a line position, or the last one before it if searching backward.
+// If there is none, the search goes round the end of the document and may come back to the
+// position itself. The position is replaced with the match found.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if there is no match
+ResultCode FindDocText(Doc * doc, const DocSearch * search, bool backward, size_t * lineIndex, size_t * charIndex, bool * wrapped);
+
+struct Regex;
+
+// Finds the first match of a regex starting behind a line position, or the last one starting
+// before it if searching backward, going round the end of the document like FindDocText. The
+// regex must not be in use on another thread.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if there is no match
+ResultCode FindDocRegex(Doc * doc, Regex * regex, bool backward, size_t * lineIndex, size_t * charIndex, bool * wrapped);
+
+// A match within a line.
+struct DocMatch {
+    size_t charIndex;
+    size_t length;
+};
+
+// Finds the matches of a search overlapping a part of a line, in order, up to a maximum count.
+// Matches may overlap.
+// Returns the number of matches found.
+size_t FindDocLineText(Doc * doc, const DocSearch * search, size_t lineIndex, size_t charIndex, size_t length, DocMatch * matches, size_t maxCount);
+
+// Finds the matches of a regex overlapping a part of a line, in order, up to a maximum count. Each
+// match starts behind the last one, so they never overlap. The whole line is matched, as matches
+// depend on what comes before them.
+// Returns the number of matches found.
+size_t FindDocLineRegex(Doc * doc, Regex * regex, size_t lineIndex, size_t charIndex, size_t length, DocMatch * matches, size_t maxCount);
+
+// Returns the characters of a line without the line break. The pointer is valid until the next
+// call that reads or changes the document.
+// Returns NULL on memory allocation failure.
+const wchar_t * GetDocLine(Doc * doc, size_t lineIndex, size_t * length);
+
+// Returns up to maxLength characters of a line, starting at a character index. Only the pieces
+// covering that part are read, so this stays cheap on very long lines. The pointer is valid until
+// the next call that reads or changes the document.
+// Returns NULL on memory allocation failure.
+const wchar_t * GetDocLineSlice(Doc * doc, size_t lineIndex, size_t charIndex, size_t maxLength, size_t * length);
+
+// Returns the length of a line without the line break.
+size_t GetDocLineLength(Doc * doc, size_t lineIndex);
+
+// Returns the position of a character counted from the start of the document. The insert gap buffer
+// must have been written back.
+size_t GetDocPos(Doc * doc, size_t lineIndex, size_t charIndex);
+
+// Returns the line containing a position and the index of the position within it, like GetDocPos
+// the other way round.
+size_t GetDocPosLine(Doc * doc, size_t pos, size_t * charIndex);
+
+// Returns the actual cursor column and the column count of the cursor line.
+void GetDocCursorCols(Doc * doc, ulong * cursorColIndex, ulong * lineColCount);
+
+// Inserts text at a line position. The text may contain line breaks.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode InsertDocText(Doc * doc, size_t lineIndex, size_t charIndex, const wchar_t * text, size_t length);
+
+// Removes text at a line position. Line breaks count as one character each.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode RemoveDocText(Doc * doc, size_t lineIndex, size_t charIndex, size_t length);
+
+// Removes whole lines. Removing every line leaves one empty line.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode RemoveDocLines(Doc * doc, size_t lineIndex, size_t count);
+
+// A run of whole lines to be replaced, without the line break behind it, and the new text for it.
+struct DocEdit {
+    size_t pos;
+    size_t removedLength;
+    size_t textStart; // into the text of the list
+    size_t textLength;
+};
+
+// The edits made by a substitution in a part of a document, in order.
+struct DocEditList {
+    MkDynArray<DocEdit> edits;
+    MkDynArray<wchar_t> text;
+    size_t matchCount;
+};
+
+// Replaces the matches of a regex in a number of lines of a snapshot, from the start of a line on,
+// and fills a list with edits rebuilding the lines changed. In the replacement, & stands for the
+// match, \n for a line break, \t for a tab and a backslash before any other character for the
+// character itself. Without global, only the first match of each line is replaced. This can run
+// on any thread, with a regex of its own. The list must be cleared even on failure.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if a line would grow too long
+ResultCode SubstituteDocSnapshot(DocSnapshot * snapshot, Regex * regex, size_t pos, size_t lineCount, const wchar_t * replacement, size_t replacementLength, bool global, DocEditList * edits);
+
+// Frees the edits of a list.
+void ClearDocEditList(DocEditList * edits);
+
+// Applies lists of edits made from a snapshot the document still holds, in order, as one change to
+// undo. The text between the edits is kept as it is, and the cursor moves to the start of the
+// last line changed.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode ApplyDocEdits(Doc * doc, const DocEditList * lists, size_t listCount);
+
+// Moves the cursor line into the insert gap buffer. Character input does this on its own.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode BeginDocInsert(Doc * doc);
+
+// Writes the insert gap buffer back into the document. Other edits do this on their own.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+ResultCode EndDocInsert(Doc * doc);
+
+// Undoes the last group of changes and moves the cursor to where it started. Everything typed
+// between entering and leaving insert mode forms one group, every other edit a group of its own.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if there is nothing to undo
+ResultCode UndoDocChange(Doc * doc);
+
+// Redoes the last undone group of changes.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if there is nothing to redo
+ResultCode RedoDocChange(Doc * doc);
+
 // Processes character input into the document.
 // Returns:
 // - RESULT_OK
@@ -54,6 +429,15 @@ void DestroyDoc(Doc * doc);
 // - RESULT_LIMIT_REACHED
 ResultCode ProcessDocCharInput(Doc * doc, wchar_t c);
 
+// Processes a run of text input into the document, such as pasted text. Line breaks may be CR,
+// LF or CRLF, other control characters are dropped. The whole run is inserted at once and the
+// cursor ends up behind it.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+ResultCode ProcessDocTextInput(Doc * doc, const wchar_t * text, size_t length);
+
 // Recalculates the actual cursor column.
 void ResetColIndex(Doc * doc);
 
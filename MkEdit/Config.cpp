@@ -12,6 +12,14 @@ static bool ValidateTabWidth(unsigned long value) {
     return value <= USHRT_MAX;
 }
 
+static bool ValidateSaveDurability(unsigned long value) {
+    return value <= 2;
+}
+
+static bool ValidateThreadCount(unsigned long value) {
+    return value <= 64;
+}
+
 MKCONFGEN_FILE_BEGIN
 
 MKCONFGEN_DEF_BEGIN(Config)
@@ -21,9 +29,17 @@ MKCONFGEN_ITEM_WSTR(fontName, 32, L"Consolas")
 MKCONFGEN_ITEM_INT(fontSize, 10)
 MKCONFGEN_ITEM_UINT(tabWidth, 4)
 MKCONFGEN_ITEM_INT(expandTabs, 0)
+MKCONFGEN_ITEM_UINT(undoMemoryLimit, 65536)
+MKCONFGEN_ITEM_UINT(loadThreadCount, 0)
+MKCONFGEN_ITEM_UINT(searchThreadCount, 0)
+MKCONFGEN_ITEM_INT(atomicSave, 1)
+MKCONFGEN_ITEM_UINT(saveDurability, 1)
 
 MKCONFGEN_VALIDATE(fontSize, ValidateFontSize)
 MKCONFGEN_VALIDATE(tabWidth, ValidateTabWidth);
+MKCONFGEN_VALIDATE(loadThreadCount, ValidateThreadCount)
+MKCONFGEN_VALIDATE(searchThreadCount, ValidateThreadCount)
+MKCONFGEN_VALIDATE(saveDurability, ValidateSaveDurability)
 
 MKCONFGEN_HEADING(Colors)
 MKCONFGEN_ITEM_UINT(textColor, 0xdcdcdc)
@@ -33,6 +49,7 @@ MKCONFGEN_ITEM_UINT(statusBackgroundColor, 0x2e2e2e)
 MKCONFGEN_ITEM_UINT(docTitleBackgroundColor, 0x3d3d3d)
 MKCONFGEN_ITEM_UINT(promptTextColor, 0xffffff)
 MKCONFGEN_ITEM_UINT(promptBackgroundColor, 0x2d1b86)
+MKCONFGEN_ITEM_UINT(matchBackgroundColor, 0x1f5f8b)
 
 MKCONFGEN_VALIDATE(textColor, ValidateColor)
 MKCONFGEN_VALIDATE(backgroundColor, ValidateColor)
@@ -41,6 +58,7 @@ MKCONFGEN_VALIDATE(statusBackgroundColor, ValidateColor)
 MKCONFGEN_VALIDATE(docTitleBackgroundColor, ValidateColor)
 MKCONFGEN_VALIDATE(promptTextColor, ValidateColor)
 MKCONFGEN_VALIDATE(promptBackgroundColor, ValidateColor)
+MKCONFGEN_VALIDATE(matchBackgroundColor, ValidateColor)
 
 MKCONFGEN_DEF_END
 
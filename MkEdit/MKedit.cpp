@@ -2,8 +2,10 @@
 
 #include <KnownFolders.h>
 #include <objbase.h>
+#include <Psapi.h>
 #include <ShlObj.h>
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <wctype.h>
@@ -12,23 +14,15 @@
 #include "Import/MkString.h"
 #include "Generated/ConfigGen.h"
 #include "Base.h"
+#include "Regex.h"
 
 Config config;
 
-bool ReadFileCallback(void * stream, void * buffer, ulong count, void * status) {
-    ulong * error = static_cast<ulong *>(status);
-
-    ulong readCount;
-    if (ReadFile(stream, buffer, count, &readCount, nullptr)) {
-        *error = ERROR_SUCCESS;
-        if (readCount == 0) {
-            return false;
-        } else {
-            return true;
-        }
-    } else {
-        *error = GetLastError();
-        return false;
+// Skips the UTF-8 byte order mark at the start of a file, if there is one.
+static void SkipByteOrderMark(const char ** bytes, size_t * count) {
+    if (*count >= 3 && memcmp(*bytes, "\xEF\xBB\xBF", 3) == 0) {
+        *bytes += 3;
+        *count -= 3;
     }
 }
 
@@ -48,42 +42,45 @@ ResultCode LoadConfigFile(const wchar_t filePath[MAX_PATH_COUNT]) {
         return RESULT_OK;
     }
 
-    MkDynArray<wchar_t> content;
-    content.Init(128);
-
-    auto writeCallback = [](void * stream, const void * buffer, ulong count, void * status) {
-        MkDynArray<wchar_t> * content = static_cast<MkDynArray<wchar_t> *>(stream);
-        const wchar_t * wcs = static_cast<const wchar_t *>(buffer);
-
-        wchar_t * newElems = content->Insert(SIZE_MAX, count);
-        if (!newElems) {
-            return false;
-        }
-        for (ulong i = 0; i != count; i++) {
-            newElems[i] = wcs[i];
-        }
-        return true;
-    };
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart >= MAXDWORD) {
+        CloseHandle(file);
+        return RESULT_MEMORY_ERROR;
+    }
 
-    ulong readStatus;
-    bool utf8Success = MkUtf8Read(
-        ReadFileCallback, file, &readStatus,
-        writeCallback, &content, nullptr);
+    ulong byteCount = static_cast<ulong>(fileSize.QuadPart);
+    char * bytes = static_cast<char *>(malloc(byteCount + 1));
+    wchar_t * content = static_cast<wchar_t *>(malloc((byteCount + 1) * sizeof(wchar_t)));
+    if (!bytes || !content) {
+        free(bytes);
+        free(content);
+        CloseHandle(file);
+        return RESULT_MEMORY_ERROR;
+    }
 
+    ulong readCount;
+    bool readSuccess = ReadFile(file, bytes, byteCount, &readCount, nullptr);
     CloseHandle(file);
-
-    if (!utf8Success) {
+    if (!readSuccess) {
+        free(bytes);
+        free(content);
         return RESULT_MEMORY_ERROR;
     }
 
+    const char * text = bytes;
+    size_t textCount = readCount;
+    SkipByteOrderMark(&text, &textCount);
+    size_t contentLength = TranscodeUtf8ToUtf16(text, textCount, content);
+    free(bytes);
+
     MkConfGenLoadError * loadErrors;
     size_t loadErrorCount;
-    bool loadSuccess = ConfigLoad(&config, content.elems, content.count, &loadErrors, &loadErrorCount);
+    bool loadSuccess = ConfigLoad(&config, content, contentLength, &loadErrors, &loadErrorCount);
     if (loadErrors) {
         free(loadErrors);
     }
 
-    content.Clear();
+    free(content);
 
     if (loadSuccess) {
         return RESULT_OK;
@@ -92,1581 +89,6230 @@ ResultCode LoadConfigFile(const wchar_t filePath[MAX_PATH_COUNT]) {
     }
 }
 
-// Returns:
-// - RESULT_OK
-// - RESULT_FILE_LOCKED - existing file is locked by another process
-// - RESULT_FILE_EXISTS - file with same name already exists or was modified externally
-// - RESULT_FILE_ERROR
-// - RESULT_FILE_NOT_FOUND - file was removed
-ResultCode WriteDoc(Doc * doc, const wchar_t * newPath, bool overwrite) {
-    DWORD disposition;
-    const wchar_t * path;
-    if (newPath) {
-        path = newPath;
-        if (overwrite) {
-            disposition = CREATE_ALWAYS;
-        } else {
-            disposition = CREATE_NEW;
-        }
-    } else {
-        path = doc->title;
-        if (overwrite) {
-            disposition = CREATE_ALWAYS;
-        } else if (doc->timestamp == 0) {
-            disposition = CREATE_NEW;
-        } else {
-            disposition = OPEN_EXISTING;
+bool WriteBytes(HANDLE file, const char * bytes, size_t count) {
+    while (count != 0) {
+        ulong chunkCount = count < 0x40000000 ? static_cast<ulong>(count) : 0x40000000;
+        ulong writeCount;
+        if (!WriteFile(file, bytes, chunkCount, &writeCount, nullptr)) {
+            return false;
         }
+        bytes += writeCount;
+        count -= writeCount;
     }
+    return true;
+}
 
-    HANDLE file = CreateFileW(
+//--------------
+// Lazy Loading
+
+// Large files are loaded lazily. The document reads straight from the mapped view of the file, so
+// the system pages the text in and out as needed, and only the piece tree grows with the file, by
+// one node per DOCPIECE_MAX_LENGTH bytes. Chunks that are not valid UTF-8 are decoded into a sparse
+// temporary file, mapped the same way, so decoded text is paged as well instead of held in memory.
+// The first chunk is scanned right away so the first screen can be painted. The rest is split into
+// chunks ending behind line breaks, which worker threads scan in parallel and hand to the window
+// thread. It appends them to the document in order. Nobody else may write to the file while it is
+// open, as the pieces would no longer match the text they point to. It is opened for appending as
+// well if allowed, so saving it over itself can append through the same handle. A file another
+// program has open for writing already, like a log, is copied to a temporary file as the chunks are
+// claimed, and the document reads from the copy. If the first chunk breaks its lines with CR LF
+// only, the file is taken to do so throughout. The pieces of every chunk doing so as well keep the
+// CRs in the view and hide them, so nothing is copied, and they are saved as they are. A chunk with
+// a bare LF shows its CRs, and the file counts as mixing both from then on, so text added later is
+// saved with bare LFs.
+
+#define LAZYLOAD_MIN_COUNT (64 * 1024 * 1024)
+#define LAZYLOAD_FIRST_CHUNK_COUNT (1024 * 1024)
+#define LAZYLOAD_CHUNK_COUNT (16 * 1024 * 1024)
+#define LAZYLOAD_LINE_SEARCH_COUNT (64 * 1024)
+#define LAZYLOAD_MAX_THREAD_COUNT 64
+#define LAZYLOAD_MAX_PENDING_COUNT (2 * LAZYLOAD_MAX_THREAD_COUNT)
+#define WM_DOCLOAD (WM_APP + 1)
+
+HWND mainWindow;
+
+// A chunk of the file scanned by a worker thread. Valid UTF-8 becomes pieces pointing into the
+// view, anything else is decoded into the decoded file and becomes pieces pointing into its view.
+struct LoadChunk {
+    uint index;
+    size_t byteCount;
+    const char * buffer; // the decoded chunk if stripped of its CRs, or NULL
+    size_t bufferCount;
+    DocPiece * pieces;
+    size_t pieceCount;
+    size_t firstLineCount; // bytes before the first line break
+    size_t lastLineCount; // bytes behind the last line break
+    bool hasLineBreak;
+    bool bareLineFeeds; // the CRs are shown, as not every LF has one
+    ResultCode result;
+};
+
+// A decoded chunk stripped of its CRs, which the pieces of the chunk point into.
+struct LoadBuffer {
+    const char * start;
+    size_t count;
+};
+
+struct MappedFile {
+    HANDLE file;
+    HANDLE source; // copied into the file while others write to it, or NULL
+    const char * view;
+    const char * text; // behind the byte order mark
+    size_t textCount;
+    bool appendable; // the file was opened for appending
+    bool crlf;
+    bool mixed; // some chunk has a bare LF
+    HANDLE decodedFile; // a unit for each byte of the text, or NULL until a chunk needs decoding
+    const wchar_t * decoded; // the view of the decoded file
+    uint loadId;
+    volatile bool cancelled;
+
+    // shared by the worker threads
+    CRITICAL_SECTION lock;
+    size_t claimedCount;
+    uint claimedChunkCount;
+    size_t copiedCount; // of the view, from the source
+    volatile bool copyFailed;
+    HANDLE slots; // chunks that may be claimed before the window thread catches up
+    HANDLE threads[LAZYLOAD_MAX_THREAD_COUNT];
+    uint threadCount;
+
+    // window thread only
+    LoadChunk * pending[LAZYLOAD_MAX_PENDING_COUNT]; // arrived out of order
+    uint appliedChunkCount;
+    size_t appliedCount;
+    size_t lineByteCount; // bytes since the last line break
+    MkDynArray<LoadBuffer> buffers; // of the chunks applied
+    ResultCode result;
+
+    wchar_t asidePath[MAX_PATH_COUNT]; // where the file went when the document was saved over it
+};
+
+static uint lastLoadId = 0;
+
+static void FreeLoadChunk(LoadChunk * chunk) {
+    if (chunk) {
+        free(chunk->pieces);
+        free(chunk);
+    }
+}
+
+// Creates a temporary file of a size, deleted once it is closed, and maps it for writing. A sparse
+// file takes up disk space only where it is written to.
+// Returns NULL on failure.
+static char * MapTempFile(size_t byteCount, bool sparse, HANDLE * file) {
+    wchar_t directory[MAX_PATH_COUNT];
+    wchar_t path[MAX_PATH_COUNT];
+    if (!GetTempPathW(MAX_PATH_COUNT, directory) || !GetTempFileNameW(directory, L"mke", 0, path)) {
+        return nullptr;
+    }
+    *file = CreateFileW(
         path,
-        GENERIC_WRITE,
+        GENERIC_READ | GENERIC_WRITE,
         0,
         nullptr,
-        disposition,
-        FILE_ATTRIBUTE_NORMAL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
         nullptr);
-    if (file == INVALID_HANDLE_VALUE) {
-        ulong error = GetLastError();
-        switch (error) {
-            case ERROR_FILE_EXISTS:
-                return RESULT_FILE_EXISTS;
+    if (*file == INVALID_HANDLE_VALUE) {
+        DeleteFileW(path);
+        return nullptr;
+    }
 
-            case ERROR_FILE_NOT_FOUND:
-                return RESULT_FILE_NOT_FOUND;
+    if (sparse) {
+        // without support for it, the file is simply not sparse
+        ulong returnedCount;
+        DeviceIoControl(*file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returnedCount, nullptr);
+    }
 
-            case ERROR_SHARING_VIOLATION:
-                return RESULT_FILE_LOCKED;
+    LARGE_INTEGER size;
+    size.QuadPart = byteCount;
+    HANDLE mapping = CreateFileMappingW(*file, nullptr, PAGE_READWRITE, size.HighPart, size.LowPart, nullptr);
+    char * view = nullptr;
+    if (mapping) {
+        view = static_cast<char *>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+        CloseHandle(mapping); // the view keeps it alive
+    }
+    if (!view) {
+        CloseHandle(*file);
+    }
+    return view;
+}
 
-            default:
-                return RESULT_FILE_ERROR;
+// Copies the source into the view up to an offset, as far as it is not copied yet. It is read in
+// order, so the worker threads take turns. Text a writer cuts off meanwhile stays zero.
+static void CopyLoadSource(MappedFile * mapped, size_t end) {
+    char * view = const_cast<char *>(mapped->view);
+    while (!mapped->copyFailed && mapped->copiedCount < end) {
+        size_t rest = end - mapped->copiedCount;
+        ulong chunkCount = rest < 0x40000000 ? static_cast<ulong>(rest) : 0x40000000;
+        ulong readCount;
+        if (!ReadFile(mapped->source, view + mapped->copiedCount, chunkCount, &readCount, nullptr)) {
+            mapped->copyFailed = true;
+        } else if (readCount == 0) {
+            mapped->copiedCount = SIZE_MAX;
+        } else {
+            mapped->copiedCount += readCount;
         }
     }
+}
 
-    if (disposition == OPEN_EXISTING) {
-        FILETIME fileTimestamp;
-        GetFileTime(file, nullptr, nullptr, &fileTimestamp);
-        ULARGE_INTEGER timestamp;
-        timestamp.LowPart = fileTimestamp.dwLowDateTime;
-        timestamp.HighPart = fileTimestamp.dwHighDateTime;
-        if (timestamp.QuadPart != doc->timestamp) {
-            CloseHandle(file);
-            return RESULT_FILE_EXISTS;
+// Returns whether text has line breaks, all of them CR LF.
+static bool HasOnlyCrlf(const char * text, size_t count) {
+    const char * end = text + count;
+    const char * lineBreak = static_cast<const char *>(memchr(text, '\n', count));
+    if (!lineBreak) {
+        return false;
+    }
+    do {
+        if (lineBreak == text || lineBreak[-1] != '\r') {
+            return false;
+        }
+        lineBreak = static_cast<const char *>(memchr(lineBreak + 1, '\n', end - lineBreak - 1));
+    } while (lineBreak);
+    return true;
+}
+
+// Drops the CR of every CR LF from decoded text in place. CR and LF are never part of a malformed
+// sequence, so they are decoded as they are.
+// Returns the length left.
+static size_t StripDecodedCarriageReturns(wchar_t * chars, size_t length) {
+    size_t keptLength = 0;
+    for (size_t i = 0; i != length; i++) {
+        if (chars[i] != L'\r' || i + 1 == length || chars[i + 1] != L'\n') {
+            chars[keptLength++] = chars[i];
         }
     }
+    return keptLength;
+}
 
-    auto writeCallback = [](void * stream, const void * buffer, ulong count, void * status) {
-        ulong writeCount;
-        return static_cast<bool>(WriteFile(stream, buffer, count, &writeCount, nullptr));
-    };
+// Splits the next chunk off the text not claimed yet. It ends behind a line break found shortly
+// after maxCount bytes, or else at the start of a sequence.
+// Returns false once all text is claimed.
+static bool ClaimLoadChunk(MappedFile * mapped, size_t maxCount, size_t * start, size_t * count, uint * index) {
+    EnterCriticalSection(&mapped->lock);
+    *start = mapped->claimedCount;
+    *count = mapped->textCount - mapped->claimedCount;
+    *index = mapped->claimedChunkCount;
+    if (mapped->source) {
+        size_t searchEnd = maxCount + LAZYLOAD_LINE_SEARCH_COUNT;
+        size_t end = *start + (*count > searchEnd ? searchEnd : *count);
+        CopyLoadSource(mapped, mapped->text - mapped->view + end);
+    }
+    if (*count > maxCount) {
+        const char * bytes = mapped->text + *start;
+        size_t searchCount = *count - maxCount;
+        if (searchCount > LAZYLOAD_LINE_SEARCH_COUNT) {
+            searchCount = LAZYLOAD_LINE_SEARCH_COUNT;
+        }
+        const char * lineBreak = static_cast<const char *>(memchr(bytes + maxCount, '\n', searchCount));
+        if (lineBreak) {
+            *count = lineBreak + 1 - bytes;
+        } else {
+            size_t end = maxCount;
+            while (end != 0 && maxCount - end != 3 && (bytes[end] & 0xC0) == 0x80) {
+                end--;
+            }
+            *count = end != 0 && (bytes[end] & 0xC0) != 0x80 ? end : maxCount;
+        }
+    }
+    mapped->claimedCount += *count;
+    if (*count != 0 || *index == 0) {
+        mapped->claimedChunkCount++;
+    }
+    LeaveCriticalSection(&mapped->lock);
+    return *count != 0 || *index == 0;
+}
 
-    bool writeSuccess = MkUtf8WriteWcs(
-        doc->lines.elems[0].elems, doc->lines.elems[0].count, true,
-        writeCallback, file, nullptr);
-    if (!writeSuccess) {
-        CloseHandle(file);
-        return RESULT_FILE_ERROR;
+// Returns the view of the decoded file, creating it once the first chunk needs decoding. It is
+// sparse, so the chunks that need none take up no disk space.
+// Returns NULL on failure.
+static const wchar_t * GetDecodedView(MappedFile * mapped) {
+    EnterCriticalSection(&mapped->lock);
+    if (!mapped->decoded) {
+        HANDLE file;
+        char * view = MapTempFile(mapped->textCount * sizeof(wchar_t), true, &file);
+        if (view) {
+            mapped->decodedFile = file;
+            mapped->decoded = reinterpret_cast<const wchar_t *>(view);
+        }
+    }
+    const wchar_t * decoded = mapped->decoded;
+    LeaveCriticalSection(&mapped->lock);
+    return decoded;
+}
+
+// Writes decoded text to the decoded file, at the unit offset of the chunk it comes from. It goes
+// through the handle rather than the view, so a full disk fails the write instead of the page.
+static bool WriteDecodedText(MappedFile * mapped, size_t start, const wchar_t * chars, size_t length) {
+    ULARGE_INTEGER offset;
+    offset.QuadPart = start * sizeof(wchar_t);
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = offset.LowPart;
+    overlapped.OffsetHigh = offset.HighPart;
+    ulong byteCount = static_cast<ulong>(length * sizeof(wchar_t));
+    ulong writeCount;
+    return WriteFile(mapped->decodedFile, chars, byteCount, &writeCount, &overlapped) && writeCount == byteCount;
+}
+
+// Scans a chunk of a file. Decoding is done in a buffer of the chunk's size, which is freed once
+// the text is in the decoded file, so only the chunks being scanned take up memory.
+// Returns NULL on memory allocation failure.
+static LoadChunk * ReadLoadChunk(MappedFile * mapped, size_t start, size_t count, uint index) {
+    LoadChunk * chunk = static_cast<LoadChunk *>(malloc(sizeof(LoadChunk)));
+    if (!chunk) {
+        return nullptr;
     }
 
-    for (size_t i = 1; i != doc->lines.count; i++) {
-        writeSuccess = MkUtf8WriteWcs(
-            L"\n", 1, true,
-            writeCallback, file, nullptr);
-        if (!writeSuccess) {
-            CloseHandle(file);
-            return RESULT_FILE_ERROR;
+    const char * bytes = mapped->text + start;
+    chunk->index = index;
+    chunk->byteCount = count;
+    chunk->buffer = nullptr;
+    chunk->bufferCount = 0;
+    chunk->pieces = nullptr;
+    chunk->pieceCount = 0;
+    chunk->bareLineFeeds = false;
+    chunk->result = RESULT_OK;
+
+    // The pieces of a chunk of a file using CR LF keep the CRs and hide them, unless some LF of the
+    // chunk has none.
+    bool crlf = false;
+    if (mapped->crlf) {
+        chunk->bareLineFeeds = memchr(bytes, '\n', count) && !HasOnlyCrlf(bytes, count);
+        crlf = !chunk->bareLineFeeds;
+    }
+
+    if (IsDocUtf8(bytes, count)) {
+        size_t pieceCount = (count + DOCPIECE_MAX_LENGTH - 1) / DOCPIECE_MAX_LENGTH;
+        chunk->pieces = static_cast<DocPiece *>(malloc((pieceCount + 1) * sizeof(DocPiece)));
+        if (chunk->pieces) {
+            chunk->pieceCount = SplitDocUtf8(bytes, count, crlf, chunk->pieces);
+        } else {
+            chunk->result = RESULT_MEMORY_ERROR;
+        }
+    } else {
+        // Decoding never yields more UTF-16 units than there are bytes, so each chunk fits in front
+        // of the next one.
+        wchar_t * chars = static_cast<wchar_t *>(malloc((count + 1) * sizeof(wchar_t)));
+        const wchar_t * decoded = GetDecodedView(mapped);
+        if (!chars) {
+            chunk->result = RESULT_MEMORY_ERROR;
+        } else if (!decoded) {
+            chunk->result = RESULT_FILE_ERROR;
+        } else {
+            size_t length = TranscodeUtf8ToUtf16(bytes, count, chars);
+            if (crlf) {
+                length = StripDecodedCarriageReturns(chars, length);
+            }
+            size_t pieceCount = (length + DOCPIECE_MAX_LENGTH - 1) / DOCPIECE_MAX_LENGTH;
+            chunk->pieces = static_cast<DocPiece *>(malloc((pieceCount + 1) * sizeof(DocPiece)));
+            if (!chunk->pieces) {
+                chunk->result = RESULT_MEMORY_ERROR;
+            } else if (!WriteDecodedText(mapped, start, chars, length)) {
+                chunk->result = RESULT_FILE_ERROR;
+            } else {
+                chunk->pieceCount = SplitDocUtf16(decoded + start, length, chunk->pieces);
+                if (crlf) {
+                    chunk->buffer = reinterpret_cast<const char *>(decoded + start);
+                    chunk->bufferCount = length * sizeof(wchar_t);
+                }
+            }
         }
+        free(chars);
+    }
 
-        writeSuccess = MkUtf8WriteWcs(
-            doc->lines.elems[i].elems, doc->lines.elems[i].count, true,
-            writeCallback, file, nullptr);
-        if (!writeSuccess) {
-            CloseHandle(file);
-            return RESULT_FILE_ERROR;
+    // Lines crossing chunks are measured when the chunks are put together, in bytes, which are
+    // never fewer than the UTF-16 units. Lines within a chunk are short enough anyway.
+    const char * firstLineBreak = static_cast<const char *>(memchr(bytes, '\n', count));
+    chunk->hasLineBreak = firstLineBreak != nullptr;
+    chunk->firstLineCount = count;
+    chunk->lastLineCount = count;
+    if (firstLineBreak) {
+        chunk->firstLineCount = firstLineBreak - bytes;
+        size_t lineStart = count;
+        while (bytes[lineStart - 1] != '\n') {
+            lineStart--;
         }
+        chunk->lastLineCount = count - lineStart;
     }
+    return chunk;
+}
 
-    if (disposition == OPEN_EXISTING) {
-        SetEndOfFile(file);
+static DWORD WINAPI LoadThreadProc(void * parameter) {
+    MappedFile * mapped = static_cast<MappedFile *>(parameter);
+    while (true) {
+        WaitForSingleObject(mapped->slots, INFINITE);
+        size_t start;
+        size_t count;
+        uint index;
+        if (mapped->cancelled || !ClaimLoadChunk(mapped, LAZYLOAD_CHUNK_COUNT, &start, &count, &index)) {
+            break;
+        }
+        LoadChunk * chunk = ReadLoadChunk(mapped, start, count, index);
+        if (!PostMessageW(mainWindow, WM_DOCLOAD, mapped->loadId, reinterpret_cast<LPARAM>(chunk))) {
+            FreeLoadChunk(chunk);
+            break;
+        }
     }
+    return 0;
+}
 
-    FILETIME fileTimestamp;
-    GetFileTime(file, nullptr, nullptr, &fileTimestamp);
-    ULARGE_INTEGER timestamp;
-    timestamp.LowPart = fileTimestamp.dwLowDateTime;
-    timestamp.HighPart = fileTimestamp.dwHighDateTime;
-    doc->timestamp = timestamp.QuadPart;
+static void ReleaseMappedFile(void * original) {
+    MappedFile * mapped = static_cast<MappedFile *>(original);
+    if (mapped->threadCount != 0) {
+        mapped->cancelled = true;
+        ReleaseSemaphore(mapped->slots, mapped->threadCount, nullptr);
+        WaitForMultipleObjects(mapped->threadCount, mapped->threads, TRUE, INFINITE);
+        for (uint i = 0; i != mapped->threadCount; i++) {
+            CloseHandle(mapped->threads[i]);
+        }
+    }
+    for (uint i = 0; i != LAZYLOAD_MAX_PENDING_COUNT; i++) {
+        FreeLoadChunk(mapped->pending[i]);
+    }
+    mapped->buffers.Clear();
+    if (mapped->decoded) {
+        UnmapViewOfFile(mapped->decoded);
+        CloseHandle(mapped->decodedFile);
+    }
+    CloseHandle(mapped->slots);
+    DeleteCriticalSection(&mapped->lock);
+    UnmapViewOfFile(mapped->view);
+    CloseHandle(mapped->file);
+    if (mapped->source) {
+        CloseHandle(mapped->source);
+    }
+    if (mapped->asidePath[0] != L'\0') {
+        DeleteFileW(mapped->asidePath);
+    }
+    free(mapped);
+}
 
-    CloseHandle(file);
-    return RESULT_OK;
+// Returns the file a document is loaded from lazily, or NULL.
+static MappedFile * GetMappedFile(Doc * doc) {
+    if (doc->releaseOriginal == ReleaseMappedFile) {
+        return static_cast<MappedFile *>(doc->original);
+    }
+    return nullptr;
 }
 
-// Returns:
-// - RESULT_OK
-// - RESULT_MEMORY_ERROR
-// - RESULT_LIMIT_REACHED
-// - RESULT_FILE_ERROR
-// - RESULT_FILE_LOCKED
-// - RESULT_FILE_NOT_FOUND
-ResultCode LoadFile(const wchar_t * path, Doc ** doc) {
-    HANDLE file = CreateFileW(
-        path,
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_FLAG_SEQUENTIAL_SCAN,
-        nullptr);
-    if (file == INVALID_HANDLE_VALUE) {
-        ulong error = GetLastError();
-        switch (error) {
-            case ERROR_SHARING_VIOLATION:
-                return RESULT_FILE_LOCKED;
+// Returns whether a piece lies in a decoded chunk stripped of its CRs. The buffer found last is tried first,
+// as the pieces of a chunk mostly follow each other.
+static bool IsStrippedPiece(MappedFile * mapped, const DocPiece * piece, size_t * bufferIndex) {
+    const char * text = piece->bytes ? piece->bytes : reinterpret_cast<const char *>(piece->chars);
+    if (text >= mapped->view && text < mapped->text + mapped->textCount) {
+        return false;
+    }
+    LoadBuffer * buffers = mapped->buffers.elems;
+    if (*bufferIndex < mapped->buffers.count
+        && text >= buffers[*bufferIndex].start
+        && text < buffers[*bufferIndex].start + buffers[*bufferIndex].count)
+    {
+        return true;
+    }
+    for (size_t i = 0; i != mapped->buffers.count; i++) {
+        if (text >= buffers[i].start && text < buffers[i].start + buffers[i].count) {
+            *bufferIndex = i;
+            return true;
+        }
+    }
+    return false;
+}
 
-            case ERROR_FILE_NOT_FOUND:
-                return RESULT_FILE_NOT_FOUND;
+// Appends the next chunk to a document and frees it. A failure stops the loading.
+static void ApplyLoadChunk(Doc * doc, MappedFile * mapped, LoadChunk * chunk) {
+    ResultCode result = mapped->copyFailed ? RESULT_FILE_ERROR : chunk->result;
+    mapped->lineByteCount += chunk->firstLineCount;
+    if (mapped->lineByteCount > MAX_LINE_LENGTH) {
+        result = RESULT_LIMIT_REACHED;
+    }
+    if (chunk->hasLineBreak) {
+        mapped->lineByteCount = chunk->lastLineCount;
+    }
+    if (chunk->bareLineFeeds && !mapped->mixed) {
+        // Text added from now on is saved as it is, like that of a smaller file mixing both.
+        mapped->mixed = true;
+        doc->crlf = false;
+    }
 
-            default:
-                return RESULT_FILE_ERROR;
+    if (result == RESULT_OK && chunk->buffer) {
+        LoadBuffer * buffer = mapped->buffers.Insert(SIZE_MAX, 1);
+        if (buffer) {
+            buffer->start = chunk->buffer;
+            buffer->count = chunk->bufferCount;
+        } else {
+            result = RESULT_MEMORY_ERROR;
         }
     }
-
-    *doc = CreateEmptyDoc();
-    if (!(*doc)) {
-        CloseHandle(file);
-        return RESULT_MEMORY_ERROR;
+    if (result == RESULT_OK) {
+        result = AppendDocPieces(doc, chunk->pieces, chunk->pieceCount);
     }
 
-    auto writeCallback = [](void * stream, const void * buffer, ulong count, void * status) {
-        Doc * doc = static_cast<Doc *>(stream);
-        const wchar_t * chars = static_cast<const wchar_t *>(buffer);
-        ResultCode * result = static_cast<ResultCode *>(status);
+    if (result == RESULT_OK) {
+        mapped->appliedCount += chunk->byteCount;
+        mapped->appliedChunkCount++;
+    } else {
+        mapped->result = result;
+        mapped->cancelled = true;
+    }
+    FreeLoadChunk(chunk);
+}
 
-        for (ulong i = 0; i != count; i++) {
-            if (chars[i] == L'\n') {
-                if (doc->lines.count == MAX_LINE_COUNT) {
-                    *result = RESULT_LIMIT_REACHED;
-                    return false;
-                }
+// Takes a chunk from a worker thread and appends the chunks that are next in order, unless they
+// are meant for a document that has been closed since.
+static void ReceiveLoadChunk(Doc * doc, uint loadId, LoadChunk * chunk) {
+    MappedFile * mapped = GetMappedFile(doc);
+    if (!mapped || mapped->loadId != loadId || mapped->result != RESULT_OK) {
+        FreeLoadChunk(chunk);
+        return;
+    }
+    if (!chunk) {
+        mapped->result = RESULT_MEMORY_ERROR;
+        mapped->cancelled = true;
+        return;
+    }
 
-                MkDynArray<wchar_t> * newLine = doc->lines.Insert(SIZE_MAX, 1);
-                if (!newLine) {
-                    *result = RESULT_MEMORY_ERROR;
-                    return false;
-                }
-                newLine->Init(DOCLINE_INIT_CAPACITY);
-                if (!newLine->SetCapacity(newLine->growCount)) {
-                    *result = RESULT_MEMORY_ERROR;
-                    return false;
-                }
-            } else {
-                MkDynArray<wchar_t> * line = &doc->lines.elems[doc->lines.count - 1];
+    mapped->pending[chunk->index % LAZYLOAD_MAX_PENDING_COUNT] = chunk;
+    while (mapped->result == RESULT_OK) {
+        LoadChunk ** next = &mapped->pending[mapped->appliedChunkCount % LAZYLOAD_MAX_PENDING_COUNT];
+        if (!*next || (*next)->index != mapped->appliedChunkCount) {
+            break;
+        }
+        LoadChunk * nextChunk = *next;
+        *next = nullptr;
+        ApplyLoadChunk(doc, mapped, nextChunk);
+        ReleaseSemaphore(mapped->slots, 1, nullptr);
+    }
+}
 
-                if (line->count == MAX_LINE_LENGTH) {
-                    *result = RESULT_LIMIT_REACHED;
-                    return false;
-                }
+// Returns whether a document is still being loaded, and how far along it is.
+static bool GetDocLoadPercent(Doc * doc, size_t * percent) {
+    MappedFile * mapped = GetMappedFile(doc);
+    if (!mapped || mapped->appliedCount == mapped->textCount || mapped->result != RESULT_OK) {
+        return false;
+    }
+    *percent = static_cast<size_t>(100 * static_cast<double>(mapped->appliedCount) / mapped->textCount);
+    return true;
+}
 
-                if (line->count == line->capacity && !line->SetCapacity(line->capacity * 2)) {
-                    *result = RESULT_MEMORY_ERROR;
-                    return false;
-                }
-                wchar_t * newChar = line->Insert(SIZE_MAX, 1);
-                *newChar = chars[i];
+// Waits until a document is loaded completely, as needed before writing it. The chunks arriving
+// meanwhile are appended here, or the workers would run out of slots.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+// - RESULT_FILE_ERROR - the file could not be copied
+static ResultCode FinishDocLoad(Doc * doc) {
+    MappedFile * mapped = GetMappedFile(doc);
+    if (!mapped) {
+        return RESULT_OK;
+    }
+    while (mapped->result == RESULT_OK && mapped->appliedCount != mapped->textCount) {
+        MSG message;
+        if (PeekMessageW(&message, mainWindow, WM_DOCLOAD, WM_DOCLOAD, PM_REMOVE)) {
+            ReceiveLoadChunk(doc, static_cast<uint>(message.wParam), reinterpret_cast<LoadChunk *>(message.lParam));
+        } else if (WaitForMultipleObjects(mapped->threadCount, mapped->threads, TRUE, 10) == WAIT_OBJECT_0) {
+            // the workers are done, so a chunk not posted by now got lost
+            if (!PeekMessageW(&message, mainWindow, WM_DOCLOAD, WM_DOCLOAD, PM_NOREMOVE)) {
+                return RESULT_MEMORY_ERROR;
             }
         }
+    }
+    return mapped->result;
+}
 
-        return true;
-    };
+// Returns the number of worker threads to use for a configured count, one per processor for 0.
+static uint GetThreadCount(uint threadCount) {
+    if (threadCount == 0) {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        threadCount = systemInfo.dwNumberOfProcessors;
+    }
+    if (threadCount > LAZYLOAD_MAX_THREAD_COUNT) {
+        threadCount = LAZYLOAD_MAX_THREAD_COUNT;
+    }
+    return threadCount != 0 ? threadCount : 1;
+}
 
-    ulong readStatus;
-    ResultCode writeStatus;
-    bool readSuccess = MkUtf8Read(
-        ReadFileCallback, file, &readStatus,
-        writeCallback, *doc, &writeStatus);
-    if (!readSuccess) {
+// Creates a document loading lazily from a mapped file, taking ownership of the file, the view and
+// the source, if the view is a copy of it still to be made.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+// - RESULT_FILE_ERROR
+static ResultCode LoadMappedFile(HANDLE file, HANDLE source, bool appendable, const char * view, const char * text, size_t textCount, Doc ** doc) {
+    uint threadCount = GetThreadCount(config.loadThreadCount);
+    MappedFile * mapped = static_cast<MappedFile *>(malloc(sizeof(MappedFile)));
+    HANDLE slots = CreateSemaphoreW(nullptr, 2 * threadCount, LONG_MAX, nullptr);
+    Doc * newDoc = CreateEmptyDoc();
+    if (!mapped || !slots || !newDoc) {
+        free(mapped);
+        if (slots) {
+            CloseHandle(slots);
+        }
+        DestroyDoc(newDoc);
+        UnmapViewOfFile(view);
         CloseHandle(file);
-        DestroyDoc(*doc);
-        return writeStatus;
+        if (source) {
+            CloseHandle(source);
+        }
+        return RESULT_MEMORY_ERROR;
+    }
+
+    mapped->file = file;
+    mapped->source = source;
+    mapped->view = view;
+    mapped->text = text;
+    mapped->textCount = textCount;
+    mapped->appendable = appendable;
+    mapped->mixed = false;
+    mapped->decodedFile = nullptr;
+    mapped->decoded = nullptr;
+    mapped->loadId = ++lastLoadId;
+    mapped->cancelled = false;
+    InitializeCriticalSection(&mapped->lock);
+    mapped->claimedCount = 0;
+    mapped->claimedChunkCount = 0;
+    mapped->copiedCount = text - view;
+    mapped->copyFailed = false;
+    mapped->slots = slots;
+    mapped->threadCount = 0;
+    for (uint i = 0; i != LAZYLOAD_MAX_PENDING_COUNT; i++) {
+        mapped->pending[i] = nullptr;
+    }
+    mapped->appliedChunkCount = 0;
+    mapped->appliedCount = 0;
+    mapped->lineByteCount = 0;
+    mapped->buffers.Init(64);
+    mapped->result = RESULT_OK;
+    mapped->asidePath[0] = L'\0';
+    newDoc->original = mapped;
+    newDoc->releaseOriginal = ReleaseMappedFile;
+
+    // the first chunk is only copied once it is claimed
+    size_t start;
+    size_t count;
+    uint index;
+    ClaimLoadChunk(mapped, LAZYLOAD_FIRST_CHUNK_COUNT, &start, &count, &index);
+    mapped->crlf = HasOnlyCrlf(text, count);
+    newDoc->crlf = mapped->crlf;
+    LoadChunk * chunk = ReadLoadChunk(mapped, start, count, index);
+    if (chunk) {
+        ApplyLoadChunk(newDoc, mapped, chunk);
+    } else {
+        mapped->result = RESULT_MEMORY_ERROR;
+    }
+    if (mapped->result != RESULT_OK) {
+        ResultCode result = mapped->result;
+        DestroyDoc(newDoc);
+        return result;
+    }
+
+    if (mapped->claimedCount != textCount) {
+        for (; mapped->threadCount != threadCount; mapped->threadCount++) {
+            HANDLE thread = CreateThread(nullptr, 0, LoadThreadProc, mapped, 0, nullptr);
+            if (!thread) {
+                break;
+            }
+            mapped->threads[mapped->threadCount] = thread;
+        }
+        if (mapped->threadCount == 0) {
+            DestroyDoc(newDoc);
+            return RESULT_MEMORY_ERROR;
+        }
     }
 
+    *doc = newDoc;
+    return RESULT_OK;
+}
+
+static uint64_t GetFileTimestamp(HANDLE file) {
     FILETIME fileTimestamp;
     GetFileTime(file, nullptr, nullptr, &fileTimestamp);
     ULARGE_INTEGER timestamp;
     timestamp.LowPart = fileTimestamp.dwLowDateTime;
     timestamp.HighPart = fileTimestamp.dwHighDateTime;
-
-    CloseHandle(file);
-
-    (*doc)->cursorLineIndex = 0;
-    (*doc)->cursorCharIndex = 0;
-    (*doc)->timestamp = timestamp.QuadPart;
-    wcscpy_s((*doc)->title, MAX_PATH_COUNT, path);
-    return RESULT_OK;
+    return timestamp.QuadPart;
 }
 
-wchar_t * tabSpaces;
+// Puts a file moved aside by a save back in place after the new one could not be written.
+static void RestoreAside(MappedFile * mapped, const wchar_t * path) {
+    MoveFileExW(mapped->asidePath, path, MOVEFILE_REPLACE_EXISTING);
+    mapped->asidePath[0] = L'\0';
+}
 
-HBRUSH textBrush;
-HBRUSH backgroundBrush;
-HBRUSH cursorBrush;
-HBRUSH statusBackgroundBrush;
-HBRUSH docTitleBackgroundBrush;
-HBRUSH promptTextBrush;
-HBRUSH promptBackgroundBrush;
+// Returns whether a path leads to the file a document is loaded from.
+static bool IsMappedFile(MappedFile * mapped, const wchar_t * path) {
+    HANDLE file = CreateFileW(
+        path,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
 
-enum Mode {
-    MODE_NORMAL,
-    MODE_COMMAND,
-    MODE_INSERT,
-};
+    BY_HANDLE_FILE_INFORMATION fileInfo;
+    BY_HANDLE_FILE_INFORMATION mappedInfo;
+    bool same = GetFileInformationByHandle(file, &fileInfo)
+        && GetFileInformationByHandle(mapped->file, &mappedInfo)
+        && fileInfo.dwVolumeSerialNumber == mappedInfo.dwVolumeSerialNumber
+        && fileInfo.nFileIndexHigh == mappedInfo.nFileIndexHigh
+        && fileInfo.nFileIndexLow == mappedInfo.nFileIndexLow;
+    CloseHandle(file);
+    return same;
+}
 
-Mode currentMode = MODE_NORMAL;
+// Moves the file a document is still reading from out of the way, as it cannot be written over.
+// It is deleted once the document is closed. If a timestamp is given, the file is put back unless
+// it still has it once moved.
+// Returns:
+// - RESULT_OK
+// - RESULT_FILE_LOCKED - the path leads to where the file was moved before
+// - RESULT_FILE_EXISTS - the file was modified
+// - RESULT_FILE_ERROR
+// - RESULT_FILE_NOT_FOUND
+static ResultCode MoveAside(MappedFile * mapped, const wchar_t * path, const uint64_t * timestamp) {
+    if (mapped->asidePath[0] != L'\0') {
+        return RESULT_FILE_LOCKED;
+    }
+    size_t pathLength = wcslen(path);
+    if (pathLength + 2 > MAX_PATH_COUNT) {
+        return RESULT_FILE_ERROR;
+    }
+    wcscpy_s(mapped->asidePath, MAX_PATH_COUNT, path);
+    mapped->asidePath[pathLength] = L'~';
+    mapped->asidePath[pathLength + 1] = L'\0';
+    if (!MoveFileExW(path, mapped->asidePath, MOVEFILE_REPLACE_EXISTING)) {
+        ulong error = GetLastError();
+        mapped->asidePath[0] = L'\0';
+        return error == ERROR_FILE_NOT_FOUND ? RESULT_FILE_NOT_FOUND : RESULT_FILE_ERROR;
+    }
+    if (timestamp && GetFileTimestamp(mapped->file) != *timestamp) {
+        RestoreAside(mapped, path);
+        return RESULT_FILE_EXISTS;
+    }
+    return RESULT_OK;
+}
 
-wchar_t workingFolderPath[MAX_PATH];
-Doc * currentDoc;
-bool paintContentCursor = true;
-bool paintStatusCursor = false;
+// Gathers the encoded text of a document so it is written in large blocks. UTF-8 runs too large
+// for the buffer are written straight from the document. A surrogate pair split between two
+// UTF-16 pieces is held back until the next piece shows whether it is complete. Line breaks are
+// written as CR LF if the document uses them, or the piece was loaded from them in a file mixing
+// both.
+#define DOCWRITER_BUFFER_COUNT (1024 * 1024)
+
+struct DocWriter {
+    HANDLE file;
+    char * bytes;
+    size_t count;
+    wchar_t highSurrogate;
+    bool crlf;
+};
 
-#define MAX_STATUS_COUNT 512
-wchar_t statusLine[MAX_STATUS_COUNT];
-ushort statusLength = 0;
-ushort statusCursorChar = 0;
-bool statusPrompt = false;
+static char docWriterBuffer[DOCWRITER_BUFFER_COUNT];
 
-enum CommandType {
-    COMMAND_NONE,
-    COMMAND_TO_NEXT_CHAR,
-    COMMAND_TO_PREV_CHAR,
-    COMMAND_DELETE,
-};
+bool FlushDocWriter(DocWriter * writer) {
+    bool success = WriteBytes(writer->file, writer->bytes, writer->count);
+    writer->count = 0;
+    return success;
+}
 
-CommandType commandStaged = COMMAND_NONE;
-wchar_t commandDigitStack[16];
-ushort commandDigitCount = 0;
+static bool PutBytes(DocWriter * writer, const char * bytes, size_t count) {
+    if (count >= DOCWRITER_BUFFER_COUNT) {
+        return FlushDocWriter(writer) && WriteBytes(writer->file, bytes, count);
+    }
+    if (DOCWRITER_BUFFER_COUNT - writer->count < count && !FlushDocWriter(writer)) {
+        return false;
+    }
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+    return true;
+}
 
-void SetStatusLineNormal() {
-    size_t cursorLinePercent;
-    if (currentDoc->lines.count > 1) {
-        cursorLinePercent = (100 * currentDoc->cursorLineIndex) / (currentDoc->lines.count - 1);
-    } else {
-        cursorLinePercent = 0;
+static bool PutUtf16(DocWriter * writer, const wchar_t * chars, size_t length) {
+    while (length != 0) {
+        size_t chunkLength = (DOCWRITER_BUFFER_COUNT - writer->count) / 3;
+        if (chunkLength >= length) {
+            chunkLength = length;
+        } else if (chunkLength != 0 && chars[chunkLength - 1] >= 0xD800 && chars[chunkLength - 1] <= 0xDBFF) {
+            chunkLength--; // keep the pair together
+        }
+        writer->count += TranscodeUtf16ToUtf8(chars, chunkLength, writer->bytes + writer->count);
+        chars += chunkLength;
+        length -= chunkLength;
+        if (length != 0 && !FlushDocWriter(writer)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    MkDynArray<wchar_t> * cursorLine = &currentDoc->lines.elems[currentDoc->cursorLineIndex];
+// Writes a high surrogate held back from the last piece, which is unpaired if nothing follows.
+bool EndUtf16(DocWriter * writer) {
+    if (!writer->highSurrogate) {
+        return true;
+    }
+    if (DOCWRITER_BUFFER_COUNT - writer->count < 3 && !FlushDocWriter(writer)) {
+        return false;
+    }
+    writer->count += TranscodeUtf16ToUtf8(&writer->highSurrogate, 1, writer->bytes + writer->count);
+    writer->highSurrogate = 0;
+    return true;
+}
 
-    ulong cursorColCount = 0;
-    for (ushort i = 0; i != currentDoc->cursorCharIndex; i++) {
-        if (cursorLine->elems[i] == L'\t') {
-            cursorColCount += config.tabWidth;
-        } else {
-            cursorColCount++;
-        }
+bool WriteUtf8(DocWriter * writer, const char * bytes, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    if (!EndUtf16(writer)) {
+        return false;
+    }
+    if (!writer->crlf) {
+        return PutBytes(writer, bytes, count);
     }
 
-    ulong cursorLineColCount = 0;
-    for (ushort i = 0; i != cursorLine->count; i++) {
-        if (cursorLine->elems[i] == L'\t') {
-            cursorLineColCount += config.tabWidth;
-        } else {
-            cursorLineColCount++;
+    const char * end = bytes + count;
+    const char * lineBreak;
+    while ((lineBreak = static_cast<const char *>(memchr(bytes, '\n', end - bytes)))) {
+        if (!PutBytes(writer, bytes, lineBreak - bytes) || !PutBytes(writer, "\r\n", 2)) {
+            return false;
         }
+        bytes = lineBreak + 1;
     }
+    return PutBytes(writer, bytes, end - bytes);
+}
 
-
-    const wchar_t modeNameNormal[] = L"NORMAL";
-    const wchar_t modeNameInsert[] = L"INSERT";
-    const wchar_t * modeName;
-    if (currentMode == MODE_INSERT) {
-        modeName = modeNameInsert;
-    } else {
-        modeName = modeNameNormal;
+bool WriteUtf16(DocWriter * writer, const wchar_t * chars, size_t length) {
+    if (length == 0) {
+        return true;
+    }
+    if (writer->highSurrogate && chars[0] >= 0xDC00 && chars[0] <= 0xDFFF) {
+        wchar_t pair[2] = { writer->highSurrogate, chars[0] };
+        writer->highSurrogate = 0;
+        if (DOCWRITER_BUFFER_COUNT - writer->count < 4 && !FlushDocWriter(writer)) {
+            return false;
+        }
+        writer->count += TranscodeUtf16ToUtf8(pair, 2, writer->bytes + writer->count);
+        chars++;
+        length--;
+    } else if (!EndUtf16(writer)) {
+        return false;
     }
 
-    swprintf_s(
-        statusLine,
-        MAX_STATUS_COUNT,
-        L"%s | Line: %zu/%zu (%zu %%) | Char: %hu/%zu (%lu/%lu) | ",
-        modeName,
-        currentDoc->cursorLineIndex + 1,
-        currentDoc->lines.count,
-        cursorLinePercent,
-        currentDoc->cursorCharIndex + 1,
-        cursorLine->count,
-        cursorColCount + 1,
-        cursorLineColCount);
-    statusLength = static_cast<ushort>(wcslen(statusLine));
+    if (length != 0 && chars[length - 1] >= 0xD800 && chars[length - 1] <= 0xDBFF) {
+        writer->highSurrogate = chars[length - 1];
+        length--;
+    }
+    if (!writer->crlf) {
+        return PutUtf16(writer, chars, length);
+    }
 
-    if (commandDigitCount != 0) {
-        for (ushort i = 0; i != commandDigitCount; i++) {
-            statusLine[statusLength++] = commandDigitStack[i];
+    const wchar_t * end = chars + length;
+    const wchar_t * lineBreak;
+    while ((lineBreak = wmemchr(chars, L'\n', end - chars))) {
+        if (!PutUtf16(writer, chars, lineBreak - chars) || !PutBytes(writer, "\r\n", 2)) {
+            return false;
         }
+        chars = lineBreak + 1;
     }
+    return PutUtf16(writer, chars, end - chars);
+}
 
-    if (commandStaged != COMMAND_NONE) {
-        switch (commandStaged) {
-            case COMMAND_TO_NEXT_CHAR:
-            {
-                statusLine[statusLength++] = L'f';
-                break;
-            }
+//-------------------
+// Background Saving
 
-            case COMMAND_TO_PREV_CHAR:
-            {
-                statusLine[statusLength++] = L'F';
-                break;
-            }
+// A document is saved from a snapshot on a worker thread, so editing can go on meanwhile. The
+// window thread learns about the outcome from a message and a timer keeps the progress shown.
+// Only one save runs at a time, and the document is not destroyed before it is done.
 
-            case COMMAND_DELETE:
-            {
-                statusLine[statusLength++] = L'd';
-                break;
-            }
-        }
-    }
+#define WM_DOCSAVE (WM_APP + 2)
+#define SAVE_TIMER_ID 1
+#define SAVE_TIMER_INTERVAL 100
+#define SAVE_MAX_RUN_COUNT (16 * 1024 * 1024)
 
-    statusPrompt = false;
-}
+struct SaveJob {
+    Doc * doc;
+    DocSnapshot * snapshot;
+    DocSnapshot * savedSnapshot; // what the file held before, if known
+    MappedFile * mapped;
+    wchar_t path[MAX_PATH_COUNT];
+    bool newPath;
+    bool crlf;
+    DWORD disposition;
+    uint64_t timestamp; // expected before the save, written after it
+    uint64_t byteCount; // expected before the save, written after it
+    volatile size_t savedLength;
+    ResultCode result;
+    HANDLE thread;
+};
 
-void SetStatusInvalidCommand(const wchar_t * text) {
-    currentMode = MODE_NORMAL;
-    paintContentCursor = true;
-    paintStatusCursor = false;
-    wcscpy_s(statusLine, MAX_STATUS_COUNT, text);
-    statusLength = static_cast<ushort>(wcslen(text));
-    statusPrompt = true;
-}
+static SaveJob * saveJob = nullptr;
 
-size_t PowUz(size_t base, size_t exp) {
-    size_t result = 1;
-    for (size_t i = 1; i <= exp; i++) {
-        result *= base;
+// Returns whether a CR is written in front of each LF of a piece. A piece keeping its CRs is
+// written as it is.
+static bool AddsCarriageReturns(SaveJob * job, const DocPiece * piece, size_t * bufferIndex) {
+    if (piece->crlf) {
+        return false;
     }
-    return result;
+    return job->crlf || (job->mapped && job->mapped->mixed && IsStrippedPiece(job->mapped, piece, bufferIndex));
 }
 
-void ResetCommand() {
-    commandStaged = COMMAND_NONE;
-    commandDigitCount = 0;
-    SetStatusLineNormal();
+// Writes the text of a snapshot to a file, from a piece on. UTF-8 pieces are written as they are,
+// and consecutive ones still lying next to each other in the original buffer are written at once,
+// up to a limit so the progress keeps moving. UTF-16 pieces are encoded on the way.
+static bool WriteDocText(SaveJob * job, HANDLE file, DocPieceIterator * pieces, const DocPiece * piece) {
+    DocWriter writer;
+    writer.file = file;
+    writer.bytes = docWriterBuffer;
+    writer.count = 0;
+    writer.highSurrogate = 0;
+    writer.crlf = job->crlf;
+
+    const char * utf8Run = nullptr;
+    size_t utf8RunCount = 0;
+    size_t utf8RunLength = 0;
+    size_t bufferIndex = 0;
+    for (; piece; piece = NextDocPiece(pieces)) {
+        bool crlf = AddsCarriageReturns(job, piece, &bufferIndex);
+        if (piece->bytes && piece->bytes == utf8Run + utf8RunCount && crlf == writer.crlf && utf8RunCount < SAVE_MAX_RUN_COUNT) {
+            utf8RunCount += piece->byteCount;
+            utf8RunLength += piece->length;
+            continue;
+        }
+        if (!WriteUtf8(&writer, utf8Run, utf8RunCount)) {
+            return false;
+        }
+        job->savedLength += utf8RunLength;
+        writer.crlf = crlf;
+        utf8Run = piece->bytes;
+        utf8RunCount = piece->byteCount;
+        utf8RunLength = piece->length;
+        if (!piece->bytes) {
+            if (!WriteUtf16(&writer, piece->chars, piece->length)) {
+                return false;
+            }
+            job->savedLength += piece->length;
+            utf8RunLength = 0;
+        }
+    }
+    return WriteUtf8(&writer, utf8Run, utf8RunCount) && EndUtf16(&writer) && FlushDocWriter(&writer);
 }
 
-void ProcessNormalCharInput(wchar_t c) {
-    if (c == 0x1b) { // Esc
-        ResetCommand();
-        return;
-    }
+// Levels of config.saveDurability. Without a data-only flush on Windows, the data level flushes the
+// file, and the full level makes the rename or replacement of an atomic save durable as well.
+#define SAVE_DURABILITY_NONE 0
+#define SAVE_DURABILITY_DATA 1
+#define SAVE_DURABILITY_FULL 2
 
-    switch (commandStaged) {
-        case COMMAND_TO_NEXT_CHAR:
-        {
-            if (iswcntrl(c)) {
-                ResetCommand();
-            }
+// Flushes a written file to the disk as far as config.saveDurability asks for.
+static bool SyncFile(HANDLE file) {
+    return config.saveDurability == SAVE_DURABILITY_NONE || FlushFileBuffers(file);
+}
 
-            size_t count;
-            if (commandDigitCount == 0) {
-                count = 1;
-            } else {
-                count = 0;
-                for (ushort i = 0; i != commandDigitCount; i++) {
-                    count += (commandDigitStack[commandDigitCount - 1 - i] - L'0') * PowUz(10, i);
-                }
+// Finds how much of the text being saved the file holds already, as last loaded or saved. Pieces
+// never change their text, so equal pieces mean equal text. A piece the file holds only the start
+// of, like a line typed at the end, is cut to the rest, which is where the iterator is left. The
+// pieces matched count as saved.
+// Returns the number of bytes the file holds already, and whether it holds nothing else.
+static uint64_t MatchSavedText(SaveJob * job, DocPieceIterator * pieces, DocPiece * cutPiece, const DocPiece ** piece, bool * complete) {
+    InitDocSnapshotPieceIterator(job->snapshot, pieces);
+    *piece = NextDocPiece(pieces);
+    *complete = false;
+    uint64_t count = 0;
+    size_t bufferIndex = 0;
+    if (job->savedSnapshot) {
+        DocPieceIterator savedPieces;
+        InitDocSnapshotPieceIterator(job->savedSnapshot, &savedPieces);
+        const DocPiece * savedPiece = NextDocPiece(&savedPieces);
+        while (*piece && savedPiece) {
+            const DocPiece * next = *piece;
+            bool sameStart = next->bytes ? next->bytes == savedPiece->bytes : next->chars == savedPiece->chars;
+            if (!sameStart || next->length < savedPiece->length) {
+                break;
             }
-
-            MkDynArray<wchar_t> * line = &currentDoc->lines.elems[currentDoc->cursorLineIndex];
-            for (size_t i = 0; i != count; i++) {
-                for (ushort j = currentDoc->cursorCharIndex + 1; j <= line->count ; j++) {
-                    if (line->elems[j] == c) {
-                        currentDoc->cursorCharIndex = j;
-                        break;
-                    }
+            if (!next->bytes && savedPiece->length != 0) {
+                wchar_t last = next->chars[savedPiece->length - 1];
+                if (last >= 0xD800 && last <= 0xDBFF) {
+                    break; // the pair it starts may have been completed since
                 }
             }
 
-            ResetCommand();
-            return;
-        }
-
-        case COMMAND_TO_PREV_CHAR:
-        {
-            if (iswcntrl(c)) {
-                ResetCommand();
-            }
-
-            size_t count;
-            if (commandDigitCount == 0) {
-                count = 1;
+            if (next->bytes) {
+                count += savedPiece->byteCount;
             } else {
-                count = 0;
-                for (ushort i = 0; i != commandDigitCount; i++) {
-                    count += (commandDigitStack[commandDigitCount - 1 - i] - L'0') * PowUz(10, i);
-                }
+                count += GetTranscodedUtf8Count(savedPiece->chars, savedPiece->length);
             }
-
-            MkDynArray<wchar_t> * line = &currentDoc->lines.elems[currentDoc->cursorLineIndex];
-            for (size_t i = 0; i != count; i++) {
-                for (ushort j = currentDoc->cursorCharIndex - 1; j != USHRT_MAX; j--) { // intentional overflow
-                    if (line->elems[j] == c) {
-                        currentDoc->cursorCharIndex = j;
-                        break;
-                    }
-                }
+            if (AddsCarriageReturns(job, savedPiece, &bufferIndex)) {
+                count += savedPiece->lineBreakCount; // the CRs
             }
-
-            ResetCommand();
-            return;
-        }
-
-        case COMMAND_DELETE:
-        {
-            if (c == L'd') {
-                if (currentDoc->lines.count == 1) {
-                    currentDoc->lines.elems[0].count = 0;
-                    currentDoc->cursorCharIndex = 0;
-                    currentDoc->lastCursorColIndex = 0;
+            job->savedLength += savedPiece->length;
+            if (next->length != savedPiece->length) {
+                *cutPiece = *next;
+                if (next->bytes) {
+                    cutPiece->bytes += savedPiece->byteCount;
+                    cutPiece->byteCount -= savedPiece->byteCount;
                 } else {
-                    currentDoc->lines.elems[currentDoc->cursorLineIndex].Clear();
-                    currentDoc->lines.Remove(currentDoc->cursorLineIndex, 1);
-                    currentDoc->cursorLineIndex = min(currentDoc->cursorLineIndex, currentDoc->lines.count - 1);
-                    ApplyColIndex(currentDoc, false);
+                    cutPiece->chars += savedPiece->length;
                 }
-
-                currentDoc->modified = true;
+                cutPiece->length -= savedPiece->length;
+                *piece = cutPiece;
+                savedPiece = NextDocPiece(&savedPieces);
+                break;
             }
-            ResetCommand();
-            return;
+            *piece = NextDocPiece(pieces);
+            savedPiece = NextDocPiece(&savedPieces);
         }
+        *complete = !savedPiece;
+    } else if (job->mapped && job->mapped->text == job->mapped->view) {
+        const char * text = job->mapped->text;
+        while (*piece && (*piece)->bytes == text + count && !AddsCarriageReturns(job, *piece, &bufferIndex)) {
+            count += (*piece)->byteCount;
+            job->savedLength += (*piece)->length;
+            *piece = NextDocPiece(pieces);
+        }
+        *complete = count == job->mapped->textCount;
     }
+    return count;
+}
 
-    if ((c >= L'1' && c <= L'9') || (c == L'0' && commandDigitCount != 0)) {
-        commandDigitStack[commandDigitCount++] = c;
-        SetStatusLineNormal();
-        return;
+// Writes only the text behind the part the file holds already. As long as the file holds nothing
+// else, the text is appended, which never touches what is there. Otherwise this is only done if
+// saving may write over the file anyway.
+// Returns false if the whole text needs to be written.
+static bool WriteDocTail(SaveJob * job, ResultCode * result) {
+    MappedFile * mapped = job->mapped;
+    bool mappedPath = mapped && mapped->asidePath[0] == L'\0' && IsMappedFile(mapped, job->path);
+    if (job->disposition != OPEN_EXISTING || (!job->savedSnapshot && !mappedPath)) {
+        return false;
     }
 
-    switch (c) {
-        case L':':
-        {
-            currentMode = MODE_COMMAND;
-            statusLine[0] = L':';
-            statusLength = 1;
-            statusCursorChar = 1;
-            paintContentCursor = false;
-            paintStatusCursor = true;
-            statusPrompt = true;
-            break;
-        }
-
-        case L'i':
-        {
-            currentMode = MODE_INSERT;
-            SetStatusLineNormal();
-            break;
-        }
+    DocPieceIterator pieces;
+    DocPiece cutPiece;
+    const DocPiece * piece;
+    bool complete;
+    uint64_t keptCount = MatchSavedText(job, &pieces, &cutPiece, &piece, &complete);
+    if (keptCount == 0 || (!complete && config.atomicSave)) {
+        job->savedLength = 0;
+        return false;
+    }
 
-        case L'I':
-        {
-            MkDynArray<wchar_t> * line = &currentDoc->lines.elems[currentDoc->cursorLineIndex];
-            for (currentDoc->cursorCharIndex = 0; currentDoc->cursorCharIndex != line->count; currentDoc->cursorCharIndex++) {
-                if (!iswspace(line->elems[currentDoc->cursorCharIndex])) {
-                    break;
-                }
-            }
-            currentMode = MODE_INSERT;
-            SetStatusLineNormal();
-            break;
+    // A file the document still reads from is mapped, so it can only grow. It cannot be opened for
+    // writing once more, so it is appended to through the handle it was loaded with, if that allows
+    // appending.
+    HANDLE file = INVALID_HANDLE_VALUE;
+    if (!mappedPath) {
+        file = CreateFileW(
+            job->path,
+            complete ? FILE_APPEND_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE : GENERIC_WRITE,
+            0,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+    } else if (complete && mapped->appendable) {
+        HANDLE process = GetCurrentProcess();
+        if (!DuplicateHandle(process, mapped->file, process, &file, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+            file = INVALID_HANDLE_VALUE;
         }
+    }
+    if (file == INVALID_HANDLE_VALUE) {
+        job->savedLength = 0;
+        return false;
+    }
 
-        case L'a':
-        {
-            if (currentDoc->lines.elems[currentDoc->cursorLineIndex].count != 0) {
-                currentDoc->cursorCharIndex++;
-            }
-            currentMode = MODE_INSERT;
-            SetStatusLineNormal();
-            break;
-        }
-
-        case L'A':
-        {
-            currentDoc->cursorCharIndex = static_cast<ushort>(currentDoc->lines.elems[currentDoc->cursorLineIndex].count);
-            currentMode = MODE_INSERT;
-            SetStatusLineNormal();
-            break;
-        }
+    LARGE_INTEGER fileSize;
+    uint64_t expectedCount = job->savedSnapshot ? job->byteCount : mapped->textCount;
+    if (!GetFileSizeEx(file, &fileSize) || static_cast<uint64_t>(fileSize.QuadPart) != expectedCount) {
+        CloseHandle(file);
+        job->savedLength = 0;
+        return false;
+    }
+    if (GetFileTimestamp(file) != job->timestamp) {
+        CloseHandle(file);
+        *result = RESULT_FILE_EXISTS;
+        return true;
+    }
 
-        case L'o':
-        {
-            MkDynArray<wchar_t> * newLine = currentDoc->lines.Insert(++currentDoc->cursorLineIndex, 1);
-            newLine->Init(DOCLINE_INIT_CAPACITY);
-            newLine->SetCapacity(newLine->growCount);
-            currentDoc->cursorCharIndex = 0;
+    LARGE_INTEGER keptSize;
+    keptSize.QuadPart = keptCount;
+    bool writeSuccess = (complete || SetFilePointerEx(file, keptSize, nullptr, FILE_BEGIN))
+        && WriteDocText(job, file, &pieces, piece)
+        && (complete || SetEndOfFile(file))
+        && SyncFile(file)
+        && GetFileSizeEx(file, &fileSize);
+    if (writeSuccess) {
+        job->timestamp = GetFileTimestamp(file);
+        job->byteCount = fileSize.QuadPart;
+        *result = RESULT_OK;
+    } else {
+        *result = RESULT_FILE_ERROR;
+    }
+    CloseHandle(file);
+    return true;
+}
 
-            currentMode = MODE_INSERT;
-            currentDoc->modified = true;
-            SetStatusLineNormal();
-            break;
+// Writes to a new file next to the path and puts it in place of the file there once it is complete,
+// so a failed save never leaves a partly written file behind. A file already there is replaced, so it
+// keeps its attributes and security, which a rename would take from the new file.
+// Returns:
+// - RESULT_OK
+// - RESULT_FILE_LOCKED
+// - RESULT_FILE_EXISTS
+// - RESULT_FILE_ERROR
+// - RESULT_FILE_NOT_FOUND
+static ResultCode WriteDocAtomic(SaveJob * job) {
+    const wchar_t * path = job->path;
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    bool exists = GetFileAttributesExW(path, GetFileExInfoStandard, &attributes);
+    if (exists) {
+        if (job->disposition == CREATE_NEW) {
+            return RESULT_FILE_EXISTS;
         }
-
-        case L'O':
-        {
-            MkDynArray<wchar_t> * newLine = currentDoc->lines.Insert(currentDoc->cursorLineIndex, 1);
-            newLine->Init(DOCLINE_INIT_CAPACITY);
-            newLine->SetCapacity(newLine->growCount);
-            currentDoc->cursorCharIndex = 0;
-
-            currentMode = MODE_INSERT;
-            currentDoc->modified = true;
-            SetStatusLineNormal();
-            break;
+        ULARGE_INTEGER timestamp;
+        timestamp.LowPart = attributes.ftLastWriteTime.dwLowDateTime;
+        timestamp.HighPart = attributes.ftLastWriteTime.dwHighDateTime;
+        if (job->disposition == OPEN_EXISTING && timestamp.QuadPart != job->timestamp) {
+            return RESULT_FILE_EXISTS;
         }
+    } else if (job->disposition == OPEN_EXISTING) {
+        return GetLastError() == ERROR_FILE_NOT_FOUND ? RESULT_FILE_NOT_FOUND : RESULT_FILE_ERROR;
+    }
 
-        case L'x':
-        {
-            MkDynArray<wchar_t> * line = &currentDoc->lines.elems[currentDoc->cursorLineIndex];
-            if (line->count != 0) {
-                line->Remove(currentDoc->cursorCharIndex, 1);
-                currentDoc->cursorCharIndex = min(currentDoc->cursorCharIndex, static_cast<ushort>(line->count) - 1);
-                currentDoc->modified = true;
-            }
+    // The temporary file goes into the same directory, as a rename cannot cross volumes.
+    wchar_t directory[MAX_PATH_COUNT];
+    wcscpy_s(directory, MAX_PATH_COUNT, path);
+    size_t directoryLength = wcslen(directory);
+    while (directoryLength != 0 && directory[directoryLength - 1] != L'\\' && directory[directoryLength - 1] != L'/') {
+        directoryLength--;
+    }
+    if (directoryLength == 0) {
+        wcscpy_s(directory, MAX_PATH_COUNT, L".");
+    } else {
+        directory[directoryLength] = L'\0';
+    }
+    wchar_t tempPath[MAX_PATH_COUNT];
+    if (!GetTempFileNameW(directory, L"mke", 0, tempPath)) {
+        return GetLastError() == ERROR_ACCESS_DENIED ? RESULT_FILE_LOCKED : RESULT_FILE_ERROR;
+    }
 
-            ResetColIndex(currentDoc);
-            SetStatusLineNormal();
-            break;
-        }
+    HANDLE file = CreateFileW(
+        tempPath,
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        TRUNCATE_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        DeleteFileW(tempPath);
+        return RESULT_FILE_ERROR;
+    }
+    DocPieceIterator pieces;
+    InitDocSnapshotPieceIterator(job->snapshot, &pieces);
+    LARGE_INTEGER fileSize;
+    bool writeSuccess = WriteDocText(job, file, &pieces, NextDocPiece(&pieces))
+        && SyncFile(file)
+        && GetFileSizeEx(file, &fileSize);
+    uint64_t timestamp = GetFileTimestamp(file);
+    CloseHandle(file);
+    if (!writeSuccess) {
+        DeleteFileW(tempPath);
+        return RESULT_FILE_ERROR;
+    }
 
-        case L'd':
-        {
-            commandStaged = COMMAND_DELETE;
-            SetStatusLineNormal();
-            break;
+    MappedFile * mapped = job->mapped;
+    bool moveAside = mapped && IsMappedFile(mapped, path);
+    if (moveAside) {
+        ResultCode asideResult = MoveAside(mapped, path, job->disposition == OPEN_EXISTING ? &job->timestamp : nullptr);
+        if (asideResult != RESULT_OK) {
+            DeleteFileW(tempPath);
+            return asideResult;
         }
+    }
 
-        case L'h':
-        {
-            if (currentDoc->cursorCharIndex != 0) {
-                currentDoc->cursorCharIndex--;
-            }
-            ResetColIndex(currentDoc);
-            SetStatusLineNormal();
-            break;
+    // Replacing cannot write through, but the new file is flushed already. If the old file is gone
+    // but the new one could not take its name, it is moved there instead, and kept if that fails
+    // too, as it is the only copy of the text left.
+    DWORD moveFlags = job->disposition == CREATE_NEW ? 0 : MOVEFILE_REPLACE_EXISTING;
+    if (config.saveDurability == SAVE_DURABILITY_FULL) {
+        moveFlags |= MOVEFILE_WRITE_THROUGH;
+    }
+    bool replace = exists && !moveAside;
+    bool moveSuccess;
+    bool replaced = false;
+    if (replace) {
+        moveSuccess = ReplaceFileW(path, tempPath, nullptr, REPLACEFILE_IGNORE_MERGE_ERRORS | REPLACEFILE_IGNORE_ACL_ERRORS, nullptr, nullptr);
+        if (!moveSuccess && GetLastError() == ERROR_UNABLE_TO_MOVE_REPLACEMENT) {
+            replaced = true;
+            moveSuccess = MoveFileExW(tempPath, path, moveFlags);
         }
-
-        case L'l':
-        {
-            ushort length = static_cast<ushort>(currentDoc->lines.elems[currentDoc->cursorLineIndex].count);
-            if (length != 0 && currentDoc->cursorCharIndex != length - 1) {
-                currentDoc->cursorCharIndex++;
-            }
-            ResetColIndex(currentDoc);
-            SetStatusLineNormal();
-            break;
+    } else {
+        moveSuccess = MoveFileExW(tempPath, path, moveFlags);
+    }
+    if (!moveSuccess) {
+        ulong error = GetLastError();
+        if (!replaced) {
+            DeleteFileW(tempPath);
         }
-
-        case L'k':
-        {
-            if (currentDoc->cursorLineIndex != 0) {
-                currentDoc->cursorLineIndex--;
-                ApplyColIndex(currentDoc, false);
-            }
-            SetStatusLineNormal();
-            break;
+        if (moveAside) {
+            RestoreAside(mapped, path);
         }
+        switch (error) {
+            case ERROR_FILE_EXISTS:
+            case ERROR_ALREADY_EXISTS:
+                return RESULT_FILE_EXISTS;
 
-        case L'j':
-        {
-            if (currentDoc->cursorLineIndex != currentDoc->lines.count - 1) {
-                currentDoc->cursorLineIndex++;
-                ApplyColIndex(currentDoc, false);
-            }
-            SetStatusLineNormal();
-            break;
-        }
+            case ERROR_ACCESS_DENIED:
+            case ERROR_SHARING_VIOLATION:
+            case ERROR_UNABLE_TO_REMOVE_REPLACED:
+                return RESULT_FILE_LOCKED;
 
-        case L'0':
-        {
-            currentDoc->cursorCharIndex = 0;
-            currentDoc->lastCursorColIndex = 0;
-            SetStatusLineNormal();
-            break;
+            default:
+                return RESULT_FILE_ERROR;
         }
+    }
 
-        case L'^':
-        {
-            MkDynArray<wchar_t> * line = &currentDoc->lines.elems[currentDoc->cursorLineIndex];
-            for (ushort i = 0; i != line->count; i++) {
-                if (!iswspace(line->elems[i])) {
-                    currentDoc->cursorCharIndex = i;
-                    break;
-                }
+    // The replaced file keeps some of its own timestamps. With full durability it is flushed once
+    // more, which on NTFS commits the log holding its new name as well.
+    if (replace) {
+        bool flush = config.saveDurability == SAVE_DURABILITY_FULL;
+        HANDLE replacedFile = CreateFileW(
+            path,
+            flush ? GENERIC_WRITE : FILE_READ_ATTRIBUTES,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (replacedFile != INVALID_HANDLE_VALUE) {
+            if (flush) {
+                FlushFileBuffers(replacedFile);
             }
-            ResetColIndex(currentDoc);
-            SetStatusLineNormal();
-            break;
+            timestamp = GetFileTimestamp(replacedFile);
+            CloseHandle(replacedFile);
         }
+    }
+    job->timestamp = timestamp;
+    job->byteCount = fileSize.QuadPart;
+    return RESULT_OK;
+}
 
-        case L'$':
-        {
-            ushort length = static_cast<ushort>(currentDoc->lines.elems[currentDoc->cursorLineIndex].count);
-            if (length != 0) {
-                currentDoc->cursorCharIndex = length - 1;
-            }
-            ResetColIndex(currentDoc);
-            SetStatusLineNormal();
-            break;
+// Writes over the file at the path directly.
+// Returns:
+// - RESULT_OK
+// - RESULT_FILE_LOCKED
+// - RESULT_FILE_EXISTS
+// - RESULT_FILE_ERROR
+// - RESULT_FILE_NOT_FOUND
+static ResultCode WriteDocInPlace(SaveJob * job) {
+    const wchar_t * path = job->path;
+    DWORD disposition = job->disposition;
+    MappedFile * mapped = job->mapped;
+    bool moveAside = mapped && IsMappedFile(mapped, path);
+    if (moveAside) {
+        ResultCode asideResult = MoveAside(mapped, path, job->disposition == OPEN_EXISTING ? &job->timestamp : nullptr);
+        if (asideResult != RESULT_OK) {
+            return asideResult;
         }
+        disposition = CREATE_NEW;
+    }
 
-        case L'f':
-        {
-            commandStaged = COMMAND_TO_NEXT_CHAR;
-            SetStatusLineNormal();
-            break;
+    HANDLE file = CreateFileW(
+        path,
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        disposition,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        ulong error = GetLastError();
+        if (moveAside) {
+            RestoreAside(mapped, path);
         }
+        switch (error) {
+            case ERROR_FILE_EXISTS:
+                return RESULT_FILE_EXISTS;
 
-        case L'F':
-        {
-            commandStaged = COMMAND_TO_PREV_CHAR;
-            SetStatusLineNormal();
-            break;
+            case ERROR_FILE_NOT_FOUND:
+                return RESULT_FILE_NOT_FOUND;
+
+            case ERROR_SHARING_VIOLATION:
+                return RESULT_FILE_LOCKED;
+
+            default:
+                return RESULT_FILE_ERROR;
         }
     }
-}
-
-void ExecuteCommandEdit(const wchar_t * args, ushort argsLength) {
-    const wchar_t statusArgsInvalid[] = L"Command args invalid!";
-    const wchar_t statusPathTooLong[] = L"Path too long!";
-    const wchar_t statusFileTooLarge[] = L"File too large!";
-    const wchar_t statusFileError[] = L"Could not open file.";
-    const wchar_t statusFileLocked[] = L"File locked!";
-    const wchar_t statusOutOfMemory[] = L"Out of memory!";
-    const wchar_t statusCurDocUnsaved[] = L"Current document has unsaved changes!";
 
-    //-----------
-    // Parse Args
+    if (disposition == OPEN_EXISTING && GetFileTimestamp(file) != job->timestamp) {
+        CloseHandle(file);
+        return RESULT_FILE_EXISTS;
+    }
 
-    ushort i = 0;
-    while (i != argsLength && iswspace(args[i])) {
-        i++;
+    DocPieceIterator pieces;
+    InitDocSnapshotPieceIterator(job->snapshot, &pieces);
+    LARGE_INTEGER fileSize;
+    bool writeSuccess = WriteDocText(job, file, &pieces, NextDocPiece(&pieces))
+        && (disposition != OPEN_EXISTING || SetEndOfFile(file))
+        && SyncFile(file)
+        && GetFileSizeEx(file, &fileSize);
+    if (!writeSuccess) {
+        CloseHandle(file);
+        if (moveAside) {
+            RestoreAside(mapped, path);
+        }
+        return RESULT_FILE_ERROR;
     }
-    if (i == argsLength) {
-        SetStatusInvalidCommand(statusArgsInvalid);
-        return;
+
+    job->timestamp = GetFileTimestamp(file);
+    job->byteCount = fileSize.QuadPart;
+    CloseHandle(file);
+    return RESULT_OK;
+}
+
+static DWORD WINAPI SaveThreadProc(void * parameter) {
+    SaveJob * job = static_cast<SaveJob *>(parameter);
+    if (!WriteDocTail(job, &job->result)) {
+        if (config.atomicSave) {
+            job->result = WriteDocAtomic(job);
+        } else {
+            job->result = WriteDocInPlace(job);
+        }
     }
+    PostMessageW(mainWindow, WM_DOCSAVE, 0, 0);
+    return 0;
+}
 
-    if (args[i] == L'!') {
-        i++;
-    } else if (currentDoc->modified) {
-        SetStatusInvalidCommand(statusCurDocUnsaved);
-        return;
+// Starts saving a document in the background. Without a new path, it is saved to its title.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED - file could not be loaded completely
+// - RESULT_FILE_ERROR - file could not be read completely
+ResultCode StartDocSave(Doc * doc, const wchar_t * newPath, bool overwrite) {
+    ResultCode loadResult = FinishDocLoad(doc);
+    if (loadResult != RESULT_OK) {
+        return loadResult;
     }
 
-    while (i != argsLength && iswspace(args[i])) {
-        i++;
+    SaveJob * job = static_cast<SaveJob *>(malloc(sizeof(SaveJob)));
+    if (!job) {
+        return RESULT_MEMORY_ERROR;
     }
-    if (i == argsLength) {
-        SetStatusInvalidCommand(statusArgsInvalid);
-        return;
+    ResultCode snapshotResult = CreateDocSnapshot(doc, &job->snapshot);
+    if (snapshotResult != RESULT_OK) {
+        free(job);
+        return snapshotResult;
     }
 
-    ushort j;
-    if (args[i] == L'\"') {
-        i++;
-        j = i;
-        while (j != argsLength && args[j] != L'\"') {
-            j++;
-        }
-        if (j == argsLength) {
-            SetStatusInvalidCommand(statusArgsInvalid);
-            return;
+    job->doc = doc;
+    job->mapped = GetMappedFile(doc);
+    job->savedSnapshot = doc->savedSnapshot;
+    job->newPath = newPath != nullptr;
+    job->crlf = doc->crlf;
+    job->timestamp = doc->timestamp;
+    job->byteCount = doc->savedByteCount;
+    job->savedLength = 0;
+    job->result = RESULT_OK;
+    if (newPath) {
+        wcscpy_s(job->path, MAX_PATH_COUNT, newPath);
+        if (overwrite) {
+            job->disposition = CREATE_ALWAYS;
+        } else {
+            job->disposition = CREATE_NEW;
         }
     } else {
-        j = i;
-        while (j != argsLength && !iswspace(args[j])) {
-            j++;
+        wcscpy_s(job->path, MAX_PATH_COUNT, doc->title);
+        if (overwrite) {
+            job->disposition = CREATE_ALWAYS;
+        } else if (doc->timestamp == 0) {
+            job->disposition = CREATE_NEW;
+        } else {
+            job->disposition = OPEN_EXISTING;
         }
     }
 
-    for (ushort k = j; k != argsLength; k++) {
-        if (!iswspace(args[k])) {
-            SetStatusInvalidCommand(statusArgsInvalid);
-            return;
+    job->thread = CreateThread(nullptr, 0, SaveThreadProc, job, 0, nullptr);
+    if (!job->thread) {
+        DestroyDocSnapshot(job->snapshot);
+        free(job);
+        return RESULT_MEMORY_ERROR;
+    }
+    saveJob = job;
+    SetTimer(mainWindow, SAVE_TIMER_ID, SAVE_TIMER_INTERVAL, nullptr);
+    return RESULT_OK;
+}
+
+// Waits for the running save and takes over its outcome. The document counts as modified unless it
+// still holds the text that was saved. The snapshot saved is kept to compare the next save with,
+// while a failed save may have left the file in any state.
+// Returns:
+// - RESULT_OK
+// - RESULT_FILE_LOCKED - existing file is locked by another process
+// - RESULT_FILE_EXISTS - file with same name already exists or was modified externally
+// - RESULT_FILE_ERROR
+// - RESULT_FILE_NOT_FOUND - file was removed
+static ResultCode FinishDocSave(bool * newPath) {
+    SaveJob * job = saveJob;
+    WaitForSingleObject(job->thread, INFINITE);
+    CloseHandle(job->thread);
+    KillTimer(mainWindow, SAVE_TIMER_ID);
+
+    ResultCode result = job->result;
+    Doc * doc = job->doc;
+    DestroyDocSnapshot(doc->savedSnapshot);
+    if (result == RESULT_OK) {
+        doc->timestamp = job->timestamp;
+        doc->modified = !IsDocSnapshotCurrent(job->snapshot);
+        if (job->newPath) {
+            wcscpy_s(doc->title, MAX_PATH_COUNT, job->path);
         }
+        doc->savedSnapshot = job->snapshot;
+        doc->savedByteCount = job->byteCount;
+    } else {
+        DestroyDocSnapshot(job->snapshot);
+        doc->savedSnapshot = nullptr;
     }
+    *newPath = job->newPath;
+    free(job);
+    saveJob = nullptr;
+    return result;
+}
 
-    //-------------
-    // Load File
+// Returns whether a document is being saved, and how far along it is.
+static bool GetDocSavePercent(Doc * doc, size_t * percent) {
+    if (!saveJob || saveJob->doc != doc) {
+        return false;
+    }
+    size_t charCount = saveJob->snapshot->charCount;
+    *percent = charCount != 0 ? static_cast<size_t>(100 * static_cast<double>(saveJob->savedLength) / charCount) : 0;
+    return true;
+}
 
-    if (j - i > MAX_PATH_COUNT) {
-        SetStatusInvalidCommand(statusPathTooLong);
-        return;
+// Decodes the bytes of a file into a new document, reading them where they are, so no copy of
+// them is held alongside the decoded text. A file using CR LF for every line break is stripped of
+// the CRs.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+static ResultCode LoadDecodedFile(const char * bytes, size_t byteCount, bool crlf, Doc ** doc) {
+    // Decoding never yields more UTF-16 units than there are UTF-8 bytes, so the file size is
+    // enough for the whole original buffer.
+    wchar_t * chars = static_cast<wchar_t *>(malloc((byteCount + 1) * sizeof(wchar_t)));
+    if (!chars) {
+        return RESULT_MEMORY_ERROR;
     }
-    wchar_t path[MAX_PATH_COUNT];
-    wcsncpy_s(path, MAX_PATH_COUNT, args + i, j - i);
+    size_t length = TranscodeUtf8ToUtf16(bytes, byteCount, chars);
 
-    Doc * fileDoc;
-    ResultCode resultCode = LoadFile(path, &fileDoc);
-    switch (resultCode) {
-        case RESULT_LIMIT_REACHED:
-        {
-            SetStatusInvalidCommand(statusFileTooLarge);
-            break;
-        }
+    if (crlf) {
+        length = StripDecodedCarriageReturns(chars, length);
+    }
 
-        case RESULT_FILE_LOCKED:
-        {
-            SetStatusInvalidCommand(statusFileLocked);
-            break;
+    // Multi-byte sequences and CRs leave the buffer larger than needed. Its unused tail is released,
+    // as the buffer stays as long as the document.
+    if (length != 0 && length < byteCount + 1) {
+        wchar_t * exactChars = static_cast<wchar_t *>(realloc(chars, length * sizeof(wchar_t)));
+        if (exactChars) {
+            chars = exactChars;
         }
+    }
 
-        case RESULT_FILE_NOT_FOUND:
-        {
-            Doc * newDoc = CreateEmptyDoc();
-            if (!newDoc) {
-                SetStatusInvalidCommand(statusOutOfMemory);
-                break;
-            }
-            DestroyDoc(currentDoc);
-            currentDoc = newDoc;
-            wcscpy_s(currentDoc->title, MAX_PATH_COUNT, path);
-
-            currentMode = MODE_NORMAL;
-            paintContentCursor = true;
-            paintStatusCursor = false;
-            statusPrompt = false;
-            SetStatusLineNormal();
-            break;
-        }
+    return CreateDocFromBuffer(chars, length, doc);
+}
 
-        case RESULT_FILE_ERROR:
-        {
-            SetStatusInvalidCommand(statusFileError);
-            break;
-        }
+static HANDLE OpenLoadFile(const wchar_t * path, DWORD access, DWORD shareMode) {
+    return CreateFileW(
+        path,
+        access,
+        shareMode,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr);
+}
 
-        case RESULT_MEMORY_ERROR:
-        {
-            SetStatusInvalidCommand(statusOutOfMemory);
-            break;
-        }
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED
+// - RESULT_FILE_ERROR
+// - RESULT_FILE_LOCKED
+// - RESULT_FILE_NOT_FOUND
+ResultCode LoadFile(const wchar_t * path, Doc ** doc) {
+    // Writing is not shared, so the text cannot change while it is read. A file large enough to be
+    // loaded lazily, going by its size beforehand, is opened for appending as well if allowed. A
+    // file another program has open for writing already, like a log, is loaded from a copy, which
+    // leaves that program undisturbed.
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    bool appendable = GetFileAttributesExW(path, GetFileExInfoStandard, &attributes)
+        && (attributes.nFileSizeHigh != 0 || attributes.nFileSizeLow >= LAZYLOAD_MIN_COUNT);
+    HANDLE file = OpenLoadFile(path, appendable ? GENERIC_READ | FILE_APPEND_DATA : GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE);
+    if (file == INVALID_HANDLE_VALUE && appendable && GetLastError() == ERROR_ACCESS_DENIED) {
+        appendable = false;
+        file = OpenLoadFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE);
+    }
+    bool shared = false;
+    if (file == INVALID_HANDLE_VALUE && GetLastError() == ERROR_SHARING_VIOLATION) {
+        appendable = false;
+        shared = true;
+        file = OpenLoadFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE);
+    }
+    if (file == INVALID_HANDLE_VALUE) {
+        ulong error = GetLastError();
+        switch (error) {
+            case ERROR_SHARING_VIOLATION:
+                return RESULT_FILE_LOCKED;
 
-        default:
-        {
-            DestroyDoc(currentDoc);
-            currentDoc = fileDoc;
+            case ERROR_FILE_NOT_FOUND:
+                return RESULT_FILE_NOT_FOUND;
 
-            currentMode = MODE_NORMAL;
-            paintContentCursor = true;
-            paintStatusCursor = false;
-            statusPrompt = false;
-            SetStatusLineNormal();
-            break;
+            default:
+                return RESULT_FILE_ERROR;
         }
     }
-}
-
-void ExecuteCommandWrite(const wchar_t * args, ushort argsLength) {
-    const wchar_t statusNoName[] = L"No file name!";
-    const wchar_t statusFileLocked[] = L"File locked!";
-    const wchar_t statusFileModified[] = L"File was modified by another program!";
-    const wchar_t statusFileRemoved[] = L"File was deleted!";
-    const wchar_t statusFileWriteError[] = L"Could not write file.";
-    const wchar_t statusArgsInvalid[] = L"Command args invalid!";
-    const wchar_t statusPathTooLong[] = L"Path too long!";
-    const wchar_t statusFileExists[] = L"File already exists!";
 
-    ushort i = 0;
-
-    while (i != argsLength && iswspace(args[i])) {
-        i++;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        return RESULT_FILE_ERROR;
     }
-    
-    bool overwrite;
-    if (i != argsLength && args[i] == L'!') {
-        overwrite = true;
-        i++;
-    } else {
-        overwrite = false;
+    if (static_cast<ULONGLONG>(fileSize.QuadPart) >= SIZE_MAX / sizeof(wchar_t)) {
+        CloseHandle(file);
+        return RESULT_LIMIT_REACHED;
     }
 
-    while (i != argsLength && iswspace(args[i])) {
-        i++;
+    // The file is mapped and scanned in place. Valid UTF-8 is copied as it is into a buffer of
+    // exactly its size, anything else is decoded, which replaces malformed sequences. A byte order
+    // mark is dropped either way. Large files are loaded lazily instead. If others write to one,
+    // only the byte order mark is copied here, and the rest once the chunks are claimed.
+    size_t byteCount = static_cast<size_t>(fileSize.QuadPart);
+    bool lazy = byteCount >= LAZYLOAD_MIN_COUNT;
+    HANDLE mapping = nullptr;
+    HANDLE copyFile = nullptr;
+    const char * view = "";
+    if (shared && lazy) {
+        char * copy = MapTempFile(byteCount, false, &copyFile);
+        ulong readCount;
+        if (!copy || !ReadFile(file, copy, 3, &readCount, nullptr)) {
+            if (copy) {
+                UnmapViewOfFile(copy);
+                CloseHandle(copyFile);
+            }
+            CloseHandle(file);
+            return RESULT_FILE_ERROR;
+        }
+        view = copy;
+    } else if (byteCount != 0) { // empty files cannot be mapped
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            CloseHandle(file);
+            return RESULT_FILE_ERROR;
+        }
+        view = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!view) {
+            CloseHandle(mapping);
+            CloseHandle(file);
+            return RESULT_FILE_ERROR;
+        }
     }
 
-    if (i == argsLength) {
-        if (currentDoc->title[0] == L'\0') {
-            SetStatusInvalidCommand(statusNoName);
-            return;
-        } else {
-            ResultCode resultCode = WriteDoc(currentDoc, nullptr, overwrite);
-            switch (resultCode) {
-                case RESULT_FILE_LOCKED:
-                {
-                    SetStatusInvalidCommand(statusFileLocked);
-                    return;
-                }
-
-                case RESULT_FILE_EXISTS:
-                {
-                    SetStatusInvalidCommand(statusFileModified);
-                    return;
-                }
-
-                case RESULT_FILE_NOT_FOUND:
-                {
-                    SetStatusInvalidCommand(statusFileRemoved);
-                    return;
-                }
+    const char * text = view;
+    size_t textCount = byteCount;
+    SkipByteOrderMark(&text, &textCount);
+    if (copyFile) {
+        LARGE_INTEGER textStart;
+        textStart.QuadPart = text - view;
+        SetFilePointerEx(file, textStart, nullptr, FILE_BEGIN);
+    }
 
-                case RESULT_FILE_ERROR:
-                {
-                    SetStatusInvalidCommand(statusFileWriteError);
-                    return;
-                }
-            }
+    FILETIME fileTimestamp;
+    GetFileTime(file, nullptr, nullptr, &fileTimestamp);
+    ULARGE_INTEGER timestamp;
+    timestamp.LowPart = fileTimestamp.dwLowDateTime;
+    timestamp.HighPart = fileTimestamp.dwHighDateTime;
 
-            currentDoc->modified = false;
+    ResultCode createResult;
+    bool textKept = false;
+    if (lazy) {
+        if (copyFile) {
+            createResult = LoadMappedFile(copyFile, file, false, view, text, textCount, doc);
+        } else {
+            CloseHandle(mapping); // the view keeps it alive
+            createResult = LoadMappedFile(file, nullptr, appendable, view, text, textCount, doc);
+        }
+        if (createResult != RESULT_OK) {
+            return createResult;
         }
     } else {
-        ushort j;
-        if (args[i] == L'\"') {
-            i++;
-            j = i;
-            while (j != argsLength && args[j] != L'\"') {
-                j++;
-            }
-            if (j == argsLength) {
-                SetStatusInvalidCommand(statusArgsInvalid);
-                return;
-            }
-        } else {
-            j = i;
-            while (j != argsLength && !iswspace(args[j])) {
-                j++;
+        // A file others write to is copied out first, so the text checked is the text kept.
+        char * copy = nullptr;
+        if (shared && textCount != 0) {
+            copy = static_cast<char *>(malloc(textCount));
+            if (!copy) {
+                UnmapViewOfFile(view);
+                CloseHandle(mapping);
+                CloseHandle(file);
+                return RESULT_MEMORY_ERROR;
             }
+            memcpy(copy, text, textCount);
+            text = copy;
         }
 
-        for (ushort k = j; k != argsLength; k++) {
-            if (!iswspace(args[k])) {
-                SetStatusInvalidCommand(statusArgsInvalid);
-                return;
+        // Line breaks are stored as LF alone. A file using CR LF for every one of them is stripped
+        // of the CRs and gets them back when saved. A file mixing both keeps its bytes as they are.
+        bool crlf = false;
+        if (IsDocUtf8(text, textCount)) {
+            char * bytes = static_cast<char *>(malloc(textCount + 1));
+            if (bytes) {
+                bool bareLineFeeds;
+                size_t count = StripCarriageReturns(text, textCount, bytes, &bareLineFeeds);
+                crlf = count != textCount && !bareLineFeeds;
+                if (count != textCount && !crlf) {
+                    memcpy(bytes, text, textCount);
+                    count = textCount;
+                } else if (count != textCount) {
+                    char * exactBytes = static_cast<char *>(realloc(bytes, count + 1));
+                    if (exactBytes) {
+                        bytes = exactBytes;
+                    }
+                }
+                createResult = CreateDocFromUtf8(bytes, count, doc);
+                textKept = text == view;
+            } else {
+                createResult = RESULT_MEMORY_ERROR;
             }
+        } else {
+            crlf = HasOnlyCrlf(text, textCount);
+            createResult = LoadDecodedFile(text, textCount, crlf, doc);
         }
+        free(copy);
 
-        if (j - i > MAX_PATH_COUNT) {
-            SetStatusInvalidCommand(statusPathTooLong);
-            return;
+        if (mapping) {
+            UnmapViewOfFile(view);
+            CloseHandle(mapping);
         }
-        wchar_t path[MAX_PATH_COUNT];
-        wcsncpy_s(path, MAX_PATH_COUNT, args + i, j - i);
+        CloseHandle(file);
+        if (createResult != RESULT_OK) {
+            return createResult;
+        }
+        (*doc)->crlf = crlf;
+    }
 
-        ResultCode resultCode = WriteDoc(currentDoc, path, overwrite);
-        switch (resultCode) {
-            case RESULT_FILE_LOCKED:
-            {
-                SetStatusInvalidCommand(statusFileLocked);
-                return;
-            }
+    // UTF-8 without a byte order mark is what saving writes, so the file holds the text as loaded.
+    // Lazily loaded files are compared with their mapped view instead, unless their CRs were
+    // dropped. Without a snapshot, the next save writes everything.
+    if (textKept && CreateDocSnapshot(*doc, &(*doc)->savedSnapshot) == RESULT_OK) {
+        (*doc)->savedByteCount = byteCount;
+    }
+    (*doc)->cursorLineIndex = 0;
+    (*doc)->cursorCharIndex = 0;
+    (*doc)->timestamp = timestamp.QuadPart;
+    wcscpy_s((*doc)->title, MAX_PATH_COUNT, path);
+    return RESULT_OK;
+}
 
-            case RESULT_FILE_EXISTS:
-            {
-                SetStatusInvalidCommand(statusFileExists);
-                return;
-            }
+//--------------
+// Search Index
+
+// Each new search is indexed in the background: worker threads find the matches in their own parts
+// of a snapshot of the document and hand them to the window thread, which joins them into one
+// sorted array of positions. It tells which match the cursor is at and how many there are, and n
+// and N jump through it instead of scanning the text. Edits are followed through the change log of
+// the document: matches touched by a change are dropped, those behind it are moved along, and only
+// the text around the change is scanned again. The index is built anew once more changes were
+// made than the log holds. A done index keeps a snapshot of the text it is up to date with, so it
+// is only synced once the document was changed.
+
+#define WM_SEARCHINDEX (WM_APP + 3)
+#define SEARCHINDEX_BATCH_COUNT 256
+#define SEARCHINDEX_MIN_PART_CANDIDATE_COUNT 65536
+
+struct SearchIndex;
+
+// A part of the text searched by a worker thread, or of the candidates it checks.
+struct SearchIndexPart {
+    SearchIndex * index;
+    size_t start;
+    size_t end;
+    MkDynArray<size_t> positions;
+    ResultCode result;
+};
 
-            case RESULT_FILE_NOT_FOUND:
-            {
-                SetStatusInvalidCommand(statusFileRemoved);
-                return;
-            }
+// A range of the text to be searched again.
+struct SearchIndexRange {
+    size_t start;
+    size_t end;
+};
 
-            case RESULT_FILE_ERROR:
-            {
-                SetStatusInvalidCommand(statusFileWriteError);
-                return;
+// A stretch of the positions as of the last sync, up to the start of the next one, and how the
+// changes since then moved it along or whether they dropped it.
+struct SearchIndexShift {
+    size_t start;
+    size_t shift; // added to the positions, wrapping around to move them back
+    bool dropped;
+};
+
+struct SearchIndex {
+    DocSearch search;
+    Doc * doc;
+    uint id;
+    volatile bool cancelled;
+    DocSnapshot * snapshot; // of the text searched, then of the text the positions are up to date with
+
+    // while the worker threads run
+    MkDynArray<size_t> candidates; // matches of the start of the search, to check instead of the text
+    bool filtering;
+    SearchIndexPart parts[LAZYLOAD_MAX_THREAD_COUNT];
+    HANDLE threads[LAZYLOAD_MAX_THREAD_COUNT];
+    uint threadCount;
+    uint finishedCount;
+
+    // once they are done
+    MkDynArray<size_t> positions; // of the matches, in order
+    size_t changeCount; // of the document, as far as the positions follow them
+    bool ready;
+};
+
+static SearchIndex * searchIndex = nullptr;
+static uint lastSearchIndexId = 0;
+static bool searchIndexFailed = false; // once the last index was dropped for a failure, until another one starts
+
+static DWORD WINAPI SearchIndexThreadProc(void * parameter) {
+    SearchIndexPart * part = static_cast<SearchIndexPart *>(parameter);
+    SearchIndex * index = part->index;
+    size_t found[SEARCHINDEX_BATCH_COUNT];
+    size_t pos = part->start;
+    while (pos < part->end && !index->cancelled) {
+        if (index->filtering) {
+            size_t end = part->end - pos > SEARCHINDEX_BATCH_COUNT ? pos + SEARCHINDEX_BATCH_COUNT : part->end;
+            size_t count = FilterDocSnapshotText(index->snapshot, &index->search, index->candidates.elems + pos, end - pos, found);
+            if (count != 0) {
+                size_t * positions = part->positions.Insert(SIZE_MAX, count);
+                if (!positions) {
+                    part->result = RESULT_MEMORY_ERROR;
+                    break;
+                }
+                memcpy(positions, found, count * sizeof(size_t));
             }
+            pos = end;
+            continue;
         }
 
-        currentDoc->modified = false;
-        wcscpy_s(currentDoc->title, MAX_PATH_COUNT, path);
+        // The part is searched a block at a time, so cancelling does not wait for all of it.
+        size_t end;
+        if (part->end - pos > DOCSEARCH_BLOCK_LENGTH) {
+            end = pos + DOCSEARCH_BLOCK_LENGTH;
+        } else {
+            end = part->end;
+        }
+        size_t count = FindDocSnapshotText(index->snapshot, &index->search, pos, end, found, SEARCHINDEX_BATCH_COUNT);
+        if (count != 0) {
+            size_t * positions = part->positions.Insert(SIZE_MAX, count);
+            if (!positions) {
+                part->result = RESULT_MEMORY_ERROR;
+                break;
+            }
+            memcpy(positions, found, count * sizeof(size_t));
+        }
+        if (count == SEARCHINDEX_BATCH_COUNT) {
+            pos = found[count - 1] + 1;
+        } else {
+            pos = end;
+        }
     }
-
-    currentMode = MODE_NORMAL;
-    paintContentCursor = true;
-    paintStatusCursor = false;
-    statusPrompt = false;
-    SetStatusLineNormal();
+    PostMessageW(mainWindow, WM_SEARCHINDEX, index->id, 0);
+    return 0;
 }
 
-void ExecuteCommandNew(const wchar_t * args, ushort argsLength) {
-    ushort i = 0;
-    while (i != argsLength && iswspace(args[i])) {
-        i++;
+static void DestroySearchIndex() {
+    SearchIndex * index = searchIndex;
+    if (!index) {
+        return;
     }
-
-    if (i != argsLength && args[i] == L'!') {
-        i++;
-    } else if (currentDoc->modified) {
-        SetStatusInvalidCommand(L"Current document has unsaved changes!");
-        return;
-    }
-
-    for (ushort j = i; j != argsLength; j++) {
-        if (!iswspace(args[j])) {
-            SetStatusInvalidCommand(L"Invalid command args!");
-            return;
+    if (!index->ready) {
+        index->cancelled = true;
+        if (index->threadCount != 0) {
+            WaitForMultipleObjects(index->threadCount, index->threads, true, INFINITE);
         }
+        for (uint i = 0; i != index->threadCount; i++) {
+            CloseHandle(index->threads[i]);
+            index->parts[i].positions.Clear();
+        }
+        index->candidates.Clear();
     }
-
-    DestroyDoc(currentDoc);
-    currentDoc = CreateEmptyDoc();
-
-    currentMode = MODE_NORMAL;
-    paintContentCursor = true;
-    paintStatusCursor = false;
-    statusPrompt = false;
-    SetStatusLineNormal();
+    DestroyDocSnapshot(index->snapshot);
+    index->positions.Clear();
+    free(index);
+    searchIndex = nullptr;
+    searchIndexFailed = false;
 }
 
-static bool WcIsAsciiAlpha(wchar_t c) {
-    return (c >= L'A' && c <= L'Z') || (c >= L'a' && c <= L'z');
-}
+static bool SyncSearchIndex(Doc * doc);
 
-static bool WcIsCName(wchar_t c) {
-    return WcIsAsciiAlpha(c) || iswdigit(c) || c == L'_';
+// Starts indexing the matches of a search in a document, in place of the last index. An index of
+// the same text is kept, whether done or not. If the last index is done and searched for the start
+// of the text, as while the text is typed, only its matches are checked instead of the whole text.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+static ResultCode StartSearchIndex(Doc * doc, const DocSearch * search) {
+    SearchIndex * lastIndex = searchIndex;
+    MkDynArray<size_t> candidates;
+    candidates.Init(1024);
+    bool filtering = false;
+    if (lastIndex
+        && lastIndex->doc == doc
+        && lastIndex->search.length <= search->length
+        && memcmp(lastIndex->search.text, search->text, lastIndex->search.length * sizeof(wchar_t)) == 0)
+    {
+        if (lastIndex->search.length == search->length) {
+            return RESULT_OK;
+        }
+        if (SyncSearchIndex(doc) && searchIndex == lastIndex) {
+            candidates = lastIndex->positions;
+            lastIndex->positions.Init(1024);
+            filtering = true;
+        }
+    }
+
+    DestroySearchIndex();
+    SearchIndex * index = static_cast<SearchIndex *>(malloc(sizeof(SearchIndex)));
+    if (!index) {
+        candidates.Clear();
+        searchIndexFailed = true;
+        return RESULT_MEMORY_ERROR;
+    }
+    ResultCode result = CreateDocSnapshot(doc, &index->snapshot);
+    if (result != RESULT_OK) {
+        candidates.Clear();
+        free(index);
+        searchIndexFailed = true;
+        return result;
+    }
+    index->search = *search;
+    index->doc = doc;
+    index->id = ++lastSearchIndexId;
+    index->cancelled = false;
+    index->candidates = candidates;
+    index->filtering = filtering;
+    index->threadCount = 0;
+    index->finishedCount = 0;
+    index->positions.Init(1024);
+    index->changeCount = doc->changeCount;
+    index->ready = false;
+    searchIndex = index;
+
+    // Each thread gets a block of text or a batch of candidates at least, so small documents and
+    // few candidates use fewer of them.
+    size_t totalLength = filtering ? candidates.count : doc->charCount;
+    size_t minPartLength = filtering ? SEARCHINDEX_MIN_PART_CANDIDATE_COUNT : DOCSEARCH_BLOCK_LENGTH;
+    uint threadCount = GetThreadCount(config.searchThreadCount);
+    if (totalLength / minPartLength < threadCount) {
+        threadCount = static_cast<uint>(totalLength / minPartLength) + 1;
+    }
+    size_t partLength = totalLength / threadCount;
+    for (uint i = 0; i != threadCount; i++) {
+        SearchIndexPart * part = &index->parts[i];
+        part->index = index;
+        part->start = i * partLength;
+        if (i + 1 == threadCount) {
+            part->end = totalLength;
+        } else {
+            part->end = part->start + partLength;
+        }
+        part->positions.Init(1024);
+        part->result = RESULT_OK;
+
+        HANDLE thread = CreateThread(nullptr, 0, SearchIndexThreadProc, part, 0, nullptr);
+        if (!thread) {
+            DestroySearchIndex();
+            searchIndexFailed = true;
+            return RESULT_MEMORY_ERROR;
+        }
+        index->threads[index->threadCount++] = thread;
+    }
+    return RESULT_OK;
 }
 
-void ExecuteCommand(const wchar_t * commandLine, ushort commandLength) {
-    ushort i = 0;
-    while (i != commandLength && iswspace(commandLine[i])) {
-        i++;
+// Takes note of a worker thread being done and joins the parts once all of them are. A failure
+// drops the index.
+static void ReceiveSearchIndexPart(uint id) {
+    SearchIndex * index = searchIndex;
+    if (!index || index->ready || index->id != id) {
+        return;
     }
-    if (i == commandLength) {
+    index->finishedCount++;
+    if (index->finishedCount != index->threadCount) {
         return;
     }
-    
-    if (!(WcIsAsciiAlpha(commandLine[i]) || commandLine[i] == L'_')) {
-        SetStatusInvalidCommand(L"Invalid command!");
+
+    WaitForMultipleObjects(index->threadCount, index->threads, true, INFINITE);
+    bool failed = false;
+    for (uint i = 0; i != index->threadCount; i++) {
+        SearchIndexPart * part = &index->parts[i];
+        CloseHandle(index->threads[i]);
+        if (part->result != RESULT_OK) {
+            failed = true;
+        } else if (!failed && part->positions.count != 0) {
+            size_t * positions = index->positions.Insert(SIZE_MAX, part->positions.count);
+            if (positions) {
+                memcpy(positions, part->positions.elems, part->positions.count * sizeof(size_t));
+            } else {
+                failed = true;
+            }
+        }
+        part->positions.Clear();
     }
-    ushort j = i;
-    do {
-        j++;
-    } while (j != commandLength && WcIsCName(commandLine[j]));
-    ushort initLength = j - i;
+    index->candidates.Clear();
+    index->ready = true;
+    if (failed) {
+        DestroySearchIndex();
+        searchIndexFailed = true;
+    }
+}
 
-    const wchar_t editCommand[] = L"edit";
-    const wchar_t writeCommand[] = L"write";
-    const wchar_t newCommand[] = L"enew";
+// Returns the index of the first match starting at a position or behind it.
+static size_t FindSearchIndexPos(SearchIndex * index, size_t pos) {
+    size_t first = 0;
+    size_t last = index->positions.count;
+    while (first != last) {
+        size_t middle = first + (last - first) / 2;
+        if (index->positions.elems[middle] < pos) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+    return first;
+}
 
-    if (wcsncmp(commandLine + i, editCommand, initLength) == 0 && initLength == wcslen(editCommand)) {
-        ExecuteCommandEdit(commandLine + j, commandLength - j);
-    } else if (wcsncmp(commandLine + i, writeCommand, initLength) == 0 && initLength == wcslen(writeCommand)) {
-        ExecuteCommandWrite(commandLine + j, commandLength - j);
-    } else if (wcsncmp(commandLine + i, newCommand, initLength) == 0 && initLength == wcslen(newCommand)) {
-        ExecuteCommandNew(commandLine + j, commandLength - j);
-    } else {
-        SetStatusInvalidCommand(L"Unknown command!");
+// Returns where a position is moved by a change. Positions within the removed text end up at the
+// start of the change.
+static size_t MoveSearchIndexPos(size_t pos, const DocChange * change) {
+    if (pos >= change->pos + change->removedLength) {
+        return pos - change->removedLength + change->insertedLength;
     }
+    if (pos > change->pos) {
+        return change->pos;
+    }
+    return pos;
 }
 
-void ProcessCommandCharInput(wchar_t c) {
-    switch (c) {
-        case 0x1b: // Esc
+// Splits the stretch of positions a position falls into once moved along by the changes so far, so
+// the part from there on can be dropped or moved along on its own.
+static void SplitSearchIndexShift(SearchIndexShift * shifts, uint * shiftCount, size_t pos) {
+    for (uint i = 0; i != *shiftCount; i++) {
+        SearchIndexShift * shift = &shifts[i];
+        if (shift->dropped
+            || pos <= shift->start + shift->shift
+            || (i + 1 != *shiftCount && pos >= shifts[i + 1].start + shift->shift))
         {
-            currentMode = MODE_NORMAL;
-            paintContentCursor = true;
-            paintStatusCursor = false;
-            SetStatusLineNormal();
-            break;
+            continue;
         }
+        memmove(shifts + i + 2, shifts + i + 1, (*shiftCount - i - 1) * sizeof(SearchIndexShift));
+        shifts[i + 1].start = pos - shift->shift;
+        shifts[i + 1].shift = shift->shift;
+        shifts[i + 1].dropped = false;
+        (*shiftCount)++;
+        return;
+    }
+}
 
-        case L'\b':
-        {
-            if (statusCursorChar == 1) {
-                if (statusLength == 1) {
-                    currentMode = MODE_NORMAL;
-                    paintContentCursor = true;
-                    paintStatusCursor = false;
-                    SetStatusLineNormal();
-                }
-            } else {
-                statusCursorChar--;
-                ushort shiftEnd = statusLength - 1;
-                for (ushort i = statusCursorChar; i != shiftEnd; i++) {
-                    statusLine[i] = statusLine[i + 1];
-                }
-                statusLength--;
+// Brings the index of a document up to date with the changes made since it was last synced, unless
+// the document is still the same. This writes back the insert gap buffer. A failure drops the index.
+// Returns whether the index can be used.
+static bool SyncSearchIndex(Doc * doc) {
+    SearchIndex * index = searchIndex;
+    if (!index || !index->ready || index->doc != doc) {
+        return false;
+    }
+    if (IsDocSnapshotCurrent(index->snapshot)) {
+        return true;
+    }
+
+    // Taking a snapshot writes back the insert gap buffer, so its edits are in the log as well.
+    DocSnapshot * snapshot;
+    if (CreateDocSnapshot(doc, &snapshot) != RESULT_OK) {
+        DestroySearchIndex();
+        searchIndexFailed = true;
+        return false;
+    }
+    size_t changeCount = doc->changeCount - index->changeCount;
+    if (changeCount == 0) {
+        DestroyDocSnapshot(index->snapshot);
+        index->snapshot = snapshot;
+        return true;
+    }
+    if (changeCount > DOCCHANGE_LOG_COUNT) {
+        DestroyDocSnapshot(snapshot);
+        DocSearch search = index->search;
+        DestroySearchIndex();
+        StartSearchIndex(doc, &search); // a failure is shown on the status line
+        return false;
+    }
+
+    // The changes are first only noted: which stretches of the positions they drop and how far
+    // they move the others along. A match touching a change may start up to the search length
+    // minus one before it.
+    SearchIndexShift shifts[1 + 2 * DOCCHANGE_LOG_COUNT];
+    uint shiftCount = 1;
+    shifts[0].start = 0;
+    shifts[0].shift = 0;
+    shifts[0].dropped = false;
+    SearchIndexRange ranges[DOCCHANGE_LOG_COUNT];
+    uint rangeCount = 0;
+    size_t reach = index->search.length - 1;
+    for (size_t i = index->changeCount; i != doc->changeCount; i++) {
+        const DocChange * change = &doc->changeLog[i % DOCCHANGE_LOG_COUNT];
+        size_t first;
+        if (change->pos > reach) {
+            first = change->pos - reach;
+        } else {
+            first = 0;
+        }
+        size_t last = change->pos + change->removedLength;
+
+        SplitSearchIndexShift(shifts, &shiftCount, first);
+        SplitSearchIndexShift(shifts, &shiftCount, last);
+        for (uint j = 0; j != shiftCount; j++) {
+            SearchIndexShift * shift = &shifts[j];
+            if (shift->dropped) {
+                continue;
+            }
+            size_t start = shift->start + shift->shift;
+            if (start >= last) {
+                shift->shift += change->insertedLength - change->removedLength;
+            } else if (start >= first) {
+                shift->dropped = true;
             }
-            break;
         }
 
-        case L'\r':
-        {
-            ExecuteCommand(statusLine + 1, statusLength - 1);
-            break;
+        for (uint j = 0; j != rangeCount; j++) {
+            ranges[j].start = MoveSearchIndexPos(ranges[j].start, change);
+            ranges[j].end = MoveSearchIndexPos(ranges[j].end, change);
         }
+        ranges[rangeCount].start = first;
+        ranges[rangeCount].end = change->pos + change->insertedLength;
+        rangeCount++;
+    }
 
-        default:
-        {
-            if (iswcntrl(c)) {
-                break;
+    // The ranges are sorted and joined where they overlap, then searched again.
+    for (uint i = 1; i < rangeCount; i++) {
+        SearchIndexRange range = ranges[i];
+        uint j = i;
+        while (j != 0 && ranges[j - 1].start > range.start) {
+            ranges[j] = ranges[j - 1];
+            j--;
+        }
+        ranges[j] = range;
+    }
+    MkDynArray<size_t> found;
+    found.Init(1024);
+    bool failed = false;
+    uint joinedCount = 0;
+    uint i = 0;
+    while (i != rangeCount && !failed) {
+        size_t start = ranges[i].start;
+        size_t end = ranges[i].end;
+        for (i++; i != rangeCount && ranges[i].start <= end; i++) {
+            if (ranges[i].end > end) {
+                end = ranges[i].end;
             }
-
-            if (statusLength == MAX_STATUS_COUNT - 1) {
+        }
+        if (end > doc->charCount) {
+            end = doc->charCount;
+        }
+        ranges[joinedCount].start = start;
+        ranges[joinedCount].end = end;
+        joinedCount++;
+
+        size_t pos = start;
+        while (pos < end) {
+            size_t batch[SEARCHINDEX_BATCH_COUNT];
+            size_t count = FindDocSnapshotText(snapshot, &index->search, pos, end, batch, SEARCHINDEX_BATCH_COUNT);
+            if (count == 0) {
                 break;
             }
-            statusLength++;
-            for (ushort i = statusLength - 1; i != statusCursorChar; i--) {
-                statusLine[i] = statusLine[i - 1];
+            size_t * positions = found.Insert(SIZE_MAX, count);
+            if (!positions) {
+                failed = true;
+                break;
             }
-            statusLine[statusCursorChar++] = c;
-            break;
+            memcpy(positions, batch, count * sizeof(size_t));
+            pos = batch[count - 1] + 1;
         }
     }
-}
 
-HDC bitmapDeviceContext;
-long bitmapWidth;
-long bitmapHeight;
+    // Then the positions are moved along or dropped in one pass, along with those within the
+    // ranges, and the matches found there are merged in.
+    MkDynArray<size_t> positions;
+    positions.Init(1024);
+    size_t maxCount = index->positions.count + found.count;
+    if (!failed && maxCount != 0 && !positions.Insert(SIZE_MAX, maxCount)) {
+        failed = true;
+    }
+    if (failed) {
+        found.Clear();
+        DestroyDocSnapshot(snapshot);
+        DestroySearchIndex();
+        searchIndexFailed = true;
+        return false;
+    }
 
-long lineHeight;
-long avgCharWidth;
+    size_t count = 0;
+    size_t foundIndex = 0;
+    uint shiftIndex = 0;
+    uint rangeIndex = 0;
+    for (size_t j = 0; j != index->positions.count; j++) {
+        size_t pos = index->positions.elems[j];
+        while (shiftIndex + 1 != shiftCount && shifts[shiftIndex + 1].start <= pos) {
+            shiftIndex++;
+        }
+        if (shifts[shiftIndex].dropped) {
+            continue;
+        }
+        pos += shifts[shiftIndex].shift;
+        while (rangeIndex != joinedCount && ranges[rangeIndex].end <= pos) {
+            rangeIndex++;
+        }
+        if (rangeIndex != joinedCount && ranges[rangeIndex].start <= pos) {
+            continue;
+        }
+        while (foundIndex != found.count && found.elems[foundIndex] < pos) {
+            positions.elems[count++] = found.elems[foundIndex++];
+        }
+        positions.elems[count++] = pos;
+    }
+    while (foundIndex != found.count) {
+        positions.elems[count++] = found.elems[foundIndex++];
+    }
+    positions.Remove(count, maxCount - count);
+    found.Clear();
+
+    index->positions.Clear();
+    index->positions = positions;
+    index->changeCount = doc->changeCount;
+    DestroyDocSnapshot(index->snapshot);
+    index->snapshot = snapshot;
+    return true;
+}
 
-static void PaintCursorLine(const RECT * textRect, const wchar_t * text, ushort length, ushort charIndex) {
-    SIZE extent;
+// Returns whether the index is of a search.
+static bool IsSearchIndexOf(const DocSearch * search) {
+    return searchIndex
+        && searchIndex->search.length == search->length
+        && memcmp(searchIndex->search.text, search->text, search->length * sizeof(wchar_t)) == 0;
+}
 
-    RECT lineRect = *textRect;
+wchar_t * tabSpaces;
 
-    const wchar_t * currentText = text;
-    ushort currentLength = length;
-    size_t nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
-    ushort nextTabOffset = static_cast<ushort>(min(nextTabIndex, MAX_LINE_LENGTH));
-    long cursorOffset = charIndex;
-    while (nextTabOffset != MAX_LINE_LENGTH) {
-        if (cursorOffset < 0 || cursorOffset >= nextTabOffset) {
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                currentText,
-                nextTabOffset,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                const_cast<wchar_t *>(currentText),
-                nextTabOffset,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left >= lineRect.right) {
-                break;
-            }
+HBRUSH textBrush;
+HBRUSH backgroundBrush;
+HBRUSH cursorBrush;
+HBRUSH statusBackgroundBrush;
+HBRUSH docTitleBackgroundBrush;
+HBRUSH promptTextBrush;
+HBRUSH promptBackgroundBrush;
+HBRUSH matchBackgroundBrush;
 
-            if (cursorOffset == nextTabOffset) {
-                RECT cursorRect;
-                cursorRect.left = lineRect.left;
-                cursorRect.top = lineRect.top;
-                cursorRect.right = lineRect.left + avgCharWidth;
-                cursorRect.bottom = lineRect.top + lineHeight;
-                FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
-            }
+enum Mode {
+    MODE_NORMAL,
+    MODE_COMMAND,
+    MODE_INSERT,
+};
 
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                tabSpaces,
-                config.tabWidth,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                tabSpaces,
-                config.tabWidth,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left >= lineRect.right) {
-                break;
-            }
-        } else {
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                currentText,
-                cursorOffset,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                const_cast<wchar_t *>(currentText),
-                cursorOffset,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left >= lineRect.right) {
-                break;
-            }
+Mode currentMode = MODE_NORMAL;
 
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                &currentText[cursorOffset],
-                1,
-                &extent);
-            RECT cursorRect;
-            cursorRect.left = lineRect.left;
-            cursorRect.top = lineRect.top;
-            cursorRect.right = lineRect.left + extent.cx;
-            cursorRect.bottom = lineRect.top + lineHeight;
-            FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
+wchar_t workingFolderPath[MAX_PATH];
+Doc * currentDoc;
+bool paintContentCursor = true;
+bool paintStatusCursor = false;
 
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                currentText + cursorOffset,
-                nextTabOffset - cursorOffset,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                const_cast<wchar_t *>(currentText + cursorOffset),
-                nextTabOffset - cursorOffset,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left >= lineRect.right) {
+#define MAX_STATUS_COUNT 512
+wchar_t statusLine[MAX_STATUS_COUNT];
+ushort statusLength = 0;
+ushort statusCursorChar = 0;
+bool statusPrompt = false;
+
+enum CommandType {
+    COMMAND_NONE,
+    COMMAND_TO_NEXT_CHAR,
+    COMMAND_TO_PREV_CHAR,
+    COMMAND_DELETE,
+};
+
+CommandType commandStaged = COMMAND_NONE;
+wchar_t commandDigitStack[16];
+ushort commandDigitCount = 0;
+
+DocSearch lastSearch;
+Regex * lastRegex = nullptr; // set if the last search is not literal text, which lastSearch is then not
+bool lastSearchValid = false;
+bool lastSearchBackward = false;
+
+// Returns whether the index is of the last search and up to date with the current document.
+static bool SyncLastSearchIndex() {
+    return !lastRegex && lastSearchValid && IsSearchIndexOf(&lastSearch) && SyncSearchIndex(currentDoc);
+}
+
+void SetStatusLineNormal() {
+    size_t cursorLinePercent;
+    if (currentDoc->lineCount > 1) {
+        cursorLinePercent = (100 * currentDoc->cursorLineIndex) / (currentDoc->lineCount - 1);
+    } else {
+        cursorLinePercent = 0;
+    }
+
+    size_t cursorLineLength = GetDocLineLength(currentDoc, currentDoc->cursorLineIndex);
+    ulong cursorColCount;
+    ulong cursorLineColCount;
+    GetDocCursorCols(currentDoc, &cursorColCount, &cursorLineColCount);
+
+
+    const wchar_t modeNameNormal[] = L"NORMAL";
+    const wchar_t modeNameInsert[] = L"INSERT";
+    const wchar_t * modeName;
+    if (currentMode == MODE_INSERT) {
+        modeName = modeNameInsert;
+    } else {
+        modeName = modeNameNormal;
+    }
+
+    wchar_t loadStatus[32] = L"";
+    size_t loadPercent;
+    if (GetDocLoadPercent(currentDoc, &loadPercent)) {
+        swprintf_s(loadStatus, 32, L"Loading: %zu %% | ", loadPercent);
+    } else if (GetDocSavePercent(currentDoc, &loadPercent)) {
+        swprintf_s(loadStatus, 32, L"Saving: %zu %% | ", loadPercent);
+    }
+
+    // In insert mode, the index would be synced on every key.
+    wchar_t matchStatus[64] = L"";
+    if (currentMode != MODE_INSERT && SyncLastSearchIndex()) {
+        size_t cursorPos = GetDocPos(currentDoc, currentDoc->cursorLineIndex, currentDoc->cursorCharIndex);
+        swprintf_s(
+            matchStatus,
+            64,
+            L"Match: %zu/%zu | ",
+            FindSearchIndexPos(searchIndex, cursorPos + 1),
+            searchIndex->positions.count);
+    } else if (!lastRegex && lastSearchValid && searchIndexFailed) {
+        wcscpy_s(matchStatus, 64, L"Match: out of memory | ");
+    }
+
+    swprintf_s(
+        statusLine,
+        MAX_STATUS_COUNT,
+        L"%s | %s%sLine: %zu/%zu (%zu %%) | Char: %u/%zu (%lu/%lu) | ",
+        modeName,
+        loadStatus,
+        matchStatus,
+        currentDoc->cursorLineIndex + 1,
+        currentDoc->lineCount,
+        cursorLinePercent,
+        currentDoc->cursorCharIndex + 1,
+        cursorLineLength,
+        cursorColCount + 1,
+        cursorLineColCount);
+    statusLength = static_cast<ushort>(wcslen(statusLine));
+
+    if (commandDigitCount != 0) {
+        for (ushort i = 0; i != commandDigitCount; i++) {
+            statusLine[statusLength++] = commandDigitStack[i];
+        }
+    }
+
+    if (commandStaged != COMMAND_NONE) {
+        switch (commandStaged) {
+            case COMMAND_TO_NEXT_CHAR:
+            {
+                statusLine[statusLength++] = L'f';
                 break;
             }
 
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                tabSpaces,
-                config.tabWidth,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                tabSpaces,
-                config.tabWidth,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left >= lineRect.right) {
+            case COMMAND_TO_PREV_CHAR:
+            {
+                statusLine[statusLength++] = L'F';
+                break;
+            }
+
+            case COMMAND_DELETE:
+            {
+                statusLine[statusLength++] = L'd';
                 break;
             }
         }
+    }
 
-        nextTabOffset++;
-        currentText += nextTabOffset;
-        currentLength -= nextTabOffset;
-        cursorOffset -= nextTabOffset;
-        nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
-        nextTabOffset = static_cast<ushort>(min(nextTabIndex, MAX_LINE_LENGTH));
+    statusPrompt = false;
+}
+
+void SetStatusInvalidCommand(const wchar_t * text) {
+    currentMode = MODE_NORMAL;
+    paintContentCursor = true;
+    paintStatusCursor = false;
+    wcscpy_s(statusLine, MAX_STATUS_COUNT, text);
+    statusLength = static_cast<ushort>(wcslen(text));
+    statusPrompt = true;
+}
+
+size_t PowUz(size_t base, size_t exp) {
+    size_t result = 1;
+    for (size_t i = 1; i <= exp; i++) {
+        result *= base;
     }
+    return result;
+}
 
-    if (nextTabOffset == MAX_LINE_LENGTH) {
-        if (cursorOffset == currentLength) {
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                currentText,
-                currentLength,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                const_cast<wchar_t *>(currentText),
-                currentLength,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left < lineRect.right) {
-                RECT cursorRect;
-                cursorRect.left = lineRect.left;
-                cursorRect.top = lineRect.top;
-                cursorRect.right = lineRect.left + avgCharWidth;
-                cursorRect.bottom = lineRect.top + lineHeight;
-                FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
+void ResetCommand() {
+    commandStaged = COMMAND_NONE;
+    commandDigitCount = 0;
+    SetStatusLineNormal();
+}
+
+// Returns the count typed before a command, 1 if there is none.
+static size_t GetCommandCount() {
+    if (commandDigitCount == 0) {
+        return 1;
+    }
+    size_t count = 0;
+    for (ushort i = 0; i != commandDigitCount; i++) {
+        count += (commandDigitStack[commandDigitCount - 1 - i] - L'0') * PowUz(10, i);
+    }
+    return count;
+}
+
+// Moves the cursor to the next match of the last search, as often as the command count says, in
+// its direction or the other one. Once a search for literal text is indexed, the matches are
+// counted off the index, and until then the text is scanned. Regexes are always matched against
+// the text.
+static void RepeatSearch(bool reverse) {
+    size_t count = GetCommandCount();
+    commandDigitCount = 0;
+    if (!lastSearchValid) {
+        SetStatusInvalidCommand(L"No previous search!");
+        return;
+    }
+
+    bool backward = lastSearchBackward != reverse;
+    if (SyncLastSearchIndex()) {
+        size_t matchCount = searchIndex->positions.count;
+        if (matchCount == 0) {
+            SetStatusInvalidCommand(L"Pattern not found!");
+            return;
+        }
+
+        size_t cursorPos = GetDocPos(currentDoc, currentDoc->cursorLineIndex, currentDoc->cursorCharIndex);
+        size_t matchIndex;
+        bool wrapped;
+        if (backward) {
+            matchIndex = FindSearchIndexPos(searchIndex, cursorPos);
+            wrapped = count > matchIndex;
+            matchIndex = (matchIndex + matchCount - count % matchCount) % matchCount;
+        } else {
+            matchIndex = FindSearchIndexPos(searchIndex, cursorPos + 1) + count - 1;
+            wrapped = matchIndex >= matchCount;
+            matchIndex %= matchCount;
+        }
+
+        size_t charIndex;
+        currentDoc->cursorLineIndex = GetDocPosLine(currentDoc, searchIndex->positions.elems[matchIndex], &charIndex);
+        currentDoc->cursorCharIndex = static_cast<uint>(charIndex);
+        ResetColIndex(currentDoc);
+        if (wrapped) {
+            SetStatusInvalidCommand(backward ? L"Search hit top, continuing at bottom." : L"Search hit bottom, continuing at top.");
+        } else {
+            SetStatusLineNormal();
+        }
+        return;
+    }
+    if (!lastRegex) {
+        StartSearchIndex(currentDoc, &lastSearch); // on failure, the next search tries again
+    }
+
+    size_t lineIndex = currentDoc->cursorLineIndex;
+    size_t charIndex = currentDoc->cursorCharIndex;
+    bool wrapped = false;
+    for (size_t i = 0; i != count; i++) {
+        bool matchWrapped;
+        ResultCode result;
+        if (lastRegex) {
+            result = FindDocRegex(currentDoc, lastRegex, backward, &lineIndex, &charIndex, &matchWrapped);
+        } else {
+            result = FindDocText(currentDoc, &lastSearch, backward, &lineIndex, &charIndex, &matchWrapped);
+        }
+        if (result == RESULT_MEMORY_ERROR) {
+            SetStatusInvalidCommand(L"Out of memory!");
+            return;
+        }
+        if (result == RESULT_LIMIT_REACHED) {
+            SetStatusInvalidCommand(L"Pattern not found!");
+            return;
+        }
+        wrapped = wrapped || matchWrapped;
+    }
+
+    currentDoc->cursorLineIndex = lineIndex;
+    currentDoc->cursorCharIndex = static_cast<uint>(charIndex);
+    ResetColIndex(currentDoc);
+    if (wrapped) {
+        SetStatusInvalidCommand(backward ? L"Search hit top, continuing at bottom." : L"Search hit bottom, continuing at top.");
+    } else {
+        SetStatusLineNormal();
+    }
+}
+
+void ProcessNormalCharInput(wchar_t c) {
+    if (c == 0x1b) { // Esc
+        ResetCommand();
+        return;
+    }
+
+    switch (commandStaged) {
+        case COMMAND_TO_NEXT_CHAR:
+        {
+            if (iswcntrl(c)) {
+                ResetCommand();
             }
-        } else if (cursorOffset >= 0) {
-            GetTextExtentPoint32W(
-                bitmapDeviceContext,
-                currentText,
-                cursorOffset,
-                &extent);
-            DrawTextExW(
-                bitmapDeviceContext,
-                const_cast<wchar_t *>(currentText),
-                cursorOffset,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
-            lineRect.left += extent.cx;
-            if (lineRect.left < lineRect.right) {
-                GetTextExtentPoint32W(
-                    bitmapDeviceContext,
-                    currentText + cursorOffset,
-                    1,
-                    &extent);
-                RECT cursorRect;
-                cursorRect.left = lineRect.left;
-                cursorRect.top = lineRect.top;
-                cursorRect.right = lineRect.left + extent.cx;
-                cursorRect.bottom = lineRect.top + lineHeight;
-                FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
 
-                DrawTextExW(
-                    bitmapDeviceContext,
-                    const_cast<wchar_t *>(currentText + cursorOffset),
-                    currentLength - cursorOffset,
-                    &lineRect,
-                    DT_NOCLIP | DT_NOPREFIX,
-                    nullptr);
+            size_t count = GetCommandCount();
+
+            size_t length;
+            const wchar_t * line = GetDocLine(currentDoc, currentDoc->cursorLineIndex, &length);
+            for (size_t i = 0; i != count; i++) {
+                for (uint j = currentDoc->cursorCharIndex + 1; j < length; j++) {
+                    if (line[j] == c) {
+                        currentDoc->cursorCharIndex = j;
+                        break;
+                    }
+                }
+            }
+
+            ResetCommand();
+            return;
+        }
+
+        case COMMAND_TO_PREV_CHAR:
+        {
+            if (iswcntrl(c)) {
+                ResetCommand();
+            }
+
+            size_t count = GetCommandCount();
+
+            size_t length;
+            const wchar_t * line = GetDocLine(currentDoc, currentDoc->cursorLineIndex, &length);
+            for (size_t i = 0; i != count; i++) {
+                for (uint j = currentDoc->cursorCharIndex - 1; j != UINT_MAX; j--) { // intentional overflow
+                    if (line[j] == c) {
+                        currentDoc->cursorCharIndex = j;
+                        break;
+                    }
+                }
+            }
+
+            ResetCommand();
+            return;
+        }
+
+        case COMMAND_DELETE:
+        {
+            if (c == L'd') {
+                bool lastLine = currentDoc->lineCount == 1;
+                if (RemoveDocLines(currentDoc, currentDoc->cursorLineIndex, 1) != RESULT_OK) {
+                    commandStaged = COMMAND_NONE;
+                    commandDigitCount = 0;
+                    SetStatusInvalidCommand(L"Out of memory!");
+                    return;
+                }
+
+                if (lastLine) {
+                    currentDoc->cursorCharIndex = 0;
+                    currentDoc->lastCursorColIndex = 0;
+                } else {
+                    currentDoc->cursorLineIndex = min(currentDoc->cursorLineIndex, currentDoc->lineCount - 1);
+                    ApplyColIndex(currentDoc, false);
+                }
+
+                currentDoc->modified = true;
+            }
+            ResetCommand();
+            return;
+        }
+    }
+
+    if ((c >= L'1' && c <= L'9') || (c == L'0' && commandDigitCount != 0)) {
+        commandDigitStack[commandDigitCount++] = c;
+        SetStatusLineNormal();
+        return;
+    }
+
+    switch (c) {
+        case L':':
+        case L'/':
+        case L'?':
+        {
+            currentMode = MODE_COMMAND;
+            statusLine[0] = c;
+            statusLength = 1;
+            statusCursorChar = 1;
+            paintContentCursor = false;
+            paintStatusCursor = true;
+            statusPrompt = true;
+            break;
+        }
+
+        case L'i':
+        {
+            currentMode = MODE_INSERT;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'I':
+        {
+            size_t length;
+            const wchar_t * line = GetDocLine(currentDoc, currentDoc->cursorLineIndex, &length);
+            for (currentDoc->cursorCharIndex = 0; currentDoc->cursorCharIndex != length; currentDoc->cursorCharIndex++) {
+                if (!iswspace(line[currentDoc->cursorCharIndex])) {
+                    break;
+                }
+            }
+            currentMode = MODE_INSERT;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'a':
+        {
+            if (GetDocLineLength(currentDoc, currentDoc->cursorLineIndex) != 0) {
+                currentDoc->cursorCharIndex++;
+            }
+            currentMode = MODE_INSERT;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'A':
+        {
+            currentDoc->cursorCharIndex = static_cast<uint>(GetDocLineLength(currentDoc, currentDoc->cursorLineIndex));
+            currentMode = MODE_INSERT;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'o':
+        {
+            size_t length = GetDocLineLength(currentDoc, currentDoc->cursorLineIndex);
+            if (InsertDocText(currentDoc, currentDoc->cursorLineIndex, length, L"\n", 1) != RESULT_OK) {
+                SetStatusInvalidCommand(L"Out of memory!");
+                break;
+            }
+            currentDoc->cursorLineIndex++;
+            currentDoc->cursorCharIndex = 0;
+
+            currentMode = MODE_INSERT;
+            currentDoc->modified = true;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'O':
+        {
+            if (InsertDocText(currentDoc, currentDoc->cursorLineIndex, 0, L"\n", 1) != RESULT_OK) {
+                SetStatusInvalidCommand(L"Out of memory!");
+                break;
+            }
+            currentDoc->cursorCharIndex = 0;
+
+            currentMode = MODE_INSERT;
+            currentDoc->modified = true;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'x':
+        {
+            size_t length = GetDocLineLength(currentDoc, currentDoc->cursorLineIndex);
+            if (length != 0) {
+                if (RemoveDocText(currentDoc, currentDoc->cursorLineIndex, currentDoc->cursorCharIndex, 1) != RESULT_OK) {
+                    SetStatusInvalidCommand(L"Out of memory!");
+                    break;
+                }
+                length--;
+                if (currentDoc->cursorCharIndex == length && length != 0) {
+                    currentDoc->cursorCharIndex--;
+                }
+                currentDoc->modified = true;
+            }
+
+            ResetColIndex(currentDoc);
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'u':
+        case 0x12: // Ctrl+R
+        {
+            ResultCode result;
+            if (c == L'u') {
+                result = UndoDocChange(currentDoc);
+            } else {
+                result = RedoDocChange(currentDoc);
+            }
+            if (result == RESULT_MEMORY_ERROR) {
+                SetStatusInvalidCommand(L"Out of memory!");
+                break;
+            }
+            if (result == RESULT_LIMIT_REACHED) {
+                SetStatusInvalidCommand(c == L'u' ? L"Already at oldest change." : L"Already at newest change.");
+                break;
+            }
+
+            size_t length = GetDocLineLength(currentDoc, currentDoc->cursorLineIndex);
+            if (currentDoc->cursorCharIndex >= length && length != 0) {
+                currentDoc->cursorCharIndex = static_cast<uint>(length - 1);
+            }
+            ResetColIndex(currentDoc);
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'd':
+        {
+            commandStaged = COMMAND_DELETE;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'h':
+        {
+            if (currentDoc->cursorCharIndex != 0) {
+                currentDoc->cursorCharIndex--;
+            }
+            ResetColIndex(currentDoc);
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'l':
+        {
+            uint length = static_cast<uint>(GetDocLineLength(currentDoc, currentDoc->cursorLineIndex));
+            if (length != 0 && currentDoc->cursorCharIndex != length - 1) {
+                currentDoc->cursorCharIndex++;
+            }
+            ResetColIndex(currentDoc);
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'k':
+        {
+            if (currentDoc->cursorLineIndex != 0) {
+                currentDoc->cursorLineIndex--;
+                ApplyColIndex(currentDoc, false);
+            }
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'j':
+        {
+            if (currentDoc->cursorLineIndex != currentDoc->lineCount - 1) {
+                currentDoc->cursorLineIndex++;
+                ApplyColIndex(currentDoc, false);
+            }
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'0':
+        {
+            currentDoc->cursorCharIndex = 0;
+            currentDoc->lastCursorColIndex = 0;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'^':
+        {
+            size_t length;
+            const wchar_t * line = GetDocLine(currentDoc, currentDoc->cursorLineIndex, &length);
+            for (uint i = 0; i != length; i++) {
+                if (!iswspace(line[i])) {
+                    currentDoc->cursorCharIndex = i;
+                    break;
+                }
+            }
+            ResetColIndex(currentDoc);
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'$':
+        {
+            uint length = static_cast<uint>(GetDocLineLength(currentDoc, currentDoc->cursorLineIndex));
+            if (length != 0) {
+                currentDoc->cursorCharIndex = length - 1;
+            }
+            ResetColIndex(currentDoc);
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'f':
+        {
+            commandStaged = COMMAND_TO_NEXT_CHAR;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'F':
+        {
+            commandStaged = COMMAND_TO_PREV_CHAR;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'n':
+        case L'N':
+        {
+            RepeatSearch(c == L'N');
+            break;
+        }
+    }
+}
+
+void ExecuteCommandEdit(const wchar_t * args, ushort argsLength) {
+    const wchar_t statusArgsInvalid[] = L"Command args invalid!";
+    const wchar_t statusPathTooLong[] = L"Path too long!";
+    const wchar_t statusFileTooLarge[] = L"File too large!";
+    const wchar_t statusFileError[] = L"Could not open file.";
+    const wchar_t statusFileLocked[] = L"File locked!";
+    const wchar_t statusOutOfMemory[] = L"Out of memory!";
+    const wchar_t statusCurDocUnsaved[] = L"Current document has unsaved changes!";
+    const wchar_t statusSaveRunning[] = L"Save in progress!";
+
+    if (saveJob) {
+        SetStatusInvalidCommand(statusSaveRunning);
+        return;
+    }
+
+    //-----------
+    // Parse Args
+
+    ushort i = 0;
+    while (i != argsLength && iswspace(args[i])) {
+        i++;
+    }
+    if (i == argsLength) {
+        SetStatusInvalidCommand(statusArgsInvalid);
+        return;
+    }
+
+    if (args[i] == L'!') {
+        i++;
+    } else if (currentDoc->modified) {
+        SetStatusInvalidCommand(statusCurDocUnsaved);
+        return;
+    }
+
+    while (i != argsLength && iswspace(args[i])) {
+        i++;
+    }
+    if (i == argsLength) {
+        SetStatusInvalidCommand(statusArgsInvalid);
+        return;
+    }
+
+    ushort j;
+    if (args[i] == L'\"') {
+        i++;
+        j = i;
+        while (j != argsLength && args[j] != L'\"') {
+            j++;
+        }
+        if (j == argsLength) {
+            SetStatusInvalidCommand(statusArgsInvalid);
+            return;
+        }
+    } else {
+        j = i;
+        while (j != argsLength && !iswspace(args[j])) {
+            j++;
+        }
+    }
+
+    for (ushort k = j; k != argsLength; k++) {
+        if (!iswspace(args[k])) {
+            SetStatusInvalidCommand(statusArgsInvalid);
+            return;
+        }
+    }
+
+    //-------------
+    // Load File
+
+    if (j - i > MAX_PATH_COUNT) {
+        SetStatusInvalidCommand(statusPathTooLong);
+        return;
+    }
+    wchar_t path[MAX_PATH_COUNT];
+    wcsncpy_s(path, MAX_PATH_COUNT, args + i, j - i);
+
+    Doc * fileDoc;
+    ResultCode resultCode = LoadFile(path, &fileDoc);
+    switch (resultCode) {
+        case RESULT_LIMIT_REACHED:
+        {
+            SetStatusInvalidCommand(statusFileTooLarge);
+            break;
+        }
+
+        case RESULT_FILE_LOCKED:
+        {
+            SetStatusInvalidCommand(statusFileLocked);
+            break;
+        }
+
+        case RESULT_FILE_NOT_FOUND:
+        {
+            Doc * newDoc = CreateEmptyDoc();
+            if (!newDoc) {
+                SetStatusInvalidCommand(statusOutOfMemory);
+                break;
+            }
+            DestroySearchIndex();
+            DestroyDoc(currentDoc);
+            currentDoc = newDoc;
+            wcscpy_s(currentDoc->title, MAX_PATH_COUNT, path);
+
+            currentMode = MODE_NORMAL;
+            paintContentCursor = true;
+            paintStatusCursor = false;
+            statusPrompt = false;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case RESULT_FILE_ERROR:
+        {
+            SetStatusInvalidCommand(statusFileError);
+            break;
+        }
+
+        case RESULT_MEMORY_ERROR:
+        {
+            SetStatusInvalidCommand(statusOutOfMemory);
+            break;
+        }
+
+        default:
+        {
+            DestroySearchIndex();
+            DestroyDoc(currentDoc);
+            currentDoc = fileDoc;
+
+            currentMode = MODE_NORMAL;
+            paintContentCursor = true;
+            paintStatusCursor = false;
+            statusPrompt = false;
+            SetStatusLineNormal();
+            break;
+        }
+    }
+}
+
+void ExecuteCommandWrite(const wchar_t * args, ushort argsLength) {
+    const wchar_t statusNoName[] = L"No file name!";
+    const wchar_t statusSaveRunning[] = L"Save in progress!";
+    const wchar_t statusArgsInvalid[] = L"Command args invalid!";
+    const wchar_t statusPathTooLong[] = L"Path too long!";
+    const wchar_t statusOutOfMemory[] = L"Out of memory!";
+    const wchar_t statusFileTooLarge[] = L"File too large!";
+    const wchar_t statusReadError[] = L"Could not read file.";
+
+    if (saveJob) {
+        SetStatusInvalidCommand(statusSaveRunning);
+        return;
+    }
+
+    ushort i = 0;
+
+    while (i != argsLength && iswspace(args[i])) {
+        i++;
+    }
+    
+    bool overwrite;
+    if (i != argsLength && args[i] == L'!') {
+        overwrite = true;
+        i++;
+    } else {
+        overwrite = false;
+    }
+
+    while (i != argsLength && iswspace(args[i])) {
+        i++;
+    }
+
+    if (i == argsLength) {
+        if (currentDoc->title[0] == L'\0') {
+            SetStatusInvalidCommand(statusNoName);
+            return;
+        } else {
+            ResultCode resultCode = StartDocSave(currentDoc, nullptr, overwrite);
+            switch (resultCode) {
+                case RESULT_MEMORY_ERROR:
+                {
+                    SetStatusInvalidCommand(statusOutOfMemory);
+                    return;
+                }
+
+                case RESULT_LIMIT_REACHED:
+                {
+                    SetStatusInvalidCommand(statusFileTooLarge);
+                    return;
+                }
+
+                case RESULT_FILE_ERROR:
+                {
+                    SetStatusInvalidCommand(statusReadError);
+                    return;
+                }
+            }
+        }
+    } else {
+        ushort j;
+        if (args[i] == L'\"') {
+            i++;
+            j = i;
+            while (j != argsLength && args[j] != L'\"') {
+                j++;
+            }
+            if (j == argsLength) {
+                SetStatusInvalidCommand(statusArgsInvalid);
+                return;
+            }
+        } else {
+            j = i;
+            while (j != argsLength && !iswspace(args[j])) {
+                j++;
+            }
+        }
+
+        for (ushort k = j; k != argsLength; k++) {
+            if (!iswspace(args[k])) {
+                SetStatusInvalidCommand(statusArgsInvalid);
+                return;
+            }
+        }
+
+        if (j - i > MAX_PATH_COUNT) {
+            SetStatusInvalidCommand(statusPathTooLong);
+            return;
+        }
+        wchar_t path[MAX_PATH_COUNT];
+        wcsncpy_s(path, MAX_PATH_COUNT, args + i, j - i);
+
+        ResultCode resultCode = StartDocSave(currentDoc, path, overwrite);
+        switch (resultCode) {
+            case RESULT_MEMORY_ERROR:
+            {
+                SetStatusInvalidCommand(statusOutOfMemory);
+                return;
+            }
+
+            case RESULT_LIMIT_REACHED:
+            {
+                SetStatusInvalidCommand(statusFileTooLarge);
+                return;
+            }
+
+            case RESULT_FILE_ERROR:
+            {
+                SetStatusInvalidCommand(statusReadError);
+                return;
+            }
+        }
+    }
+
+    currentMode = MODE_NORMAL;
+    paintContentCursor = true;
+    paintStatusCursor = false;
+    statusPrompt = false;
+    SetStatusLineNormal();
+}
+
+// Shows why a save started by ExecuteCommandWrite failed.
+void SetStatusSaveFailed(ResultCode resultCode, bool newPath) {
+    const wchar_t statusFileLocked[] = L"File locked!";
+    const wchar_t statusFileModified[] = L"File was modified by another program!";
+    const wchar_t statusFileRemoved[] = L"File was deleted!";
+    const wchar_t statusFileWriteError[] = L"Could not write file.";
+    const wchar_t statusFileExists[] = L"File already exists!";
+
+    switch (resultCode) {
+        case RESULT_FILE_LOCKED:
+        {
+            SetStatusInvalidCommand(statusFileLocked);
+            break;
+        }
+
+        case RESULT_FILE_EXISTS:
+        {
+            SetStatusInvalidCommand(newPath ? statusFileExists : statusFileModified);
+            break;
+        }
+
+        case RESULT_FILE_NOT_FOUND:
+        {
+            SetStatusInvalidCommand(statusFileRemoved);
+            break;
+        }
+
+        default:
+        {
+            SetStatusInvalidCommand(statusFileWriteError);
+            break;
+        }
+    }
+}
+
+void ExecuteCommandNew(const wchar_t * args, ushort argsLength) {
+    if (saveJob) {
+        SetStatusInvalidCommand(L"Save in progress!");
+        return;
+    }
+
+    ushort i = 0;
+    while (i != argsLength && iswspace(args[i])) {
+        i++;
+    }
+
+    if (i != argsLength && args[i] == L'!') {
+        i++;
+    } else if (currentDoc->modified) {
+        SetStatusInvalidCommand(L"Current document has unsaved changes!");
+        return;
+    }
+
+    for (ushort j = i; j != argsLength; j++) {
+        if (!iswspace(args[j])) {
+            SetStatusInvalidCommand(L"Invalid command args!");
+            return;
+        }
+    }
+
+    DestroySearchIndex();
+    DestroyDoc(currentDoc);
+    currentDoc = CreateEmptyDoc();
+
+    currentMode = MODE_NORMAL;
+    paintContentCursor = true;
+    paintStatusCursor = false;
+    statusPrompt = false;
+    SetStatusLineNormal();
+}
+
+static bool WcIsAsciiAlpha(wchar_t c) {
+    return (c >= L'A' && c <= L'Z') || (c >= L'a' && c <= L'z');
+}
+
+static bool WcIsCName(wchar_t c) {
+    return WcIsAsciiAlpha(c) || iswdigit(c) || c == L'_';
+}
+
+// Starts a search from the prompt. Without text, the last search is repeated in the new direction.
+// A pattern matching nothing but literal text is searched for as that text, which can be indexed.
+void ExecuteSearch(bool backward, const wchar_t * text, ushort length) {
+    currentMode = MODE_NORMAL;
+    paintContentCursor = true;
+    paintStatusCursor = false;
+    if (length != 0) {
+        wchar_t literal[REGEX_MAX_LENGTH];
+        size_t literalLength;
+        Regex * regex = nullptr;
+        if (!(length <= REGEX_MAX_LENGTH
+            && GetRegexLiteral(text, length, literal, &literalLength)
+            && InitDocSearch(&lastSearch, literal, literalLength)))
+        {
+            ResultCode result = CompileRegex(text, length, &regex);
+            if (result == RESULT_MEMORY_ERROR) {
+                SetStatusInvalidCommand(L"Out of memory!");
+                return;
+            }
+            if (result != RESULT_OK) {
+                SetStatusInvalidCommand(L"Invalid search!");
+                return;
+            }
+        }
+
+        if (lastRegex) {
+            DestroyRegex(lastRegex);
+        }
+        lastRegex = regex;
+        lastSearchValid = true;
+        if (regex) {
+            DestroySearchIndex();
+        } else {
+            StartSearchIndex(currentDoc, &lastSearch);
+        }
+    }
+    lastSearchBackward = backward;
+    RepeatSearch(false);
+}
+
+// A part of the lines a substitution goes through, matched by a thread of its own.
+struct SubstitutePart {
+    DocSnapshot * snapshot;
+    Regex * regex;
+    size_t pos;
+    size_t lineCount;
+    const wchar_t * replacement;
+    size_t replacementLength;
+    bool global;
+    DocEditList * edits;
+    ResultCode result;
+};
+
+#define SUBSTITUTE_MIN_PART_LINE_COUNT 65536
+
+static DWORD WINAPI SubstituteThreadProc(void * parameter) {
+    SubstitutePart * part = static_cast<SubstitutePart *>(parameter);
+    part->result = SubstituteDocSnapshot(
+        part->snapshot,
+        part->regex,
+        part->pos,
+        part->lineCount,
+        part->replacement,
+        part->replacementLength,
+        part->global,
+        part->edits);
+    return 0;
+}
+
+// Returns the end of the text of a substitute command up to a delimiter, or the end of the command
+// if it is missing. A backslash escapes the character behind it.
+static ushort FindSubstituteDelimiter(const wchar_t * args, ushort argsLength, ushort i, wchar_t delimiter) {
+    while (i != argsLength && args[i] != delimiter) {
+        if (args[i] == L'\\' && i + 1 != argsLength) {
+            i++;
+        }
+        i++;
+    }
+    return i;
+}
+
+// Replaces the matches of a pattern in a range of lines, as in :s/pattern/replacement/g. The lines
+// are split into parts matched on worker threads, each with a regex of its own, and the changed
+// lines are rebuilt and put into the document at once, as one change to undo.
+void ExecuteCommandSubstitute(size_t firstLine, size_t endLine, const wchar_t * args, ushort argsLength) {
+    if (argsLength == 0 || WcIsCName(args[0]) || iswspace(args[0]) || args[0] == L'\\') {
+        SetStatusInvalidCommand(L"Invalid command args!");
+        return;
+    }
+    wchar_t delimiter = args[0];
+    ushort patternEnd = FindSubstituteDelimiter(args, argsLength, 1, delimiter);
+    ushort replacementStart = patternEnd != argsLength ? patternEnd + 1 : patternEnd;
+    ushort replacementEnd = FindSubstituteDelimiter(args, argsLength, replacementStart, delimiter);
+    bool global = false;
+    for (ushort i = replacementEnd != argsLength ? replacementEnd + 1 : replacementEnd; i != argsLength; i++) {
+        if (args[i] == L'g') {
+            global = true;
+        } else if (!iswspace(args[i])) {
+            SetStatusInvalidCommand(L"Invalid command args!");
+            return;
+        }
+    }
+    if (patternEnd == 1) {
+        SetStatusInvalidCommand(L"Invalid search!");
+        return;
+    }
+
+    // Each thread gets a number of lines at least, so short ranges use fewer of them.
+    size_t lineCount = endLine - firstLine;
+    uint threadCount = GetThreadCount(config.searchThreadCount);
+    if (lineCount / SUBSTITUTE_MIN_PART_LINE_COUNT < threadCount) {
+        threadCount = static_cast<uint>(lineCount / SUBSTITUTE_MIN_PART_LINE_COUNT) + 1;
+    }
+    SubstitutePart parts[LAZYLOAD_MAX_THREAD_COUNT];
+    DocEditList lists[LAZYLOAD_MAX_THREAD_COUNT];
+    for (uint i = 0; i != threadCount; i++) {
+        ResultCode result = CompileRegex(args + 1, patternEnd - 1, &parts[i].regex);
+        if (result != RESULT_OK) {
+            for (uint j = 0; j != i; j++) {
+                DestroyRegex(parts[j].regex);
+            }
+            SetStatusInvalidCommand(result == RESULT_MEMORY_ERROR ? L"Out of memory!" : L"Invalid search!");
+            return;
+        }
+    }
+
+    DocSnapshot * snapshot;
+    if (CreateDocSnapshot(currentDoc, &snapshot) != RESULT_OK) {
+        for (uint i = 0; i != threadCount; i++) {
+            DestroyRegex(parts[i].regex);
+        }
+        SetStatusInvalidCommand(L"Out of memory!");
+        return;
+    }
+
+    // The first part is done on this thread, and so is any other that gets no thread.
+    HANDLE threads[LAZYLOAD_MAX_THREAD_COUNT];
+    uint startedCount = 0;
+    size_t partLineCount = lineCount / threadCount;
+    for (uint i = 0; i != threadCount; i++) {
+        SubstitutePart * part = &parts[i];
+        size_t partFirstLine = firstLine + i * partLineCount;
+        part->snapshot = snapshot;
+        part->pos = GetDocPos(currentDoc, partFirstLine, 0);
+        if (i + 1 == threadCount) {
+            part->lineCount = endLine - partFirstLine;
+        } else {
+            part->lineCount = partLineCount;
+        }
+        part->replacement = args + replacementStart;
+        part->replacementLength = replacementEnd - replacementStart;
+        part->global = global;
+        part->edits = &lists[i];
+        if (i != 0) {
+            HANDLE thread = CreateThread(nullptr, 0, SubstituteThreadProc, part, 0, nullptr);
+            if (thread) {
+                threads[startedCount++] = thread;
+                continue;
+            }
+            SubstituteThreadProc(part);
+        }
+    }
+    SubstituteThreadProc(&parts[0]);
+    if (startedCount != 0) {
+        WaitForMultipleObjects(startedCount, threads, true, INFINITE);
+    }
+    for (uint i = 0; i != startedCount; i++) {
+        CloseHandle(threads[i]);
+    }
+    DestroyDocSnapshot(snapshot);
+
+    ResultCode result = RESULT_OK;
+    size_t matchCount = 0;
+    for (uint i = 0; i != threadCount; i++) {
+        if (parts[i].result != RESULT_OK && result != RESULT_MEMORY_ERROR) {
+            result = parts[i].result;
+        }
+        matchCount += lists[i].matchCount;
+        DestroyRegex(parts[i].regex);
+    }
+    if (result == RESULT_OK && matchCount != 0) {
+        result = ApplyDocEdits(currentDoc, lists, threadCount);
+        if (result == RESULT_OK) {
+            currentDoc->modified = true;
+        }
+    }
+    for (uint i = 0; i != threadCount; i++) {
+        ClearDocEditList(&lists[i]);
+    }
+
+    if (result == RESULT_LIMIT_REACHED) {
+        SetStatusInvalidCommand(L"Line too long!");
+        return;
+    }
+    if (result != RESULT_OK) {
+        SetStatusInvalidCommand(L"Out of memory!");
+        return;
+    }
+    if (matchCount == 0) {
+        SetStatusInvalidCommand(L"Pattern not found!");
+        return;
+    }
+
+    ResetColIndex(currentDoc);
+    currentMode = MODE_NORMAL;
+    paintContentCursor = true;
+    paintStatusCursor = false;
+    statusPrompt = false;
+    SetStatusLineNormal();
+}
+
+// Reads a line of a command range: a number counting from 1, . for the cursor line or $ for the
+// last line. A number past the end yields a line past the end.
+// Returns false if there is none.
+static bool ParseCommandLine(const wchar_t * commandLine, ushort commandLength, ushort * i, size_t * lineIndex) {
+    if (*i == commandLength) {
+        return false;
+    }
+    if (commandLine[*i] == L'.') {
+        (*i)++;
+        *lineIndex = currentDoc->cursorLineIndex;
+        return true;
+    }
+    if (commandLine[*i] == L'$') {
+        (*i)++;
+        *lineIndex = currentDoc->lineCount - 1;
+        return true;
+    }
+    if (!iswdigit(commandLine[*i])) {
+        return false;
+    }
+
+    size_t number = 0;
+    while (*i != commandLength && iswdigit(commandLine[*i])) {
+        if (number <= currentDoc->lineCount) {
+            number = number * 10 + (commandLine[*i] - L'0');
+        }
+        (*i)++;
+    }
+    *lineIndex = number != 0 ? number - 1 : SIZE_MAX;
+    return true;
+}
+
+void ExecuteCommand(const wchar_t * commandLine, ushort commandLength) {
+    ushort i = 0;
+    while (i != commandLength && iswspace(commandLine[i])) {
+        i++;
+    }
+    if (i == commandLength) {
+        return;
+    }
+
+    // :/pattern/ and :?pattern? search like the prompts, the closing delimiter being optional.
+    if (commandLine[i] == L'/' || commandLine[i] == L'?') {
+        wchar_t delimiter = commandLine[i];
+        ushort end = commandLength;
+        if (end - i >= 2 && commandLine[end - 1] == delimiter) {
+            ushort backslashCount = 0;
+            while (end - 2 - backslashCount > i && commandLine[end - 2 - backslashCount] == L'\\') {
+                backslashCount++;
+            }
+            if (backslashCount % 2 == 0) {
+                end--;
+            }
+        }
+        ExecuteSearch(delimiter == L'?', commandLine + i + 1, end - i - 1);
+        return;
+    }
+
+    // A range of lines goes before the command: % for all of them, or a line and a last line after
+    // a comma. Without one, the cursor line is meant.
+    size_t firstLine = currentDoc->cursorLineIndex;
+    size_t lastLine = firstLine;
+    bool range = false;
+    if (commandLine[i] == L'%') {
+        i++;
+        firstLine = 0;
+        lastLine = currentDoc->lineCount - 1;
+        range = true;
+    } else if (ParseCommandLine(commandLine, commandLength, &i, &firstLine)) {
+        lastLine = firstLine;
+        if (i != commandLength && commandLine[i] == L',') {
+            i++;
+            if (!ParseCommandLine(commandLine, commandLength, &i, &lastLine)) {
+                SetStatusInvalidCommand(L"Invalid range!");
+                return;
+            }
+        }
+        range = true;
+    }
+    if (range && (lastLine < firstLine || lastLine >= currentDoc->lineCount)) {
+        SetStatusInvalidCommand(L"Invalid range!");
+        return;
+    }
+    while (i != commandLength && iswspace(commandLine[i])) {
+        i++;
+    }
+
+    if (i == commandLength || !(WcIsAsciiAlpha(commandLine[i]) || commandLine[i] == L'_')) {
+        SetStatusInvalidCommand(L"Invalid command!");
+        return;
+    }
+    ushort j = i;
+    do {
+        j++;
+    } while (j != commandLength && WcIsCName(commandLine[j]));
+    ushort initLength = j - i;
+
+    const wchar_t editCommand[] = L"edit";
+    const wchar_t writeCommand[] = L"write";
+    const wchar_t newCommand[] = L"enew";
+    const wchar_t substituteCommand[] = L"substitute";
+
+    if (wcsncmp(commandLine + i, substituteCommand, initLength) == 0 && (initLength == 1 || initLength == wcslen(substituteCommand))) {
+        ExecuteCommandSubstitute(firstLine, lastLine + 1, commandLine + j, commandLength - j);
+    } else if (range) {
+        SetStatusInvalidCommand(L"Invalid range!");
+    } else if (wcsncmp(commandLine + i, editCommand, initLength) == 0 && initLength == wcslen(editCommand)) {
+        ExecuteCommandEdit(commandLine + j, commandLength - j);
+    } else if (wcsncmp(commandLine + i, writeCommand, initLength) == 0 && initLength == wcslen(writeCommand)) {
+        ExecuteCommandWrite(commandLine + j, commandLength - j);
+    } else if (wcsncmp(commandLine + i, newCommand, initLength) == 0 && initLength == wcslen(newCommand)) {
+        ExecuteCommandNew(commandLine + j, commandLength - j);
+    } else {
+        SetStatusInvalidCommand(L"Unknown command!");
+    }
+}
+
+//--------------------
+// Incremental Search
+
+// The search typed at a / or ? prompt, whose matches are shown while it is typed. Once the matches
+// of literal text are indexed, the cursor moves to the first one in the direction of the search,
+// and it goes back where it was when the prompt is left. Each key starts the search over, which
+// cancels the last one, and the index of the text typed so far narrows down to the longer text.
+struct IncSearch {
+    bool active;
+    bool backward;
+    DocSearch search;
+    bool searchValid;
+    Regex * regex; // set instead of the search for a pattern other than literal text
+    size_t cursorLineIndex;
+    uint cursorCharIndex;
+    ulong lastCursorColIndex;
+    size_t topPaintLineIndex;
+    size_t leftPaintCharIndex;
+};
+
+static IncSearch incSearch = {};
+
+static void RestoreIncSearchCursor() {
+    currentDoc->cursorLineIndex = incSearch.cursorLineIndex;
+    currentDoc->cursorCharIndex = incSearch.cursorCharIndex;
+    currentDoc->lastCursorColIndex = incSearch.lastCursorColIndex;
+    currentDoc->topPaintLineIndex = incSearch.topPaintLineIndex;
+    currentDoc->leftPaintCharIndex = incSearch.leftPaintCharIndex;
+}
+
+// Moves the cursor to the first match of the search typed, once the matches are indexed.
+static void MoveIncSearchCursor() {
+    if (!incSearch.active || !incSearch.searchValid || !IsSearchIndexOf(&incSearch.search) || !SyncSearchIndex(currentDoc)) {
+        return;
+    }
+    size_t matchCount = searchIndex->positions.count;
+    if (matchCount == 0) {
+        return;
+    }
+
+    size_t cursorPos = GetDocPos(currentDoc, incSearch.cursorLineIndex, incSearch.cursorCharIndex);
+    size_t matchIndex;
+    if (incSearch.backward) {
+        matchIndex = (FindSearchIndexPos(searchIndex, cursorPos) + matchCount - 1) % matchCount;
+    } else {
+        matchIndex = FindSearchIndexPos(searchIndex, cursorPos + 1) % matchCount;
+    }
+    size_t charIndex;
+    currentDoc->cursorLineIndex = GetDocPosLine(currentDoc, searchIndex->positions.elems[matchIndex], &charIndex);
+    currentDoc->cursorCharIndex = static_cast<uint>(charIndex);
+}
+
+// Searches for the text at the prompt again after it changed.
+static void UpdateIncSearch() {
+    if (incSearch.active) {
+        RestoreIncSearchCursor();
+    } else {
+        incSearch.active = true;
+        incSearch.cursorLineIndex = currentDoc->cursorLineIndex;
+        incSearch.cursorCharIndex = currentDoc->cursorCharIndex;
+        incSearch.lastCursorColIndex = currentDoc->lastCursorColIndex;
+        incSearch.topPaintLineIndex = currentDoc->topPaintLineIndex;
+        incSearch.leftPaintCharIndex = currentDoc->leftPaintCharIndex;
+    }
+    if (incSearch.regex) {
+        DestroyRegex(incSearch.regex);
+        incSearch.regex = nullptr;
+    }
+    incSearch.searchValid = false;
+    incSearch.backward = statusLine[0] == L'?';
+
+    const wchar_t * text = statusLine + 1;
+    size_t length = statusLength - 1;
+    if (length == 0) {
+        return;
+    }
+    wchar_t literal[REGEX_MAX_LENGTH];
+    size_t literalLength;
+    if (length <= REGEX_MAX_LENGTH
+        && GetRegexLiteral(text, length, literal, &literalLength)
+        && InitDocSearch(&incSearch.search, literal, literalLength))
+    {
+        incSearch.searchValid = true;
+        StartSearchIndex(currentDoc, &incSearch.search);
+        MoveIncSearchCursor();
+    } else {
+        CompileRegex(text, length, &incSearch.regex); // an incomplete pattern shows no matches
+    }
+}
+
+// Stops showing the search typed and puts the cursor back.
+static void EndIncSearch() {
+    if (!incSearch.active) {
+        return;
+    }
+    RestoreIncSearchCursor();
+    if (incSearch.regex) {
+        DestroyRegex(incSearch.regex);
+        incSearch.regex = nullptr;
+    }
+    incSearch.searchValid = false;
+    incSearch.active = false;
+}
+
+// Leaves the search typed without searching, indexing the last search again.
+static void CancelIncSearch() {
+    EndIncSearch();
+    if (lastSearchValid && !lastRegex) {
+        StartSearchIndex(currentDoc, &lastSearch);
+    } else {
+        DestroySearchIndex();
+    }
+}
+
+void ProcessCommandCharInput(wchar_t c) {
+    switch (c) {
+        case 0x1b: // Esc
+        {
+            CancelIncSearch();
+            currentMode = MODE_NORMAL;
+            paintContentCursor = true;
+            paintStatusCursor = false;
+            SetStatusLineNormal();
+            break;
+        }
+
+        case L'\b':
+        {
+            if (statusCursorChar == 1) {
+                if (statusLength == 1) {
+                    CancelIncSearch();
+                    currentMode = MODE_NORMAL;
+                    paintContentCursor = true;
+                    paintStatusCursor = false;
+                    SetStatusLineNormal();
+                }
+            } else {
+                statusCursorChar--;
+                ushort shiftEnd = statusLength - 1;
+                for (ushort i = statusCursorChar; i != shiftEnd; i++) {
+                    statusLine[i] = statusLine[i + 1];
+                }
+                statusLength--;
+                if (statusLine[0] != L':') {
+                    UpdateIncSearch();
+                }
+            }
+            break;
+        }
+
+        case L'\r':
+        {
+            if (statusLine[0] == L':') {
+                ExecuteCommand(statusLine + 1, statusLength - 1);
+            } else {
+                EndIncSearch();
+                ExecuteSearch(statusLine[0] == L'?', statusLine + 1, statusLength - 1);
+            }
+            break;
+        }
+
+        default:
+        {
+            if (iswcntrl(c)) {
+                break;
+            }
+
+            if (statusLength == MAX_STATUS_COUNT - 1) {
+                break;
+            }
+            statusLength++;
+            for (ushort i = statusLength - 1; i != statusCursorChar; i--) {
+                statusLine[i] = statusLine[i - 1];
+            }
+            statusLine[statusCursorChar++] = c;
+            if (statusLine[0] != L':') {
+                UpdateIncSearch();
+            }
+            break;
+        }
+    }
+}
+
+HDC bitmapDeviceContext;
+long bitmapWidth;
+long bitmapHeight;
+
+long lineHeight;
+long avgCharWidth;
+
+static void PaintCursorLine(const RECT * textRect, const wchar_t * text, uint length, uint charIndex) {
+    SIZE extent;
+
+    RECT lineRect = *textRect;
+
+    const wchar_t * currentText = text;
+    uint currentLength = length;
+    size_t nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
+    uint nextTabOffset = static_cast<uint>(min(nextTabIndex, MAX_LINE_LENGTH));
+    long cursorOffset = static_cast<long>(charIndex);
+    while (nextTabOffset != MAX_LINE_LENGTH) {
+        if (cursorOffset < 0 || cursorOffset >= static_cast<long>(nextTabOffset)) {
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                currentText,
+                nextTabOffset,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                const_cast<wchar_t *>(currentText),
+                nextTabOffset,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left >= lineRect.right) {
+                break;
+            }
+
+            if (cursorOffset == static_cast<long>(nextTabOffset)) {
+                RECT cursorRect;
+                cursorRect.left = lineRect.left;
+                cursorRect.top = lineRect.top;
+                cursorRect.right = lineRect.left + avgCharWidth;
+                cursorRect.bottom = lineRect.top + lineHeight;
+                FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
+            }
+
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                tabSpaces,
+                config.tabWidth,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                tabSpaces,
+                config.tabWidth,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left >= lineRect.right) {
+                break;
+            }
+        } else {
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                currentText,
+                cursorOffset,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                const_cast<wchar_t *>(currentText),
+                cursorOffset,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left >= lineRect.right) {
+                break;
+            }
+
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                &currentText[cursorOffset],
+                1,
+                &extent);
+            RECT cursorRect;
+            cursorRect.left = lineRect.left;
+            cursorRect.top = lineRect.top;
+            cursorRect.right = lineRect.left + extent.cx;
+            cursorRect.bottom = lineRect.top + lineHeight;
+            FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
+
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                currentText + cursorOffset,
+                nextTabOffset - cursorOffset,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                const_cast<wchar_t *>(currentText + cursorOffset),
+                nextTabOffset - cursorOffset,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left >= lineRect.right) {
+                break;
+            }
+
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                tabSpaces,
+                config.tabWidth,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                tabSpaces,
+                config.tabWidth,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left >= lineRect.right) {
+                break;
+            }
+        }
+
+        nextTabOffset++;
+        currentText += nextTabOffset;
+        currentLength -= nextTabOffset;
+        cursorOffset -= static_cast<long>(nextTabOffset);
+        nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
+        nextTabOffset = static_cast<uint>(min(nextTabIndex, MAX_LINE_LENGTH));
+    }
+
+    if (nextTabOffset == MAX_LINE_LENGTH) {
+        if (cursorOffset == static_cast<long>(currentLength)) {
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                currentText,
+                currentLength,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                const_cast<wchar_t *>(currentText),
+                currentLength,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left < lineRect.right) {
+                RECT cursorRect;
+                cursorRect.left = lineRect.left;
+                cursorRect.top = lineRect.top;
+                cursorRect.right = lineRect.left + avgCharWidth;
+                cursorRect.bottom = lineRect.top + lineHeight;
+                FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
+            }
+        } else if (cursorOffset >= 0) {
+            GetTextExtentPoint32W(
+                bitmapDeviceContext,
+                currentText,
+                cursorOffset,
+                &extent);
+            DrawTextExW(
+                bitmapDeviceContext,
+                const_cast<wchar_t *>(currentText),
+                cursorOffset,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+            lineRect.left += extent.cx;
+            if (lineRect.left < lineRect.right) {
+                GetTextExtentPoint32W(
+                    bitmapDeviceContext,
+                    currentText + cursorOffset,
+                    1,
+                    &extent);
+                RECT cursorRect;
+                cursorRect.left = lineRect.left;
+                cursorRect.top = lineRect.top;
+                cursorRect.right = lineRect.left + extent.cx;
+                cursorRect.bottom = lineRect.top + lineHeight;
+                FillRect(bitmapDeviceContext, &cursorRect, cursorBrush);
+
+                DrawTextExW(
+                    bitmapDeviceContext,
+                    const_cast<wchar_t *>(currentText + cursorOffset),
+                    currentLength - cursorOffset,
+                    &lineRect,
+                    DT_NOCLIP | DT_NOPREFIX,
+                    nullptr);
+            }
+        } else {
+            DrawTextExW(
+                bitmapDeviceContext,
+                const_cast<wchar_t *>(currentText),
+                currentLength,
+                &lineRect,
+                DT_NOCLIP | DT_NOPREFIX,
+                nullptr);
+        }
+    }
+}
+
+
+static void PaintLine(const RECT * textRect, const wchar_t * text, uint length) {
+    RECT lineRect = *textRect;
+
+    const wchar_t * currentText = text;
+    uint currentLength = length;
+    size_t nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
+    uint nextTabOffset = static_cast<uint>(min(nextTabIndex, MAX_LINE_LENGTH));
+    while (nextTabOffset != MAX_LINE_LENGTH) {
+        SIZE extent;
+
+        GetTextExtentPoint32W(
+            bitmapDeviceContext,
+            currentText,
+            nextTabOffset,
+            &extent);
+        DrawTextExW(
+            bitmapDeviceContext,
+            const_cast<wchar_t *>(currentText),
+            nextTabOffset,
+            &lineRect,
+            DT_NOCLIP | DT_NOPREFIX,
+            nullptr);
+        lineRect.left += extent.cx;
+        if (lineRect.left >= lineRect.right) {
+            break;
+        }
+
+        GetTextExtentPoint32W(
+            bitmapDeviceContext,
+            tabSpaces,
+            config.tabWidth,
+            &extent);
+        DrawTextExW(
+            bitmapDeviceContext,
+            tabSpaces,
+            config.tabWidth,
+            &lineRect,
+            DT_NOCLIP | DT_NOPREFIX,
+            nullptr);
+        lineRect.left += extent.cx;
+        if (lineRect.left >= lineRect.right) {
+            break;
+        }
+
+        nextTabOffset++;
+        currentText += nextTabOffset;
+        currentLength -= nextTabOffset;
+        nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
+        nextTabOffset = static_cast<uint>(min(nextTabIndex, MAX_LINE_LENGTH));
+    }
+
+    if (nextTabOffset == MAX_LINE_LENGTH) {
+        DrawTextExW(
+            bitmapDeviceContext,
+            const_cast<wchar_t *>(currentText),
+            currentLength,
+            &lineRect,
+            DT_NOCLIP | DT_NOPREFIX,
+            nullptr);
+    }
+}
+
+// Returns the width of the start of a line as painted, with tabs expanded.
+static long GetLineExtent(const wchar_t * text, uint length) {
+    SIZE extent;
+    long width = 0;
+    uint segmentStart = 0;
+    for (uint i = 0; i <= length; i++) {
+        if (i != length && text[i] != L'\t') {
+            continue;
+        }
+        if (i != segmentStart) {
+            GetTextExtentPoint32W(bitmapDeviceContext, text + segmentStart, i - segmentStart, &extent);
+            width += extent.cx;
+        }
+        if (i != length) {
+            GetTextExtentPoint32W(bitmapDeviceContext, tabSpaces, config.tabWidth, &extent);
+            width += extent.cx;
+        }
+        segmentStart = i + 1;
+    }
+    return width;
+}
+
+#define INCSEARCH_MAX_MATCH_COUNT 256
+
+// Finds the matches of the search typed in the painted part of a line. Regexes match whole lines,
+// so they are only matched on lines up to a search block long, which keeps typing quick.
+static size_t FindIncSearchMatches(Doc * doc, size_t lineIndex, size_t charIndex, size_t length, DocMatch * matches) {
+    if (incSearch.searchValid) {
+        return FindDocLineText(doc, &incSearch.search, lineIndex, charIndex, length, matches, INCSEARCH_MAX_MATCH_COUNT);
+    }
+    if (incSearch.regex && GetDocLineLength(doc, lineIndex) <= DOCSEARCH_BLOCK_LENGTH) {
+        return FindDocLineRegex(doc, incSearch.regex, lineIndex, charIndex, length, matches, INCSEARCH_MAX_MATCH_COUNT);
+    }
+    return 0;
+}
+
+// Paints the background of the matches in the painted part of a line, which starts at a character
+// index.
+static void PaintMatches(const RECT * textRect, const wchar_t * text, uint length, size_t charIndex, const DocMatch * matches, size_t matchCount) {
+    for (size_t i = 0; i != matchCount; i++) {
+        size_t start = matches[i].charIndex > charIndex ? matches[i].charIndex - charIndex : 0;
+        size_t end = matches[i].charIndex + matches[i].length - charIndex;
+        if (end > length) {
+            end = length;
+        }
+        if (start >= end) {
+            continue;
+        }
+
+        RECT matchRect;
+        matchRect.left = textRect->left + GetLineExtent(text, static_cast<uint>(start));
+        if (matchRect.left >= textRect->right) {
+            break;
+        }
+        matchRect.top = textRect->top;
+        matchRect.right = textRect->left + GetLineExtent(text, static_cast<uint>(end));
+        matchRect.bottom = textRect->top + lineHeight;
+        FillRect(bitmapDeviceContext, &matchRect, matchBackgroundBrush);
+    }
+}
+
+// Scrolls the document sideways just far enough for the cursor to be visible.
+static void ScrollToCursor(Doc * doc, size_t visibleColCount) {
+    if (doc->cursorCharIndex < doc->leftPaintCharIndex) {
+        doc->leftPaintCharIndex = doc->cursorCharIndex;
+        return;
+    }
+    if (doc->cursorCharIndex - doc->leftPaintCharIndex >= visibleColCount) {
+        doc->leftPaintCharIndex = doc->cursorCharIndex - visibleColCount + 1;
+    }
+
+    size_t length;
+    const wchar_t * slice = GetDocLineSlice(
+        doc,
+        doc->cursorLineIndex,
+        doc->leftPaintCharIndex,
+        doc->cursorCharIndex - doc->leftPaintCharIndex + 1,
+        &length);
+    if (!slice) {
+        return;
+    }
+
+    size_t colCount = doc->cursorCharIndex - doc->leftPaintCharIndex + 1 - length; // cursor behind the line end
+    for (size_t i = 0; i != length; i++) {
+        colCount += slice[i] == L'\t' ? config.tabWidth : 1;
+    }
+    for (size_t i = 0; colCount > visibleColCount && doc->leftPaintCharIndex != doc->cursorCharIndex; i++) {
+        colCount -= slice[i] == L'\t' ? config.tabWidth : 1;
+        doc->leftPaintCharIndex++;
+    }
+}
+
+static void Paint(Doc * doc) {
+    doc->lastPaintLineCount = 0;
+
+    if (bitmapWidth == 0 || bitmapHeight == 0) {
+        return;
+    }
+
+    RECT paintRect;
+    paintRect.left = 0;
+    paintRect.top = 0;
+    paintRect.right = bitmapWidth;
+    paintRect.bottom = bitmapHeight;
+    FillRect(bitmapDeviceContext, &paintRect, backgroundBrush);
+
+    SetTextColor(bitmapDeviceContext, config.textColor);
+    SetBkMode(bitmapDeviceContext, TRANSPARENT);
+
+    size_t paintLineCount = bitmapHeight / lineHeight;
+    if (paintLineCount == 0) {
+        return;
+    }
+    paintLineCount--; // space for status line
+
+    //---------------------------
+    // Paint Working Folder Line
+
+    if (paintLineCount != 0) {
+        paintRect.bottom = lineHeight;
+
+        wchar_t workingFolderLine[MAX_PATH + 32];
+        swprintf_s(workingFolderLine, MAX_PATH + 32, L"Working Folder: %s", workingFolderPath);
+
+        DrawTextExW(
+            bitmapDeviceContext,
+            workingFolderLine,
+            -1,
+            &paintRect,
+            DT_NOCLIP | DT_NOPREFIX,
+            nullptr);
+
+        paintLineCount--;
+    }
+
+    //------------------------
+    // Paint Doc Title Line
+
+    if (paintLineCount != 0) {
+        paintRect.top += lineHeight;
+        paintRect.bottom += lineHeight;
+        FillRect(bitmapDeviceContext, &paintRect, docTitleBackgroundBrush);
+
+        wchar_t docTitleLine[MAX_PATH_COUNT + 32];
+        if (doc->title[0] == L'\0') {
+            wcscpy_s(docTitleLine, MAX_PATH_COUNT + 32, L"<UNTITLED>");
+        } else {
+            wcscpy_s(docTitleLine, MAX_PATH_COUNT + 32, doc->title);
+            if (doc->timestamp == 0) {
+                wcscat_s(docTitleLine, MAX_PATH_COUNT + 32, L" <NEW>");
+            }
+        }
+        if (doc->modified) {
+            wcscat_s(docTitleLine, MAX_PATH_COUNT + 32, L" (modified)");
+        }
+
+        DrawTextExW(
+            bitmapDeviceContext,
+            docTitleLine,
+            -1,
+            &paintRect,
+            DT_NOCLIP | DT_NOPREFIX,
+            nullptr);
+
+        paintLineCount--;
+    }
+
+    //-----------------
+    // Paint Content
+
+    paintRect.top += lineHeight;
+    paintRect.bottom = bitmapHeight - lineHeight;
+
+    if (doc->cursorLineIndex < doc->topPaintLineIndex) {
+        doc->topPaintLineIndex = doc->cursorLineIndex;
+    }
+    size_t endPaintLineIndex = doc->topPaintLineIndex + paintLineCount;
+    if (doc->cursorLineIndex >= endPaintLineIndex) {
+        doc->topPaintLineIndex += doc->cursorLineIndex - endPaintLineIndex + 1;
+        endPaintLineIndex = doc->cursorLineIndex + 1;
+    } else if (doc->topPaintLineIndex != 0 && endPaintLineIndex > doc->lineCount) {
+        size_t diff = endPaintLineIndex - doc->lineCount;
+        if (diff > doc->topPaintLineIndex) {
+            doc->topPaintLineIndex = 0;
+        } else {
+            doc->topPaintLineIndex -= diff;
+        }
+    }
+
+    // Only the visible slice of each line is read, which keeps very long lines cheap to paint. The
+    // slice holds extra characters for the narrow glyphs of proportional fonts.
+    size_t visibleColCount = bitmapWidth / avgCharWidth;
+    if (visibleColCount == 0) {
+        visibleColCount = 1;
+    }
+    size_t paintCharCount = 4 * (visibleColCount + 1);
+    ScrollToCursor(doc, visibleColCount);
+
+    for (size_t i = doc->topPaintLineIndex; i != doc->lineCount; i++) {
+        if (paintRect.bottom - paintRect.top < lineHeight) {
+            break;
+        }
+
+        // Matching may read lines as well, so it comes before the slice is read.
+        DocMatch matches[INCSEARCH_MAX_MATCH_COUNT];
+        size_t matchCount = 0;
+        if (incSearch.active) {
+            matchCount = FindIncSearchMatches(doc, i, doc->leftPaintCharIndex, paintCharCount, matches);
+        }
+
+        size_t length;
+        const wchar_t * line = GetDocLineSlice(doc, i, doc->leftPaintCharIndex, paintCharCount, &length);
+        if (!line) {
+            break;
+        }
+        PaintMatches(&paintRect, line, static_cast<uint>(length), doc->leftPaintCharIndex, matches, matchCount);
+        if (i == doc->cursorLineIndex && paintContentCursor) {
+            PaintCursorLine(&paintRect, line, static_cast<uint>(length), doc->cursorCharIndex - static_cast<uint>(doc->leftPaintCharIndex));
+        } else {
+            PaintLine(&paintRect, line, static_cast<uint>(length));
+        }
+
+        paintRect.left = 0;
+        paintRect.top += lineHeight;
+        doc->lastPaintLineCount++;
+    }
+
+    //---------------------
+    // Paint Status Line
+
+    paintRect.top = bitmapHeight - lineHeight;
+    paintRect.bottom = bitmapHeight;
+ 
+    if (statusPrompt) {
+        FillRect(bitmapDeviceContext, &paintRect, promptBackgroundBrush);
+        SetTextColor(bitmapDeviceContext, config.promptTextColor);
+    } else {
+        FillRect(bitmapDeviceContext, &paintRect, statusBackgroundBrush);
+    }
+
+    if (paintStatusCursor) {
+        PaintCursorLine(&paintRect, statusLine, statusLength, statusCursorChar);
+    } else {
+        DrawTextExW(
+            bitmapDeviceContext,
+            statusLine,
+            statusLength,
+            &paintRect,
+            DT_NOCLIP | DT_NOPREFIX,
+            nullptr);
+    }
+}
+
+static void PasteClipboard(HWND window) {
+    if (!OpenClipboard(window)) {
+        return;
+    }
+
+    HANDLE data = GetClipboardData(CF_UNICODETEXT);
+    if (data) {
+        const wchar_t * text = static_cast<const wchar_t *>(GlobalLock(data));
+        if (text) {
+            ProcessDocTextInput(currentDoc, text, wcslen(text));
+            GlobalUnlock(data);
+        }
+    }
+    CloseClipboard();
+}
+
+LRESULT CALLBACK WindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lparam) {
+    switch (message) {
+        case WM_SIZE:
+        {
+            HDC deviceContext = GetDC(window);
+
+            if (!bitmapDeviceContext) {
+                bitmapDeviceContext = CreateCompatibleDC(deviceContext);
+
+                int ppi = GetDeviceCaps(bitmapDeviceContext, LOGPIXELSY);
+                int lfHeight = 0 - ((config.fontSize * ppi) / 72);
+                HFONT font = CreateFontW(
+                    lfHeight,
+                    0,
+                    0,
+                    0,
+                    FW_DONTCARE,
+                    0,
+                    0,
+                    0,
+                    ANSI_CHARSET,
+                    OUT_DEFAULT_PRECIS,
+                    CLIP_DEFAULT_PRECIS,
+                    DEFAULT_QUALITY,
+                    DEFAULT_PITCH | FF_DONTCARE,
+                    config.fontName);
+                HFONT oldFont = static_cast<HFONT>(SelectObject(bitmapDeviceContext, font));
+                if (oldFont) {
+                    DeleteObject(oldFont);
+                }
+
+                TEXTMETRICW fontMetrics;
+                GetTextMetricsW(bitmapDeviceContext, &fontMetrics);
+                lineHeight = fontMetrics.tmHeight;
+                avgCharWidth = fontMetrics.tmAveCharWidth;
+            }
+
+            bitmapWidth = LOWORD(lparam);
+            bitmapHeight = HIWORD(lparam);
+            HBITMAP bitmap = CreateCompatibleBitmap(deviceContext, bitmapWidth, bitmapHeight);
+            HBITMAP oldBitmap = static_cast<HBITMAP>(SelectObject(bitmapDeviceContext, bitmap));
+            if (oldBitmap) {
+                DeleteObject(oldBitmap);
+            }
+
+            Paint(currentDoc);
+            return 0;
+        }
+
+        case WM_PAINT:
+        {
+            PAINTSTRUCT paintStruct;
+            HDC deviceContext = BeginPaint(window, &paintStruct);
+
+            BitBlt(
+                deviceContext,
+                0, 0, bitmapWidth, bitmapHeight,
+                bitmapDeviceContext,
+                0, 0,
+                SRCCOPY);
+
+            EndPaint(window, &paintStruct);
+            return 0;
+        }
+
+        case WM_CLOSE:
+        {
+            if (saveJob) {
+                bool newPath;
+                FinishDocSave(&newPath); // a failed save leaves the document modified
+            }
+            if (currentDoc->modified) {
+                int promptResult = MessageBoxW(
+                    window,
+                    L"One or more documents contain unsaved changes. Close anyway?",
+                    L"Warning",
+                    MB_YESNO | MB_ICONWARNING | MB_DEFBUTTON2);
+                if (promptResult != IDYES) {
+                    return 0;
+                }
+            }
+            DestroySearchIndex();
+            DestroyWindow(window);
+            return 0;
+        }
+
+        case WM_DESTROY:
+        {
+            PostQuitMessage(0);
+            return 0;
+        }
+
+        case WM_DOCLOAD:
+        {
+            ReceiveLoadChunk(currentDoc, static_cast<uint>(wparam), reinterpret_cast<LoadChunk *>(lparam));
+            MappedFile * mapped = GetMappedFile(currentDoc);
+            if (mapped && mapped->result != RESULT_OK && mapped->loadId == wparam) {
+                if (mapped->result == RESULT_LIMIT_REACHED) {
+                    SetStatusInvalidCommand(L"File too large!");
+                } else if (mapped->result == RESULT_FILE_ERROR) {
+                    SetStatusInvalidCommand(L"Could not read file.");
+                } else {
+                    SetStatusInvalidCommand(L"Out of memory!");
+                }
+            } else if (currentMode != MODE_COMMAND && !statusPrompt) {
+                SetStatusLineNormal();
+            }
+            Paint(currentDoc);
+            InvalidateRect(window, nullptr, false);
+            return 0;
+        }
+
+        case WM_DOCSAVE:
+        {
+            if (!saveJob) {
+                return 0;
+            }
+            bool newPath;
+            ResultCode resultCode = FinishDocSave(&newPath);
+            if (resultCode != RESULT_OK) {
+                SetStatusSaveFailed(resultCode, newPath);
+            } else if (currentMode != MODE_COMMAND && !statusPrompt) {
+                SetStatusLineNormal();
+            }
+            Paint(currentDoc);
+            InvalidateRect(window, nullptr, false);
+            return 0;
+        }
+
+        case WM_SEARCHINDEX:
+        {
+            ReceiveSearchIndexPart(static_cast<uint>(wparam));
+            MoveIncSearchCursor();
+            if (currentMode != MODE_COMMAND && !statusPrompt) {
+                SetStatusLineNormal();
+            }
+            Paint(currentDoc);
+            InvalidateRect(window, nullptr, false);
+            return 0;
+        }
+
+        case WM_TIMER:
+        {
+            if (wparam == SAVE_TIMER_ID && currentMode != MODE_COMMAND && !statusPrompt) {
+                SetStatusLineNormal();
+                Paint(currentDoc);
+                InvalidateRect(window, nullptr, false);
+            }
+            return 0;
+        }
+
+        case WM_PASTE:
+        {
+            if (currentMode == MODE_INSERT) {
+                PasteClipboard(window);
+                SetStatusLineNormal();
+                Paint(currentDoc);
+                InvalidateRect(window, nullptr, false);
+            }
+            return 0;
+        }
+
+        case WM_CHAR:
+        {
+            wchar_t c = static_cast<wchar_t>(wparam);
+
+            switch (currentMode) {
+                case MODE_NORMAL:
+                {
+                    ProcessNormalCharInput(c);
+                    Paint(currentDoc);
+                    InvalidateRect(window, nullptr, false);
+                    break;
+                }
+
+                case MODE_COMMAND:
+                {
+                    ProcessCommandCharInput(c);
+                    Paint(currentDoc);
+                    InvalidateRect(window, nullptr, false);
+                    break;
+                }
+
+                case MODE_INSERT:
+                {
+                    if (c == 0x1b) { // Esc
+                        currentMode = MODE_NORMAL;
+                        EndDocInsert(currentDoc);
+                        if (currentDoc->cursorCharIndex != 0 && currentDoc->cursorCharIndex == GetDocLineLength(currentDoc, currentDoc->cursorLineIndex)) {
+                            currentDoc->cursorCharIndex--;
+                        }
+                        ResetColIndex(currentDoc);
+                    } else if (c == 0x16) { // Ctrl+V
+                        PasteClipboard(window);
+                    } else {
+                        ProcessDocCharInput(currentDoc, c);
+                    }
+                    SetStatusLineNormal();
+                    Paint(currentDoc);
+                    InvalidateRect(window, nullptr, false);
+                    break;
+                }
+            }
+
+            return 0;
+        }
+
+        default:
+        {
+            return DefWindowProcW(window, message, wparam, lparam);
+        }
+    }
+}
+
+//------------
+// Benchmarks
+
+// "MKedit -bench" times the operations below on generated text instead of opening a window, and
+// writes one line per measurement to the standard output. A window application has no console of
+// its own, so the output goes to the console it was started from, or wherever it is redirected,
+// as in "start /wait MKedit -bench > bench.txt". Files are generated in the temporary folder and
+// deleted afterwards.
+
+#define BENCH_EDIT_COUNT 10000
+#define BENCH_LOOKUP_COUNT 100000
+
+static HANDLE benchOutput;
+
+// Writes a line to the benchmark output.
+static void PrintBench(const char * format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int count = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (count < 0) {
+        return;
+    }
+    if (count > static_cast<int>(sizeof(line)) - 2) {
+        count = sizeof(line) - 2;
+    }
+    line[count++] = '\n';
+    WriteBytes(benchOutput, line, count);
+}
+
+static uint64_t GetBenchTime() {
+    LARGE_INTEGER time;
+    QueryPerformanceCounter(&time);
+    return time.QuadPart;
+}
+
+// Returns the seconds passed since a time.
+static double GetBenchSeconds(uint64_t start) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<double>(GetBenchTime() - start) / frequency.QuadPart;
+}
+
+// Generates lines of text of about 60 bytes each, all different. Latin-1 text has an accented
+// letter in every line, which is malformed as UTF-8.
+// Returns NULL on memory allocation failure.
+static char * GenerateBenchText(size_t lineCount, bool latin1, bool crlf, size_t * count) {
+    const size_t maxLineCount = 64;
+    char * bytes = static_cast<char *>(malloc(lineCount * maxLineCount + 1));
+    if (!bytes) {
+        return nullptr;
+    }
+    size_t byteCount = 0;
+    for (size_t i = 0; i != lineCount; i++) {
+        byteCount += snprintf(
+            bytes + byteCount,
+            maxLineCount + 1,
+            "%010zu INFO request %s in %zu ms by worker %zu%s",
+            i,
+            latin1 ? "serv\xE9" "d" : "served",
+            i % 997,
+            i % 16,
+            crlf ? "\r\n" : "\n");
+    }
+    *count = byteCount;
+    return bytes;
+}
+
+// Writes a file into the temporary folder.
+// Returns false on failure.
+static bool WriteBenchFile(const wchar_t * name, const char * bytes, size_t count, wchar_t path[MAX_PATH_COUNT]) {
+    wchar_t folderPath[MAX_PATH_COUNT];
+    DWORD folderLength = GetTempPathW(MAX_PATH_COUNT, folderPath);
+    if (folderLength == 0 || folderLength + wcslen(name) >= MAX_PATH_COUNT) {
+        return false;
+    }
+    swprintf_s(path, MAX_PATH_COUNT, L"%s%s", folderPath, name);
+
+    HANDLE file = CreateFileW(
+        path,
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool writeSuccess = WriteBytes(file, bytes, count);
+    CloseHandle(file);
+    if (!writeSuccess) {
+        DeleteFileW(path);
+    }
+    return writeSuccess;
+}
+
+// Creates a document of generated lines.
+// Returns NULL on memory allocation failure.
+static Doc * CreateBenchDoc(size_t lineCount) {
+    size_t count;
+    char * bytes = GenerateBenchText(lineCount, false, false, &count);
+    if (!bytes) {
+        return nullptr;
+    }
+    Doc * doc;
+    if (CreateDocFromUtf8(bytes, count, &doc) != RESULT_OK) {
+        return nullptr;
+    }
+    return doc;
+}
+
+// Times opening and joining lines near the top of documents of growing size, as Enter, o and dd
+// do, and looking up lines all over them. Both should take the same time whatever the size.
+static void BenchLineEdits() {
+    const size_t lineCounts[] = { 10000, 100000, 1000000, 5000000 };
+    for (size_t i = 0; i != sizeof(lineCounts) / sizeof(lineCounts[0]); i++) {
+        Doc * doc = CreateBenchDoc(lineCounts[i]);
+        if (!doc) {
+            PrintBench("line edits, %zu lines: out of memory", lineCounts[i]);
+            continue;
+        }
+
+        uint64_t start = GetBenchTime();
+        bool success = true;
+        for (size_t j = 0; j != BENCH_EDIT_COUNT && success; j++) {
+            size_t lineIndex = 10 + j % 100;
+            success = InsertDocText(doc, lineIndex, 5, L"\n", 1) == RESULT_OK
+                && RemoveDocText(doc, lineIndex, 5, 1) == RESULT_OK;
+        }
+        double editSeconds = GetBenchSeconds(start);
+
+        start = GetBenchTime();
+        size_t lineIndex = 0;
+        size_t totalLength = 0;
+        for (size_t j = 0; j != BENCH_LOOKUP_COUNT; j++) {
+            lineIndex = (lineIndex + 7919) % doc->lineCount;
+            size_t length;
+            GetDocLine(doc, lineIndex, &length);
+            totalLength += length;
+        }
+        double lookupSeconds = GetBenchSeconds(start);
+
+        if (success) {
+            PrintBench(
+                "line edits, %zu lines: %.2f us per line split and join, %.2f us per line lookup (%zu chars)",
+                lineCounts[i],
+                1e6 * editSeconds / BENCH_EDIT_COUNT,
+                1e6 * lookupSeconds / BENCH_LOOKUP_COUNT,
+                totalLength);
+        } else {
+            PrintBench("line edits, %zu lines: out of memory", lineCounts[i]);
+        }
+        DestroyDoc(doc);
+    }
+}
+
+// Text read and written through the callbacks of MkUtf8Read and MkUtf8WriteWcs, so the transcoders
+// of Base.cpp can be compared with them.
+struct MkStringBuffer {
+    const char * bytes;
+    size_t count;
+    MkDynArray<wchar_t> chars;
+    MkDynArray<char> writtenBytes;
+};
+
+static bool ReadMkStringBuffer(void * stream, void * buffer, ulong count, void * status) {
+    MkStringBuffer * stringBuffer = static_cast<MkStringBuffer *>(stream);
+    if (count > stringBuffer->count) {
+        count = static_cast<ulong>(stringBuffer->count);
+    }
+    memcpy(buffer, stringBuffer->bytes, count);
+    stringBuffer->bytes += count;
+    stringBuffer->count -= count;
+    return count != 0;
+}
+
+static bool WriteMkStringChars(void * stream, const void * buffer, ulong count, void * status) {
+    MkStringBuffer * stringBuffer = static_cast<MkStringBuffer *>(stream);
+    wchar_t * chars = stringBuffer->chars.Insert(SIZE_MAX, count);
+    if (!chars) {
+        return false;
+    }
+    memcpy(chars, buffer, count * sizeof(wchar_t));
+    return true;
+}
+
+static bool WriteMkStringBytes(void * stream, const void * buffer, ulong count, void * status) {
+    MkStringBuffer * stringBuffer = static_cast<MkStringBuffer *>(stream);
+    char * bytes = stringBuffer->writtenBytes.Insert(SIZE_MAX, count);
+    if (!bytes) {
+        return false;
+    }
+    memcpy(bytes, buffer, count);
+    return true;
+}
+
+// Decodes UTF-8 with MkUtf8Read into the chars of a buffer, which must have been initialized.
+static bool DecodeWithMkString(MkStringBuffer * stringBuffer, const char * bytes, size_t count) {
+    stringBuffer->bytes = bytes;
+    stringBuffer->count = count;
+    stringBuffer->chars.Remove(0, stringBuffer->chars.count);
+    ulong readStatus;
+    return MkUtf8Read(ReadMkStringBuffer, stringBuffer, &readStatus, WriteMkStringChars, stringBuffer, nullptr);
+}
+
+// Encodes UTF-16 with MkUtf8WriteWcs into the written bytes of a buffer, which must have been
+// initialized.
+static bool EncodeWithMkString(MkStringBuffer * stringBuffer, const wchar_t * chars, size_t length) {
+    stringBuffer->writtenBytes.Remove(0, stringBuffer->writtenBytes.count);
+    return MkUtf8WriteWcs(chars, length, true, WriteMkStringBytes, stringBuffer, nullptr);
+}
+
+// Times decoding and encoding a million lines of text, ASCII only and with an accented letter in
+// every line, against MkUtf8Read and MkUtf8WriteWcs. Their output arrays are allocated up front, so
+// only the transcoding is timed.
+static void BenchTranscoding() {
+    const char * names[] = { "ascii", "accented" };
+    for (uint i = 0; i != 2; i++) {
+        size_t count;
+        char * bytes = GenerateBenchText(1000000, false, false, &count);
+        wchar_t * chars = bytes ? static_cast<wchar_t *>(malloc((count + 1) * sizeof(wchar_t))) : nullptr;
+        char * encodedBytes = chars ? static_cast<char *>(malloc(3 * count + 1)) : nullptr;
+        MkStringBuffer stringBuffer;
+        stringBuffer.chars.Init(1024 * 1024);
+        stringBuffer.writtenBytes.Init(1024 * 1024);
+        if (!encodedBytes || !stringBuffer.chars.SetCapacity(count + 1) || !stringBuffer.writtenBytes.SetCapacity(count + 1)) {
+            PrintBench("transcoding, %s: out of memory", names[i]);
+            stringBuffer.chars.Clear();
+            stringBuffer.writtenBytes.Clear();
+            free(bytes);
+            free(chars);
+            free(encodedBytes);
+            continue;
+        }
+        if (i == 1) {
+            // served becomes servé, which takes as many bytes
+            for (char * served = bytes; (served = strstr(served, "served")) != nullptr; served += 6) {
+                memcpy(served, "serv\xC3\xA9", 6);
+            }
+        }
+
+        uint64_t start = GetBenchTime();
+        size_t length = TranscodeUtf8ToUtf16(bytes, count, chars);
+        double decodeSeconds = GetBenchSeconds(start);
+        start = GetBenchTime();
+        size_t encodedCount = TranscodeUtf16ToUtf8(chars, length, encodedBytes);
+        double encodeSeconds = GetBenchSeconds(start);
+        start = GetBenchTime();
+        bool mkSuccess = DecodeWithMkString(&stringBuffer, bytes, count);
+        double mkDecodeSeconds = GetBenchSeconds(start);
+        start = GetBenchTime();
+        mkSuccess = mkSuccess && EncodeWithMkString(&stringBuffer, chars, length);
+        double mkEncodeSeconds = GetBenchSeconds(start);
+
+        double gigabytes = count / 1e9;
+        PrintBench(
+            "transcoding, %s: decode %.2f GB/s (MkUtf8Read %.2f GB/s), encode %.2f GB/s (MkUtf8WriteWcs %.2f GB/s)%s",
+            names[i],
+            gigabytes / decodeSeconds,
+            gigabytes / mkDecodeSeconds,
+            gigabytes / encodeSeconds,
+            gigabytes / mkEncodeSeconds,
+            mkSuccess && encodedCount == count ? "" : ", failed");
+        stringBuffer.chars.Clear();
+        stringBuffer.writtenBytes.Clear();
+        free(bytes);
+        free(chars);
+        free(encodedBytes);
+    }
+}
+
+// Times searching a document of 10 million lines, about 550 MB, forward from the top for a line
+// added at its end and backward from the bottom for one added at its start, so the whole document
+// is scanned either way. Then times n on text found on every 16th line.
+static void BenchSearch() {
+    const size_t lineCount = 10000000;
+    Doc * doc = CreateBenchDoc(lineCount);
+    if (!doc) {
+        PrintBench("search: out of memory");
+        return;
+    }
+    DocSearch lastSearch;
+    DocSearch firstSearch;
+    DocSearch commonSearch;
+    InitDocSearch(&lastSearch, L"end of the log", 14);
+    InitDocSearch(&firstSearch, L"start of the log", 16);
+    InitDocSearch(&commonSearch, L"by worker 15", 12);
+    ResultCode result = InsertDocText(doc, 0, 0, L"start of the log\n", 17);
+    if (result == RESULT_OK) {
+        result = InsertDocText(doc, doc->lineCount - 1, 0, L"end of the log\n", 15);
+    }
+
+    bool wrapped;
+    size_t lineIndex = 0;
+    size_t charIndex = 0;
+    uint64_t start = GetBenchTime();
+    if (result == RESULT_OK) {
+        result = FindDocText(doc, &lastSearch, false, &lineIndex, &charIndex, &wrapped);
+    }
+    double forwardSeconds = GetBenchSeconds(start);
+
+    lineIndex = doc->lineCount - 1;
+    charIndex = 0;
+    start = GetBenchTime();
+    if (result == RESULT_OK) {
+        result = FindDocText(doc, &firstSearch, true, &lineIndex, &charIndex, &wrapped);
+    }
+    double backwardSeconds = GetBenchSeconds(start);
+
+    lineIndex = 0;
+    charIndex = 0;
+    start = GetBenchTime();
+    for (uint i = 0; i != BENCH_EDIT_COUNT && result == RESULT_OK; i++) {
+        result = FindDocText(doc, &commonSearch, false, &lineIndex, &charIndex, &wrapped);
+    }
+    double nextSeconds = GetBenchSeconds(start);
+
+    if (result == RESULT_OK) {
+        PrintBench(
+            "search, %zu lines: %.1f ms forward to the last line (%.2f GB/s), %.1f ms backward, %.2f us per n",
+            lineCount,
+            1e3 * forwardSeconds,
+            doc->charCount / forwardSeconds / 1e9,
+            1e3 * backwardSeconds,
+            1e6 * nextSeconds / BENCH_EDIT_COUNT);
+    } else {
+        PrintBench("search, %zu lines: failed", lineCount);
+    }
+    DestroyDoc(doc);
+}
+
+// Times regex searches through a document of 10 million lines, about 550 MB, forward from the top
+// for a line added at its end: a pattern that starts with fixed text, which is skipped to, and two
+// that do not, which run the automaton over every byte. Then times n on a pattern found on every
+// 8th line. Literal patterns are searched as text, so each has some regex syntax. The RegexBench
+// project times the engine against std::wregex, which MKedit cannot be built with.
+static void BenchRegex() {
+    const size_t lineCount = 10000000;
+    const wchar_t * patterns[] = { L"end of the lo?g$", L"(start|end) of the log", L"^[a-z]+ of the log$" };
+    Doc * doc = CreateBenchDoc(lineCount);
+    if (!doc) {
+        PrintBench("regex: out of memory");
+        return;
+    }
+    ResultCode result = InsertDocText(doc, doc->lineCount - 1, 0, L"end of the log\n", 15);
+
+    bool wrapped;
+    size_t lineIndex;
+    size_t charIndex;
+    for (uint i = 0; i != sizeof(patterns) / sizeof(patterns[0]) && result == RESULT_OK; i++) {
+        Regex * regex;
+        result = CompileRegex(patterns[i], wcslen(patterns[i]), &regex);
+        if (result != RESULT_OK) {
+            break;
+        }
+        lineIndex = 0;
+        charIndex = 0;
+        uint64_t start = GetBenchTime();
+        result = FindDocRegex(doc, regex, false, &lineIndex, &charIndex, &wrapped);
+        double seconds = GetBenchSeconds(start);
+        DestroyRegex(regex);
+        if (result == RESULT_OK) {
+            PrintBench(
+                "regex, %zu lines, %ls: %.1f ms forward to the last line (%.2f GB/s)",
+                lineCount,
+                patterns[i],
+                1e3 * seconds,
+                doc->charCount / seconds / 1e9);
+        }
+    }
+
+    Regex * regex;
+    double nextSeconds = 0;
+    if (result == RESULT_OK) {
+        result = CompileRegex(L"worker 1[45]$", 13, &regex);
+    }
+    if (result == RESULT_OK) {
+        lineIndex = 0;
+        charIndex = 0;
+        uint64_t start = GetBenchTime();
+        for (uint i = 0; i != BENCH_EDIT_COUNT && result == RESULT_OK; i++) {
+            result = FindDocRegex(doc, regex, false, &lineIndex, &charIndex, &wrapped);
+        }
+        nextSeconds = GetBenchSeconds(start);
+        DestroyRegex(regex);
+    }
+
+    if (result == RESULT_OK) {
+        PrintBench("regex, %zu lines, worker 1[45]$: %.2f us per n", lineCount, 1e6 * nextSeconds / BENCH_EDIT_COUNT);
+    } else {
+        PrintBench("regex, %zu lines: failed", lineCount);
+    }
+    DestroyDoc(doc);
+}
+
+// Waits for the search index to be done, taking the messages of its worker threads.
+// Returns false if it was dropped.
+static bool WaitForSearchIndex() {
+    while (searchIndex && !searchIndex->ready) {
+        MSG message;
+        if (GetMessageW(&message, mainWindow, WM_SEARCHINDEX, WM_SEARCHINDEX) <= 0) {
+            return false;
+        }
+        ReceiveSearchIndexPart(static_cast<uint>(message.wParam));
+    }
+    return searchIndex != nullptr;
+}
+
+// Times indexing text found on every 16th line of a document of 10 million lines, then syncing the
+// index with as many scattered edits as the change log holds, and with none. Every edit adds a
+// match, which the count of matches is checked against.
+static void BenchSearchIndex() {
+    const size_t lineCount = 10000000;
+    const uint syncCount = 20;
+    Doc * doc = CreateBenchDoc(lineCount);
+    if (!doc) {
+        PrintBench("search index: out of memory");
+        return;
+    }
+    DocSearch search;
+    InitDocSearch(&search, L"by worker 15", 12);
+
+    uint64_t start = GetBenchTime();
+    bool success = StartSearchIndex(doc, &search) == RESULT_OK && WaitForSearchIndex();
+    double buildSeconds = GetBenchSeconds(start);
+    size_t matchCount = success ? searchIndex->positions.count : 0;
+
+    double syncSeconds = 0;
+    size_t lineIndex = 0;
+    for (uint i = 0; i != syncCount && success; i++) {
+        for (uint j = 0; j != DOCCHANGE_LOG_COUNT && success; j++) {
+            lineIndex = (lineIndex + 155501) % doc->lineCount;
+            success = InsertDocText(doc, lineIndex, 0, L"by worker 15\n", 13) == RESULT_OK;
+        }
+        start = GetBenchTime();
+        success = success && SyncSearchIndex(doc);
+        syncSeconds += GetBenchSeconds(start);
+    }
+    success = success && searchIndex->positions.count == matchCount + syncCount * DOCCHANGE_LOG_COUNT;
+
+    start = GetBenchTime();
+    for (uint i = 0; i != BENCH_LOOKUP_COUNT && success; i++) {
+        success = SyncSearchIndex(doc);
+    }
+    double currentSeconds = GetBenchSeconds(start);
+
+    if (success) {
+        PrintBench(
+            "search index, %zu lines, %u %s: %.1f ms to index %zu matches, %.2f ms per sync of %d edits, %.3f us per sync without edits",
+            lineCount,
+            searchIndex->threadCount,
+            searchIndex->threadCount == 1 ? "thread" : "threads",
+            1e3 * buildSeconds,
+            matchCount,
+            1e3 * syncSeconds / syncCount,
+            DOCCHANGE_LOG_COUNT,
+            1e6 * currentSeconds / BENCH_LOOKUP_COUNT);
+    } else {
+        PrintBench("search index, %zu lines: failed", lineCount);
+    }
+    DestroySearchIndex();
+    DestroyDoc(doc);
+}
+
+// Times substitutions through a document of a million lines, changing every line and every 16th
+// line, on one thread and on one per processor. Each runs on a new document, so none starts with
+// the undo record of the last one.
+static void BenchSubstitution() {
+    const size_t lineCount = 1000000;
+    const wchar_t * commands[] = { L"/served/done/", L"/worker 15$/worker 16/" };
+    const uint threadCounts[] = { 1, 0 };
+    Doc * lastDoc = currentDoc;
+    uint searchThreadCount = config.searchThreadCount;
+    for (uint i = 0; i != 2; i++) {
+        for (uint j = 0; j != 2; j++) {
+            Doc * doc = CreateBenchDoc(lineCount);
+            if (!doc) {
+                PrintBench("substitution, %zu lines: out of memory", lineCount);
+                continue;
+            }
+            currentDoc = doc;
+            config.searchThreadCount = threadCounts[j];
+            uint threadCount = GetThreadCount(config.searchThreadCount);
+            uint64_t start = GetBenchTime();
+            ExecuteCommandSubstitute(0, doc->lineCount, commands[i], static_cast<ushort>(wcslen(commands[i])));
+            double seconds = GetBenchSeconds(start);
+            if (!statusPrompt && doc->modified) {
+                PrintBench(
+                    "substitution, %zu lines, s%ls, %u %s: %.1f ms",
+                    lineCount,
+                    commands[i],
+                    threadCount,
+                    threadCount == 1 ? "thread" : "threads",
+                    1e3 * seconds);
+            } else {
+                PrintBench("substitution, %zu lines, s%ls: failed", lineCount, commands[i]);
+            }
+            DestroyDoc(doc);
+        }
+    }
+    currentDoc = lastDoc;
+    config.searchThreadCount = searchThreadCount;
+}
+
+// Loads a file in a process of its own, which prints the time taken and the memory used, as the
+// peak memory use of a process cannot be reset between measurements. A thread count of 0 keeps the
+// configured one.
+static void BenchLoadInProcess(const wchar_t * name, uint threadCount, const wchar_t * path) {
+    wchar_t programPath[MAX_PATH_COUNT];
+    wchar_t commandLine[2 * MAX_PATH_COUNT + 64];
+    if (GetModuleFileNameW(nullptr, programPath, MAX_PATH_COUNT) == MAX_PATH_COUNT) {
+        PrintBench("load, %ls: failed", name);
+        return;
+    }
+    swprintf_s(commandLine, 2 * MAX_PATH_COUNT + 64, L"\"%s\" -bench-load %s %u %s", programPath, name, threadCount, path);
+
+    STARTUPINFOW startupInfo = {};
+    startupInfo.cb = sizeof(startupInfo);
+    startupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.hStdOutput = benchOutput;
+    PROCESS_INFORMATION processInfo;
+    SetHandleInformation(benchOutput, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    if (!CreateProcessW(programPath, commandLine, nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startupInfo, &processInfo)) {
+        PrintBench("load, %ls: failed", name);
+        return;
+    }
+    WaitForSingleObject(processInfo.hProcess, INFINITE);
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+}
+
+// Times loading files of a million lines through each way the text can take: kept as UTF-8, kept
+// without CRs, and decoded, with and without CRs. The memory counted is what the process commits,
+// which leaves out the mapped view of the file.
+static void BenchLoading() {
+    const wchar_t * names[] = { L"utf8", L"utf8-crlf", L"latin1", L"latin1-crlf" };
+    for (uint i = 0; i != 4; i++) {
+        size_t count;
+        char * bytes = GenerateBenchText(1000000, i >= 2, i % 2 != 0, &count);
+        wchar_t path[MAX_PATH_COUNT];
+        bool writeSuccess = bytes && WriteBenchFile(L"MKeditBench.txt", bytes, count, path);
+        free(bytes);
+        if (!writeSuccess) {
+            PrintBench("load, %ls: failed to write the file", names[i]);
+            continue;
+        }
+        BenchLoadInProcess(names[i], 0, path);
+        DeleteFileW(path);
+    }
+}
+
+// Times loading files large enough to be loaded lazily with 1 to 16 worker threads, both as UTF-8
+// and decoded. The files are about 500 MB, so every thread gets chunks to scan.
+static void BenchLoadScaling() {
+    const uint threadCounts[] = { 1, 2, 4, 8, 16 };
+    const wchar_t * names[] = { L"lazy-utf8", L"lazy-latin1" };
+    for (uint i = 0; i != 2; i++) {
+        size_t count;
+        char * bytes = GenerateBenchText(8000000, i != 0, false, &count);
+        wchar_t path[MAX_PATH_COUNT];
+        bool writeSuccess = bytes && WriteBenchFile(L"MKeditBench.txt", bytes, count, path);
+        free(bytes);
+        if (!writeSuccess) {
+            PrintBench("load, %ls: failed to write the file", names[i]);
+            continue;
+        }
+        for (uint j = 0; j != sizeof(threadCounts) / sizeof(threadCounts[0]); j++) {
+            BenchLoadInProcess(names[i], threadCounts[j], path);
+        }
+        DeleteFileW(path);
+    }
+}
+
+// Times saving documents of 1000 and a million lines to a file in the temporary folder, atomically
+// and in place, at each level of config.saveDurability. Each save writes the whole file.
+static void BenchSaving() {
+    const size_t lineCounts[] = { 1000, 1000000 };
+    const uint saveCounts[] = { 50, 5 };
+    const char * durabilityNames[] = { "none", "data", "full" };
+    int atomicSave = config.atomicSave;
+    uint saveDurability = config.saveDurability;
+    wchar_t path[MAX_PATH_COUNT];
+    if (!WriteBenchFile(L"MKeditBench.txt", "", 0, path)) {
+        PrintBench("save: failed to write the file");
+        return;
+    }
+    for (uint i = 0; i != 2; i++) {
+        Doc * doc = CreateBenchDoc(lineCounts[i]);
+        if (!doc) {
+            PrintBench("save, %zu lines: out of memory", lineCounts[i]);
+            continue;
+        }
+        for (uint j = 0; j != 6; j++) {
+            config.atomicSave = j < 3;
+            config.saveDurability = j % 3;
+            uint64_t start = GetBenchTime();
+            ResultCode result = RESULT_OK;
+            for (uint k = 0; k != saveCounts[i] && result == RESULT_OK; k++) {
+                result = StartDocSave(doc, path, true);
+                if (result == RESULT_OK) {
+                    bool newPath;
+                    result = FinishDocSave(&newPath);
+                }
+            }
+            double seconds = GetBenchSeconds(start);
+            if (result == RESULT_OK) {
+                PrintBench(
+                    "save, %zu lines, %s, durability %s: %.2f ms per save",
+                    lineCounts[i],
+                    config.atomicSave ? "atomic" : "in place",
+                    durabilityNames[config.saveDurability],
+                    1e3 * seconds / saveCounts[i]);
+            } else {
+                PrintBench("save, %zu lines: failed", lineCounts[i]);
+            }
+        }
+        DestroyDoc(doc);
+    }
+    config.atomicSave = atomicSave;
+    config.saveDurability = saveDurability;
+    DeleteFileW(path);
+}
+
+// Opens the standard output, or the console the process was started from if there is none.
+static bool OpenBenchOutput() {
+    benchOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (benchOutput && benchOutput != INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    if (!AttachConsole(ATTACH_PARENT_PROCESS)) {
+        return false;
+    }
+    benchOutput = CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+    return benchOutput != INVALID_HANDLE_VALUE;
+}
+
+// Runs the benchmarks.
+// Returns the exit code.
+static int RunBenchmarks() {
+    if (!OpenBenchOutput()) {
+        return 1;
+    }
+    BenchLineEdits();
+    BenchTranscoding();
+    BenchSearch();
+    BenchSearchIndex();
+    BenchRegex();
+    BenchSubstitution();
+    BenchLoading();
+    BenchLoadScaling();
+    BenchSaving();
+    return 0;
+}
+
+// Loads a file for BenchLoadInProcess, given its name, the thread count and its path.
+// Returns the exit code.
+static int RunLoadBenchmark(const wchar_t * args) {
+    const wchar_t * threads = wcschr(args, L' ');
+    if (!OpenBenchOutput() || !threads) {
+        return 1;
+    }
+    int nameLength = static_cast<int>(threads - args);
+    wchar_t * path;
+    uint threadCount = wcstoul(threads + 1, &path, 10);
+    if (*path != L' ') {
+        return 1;
+    }
+    path++;
+    char threadText[32] = "";
+    if (threadCount != 0) {
+        config.loadThreadCount = threadCount;
+        snprintf(threadText, sizeof(threadText), ", %u %s", threadCount, threadCount == 1 ? "thread" : "threads");
+    }
+
+    PROCESS_MEMORY_COUNTERS memoryBefore;
+    GetProcessMemoryInfo(GetCurrentProcess(), &memoryBefore, sizeof(memoryBefore));
+    uint64_t start = GetBenchTime();
+    Doc * doc;
+    ResultCode result = LoadFile(path, &doc);
+    if (result == RESULT_OK) {
+        result = FinishDocLoad(doc);
+    }
+    double seconds = GetBenchSeconds(start);
+    PROCESS_MEMORY_COUNTERS memoryAfter;
+    GetProcessMemoryInfo(GetCurrentProcess(), &memoryAfter, sizeof(memoryAfter));
+
+    if (result == RESULT_OK) {
+        PrintBench(
+            "load, %.*ls%s: %.3f s, peak memory +%zu MB, memory after +%zu MB",
+            nameLength,
+            args,
+            threadText,
+            seconds,
+            (memoryAfter.PeakPagefileUsage - memoryBefore.PagefileUsage) >> 20,
+            (memoryAfter.PagefileUsage - memoryBefore.PagefileUsage) >> 20);
+        DestroyDoc(doc);
+    } else {
+        PrintBench("load, %.*ls%s: failed", nameLength, args, threadText);
+    }
+    return 0;
+}
+
+//-------
+// Tests
+
+// "MKedit -test" runs the checks below instead of opening a window. It writes a line for each
+// failure and a summary to the same output as -bench, and exits with the number of failures.
+
+#define TEST_RANDOM_COUNT 100000
+#define TEST_DOC_COUNT 300
+#define TEST_PIECE_RUN_COUNT 64
+#define TEST_PIECE_ATOM_COUNT 24
+#define TEST_REGEX_DEPTH 4
+#define TEST_REGEX_MAX_NODE_COUNT 64
+#define TEST_REGEX_PATTERN_COUNT 4
+#define TEST_REGEX_CURSOR_COUNT 4
+#define TEST_REGEX_LINE_COUNT 200
+#define TEST_REGEX_LINE_LENGTH 60
+
+static uint failedTestCount;
+
+// Returns the next number of a simple generator, so the random checks are the same every run.
+static uint NextTestRandom(uint * seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+// Compares decoding UTF-8 with MkUtf8Read, embedded in ASCII so the block functions come into
+// play as well.
+static void CheckDecoding(MkStringBuffer * stringBuffer, const char * bytes, size_t count) {
+    char text[128];
+    wchar_t chars[128];
+    const size_t paddingCount = 37;
+    if (count > sizeof(text) - 2 * paddingCount) {
+        return;
+    }
+    memset(text, 'a', paddingCount);
+    memcpy(text + paddingCount, bytes, count);
+    memset(text + paddingCount + count, 'z', paddingCount);
+
+    const size_t offsets[] = { paddingCount, 0, paddingCount, 0 };
+    const size_t counts[] = { count, paddingCount + count, paddingCount + count + paddingCount, count + paddingCount };
+    for (uint i = 0; i != 4; i++) {
+        const char * part = text + offsets[i];
+        size_t length = TranscodeUtf8ToUtf16(part, counts[i], chars);
+        if (!DecodeWithMkString(stringBuffer, part, counts[i])
+            || stringBuffer->chars.count != length
+            || memcmp(stringBuffer->chars.elems, chars, length * sizeof(wchar_t)) != 0)
+        {
+            char hex[3 * 64 + 1] = "";
+            for (size_t j = 0; j != count && j != 64; j++) {
+                snprintf(hex + 3 * j, 4, " %02X", static_cast<unsigned char>(bytes[j]));
             }
-        } else {
-            DrawTextExW(
-                bitmapDeviceContext,
-                const_cast<wchar_t *>(currentText),
-                currentLength,
-                &lineRect,
-                DT_NOCLIP | DT_NOPREFIX,
-                nullptr);
+            PrintBench("FAIL decoding differs from MkUtf8Read:%s", hex);
+            failedTestCount++;
+            return;
         }
     }
 }
 
+// Compares encoding UTF-16 with MkUtf8WriteWcs.
+static void CheckEncoding(MkStringBuffer * stringBuffer, const wchar_t * chars, size_t length) {
+    char bytes[3 * 64];
+    if (length > 64) {
+        return;
+    }
+    size_t count = TranscodeUtf16ToUtf8(chars, length, bytes);
+    if (!EncodeWithMkString(stringBuffer, chars, length)
+        || stringBuffer->writtenBytes.count != count
+        || memcmp(stringBuffer->writtenBytes.elems, bytes, count) != 0)
+    {
+        char hex[5 * 64 + 1] = "";
+        for (size_t i = 0; i != length; i++) {
+            snprintf(hex + 5 * i, 6, " %04X", static_cast<uint>(chars[i]));
+        }
+        PrintBench("FAIL encoding differs from MkUtf8WriteWcs:%s", hex);
+        failedTestCount++;
+    }
+}
 
-static void PaintLine(const RECT * textRect, const wchar_t * text, ushort length) {
-    RECT lineRect = *textRect;
+// Checks that the transcoders replace malformed text unit for unit like MkUtf8Read and
+// MkUtf8WriteWcs, on known cases and on random text made of the bytes and units that matter.
+static void TestTranscoders() {
+    const char * malformed[] = {
+        "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xEF\xBF\xBD", // valid
+        "\xC3", "\xE2\x82", "\xF0\x9F\x98", "\xE2\x82x", "\xF0\x9Fx", "\xC3\xC3\xA9", // cut short
+        "\xC0\x80", "\xC1\xBF", "\xE0\x80\x80", "\xE0\x9F\xBF", "\xF0\x80\x80\x80", "\xF0\x8F\xBF\xBF", // overlong
+        "\xED\xA0\x80", "\xED\xBF\xBF", "\xED\xA0\x80\xED\xB0\x80", // surrogates
+        "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF7\xBF\xBF\xBF", "\xF8\x88\x80\x80\x80", "\xFE", "\xFF", // beyond
+        "\x80", "\xBF\xBF", "\xC3\xA9\xA9", "\xE2\x28\xA1", "\xC3\x28", // stray
+    };
+    MkStringBuffer stringBuffer;
+    stringBuffer.chars.Init(256);
+    stringBuffer.writtenBytes.Init(256);
+    for (size_t i = 0; i != sizeof(malformed) / sizeof(malformed[0]); i++) {
+        CheckDecoding(&stringBuffer, malformed[i], strlen(malformed[i]));
+    }
 
-    const wchar_t * currentText = text;
-    ushort currentLength = length;
-    size_t nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
-    ushort nextTabOffset = static_cast<ushort>(min(nextTabIndex, MAX_LINE_LENGTH));
-    while (nextTabOffset != MAX_LINE_LENGTH) {
-        SIZE extent;
+    const unsigned char testBytes[] = {
+        'a', '\n', 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF,
+        0xE0, 0xE1, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xF7, 0xF8, 0xFF,
+    };
+    const wchar_t testChars[] = { L'a', L'\n', 0xE9, 0x7FF, 0x800, 0x20AC, 0xD800, 0xDBFF, 0xDC00, 0xDFFF, 0xFFFD, 0xFFFF };
+    uint seed = 1;
+    for (uint i = 0; i != TEST_RANDOM_COUNT; i++) {
+        char bytes[16];
+        wchar_t chars[16];
+        size_t count = 1 + NextTestRandom(&seed) % 16;
+        for (size_t j = 0; j != count; j++) {
+            bytes[j] = static_cast<char>(testBytes[NextTestRandom(&seed) % sizeof(testBytes)]);
+            chars[j] = testChars[NextTestRandom(&seed) % (sizeof(testChars) / sizeof(testChars[0]))];
+        }
+        CheckDecoding(&stringBuffer, bytes, count);
+        CheckEncoding(&stringBuffer, chars, count);
+    }
+    stringBuffer.chars.Clear();
+    stringBuffer.writtenBytes.Clear();
+}
 
-        GetTextExtentPoint32W(
-            bitmapDeviceContext,
-            currentText,
-            nextTabOffset,
-            &extent);
-        DrawTextExW(
-            bitmapDeviceContext,
-            const_cast<wchar_t *>(currentText),
-            nextTabOffset,
-            &lineRect,
-            DT_NOCLIP | DT_NOPREFIX,
-            nullptr);
-        lineRect.left += extent.cx;
-        if (lineRect.left >= lineRect.right) {
+// Finds every match of a search in a document the way a new index does.
+// Returns false on memory allocation failure.
+static bool FindTestMatches(Doc * doc, const DocSearch * search, MkDynArray<size_t> * positions) {
+    DocSnapshot * snapshot;
+    if (CreateDocSnapshot(doc, &snapshot) != RESULT_OK) {
+        return false;
+    }
+    positions->Remove(0, positions->count);
+    size_t found[64];
+    size_t pos = 0;
+    size_t count;
+    bool success = true;
+    do {
+        count = FindDocSnapshotText(snapshot, search, pos, doc->charCount, found, 64);
+        size_t * inserted = count != 0 ? positions->Insert(SIZE_MAX, count) : nullptr;
+        if (count != 0 && !inserted) {
+            success = false;
             break;
         }
+        if (count != 0) {
+            memcpy(inserted, found, count * sizeof(size_t));
+            pos = found[count - 1] + 1;
+        }
+    } while (count == 64);
+    DestroyDocSnapshot(snapshot);
+    return success;
+}
 
-        GetTextExtentPoint32W(
-            bitmapDeviceContext,
-            tabSpaces,
-            config.tabWidth,
-            &extent);
-        DrawTextExW(
-            bitmapDeviceContext,
-            tabSpaces,
-            config.tabWidth,
-            &lineRect,
-            DT_NOCLIP | DT_NOPREFIX,
-            nullptr);
-        lineRect.left += extent.cx;
-        if (lineRect.left >= lineRect.right) {
-            break;
+// Returns whether the search index holds the positions of a list.
+static bool IsSearchIndexEqual(const MkDynArray<size_t> * positions) {
+    return searchIndex->positions.count == positions->count
+        && memcmp(searchIndex->positions.elems, positions->elems, positions->count * sizeof(size_t)) == 0;
+}
+
+// Makes random text of a few letters, so matches are frequent, overlap and cross line breaks.
+// Returns NULL on memory allocation failure.
+static wchar_t * MakeTestText(uint * seed, const wchar_t * letters, size_t letterCount, size_t length) {
+    wchar_t * chars = static_cast<wchar_t *>(malloc((length + 1) * sizeof(wchar_t)));
+    if (chars) {
+        for (size_t i = 0; i != length; i++) {
+            chars[i] = letters[NextTestRandom(seed) % letterCount];
+        }
+    }
+    return chars;
+}
+
+// Puts a document together from short pieces of random text, each of them UTF-8, UTF-8 keeping
+// its CRs or UTF-16, so matches often cross pieces. The pieces point into the buffers given, which
+// must stay as long as the document, and the text is written to another as the document shows it.
+// Returns NULL on memory allocation failure.
+static Doc * MakeTestPieceDoc(uint * seed, char * bytes, wchar_t * chars, wchar_t * text, size_t * length) {
+    const char * atoms[] = { "a", "b", "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\n", "\r" };
+    Doc * doc = CreateEmptyDoc();
+    size_t count = 0;
+    size_t charCount = 0;
+    *length = 0;
+    uint runCount = 1 + NextTestRandom(seed) % TEST_PIECE_RUN_COUNT;
+    for (uint i = 0; doc && i != runCount; i++) {
+        uint encoding = NextTestRandom(seed) % 3;
+        bool crlf = encoding == 1;
+        size_t runStart = count;
+        uint atomCount = 1 + NextTestRandom(seed) % TEST_PIECE_ATOM_COUNT;
+        for (uint j = 0; j != atomCount; j++) {
+            const char * atom = atoms[NextTestRandom(seed) % 7];
+            if (crlf && atom[0] == '\n') {
+                bytes[count++] = '\r';
+            }
+            size_t atomLength = strlen(atom);
+            memcpy(bytes + count, atom, atomLength);
+            count += atomLength;
         }
 
-        nextTabOffset++;
-        currentText += nextTabOffset;
-        currentLength -= nextTabOffset;
-        nextTabIndex = MkWcsFindCharIndex(currentText, currentLength, L'\t');
-        nextTabOffset = static_cast<ushort>(min(nextTabIndex, MAX_LINE_LENGTH));
+        // The text shown is the run decoded, without the CR of each CR LF if the piece keeps them.
+        size_t runLength = TranscodeUtf8ToUtf16(bytes + runStart, count - runStart, text + *length);
+        size_t keptLength = runLength;
+        if (crlf) {
+            keptLength = StripDecodedCarriageReturns(text + *length, runLength);
+        }
+
+        DocPiece pieces[2];
+        size_t pieceCount;
+        if (encoding == 2) {
+            memcpy(chars + charCount, text + *length, runLength * sizeof(wchar_t));
+            pieceCount = SplitDocUtf16(chars + charCount, runLength, pieces);
+            charCount += runLength;
+            count = runStart;
+        } else {
+            pieceCount = SplitDocUtf8(bytes + runStart, count - runStart, crlf, pieces);
+        }
+        *length += keptLength;
+        if (AppendDocPieces(doc, pieces, pieceCount) != RESULT_OK) {
+            DestroyDoc(doc);
+            doc = nullptr;
+        }
     }
+    return doc;
+}
 
-    if (nextTabOffset == MAX_LINE_LENGTH) {
-        DrawTextExW(
-            bitmapDeviceContext,
-            const_cast<wchar_t *>(currentText),
-            currentLength,
-            &lineRect,
-            DT_NOCLIP | DT_NOPREFIX,
-            nullptr);
+// Checks text search in documents made of short pieces against comparing the text at every
+// position: FindDocSnapshotText on the whole document and between random positions, and
+// FilterDocSnapshotText on every position.
+static void TestSearch() {
+    const wchar_t * texts[] = {
+        L"ab", L"a\nb", L"\r\n", L"b\r", L"\n\n", L"aaa", L"\xE9\x20AC", L"\xD83D\xDE00" L"a", L"\xE9\n\xD83D\xDE00",
+    };
+    const uint textCount = sizeof(texts) / sizeof(texts[0]);
+    const size_t maxCount = TEST_PIECE_RUN_COUNT * (TEST_PIECE_ATOM_COUNT * 4 + 1);
+    char * bytes = static_cast<char *>(malloc(maxCount));
+    wchar_t * chars = static_cast<wchar_t *>(malloc(maxCount * sizeof(wchar_t)));
+    wchar_t * text = static_cast<wchar_t *>(malloc(maxCount * sizeof(wchar_t)));
+    size_t * expected = static_cast<size_t *>(malloc((maxCount + 1) * sizeof(size_t)));
+    size_t * positions = static_cast<size_t *>(malloc((maxCount + 1) * sizeof(size_t)));
+    MkDynArray<size_t> found;
+    found.Init(1024);
+    uint seed = 21;
+    for (uint i = 0; i != TEST_DOC_COUNT; i++) {
+        size_t length;
+        Doc * doc = bytes && chars && text && expected && positions ? MakeTestPieceDoc(&seed, bytes, chars, text, &length) : nullptr;
+        DocSnapshot * snapshot;
+        if (!doc || CreateDocSnapshot(doc, &snapshot) != RESULT_OK) {
+            DestroyDoc(doc);
+            PrintBench("FAIL search: out of memory");
+            failedTestCount++;
+            break;
+        }
+        if (doc->charCount != length) {
+            PrintBench("FAIL search, round %u: the document has %zu characters, %zu expected", i, doc->charCount, length);
+            failedTestCount++;
+        }
+
+        for (uint j = 0; j != textCount && doc->charCount == length; j++) {
+            DocSearch search;
+            size_t searchLength = wcslen(texts[j]);
+            InitDocSearch(&search, texts[j], searchLength);
+            size_t expectedCount = 0;
+            for (size_t pos = 0; pos + searchLength <= length; pos++) {
+                if (memcmp(text + pos, texts[j], searchLength * sizeof(wchar_t)) == 0) {
+                    expected[expectedCount++] = pos;
+                }
+            }
+
+            bool equal = FindTestMatches(doc, &search, &found)
+                && found.count == expectedCount
+                && memcmp(found.elems, expected, expectedCount * sizeof(size_t)) == 0;
+            if (equal) {
+                size_t start = NextTestRandom(&seed) % (length + 1);
+                size_t end = start + NextTestRandom(&seed) % (length + 1 - start);
+                size_t first = 0;
+                while (first != expectedCount && expected[first] < start) {
+                    first++;
+                }
+                size_t last = first;
+                while (last != expectedCount && expected[last] < end && last - first != 64) {
+                    last++;
+                }
+                size_t count = FindDocSnapshotText(snapshot, &search, start, end, positions, 64);
+                equal = count == last - first && memcmp(positions, expected + first, count * sizeof(size_t)) == 0;
+            }
+            if (equal) {
+                for (size_t pos = 0; pos <= length; pos++) {
+                    positions[pos] = pos;
+                }
+                size_t keptCount = FilterDocSnapshotText(snapshot, &search, positions, length + 1, positions);
+                equal = keptCount == expectedCount && memcmp(positions, expected, keptCount * sizeof(size_t)) == 0;
+            }
+            if (!equal) {
+                PrintBench("FAIL search, round %u: the matches of text %u differ from %zu found by comparing", i, j, expectedCount);
+                failedTestCount++;
+            }
+        }
+        DestroyDocSnapshot(snapshot);
+        DestroyDoc(doc);
     }
+    found.Clear();
+    free(bytes);
+    free(chars);
+    free(text);
+    free(expected);
+    free(positions);
 }
 
-static void Paint(Doc * doc) {
-    doc->lastPaintLineCount = 0;
+// Checks that syncing the search index with random edits keeps the same matches as searching the
+// text afresh, and as a new index once the edits are done. Some rounds make more edits than the
+// change log holds, which starts the index over.
+static void TestSearchIndexSync() {
+    const wchar_t * texts[] = { L"aba", L"a\nb", L"aa", L"\n" };
+    const wchar_t letters[] = { L'a', L'a', L'b', L'\n' };
+    MkDynArray<size_t> positions;
+    positions.Init(1024);
+    uint seed = 22;
+    for (uint i = 0; i != TEST_DOC_COUNT; i++) {
+        size_t length = 1 + NextTestRandom(&seed) % 4000;
+        wchar_t * chars = MakeTestText(&seed, letters, 4, length);
+        Doc * doc;
+        if (!chars || CreateDocFromBuffer(chars, length, &doc) != RESULT_OK) {
+            PrintBench("FAIL search index sync: out of memory");
+            failedTestCount++;
+            break;
+        }
+        DocSearch search;
+        InitDocSearch(&search, texts[i % 4], wcslen(texts[i % 4]));
+
+        bool success = StartSearchIndex(doc, &search) == RESULT_OK && WaitForSearchIndex();
+        bool equal = true;
+        for (uint step = 0; step != 10 && success && equal; step++) {
+            uint editCount = NextTestRandom(&seed) % (step == 9 ? DOCCHANGE_LOG_COUNT + 8 : 12);
+            for (uint j = 0; j != editCount && success; j++) {
+                size_t charIndex;
+                size_t pos = NextTestRandom(&seed) % (doc->charCount + 1);
+                size_t lineIndex = GetDocPosLine(doc, pos, &charIndex);
+                if (NextTestRandom(&seed) % 2 == 0) {
+                    wchar_t inserted[8];
+                    size_t insertedLength = 1 + NextTestRandom(&seed) % 8;
+                    for (size_t k = 0; k != insertedLength; k++) {
+                        inserted[k] = letters[NextTestRandom(&seed) % 4];
+                    }
+                    success = InsertDocText(doc, lineIndex, charIndex, inserted, insertedLength) == RESULT_OK;
+                } else if (pos != doc->charCount) {
+                    size_t removedLength = 1 + NextTestRandom(&seed) % 8;
+                    if (removedLength > doc->charCount - pos) {
+                        removedLength = doc->charCount - pos;
+                    }
+                    success = RemoveDocText(doc, lineIndex, charIndex, removedLength) == RESULT_OK;
+                }
+            }
+            // with too many edits, the sync starts a new index instead
+            success = success && (SyncSearchIndex(doc) || WaitForSearchIndex()) && FindTestMatches(doc, &search, &positions);
+            equal = !success || IsSearchIndexEqual(&positions);
+            if (!equal) {
+                PrintBench(
+                    "FAIL search index sync, round %u: %zu matches after %u edits, %zu when searched afresh",
+                    i,
+                    searchIndex->positions.count,
+                    editCount,
+                    positions.count);
+                failedTestCount++;
+            }
+        }
 
-    if (bitmapWidth == 0 || bitmapHeight == 0) {
-        return;
+        if (success && equal) {
+            DestroySearchIndex();
+            success = StartSearchIndex(doc, &search) == RESULT_OK && WaitForSearchIndex();
+            if (success && !IsSearchIndexEqual(&positions)) {
+                PrintBench(
+                    "FAIL search index sync, round %u: a new index has %zu matches, %zu expected",
+                    i,
+                    searchIndex->positions.count,
+                    positions.count);
+                failedTestCount++;
+            }
+        }
+        if (!success) {
+            PrintBench("FAIL search index sync, round %u: failed", i);
+            failedTestCount++;
+        }
+        DestroySearchIndex();
+        DestroyDoc(doc);
     }
+    positions.Clear();
+}
 
-    RECT paintRect;
-    paintRect.left = 0;
-    paintRect.top = 0;
-    paintRect.right = bitmapWidth;
-    paintRect.bottom = bitmapHeight;
-    FillRect(bitmapDeviceContext, &paintRect, backgroundBrush);
+enum TestRegexNodeType {
+    TESTREGEXNODE_EMPTY,
+    TESTREGEXNODE_SET,
+    TESTREGEXNODE_CONCAT,
+    TESTREGEXNODE_ALTERNATE,
+    TESTREGEXNODE_REPEAT,
+    TESTREGEXNODE_LINE_START,
+    TESTREGEXNODE_LINE_END,
+};
 
-    SetTextColor(bitmapDeviceContext, config.textColor);
-    SetBkMode(bitmapDeviceContext, TRANSPARENT);
+// A pattern as the reference matcher reads it, a tree that is written out in the pattern syntax
+// for the engine.
+struct TestRegexNode {
+    TestRegexNodeType type;
+    uint first; // SET: index into testRegexSets, CONCAT, ALTERNATE and REPEAT: first operand
+    uint second; // CONCAT and ALTERNATE: second operand
+    uint minCount;
+    uint maxCount; // UINT_MAX for no limit
+};
 
-    size_t paintLineCount = bitmapHeight / lineHeight;
-    if (paintLineCount == 0) {
-        return;
+// A set of characters in test patterns, written in the pattern syntax and as ranges of code points.
+// A negated set holds the code points outside its ranges. Some ranges cross from one length of
+// UTF-8 encoding to the next.
+struct TestRegexSet {
+    const wchar_t * pattern;
+    ulong first[4];
+    ulong last[4];
+    uint rangeCount;
+    bool negated;
+};
+
+// the sets of testRegexSets that patterns are built from by hand
+#define TESTREGEXSET_A 0
+#define TESTREGEXSET_B 1
+#define TESTREGEXSET_AB 2
+
+static const TestRegexSet testRegexSets[] = {
+    { L"a", { L'a' }, { L'a' }, 1, false },
+    { L"b", { L'b' }, { L'b' }, 1, false },
+    { L"[ab]", { L'a' }, { L'b' }, 1, false },
+    { L".", {}, {}, 0, true },
+    { L"[^a]", { L'a' }, { L'a' }, 1, true },
+    { L"\\w", { L'0', L'A', L'_', L'a' }, { L'9', L'Z', L'_', L'z' }, 4, false },
+    { L"\\W", { L'0', L'A', L'_', L'a' }, { L'9', L'Z', L'_', L'z' }, 4, true },
+    { L"\\s", { L'\t', L' ' }, { L'\r', L' ' }, 2, false },
+    { L"\\S", { L'\t', L' ' }, { L'\r', L' ' }, 2, true },
+    { L"\xE9", { 0xE9 }, { 0xE9 }, 1, false },
+    { L"\xD83D\xDE00", { 0x1F600 }, { 0x1F600 }, 1, false },
+    { L"[\x7F-\xE9]", { 0x7F }, { 0xE9 }, 1, false },
+    { L"[\xE0-\x20AC]", { 0xE0 }, { 0x20AC }, 1, false },
+    { L"[^\xE9-\x20AC]", { 0xE9 }, { 0x20AC }, 1, true },
+    { L"[\x20AC-\xD83D\xDE00]", { 0x20AC }, { 0x1F600 }, 1, false },
+    { L"[\xD83D\xDE00-\xDBFF\xDFFF]", { 0x1F600 }, { 0x10FFFF }, 1, false },
+    { L"[b\xE9\r]", { L'\r', L'b', 0xE9 }, { L'\r', L'b', 0xE9 }, 3, false },
+};
+
+// The buffers of the regex checks, each with room for the longest text.
+struct TestRegexBuffers {
+    char * bytes; // of a line in UTF-8
+    char * marks;
+    char * expectedMarks;
+    size_t * byteOffsets; // of each position of the line
+    size_t * matchEnds;
+    size_t * lineStarts;
+    char * scratch;
+};
+
+static uint AddTestRegexNode(TestRegexNode * nodes, uint * nodeCount, TestRegexNodeType type, uint first, uint second, uint minCount, uint maxCount) {
+    TestRegexNode * node = &nodes[*nodeCount];
+    node->type = type;
+    node->first = first;
+    node->second = second;
+    node->minCount = minCount;
+    node->maxCount = maxCount;
+    return (*nodeCount)++;
+}
+
+// Makes a random tree of at most TEST_REGEX_DEPTH levels below the root.
+// Returns its root.
+static uint MakeTestRegex(uint * seed, uint depth, TestRegexNode * nodes, uint * nodeCount) {
+    const uint repeats[][2] = { { 0, UINT_MAX }, { 1, UINT_MAX }, { 0, 1 }, { 2, 2 }, { 1, 3 }, { 2, UINT_MAX }, { 0, 2 } };
+    uint choice = NextTestRandom(seed) % (depth == TEST_REGEX_DEPTH ? 4 : 10);
+    if (choice < 3) {
+        uint set = NextTestRandom(seed) % (sizeof(testRegexSets) / sizeof(testRegexSets[0]));
+        return AddTestRegexNode(nodes, nodeCount, TESTREGEXNODE_SET, set, 0, 0, 0);
+    }
+    if (choice == 3) {
+        const TestRegexNodeType types[] = { TESTREGEXNODE_EMPTY, TESTREGEXNODE_LINE_START, TESTREGEXNODE_LINE_END };
+        return AddTestRegexNode(nodes, nodeCount, types[NextTestRandom(seed) % 3], 0, 0, 0, 0);
     }
-    paintLineCount--; // space for status line
 
-    //---------------------------
-    // Paint Working Folder Line
+    uint first = MakeTestRegex(seed, depth + 1, nodes, nodeCount);
+    if (choice >= 8) {
+        const uint * counts = repeats[NextTestRandom(seed) % 7];
+        return AddTestRegexNode(nodes, nodeCount, TESTREGEXNODE_REPEAT, first, 0, counts[0], counts[1]);
+    }
+    uint second = MakeTestRegex(seed, depth + 1, nodes, nodeCount);
+    return AddTestRegexNode(nodes, nodeCount, choice == 7 ? TESTREGEXNODE_ALTERNATE : TESTREGEXNODE_CONCAT, first, second, 0, 0);
+}
 
-    if (paintLineCount != 0) {
-        paintRect.bottom = lineHeight;
+// Writes a tree out in the pattern syntax, with parentheses around every alternation and
+// everything repeated. Trees of TEST_REGEX_DEPTH levels stay well within REGEX_MAX_LENGTH.
+static void WriteTestRegex(const TestRegexNode * nodes, uint index, wchar_t * pattern, size_t * length) {
+    const TestRegexNode * node = &nodes[index];
+    switch (node->type) {
+        case TESTREGEXNODE_EMPTY:
+        {
+            break;
+        }
 
-        wchar_t workingFolderLine[MAX_PATH + 32];
-        swprintf_s(workingFolderLine, MAX_PATH + 32, L"Working Folder: %s", workingFolderPath);
+        case TESTREGEXNODE_SET:
+        {
+            const wchar_t * set = testRegexSets[node->first].pattern;
+            size_t setLength = wcslen(set);
+            memcpy(pattern + *length, set, setLength * sizeof(wchar_t));
+            *length += setLength;
+            break;
+        }
 
-        DrawTextExW(
-            bitmapDeviceContext,
-            workingFolderLine,
-            -1,
-            &paintRect,
-            DT_NOCLIP | DT_NOPREFIX,
-            nullptr);
+        case TESTREGEXNODE_CONCAT:
+        {
+            WriteTestRegex(nodes, node->first, pattern, length);
+            WriteTestRegex(nodes, node->second, pattern, length);
+            break;
+        }
 
-        paintLineCount--;
+        case TESTREGEXNODE_ALTERNATE:
+        {
+            pattern[(*length)++] = L'(';
+            WriteTestRegex(nodes, node->first, pattern, length);
+            pattern[(*length)++] = L'|';
+            WriteTestRegex(nodes, node->second, pattern, length);
+            pattern[(*length)++] = L')';
+            break;
+        }
+
+        case TESTREGEXNODE_REPEAT:
+        {
+            pattern[(*length)++] = L'(';
+            WriteTestRegex(nodes, node->first, pattern, length);
+            pattern[(*length)++] = L')';
+            if (node->maxCount == UINT_MAX && node->minCount < 2) {
+                pattern[(*length)++] = node->minCount == 0 ? L'*' : L'+';
+            } else if (node->minCount == 0 && node->maxCount == 1) {
+                pattern[(*length)++] = L'?';
+            } else if (node->maxCount == UINT_MAX) {
+                *length += swprintf_s(pattern + *length, 16, L"{%u,}", node->minCount);
+            } else if (node->minCount == node->maxCount) {
+                *length += swprintf_s(pattern + *length, 16, L"{%u}", node->minCount);
+            } else {
+                *length += swprintf_s(pattern + *length, 16, L"{%u,%u}", node->minCount, node->maxCount);
+            }
+            break;
+        }
+
+        case TESTREGEXNODE_LINE_START:
+        {
+            pattern[(*length)++] = L'^';
+            break;
+        }
+
+        case TESTREGEXNODE_LINE_END:
+        {
+            pattern[(*length)++] = L'$';
+            break;
+        }
     }
+}
 
-    //------------------------
-    // Paint Doc Title Line
+// Returns whether a position of a line lies between the units of a pair.
+static bool IsTestMidPair(const wchar_t * line, size_t length, size_t pos) {
+    return pos != 0
+        && pos < length
+        && line[pos] >= 0xDC00
+        && line[pos] <= 0xDFFF
+        && line[pos - 1] >= 0xD800
+        && line[pos - 1] <= 0xDBFF;
+}
 
-    if (paintLineCount != 0) {
-        paintRect.top += lineHeight;
-        paintRect.bottom += lineHeight;
-        FillRect(bitmapDeviceContext, &paintRect, docTitleBackgroundBrush);
+// Marks where the matches of a tree end that start where marked, in arrays of a flag for each
+// position of a line, by plain set operations rather than automata. Each level of the tree takes
+// two arrays of scratch and leaves those behind them to the levels below.
+static void MatchTestRegex(const TestRegexNode * nodes, uint index, const wchar_t * line, size_t length, const char * starts, char * ends, char * scratch) {
+    const TestRegexNode * node = &nodes[index];
+    size_t size = length + 1;
+    char * below = scratch + 2 * size;
+    switch (node->type) {
+        case TESTREGEXNODE_EMPTY:
+        {
+            memcpy(ends, starts, size);
+            break;
+        }
 
-        wchar_t docTitleLine[MAX_PATH_COUNT + 32];
-        if (doc->title[0] == L'\0') {
-            wcscpy_s(docTitleLine, MAX_PATH_COUNT + 32, L"<UNTITLED>");
-        } else {
-            wcscpy_s(docTitleLine, MAX_PATH_COUNT + 32, doc->title);
-            if (doc->timestamp == 0) {
-                wcscat_s(docTitleLine, MAX_PATH_COUNT + 32, L" <NEW>");
+        case TESTREGEXNODE_SET:
+        {
+            const TestRegexSet * set = &testRegexSets[node->first];
+            memset(ends, 0, size);
+            for (size_t pos = 0; pos != length; pos++) {
+                if (!starts[pos]) {
+                    continue;
+                }
+                ulong c = line[pos];
+                size_t unitCount = 1;
+                if (IsTestMidPair(line, length, pos + 1)) {
+                    c = 0x10000 + ((c - 0xD800) << 10 | (line[pos + 1] - 0xDC00));
+                    unitCount = 2;
+                }
+                bool inRanges = false;
+                for (uint i = 0; i != set->rangeCount; i++) {
+                    inRanges = inRanges || (c >= set->first[i] && c <= set->last[i]);
+                }
+                if (c != L'\n' && inRanges != set->negated) {
+                    ends[pos + unitCount] = true;
+                }
             }
+            break;
         }
-        if (doc->modified) {
-            wcscat_s(docTitleLine, MAX_PATH_COUNT + 32, L" (modified)");
+
+        case TESTREGEXNODE_CONCAT:
+        {
+            MatchTestRegex(nodes, node->first, line, length, starts, scratch, below);
+            MatchTestRegex(nodes, node->second, line, length, scratch, ends, below);
+            break;
+        }
+
+        case TESTREGEXNODE_ALTERNATE:
+        {
+            MatchTestRegex(nodes, node->first, line, length, starts, ends, below);
+            MatchTestRegex(nodes, node->second, line, length, starts, scratch, below);
+            for (size_t pos = 0; pos != size; pos++) {
+                if (scratch[pos]) {
+                    ends[pos] = true;
+                }
+            }
+            break;
+        }
+
+        case TESTREGEXNODE_REPEAT:
+        {
+            char * current = scratch;
+            char * next = scratch + size;
+            memcpy(current, starts, size);
+            for (uint i = 0; i != node->minCount; i++) {
+                MatchTestRegex(nodes, node->first, line, length, current, next, below);
+                memcpy(current, next, size);
+            }
+            memcpy(ends, current, size);
+
+            // Once a round reaches no new end, no later one can.
+            for (uint i = node->minCount; i != node->maxCount; i++) {
+                MatchTestRegex(nodes, node->first, line, length, current, next, below);
+                bool added = false;
+                for (size_t pos = 0; pos != size; pos++) {
+                    if (next[pos] && !ends[pos]) {
+                        ends[pos] = true;
+                        added = true;
+                    }
+                }
+                if (!added) {
+                    break;
+                }
+                memcpy(current, next, size);
+            }
+            break;
         }
 
-        DrawTextExW(
-            bitmapDeviceContext,
-            docTitleLine,
-            -1,
-            &paintRect,
-            DT_NOCLIP | DT_NOPREFIX,
-            nullptr);
+        case TESTREGEXNODE_LINE_START:
+        {
+            memset(ends, 0, size);
+            ends[0] = starts[0];
+            break;
+        }
 
-        paintLineCount--;
+        case TESTREGEXNODE_LINE_END:
+        {
+            memset(ends, 0, size);
+            ends[length] = starts[length];
+            break;
+        }
     }
+}
 
-    //-----------------
-    // Paint Content
+// Finds the longest match of a tree starting at each position of a text with the reference
+// matcher, storing where it ends, or SIZE_MAX where none starts, along with the start of each line.
+// Returns the line count.
+static size_t MatchTestRegexLines(const TestRegexNode * nodes, uint root, const wchar_t * text, size_t length, TestRegexBuffers * buffers) {
+    size_t lineCount = 0;
+    size_t lineStart = 0;
+    while (true) {
+        const wchar_t * line = text + lineStart;
+        const wchar_t * lineBreak = static_cast<const wchar_t *>(wmemchr(line, L'\n', length - lineStart));
+        size_t lineLength = lineBreak ? lineBreak - line : length - lineStart;
+        char * starts = buffers->scratch;
+        char * ends = starts + lineLength + 1;
+        for (size_t pos = 0; pos <= lineLength; pos++) {
+            buffers->matchEnds[lineStart + pos] = SIZE_MAX;
+            if (IsTestMidPair(line, lineLength, pos)) {
+                continue;
+            }
+            memset(starts, 0, lineLength + 1);
+            starts[pos] = true;
+            MatchTestRegex(nodes, root, line, lineLength, starts, ends, ends + lineLength + 1);
+            for (size_t end = lineLength + 1; end > pos; end--) {
+                if (ends[end - 1]) {
+                    buffers->matchEnds[lineStart + pos] = lineStart + end - 1;
+                    break;
+                }
+            }
+        }
+        buffers->lineStarts[lineCount++] = lineStart;
+        if (!lineBreak) {
+            break;
+        }
+        lineStart += lineLength + 1;
+    }
+    buffers->lineStarts[lineCount] = length + 1;
+    return lineCount;
+}
 
-    paintRect.top += lineHeight;
-    paintRect.bottom = bitmapHeight - lineHeight;
+// Finds a match from a cursor in the reference matches the way FindDocRegex does, going through
+// the lines from the cursor's on and wrapping around to the cursor's own.
+// Returns false if there is none.
+static bool FindTestRegex(const TestRegexBuffers * buffers, size_t lineCount, bool backward, size_t * lineIndex, size_t * charIndex, bool * wrapped) {
+    size_t cursorLineIndex = *lineIndex;
+    size_t cursor = buffers->lineStarts[cursorLineIndex] + *charIndex;
+    for (size_t i = 0; i <= lineCount; i++) {
+        size_t line = (backward ? cursorLineIndex + lineCount - i : cursorLineIndex + i) % lineCount;
+        size_t first = buffers->lineStarts[line];
+        size_t end = buffers->lineStarts[line + 1]; // behind the end of the line
+        if (i == 0) {
+            // Matches start behind the character under the cursor, which spans no other start.
+            if (backward) {
+                end = cursor;
+            } else {
+                first = cursor + 1;
+            }
+        }
+        for (size_t j = 0; first + j < end; j++) {
+            size_t pos = backward ? end - 1 - j : first + j;
+            if (buffers->matchEnds[pos] != SIZE_MAX) {
+                *lineIndex = line;
+                *charIndex = pos - buffers->lineStarts[line];
+                *wrapped = backward ? i > cursorLineIndex : cursorLineIndex + i >= lineCount;
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-    if (doc->cursorLineIndex < doc->topPaintLineIndex) {
-        doc->topPaintLineIndex = doc->cursorLineIndex;
+// Checks a pattern against the reference on every line of a document, whose text is given as the
+// document shows it: the starts marked, the longest match from each, the next match from a random
+// position and the last one before another. Then checks FindDocRegex from random cursors both
+// ways.
+static void CheckTestRegex(uint * seed, Doc * doc, const wchar_t * text, size_t length, const TestRegexNode * nodes, uint root, TestRegexBuffers * buffers, const char * name) {
+    wchar_t pattern[REGEX_MAX_LENGTH];
+    size_t patternLength = 0;
+    WriteTestRegex(nodes, root, pattern, &patternLength);
+    Regex * regex;
+    if (CompileRegex(pattern, patternLength, &regex) != RESULT_OK) {
+        PrintBench("FAIL regex %s: the pattern fails to compile", name);
+        failedTestCount++;
+        return;
     }
-    size_t endPaintLineIndex = doc->topPaintLineIndex + paintLineCount;
-    if (doc->cursorLineIndex >= endPaintLineIndex) {
-        doc->topPaintLineIndex += doc->cursorLineIndex - endPaintLineIndex + 1;
-        endPaintLineIndex = doc->cursorLineIndex + 1;
-    } else if (doc->topPaintLineIndex != 0 && endPaintLineIndex > doc->lines.count) {
-        size_t diff = endPaintLineIndex - doc->lines.count;
-        if (diff > doc->topPaintLineIndex) {
-            doc->topPaintLineIndex = 0;
-        } else {
-            doc->topPaintLineIndex -= diff;
+    size_t lineCount = MatchTestRegexLines(nodes, root, text, length, buffers);
+
+    for (size_t i = 0; i != lineCount; i++) {
+        size_t lineStart = buffers->lineStarts[i];
+        size_t lineLength = buffers->lineStarts[i + 1] - 1 - lineStart;
+        const wchar_t * line = text + lineStart;
+        const size_t * matchEnds = buffers->matchEnds + lineStart;
+        size_t * byteOffsets = buffers->byteOffsets;
+        size_t count = TranscodeUtf16ToUtf8(line, lineLength, buffers->bytes);
+        byteOffsets[0] = 0;
+        for (size_t pos = 0; pos != lineLength; pos++) {
+            wchar_t c = line[pos];
+            size_t sequenceLength = 3;
+            if (c < 0x80) {
+                sequenceLength = 1;
+            } else if (c < 0x800) {
+                sequenceLength = 2;
+            } else if (IsTestMidPair(line, lineLength, pos + 1)) {
+                sequenceLength = 4;
+            } else if (IsTestMidPair(line, lineLength, pos)) {
+                sequenceLength = 0;
+            }
+            byteOffsets[pos + 1] = byteOffsets[pos] + sequenceLength;
         }
-    }
 
-    for (size_t i = doc->topPaintLineIndex; i != doc->lines.count; i++) {
-        if (paintRect.bottom - paintRect.top < lineHeight) {
+        memset(buffers->expectedMarks, 0, count + 1);
+        bool any = false;
+        for (size_t pos = 0; pos <= lineLength; pos++) {
+            if (matchEnds[pos] != SIZE_MAX) {
+                buffers->expectedMarks[byteOffsets[pos]] = true;
+                any = true;
+            }
+        }
+        bool equal = MarkRegexLineStarts(regex, buffers->bytes, count, buffers->marks) == any
+            && memcmp(buffers->marks, buffers->expectedMarks, count + 1) == 0;
+        for (size_t pos = 0; pos <= lineLength && equal; pos++) {
+            if (matchEnds[pos] != SIZE_MAX) {
+                equal = MatchRegexLineAt(regex, buffers->bytes, count, byteOffsets[pos]) == byteOffsets[matchEnds[pos] - lineStart];
+            }
+        }
+        if (!equal) {
+            PrintBench("FAIL regex %s, line %zu: the matches differ from the reference", name, i);
+            failedTestCount++;
             break;
         }
 
-        MkDynArray<wchar_t> * line = &doc->lines.elems[i];
-        if (i == doc->cursorLineIndex && paintContentCursor) {
-            PaintCursorLine(&paintRect, line->elems, static_cast<ushort>(line->count), doc->cursorCharIndex);
+        size_t from = NextTestRandom(seed) % (lineLength + 1);
+        size_t next = from;
+        while (next <= lineLength && matchEnds[next] == SIZE_MAX) {
+            next++;
+        }
+        size_t start;
+        size_t end;
+        bool found = MatchRegexLine(regex, buffers->bytes, count, byteOffsets[from], &start, &end);
+        if (next <= lineLength) {
+            equal = found && start == byteOffsets[next] && end == byteOffsets[matchEnds[next] - lineStart];
         } else {
-            PaintLine(&paintRect, line->elems, static_cast<ushort>(line->count));
+            equal = !found;
         }
 
-        paintRect.left = 0;
-        paintRect.top += lineHeight;
-        doc->lastPaintLineCount++;
+        size_t before = NextTestRandom(seed) % (lineLength + 2);
+        size_t last = before;
+        while (last != 0 && matchEnds[last - 1] == SIZE_MAX) {
+            last--;
+        }
+        found = MatchRegexLineBackward(regex, buffers->bytes, count, before > lineLength ? count + 1 : byteOffsets[before], &start);
+        equal = equal && (last != 0 ? found && start == byteOffsets[last - 1] : !found);
+        if (!equal) {
+            PrintBench("FAIL regex %s, line %zu: the match from %zu or before %zu differs from the reference", name, i, from, before);
+            failedTestCount++;
+            break;
+        }
     }
 
-    //---------------------
-    // Paint Status Line
-
-    paintRect.top = bitmapHeight - lineHeight;
-    paintRect.bottom = bitmapHeight;
- 
-    if (statusPrompt) {
-        FillRect(bitmapDeviceContext, &paintRect, promptBackgroundBrush);
-        SetTextColor(bitmapDeviceContext, config.promptTextColor);
-    } else {
-        FillRect(bitmapDeviceContext, &paintRect, statusBackgroundBrush);
+    for (uint i = 0; i != 2 * TEST_REGEX_CURSOR_COUNT; i++) {
+        bool backward = i % 2 != 0;
+        size_t lineIndex = NextTestRandom(seed) % lineCount;
+        size_t lineStart = buffers->lineStarts[lineIndex];
+        size_t lineLength = buffers->lineStarts[lineIndex + 1] - 1 - lineStart;
+        size_t charIndex = NextTestRandom(seed) % (lineLength + 1);
+        if (IsTestMidPair(text + lineStart, lineLength, charIndex)) {
+            charIndex--;
+        }
+        size_t expectedLineIndex = lineIndex;
+        size_t expectedCharIndex = charIndex;
+        bool expectedWrapped;
+        bool expectedFound = FindTestRegex(buffers, lineCount, backward, &expectedLineIndex, &expectedCharIndex, &expectedWrapped);
+        bool wrapped;
+        ResultCode result = FindDocRegex(doc, regex, backward, &lineIndex, &charIndex, &wrapped);
+        bool equal = result == RESULT_LIMIT_REACHED;
+        if (expectedFound) {
+            equal = result == RESULT_OK
+                && lineIndex == expectedLineIndex
+                && charIndex == expectedCharIndex
+                && wrapped == expectedWrapped;
+        }
+        if (!equal) {
+            PrintBench(
+                "FAIL regex %s: searching %s finds line %zu, character %zu, where the reference finds line %zu, character %zu",
+                name,
+                backward ? "backward" : "forward",
+                result == RESULT_OK ? lineIndex : SIZE_MAX,
+                result == RESULT_OK ? charIndex : SIZE_MAX,
+                expectedFound ? expectedLineIndex : SIZE_MAX,
+                expectedFound ? expectedCharIndex : SIZE_MAX);
+            failedTestCount++;
+        }
     }
+    DestroyRegex(regex);
+}
 
-    if (paintStatusCursor) {
-        PaintCursorLine(&paintRect, statusLine, statusLength, statusCursorChar);
-    } else {
-        DrawTextExW(
-            bitmapDeviceContext,
-            statusLine,
-            statusLength,
-            &paintRect,
-            DT_NOCLIP | DT_NOPREFIX,
-            nullptr);
+// Writes a code point in UTF-16.
+// Returns the unit count.
+static size_t EncodeTestUtf16(ulong codePoint, wchar_t * chars) {
+    if (codePoint < 0x10000) {
+        chars[0] = static_cast<wchar_t>(codePoint);
+        return 1;
     }
+    chars[0] = static_cast<wchar_t>(0xD800 | (codePoint - 0x10000) >> 10);
+    chars[1] = static_cast<wchar_t>(0xDC00 | (codePoint & 0x3FF));
+    return 2;
 }
 
-LRESULT CALLBACK WindowProc(HWND window, UINT message, WPARAM wparam, LPARAM lparam) {
-    switch (message) {
-        case WM_SIZE:
-        {
-            HDC deviceContext = GetDC(window);
-
-            if (!bitmapDeviceContext) {
-                bitmapDeviceContext = CreateCompatibleDC(deviceContext);
+// Checks the regex engine: the parser on valid patterns and errors, a few patterns on known lines,
+// and classes crossing the lengths of UTF-8 encodings on each code point at the edges. Then checks
+// random patterns against a reference matcher on documents made of short pieces, so ^ and $ often
+// fall at the end of a piece, and last patterns with more states than the tables of the automata
+// hold, so they are cleared while matching.
+static void TestRegex() {
+    const wchar_t * validPatterns[] = {
+        L"", L"|", L"a|", L"()", L"(a|b)*c", L"a**", L"a{0}", L"a{2,}", L"a{1000}", L"^$", L"\\t\\.\\\\\\(",
+        L"[]a]", L"[^]a]", L"[a-]", L"[-a]", L"[\\]\\-]", L"[\\d-z]", L"[!-\\-]", L"\xD83D\xDE00+",
+    };
+    const wchar_t * invalidPatterns[] = {
+        L"(", L"(a", L")", L"a)", L"*", L"+a", L"a|?", L"{1}", L"}", L"]", L"a{", L"a{1", L"a{}", L"a{,2}",
+        L"a{2,1}", L"a{x}", L"a{1,2,3}", L"[", L"[a", L"[]", L"[^]", L"[b-a]", L"[a-\\d]", L"[\\q]", L"\\",
+        L"\\q", L"\\1", L"\xD800", L"a\xDC00", L"[\xDBFF]",
+    };
+    for (uint i = 0; i != sizeof(validPatterns) / sizeof(validPatterns[0]); i++) {
+        Regex * regex;
+        if (CompileRegex(validPatterns[i], wcslen(validPatterns[i]), &regex) == RESULT_OK) {
+            DestroyRegex(regex);
+        } else {
+            PrintBench("FAIL regex: valid pattern %u fails to compile", i);
+            failedTestCount++;
+        }
+    }
+    for (uint i = 0; i != sizeof(invalidPatterns) / sizeof(invalidPatterns[0]); i++) {
+        Regex * regex;
+        ResultCode result = CompileRegex(invalidPatterns[i], wcslen(invalidPatterns[i]), &regex);
+        if (result == RESULT_OK) {
+            DestroyRegex(regex);
+        }
+        if (result != RESULT_SYNTAX_ERROR) {
+            PrintBench("FAIL regex: invalid pattern %u is no syntax error", i);
+            failedTestCount++;
+        }
+    }
 
-                int ppi = GetDeviceCaps(bitmapDeviceContext, LOGPIXELSY);
-                int lfHeight = 0 - ((config.fontSize * ppi) / 72);
-                HFONT font = CreateFontW(
-                    lfHeight,
-                    0,
-                    0,
-                    0,
-                    FW_DONTCARE,
-                    0,
-                    0,
-                    0,
-                    ANSI_CHARSET,
-                    OUT_DEFAULT_PRECIS,
-                    CLIP_DEFAULT_PRECIS,
-                    DEFAULT_QUALITY,
-                    DEFAULT_PITCH | FF_DONTCARE,
-                    config.fontName);
-                HFONT oldFont = static_cast<HFONT>(SelectObject(bitmapDeviceContext, font));
-                if (oldFont) {
-                    DeleteObject(oldFont);
-                }
+    wchar_t longPattern[REGEX_MAX_LENGTH + 1];
+    for (size_t i = 0; i != REGEX_MAX_LENGTH + 1; i++) {
+        longPattern[i] = L'a';
+    }
+    const wchar_t * limitPatterns[] = { L"a{1001}", L"((a{1000}){1000})", longPattern };
+    for (uint i = 0; i != 3; i++) {
+        Regex * regex;
+        ResultCode result = CompileRegex(limitPatterns[i], i == 2 ? REGEX_MAX_LENGTH + 1 : wcslen(limitPatterns[i]), &regex);
+        if (result == RESULT_OK) {
+            DestroyRegex(regex);
+        }
+        if (result != RESULT_LIMIT_REACHED) {
+            PrintBench("FAIL regex: pattern %u over the limits is not refused", i);
+            failedTestCount++;
+        }
+    }
 
-                TEXTMETRICW fontMetrics;
-                GetTextMetricsW(bitmapDeviceContext, &fontMetrics);
-                lineHeight = fontMetrics.tmHeight;
-                avgCharWidth = fontMetrics.tmAveCharWidth;
-            }
+    const struct {
+        const wchar_t * pattern;
+        const char * line;
+        size_t start;
+        size_t end;
+    } knownMatches[] = {
+        { L"[]a]", "x]", 1, 2 },
+        { L"[^]a]+", "a]xy", 2, 4 },
+        { L"[a-c-e]+", "d-e", 1, 3 },
+        { L"a{2,}", "baaab", 1, 4 },
+        { L"a|ab", "xab", 1, 3 },
+        { L"(a|ab)(c|bcd)", "abcd", 0, 4 },
+        { L"x*", "ab", 0, 0 },
+        { L"\\d+", "a12b", 1, 3 },
+        { L"\\S\\s\\S", "a \tb c", 3, 6 },
+        { L"\\.\\*", "a.*", 1, 3 },
+        { L"a{0}b", "ab", 1, 2 },
+        { L"^$", "", 0, 0 },
+        { L"^b", "ab", SIZE_MAX, SIZE_MAX },
+        { L"a$", "aa", 1, 2 },
+        { L"(^a|b$)+", "ab", 0, 2 },
+    };
+    for (uint i = 0; i != sizeof(knownMatches) / sizeof(knownMatches[0]); i++) {
+        Regex * regex;
+        size_t start = SIZE_MAX;
+        size_t end = SIZE_MAX;
+        ResultCode result = CompileRegex(knownMatches[i].pattern, wcslen(knownMatches[i].pattern), &regex);
+        if (result == RESULT_OK) {
+            MatchRegexLine(regex, knownMatches[i].line, strlen(knownMatches[i].line), 0, &start, &end);
+            DestroyRegex(regex);
+        }
+        if (result != RESULT_OK || start != knownMatches[i].start || end != knownMatches[i].end) {
+            PrintBench("FAIL regex: known pattern %u matches from %zu to %zu", i, start, end);
+            failedTestCount++;
+        }
+    }
 
-            bitmapWidth = LOWORD(lparam);
-            bitmapHeight = HIWORD(lparam);
-            HBITMAP bitmap = CreateCompatibleBitmap(deviceContext, bitmapWidth, bitmapHeight);
-            HBITMAP oldBitmap = static_cast<HBITMAP>(SelectObject(bitmapDeviceContext, bitmap));
-            if (oldBitmap) {
-                DeleteObject(oldBitmap);
+    const ulong codePoints[] = {
+        0x1, 0x7F, 0x80, 0xBF, 0xC0, 0x7FF, 0x800, 0x83F, 0x840, 0xFFF, 0x1000, 0xD7FF, 0xE000, 0xFFFF, 0x10000,
+        0x10FFF, 0x11000, 0x3FFFF, 0x40000, 0x10FFFF,
+    };
+    const uint codePointCount = sizeof(codePoints) / sizeof(codePoints[0]);
+    for (uint i = 0; i != 2 * codePointCount * codePointCount; i++) {
+        bool negated = i % 2 != 0;
+        ulong first = codePoints[i / 2 / codePointCount];
+        ulong last = codePoints[i / 2 % codePointCount];
+        if (first > last) {
+            continue;
+        }
+        wchar_t pattern[8];
+        size_t patternLength = 0;
+        pattern[patternLength++] = L'[';
+        if (negated) {
+            pattern[patternLength++] = L'^';
+        }
+        patternLength += EncodeTestUtf16(first, pattern + patternLength);
+        pattern[patternLength++] = L'-';
+        patternLength += EncodeTestUtf16(last, pattern + patternLength);
+        pattern[patternLength++] = L']';
+        Regex * regex;
+        if (CompileRegex(pattern, patternLength, &regex) != RESULT_OK) {
+            PrintBench("FAIL regex: the class of U+%lX to U+%lX fails to compile", first, last);
+            failedTestCount++;
+            continue;
+        }
+        for (uint j = 0; j != codePointCount; j++) {
+            wchar_t chars[2];
+            char line[4];
+            size_t count = TranscodeUtf16ToUtf8(chars, EncodeTestUtf16(codePoints[j], chars), line);
+            bool expected = (codePoints[j] >= first && codePoints[j] <= last) != negated;
+            size_t start;
+            size_t end;
+            bool found = MatchRegexLine(regex, line, count, 0, &start, &end);
+            if (found != expected || (found && (start != 0 || end != count))) {
+                PrintBench("FAIL regex: the class of U+%lX to U+%lX%s differs on U+%lX", first, last, negated ? ", negated," : "", codePoints[j]);
+                failedTestCount++;
             }
+        }
+        DestroyRegex(regex);
+    }
 
-            Paint(currentDoc);
-            return 0;
+    const size_t pieceDocCount = TEST_PIECE_RUN_COUNT * (TEST_PIECE_ATOM_COUNT * 4 + 1);
+    const size_t lineDocLength = TEST_REGEX_LINE_COUNT * (TEST_REGEX_LINE_LENGTH + 1);
+    const size_t maxCount = pieceDocCount > lineDocLength ? pieceDocCount : lineDocLength;
+    char * bytes = static_cast<char *>(malloc(maxCount));
+    wchar_t * chars = static_cast<wchar_t *>(malloc(maxCount * sizeof(wchar_t)));
+    wchar_t * text = static_cast<wchar_t *>(malloc(maxCount * sizeof(wchar_t)));
+    TestRegexBuffers buffers;
+    buffers.bytes = static_cast<char *>(malloc(3 * maxCount + 1));
+    buffers.marks = static_cast<char *>(malloc(3 * maxCount + 1));
+    buffers.expectedMarks = static_cast<char *>(malloc(3 * maxCount + 1));
+    buffers.byteOffsets = static_cast<size_t *>(malloc((maxCount + 1) * sizeof(size_t)));
+    buffers.matchEnds = static_cast<size_t *>(malloc((maxCount + 1) * sizeof(size_t)));
+    buffers.lineStarts = static_cast<size_t *>(malloc((maxCount + 2) * sizeof(size_t)));
+    buffers.scratch = static_cast<char *>(malloc((2 * TEST_REGEX_DEPTH + 4) * (maxCount + 1)));
+    bool allocated = bytes
+        && chars
+        && text
+        && buffers.bytes
+        && buffers.marks
+        && buffers.expectedMarks
+        && buffers.byteOffsets
+        && buffers.matchEnds
+        && buffers.lineStarts
+        && buffers.scratch;
+
+    uint seed = 23;
+    for (uint i = 0; i != TEST_DOC_COUNT && allocated; i++) {
+        size_t length;
+        Doc * doc = MakeTestPieceDoc(&seed, bytes, chars, text, &length);
+        if (!doc) {
+            allocated = false;
+            break;
         }
+        for (uint j = 0; j != TEST_REGEX_PATTERN_COUNT; j++) {
+            TestRegexNode nodes[TEST_REGEX_MAX_NODE_COUNT];
+            uint nodeCount = 0;
+            uint root = MakeTestRegex(&seed, 0, nodes, &nodeCount);
+            char name[64];
+            snprintf(name, sizeof(name), "round %u, pattern %u", i, j);
+            CheckTestRegex(&seed, doc, text, length, nodes, root, &buffers, name);
+        }
+        DestroyDoc(doc);
+    }
 
-        case WM_PAINT:
-        {
-            PAINTSTRUCT paintStruct;
-            HDC deviceContext = BeginPaint(window, &paintStruct);
+    // A character a number of places behind another takes a state for each arrangement of the
+    // characters between them, so on lines of random a and b these patterns need more states than
+    // fit in the tables.
+    wchar_t * lineChars = allocated ? MakeTestText(&seed, L"ab", 2, lineDocLength) : nullptr;
+    Doc * doc = nullptr;
+    if (lineChars) {
+        for (size_t i = TEST_REGEX_LINE_LENGTH; i < lineDocLength; i += TEST_REGEX_LINE_LENGTH + 1) {
+            lineChars[i] = L'\n';
+        }
+        memcpy(text, lineChars, lineDocLength * sizeof(wchar_t));
+        if (CreateDocFromBuffer(lineChars, lineDocLength, &doc) != RESULT_OK) {
+            doc = nullptr;
+        }
+    }
+    if (doc) {
+        TestRegexNode nodes[TEST_REGEX_MAX_NODE_COUNT];
+        uint nodeCount = 0;
+        uint starts[3];
+        uint ends[3];
+        uint counts[] = { 14, 14, 12 };
+        starts[0] = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_SET, TESTREGEXSET_A, 0, 0, 0);
+        ends[0] = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_SET, TESTREGEXSET_B, 0, 0, 0);
+        starts[1] = ends[0];
+        ends[1] = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_LINE_END, 0, 0, 0, 0);
+        uint lineStart = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_LINE_START, 0, 0, 0, 0);
+        uint lineStartB = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_CONCAT, lineStart, ends[0], 0, 0);
+        starts[2] = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_ALTERNATE, starts[0], lineStartB, 0, 0);
+        ends[2] = starts[0];
+        uint set = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_SET, TESTREGEXSET_AB, 0, 0, 0);
+        for (uint i = 0; i != 3; i++) {
+            // a([ab]){14}b, b([ab]){14}$ and (a|^b)([ab]){12}a
+            uint repeat = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_REPEAT, set, 0, counts[i], counts[i]);
+            uint run = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_CONCAT, starts[i], repeat, 0, 0);
+            uint root = AddTestRegexNode(nodes, &nodeCount, TESTREGEXNODE_CONCAT, run, ends[i], 0, 0);
+            char name[64];
+            snprintf(name, sizeof(name), "with many states, pattern %u", i);
+            CheckTestRegex(&seed, doc, text, lineDocLength, nodes, root, &buffers, name);
+        }
+        DestroyDoc(doc);
+    } else {
+        allocated = false;
+    }
 
-            BitBlt(
-                deviceContext,
-                0, 0, bitmapWidth, bitmapHeight,
-                bitmapDeviceContext,
-                0, 0,
-                SRCCOPY);
+    if (!allocated) {
+        PrintBench("FAIL regex: out of memory");
+        failedTestCount++;
+    }
+    free(bytes);
+    free(chars);
+    free(text);
+    free(buffers.bytes);
+    free(buffers.marks);
+    free(buffers.expectedMarks);
+    free(buffers.byteOffsets);
+    free(buffers.matchEnds);
+    free(buffers.lineStarts);
+    free(buffers.scratch);
+}
 
-            EndPaint(window, &paintStruct);
-            return 0;
-        }
+// Reads a whole file.
+// Returns NULL on failure.
+static char * ReadTestFile(const wchar_t * path, size_t * count) {
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER fileSize;
+    char * bytes = nullptr;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart < MAXDWORD) {
+        bytes = static_cast<char *>(malloc(static_cast<size_t>(fileSize.QuadPart) + 1));
+    }
+    ulong readCount;
+    if (bytes && !ReadFile(file, bytes, static_cast<ulong>(fileSize.QuadPart), &readCount, nullptr)) {
+        free(bytes);
+        bytes = nullptr;
+    }
+    CloseHandle(file);
+    *count = bytes ? readCount : 0;
+    return bytes;
+}
 
-        case WM_CLOSE:
-        {
-            if (currentDoc->modified) {
-                int promptResult = MessageBoxW(
-                    window,
-                    L"One or more documents contain unsaved changes. Close anyway?",
-                    L"Warning",
-                    MB_YESNO | MB_ICONWARNING | MB_DEFBUTTON2);
-                if (promptResult != IDYES) {
-                    return 0;
+// Checks that a file loaded lazily that breaks its lines with CR LF in the first chunk but not
+// throughout is saved with the bytes it had, both as UTF-8 and decoded, where each Latin-1 letter
+// becomes U+FFFD. A line typed at the end is saved with a bare LF, as the file counts as mixed.
+static void TestMixedLineBreaks() {
+    const size_t lineCounts[] = { 40000, 400000, 900000 }; // CR LF, LF, CR LF, over 64 MB in all
+    for (uint i = 0; i != 2; i++) {
+        bool latin1 = i != 0;
+        char * text = static_cast<char *>(malloc(LAZYLOAD_MIN_COUNT + LAZYLOAD_MIN_COUNT / 2));
+        char * expected = static_cast<char *>(malloc(2 * LAZYLOAD_MIN_COUNT));
+        size_t textCount = 0;
+        size_t expectedCount = 0;
+        for (uint j = 0; text && expected && j != 3; j++) {
+            size_t count;
+            char * bytes = GenerateBenchText(lineCounts[j], latin1, j != 1, &count);
+            if (!bytes) {
+                free(text);
+                text = nullptr;
+                break;
+            }
+            memcpy(text + textCount, bytes, count);
+            textCount += count;
+            for (size_t k = 0; k != count; k++) {
+                if (bytes[k] == '\xE9') {
+                    memcpy(expected + expectedCount, "\xEF\xBF\xBD", 3);
+                    expectedCount += 3;
+                } else {
+                    expected[expectedCount++] = bytes[k];
                 }
             }
-            DestroyWindow(window);
-            return 0;
+            free(bytes);
         }
+        memcpy(expected + expectedCount, "typed\n", 6);
+        expectedCount += 6;
 
-        case WM_DESTROY:
-        {
-            PostQuitMessage(0);
-            return 0;
+        wchar_t path[MAX_PATH_COUNT];
+        wchar_t savedPath[MAX_PATH_COUNT];
+        bool writeSuccess = text && expected
+            && WriteBenchFile(L"MKeditTest.txt", text, textCount, path)
+            && WriteBenchFile(L"MKeditTestSaved.txt", "", 0, savedPath);
+        free(text);
+        if (!writeSuccess) {
+            free(expected);
+            PrintBench("FAIL mixed line breaks: failed to write the file");
+            failedTestCount++;
+            continue;
         }
 
-        case WM_CHAR:
-        {
-            wchar_t c = static_cast<wchar_t>(wparam);
-
-            switch (currentMode) {
-                case MODE_NORMAL:
-                {
-                    ProcessNormalCharInput(c);
-                    Paint(currentDoc);
-                    InvalidateRect(window, nullptr, false);
-                    break;
-                }
-
-                case MODE_COMMAND:
-                {
-                    ProcessCommandCharInput(c);
-                    Paint(currentDoc);
-                    InvalidateRect(window, nullptr, false);
-                    break;
-                }
-
-                case MODE_INSERT:
-                {
-                    if (c == 0x1b) { // Esc
-                        currentMode = MODE_NORMAL;
-                        if (currentDoc->cursorCharIndex != 0 && currentDoc->cursorCharIndex == currentDoc->lines.elems[currentDoc->cursorLineIndex].count) {
-                            currentDoc->cursorCharIndex--;
-                        }
-                        ResetColIndex(currentDoc);
-                    } else {
-                        ProcessDocCharInput(currentDoc, c);
-                    }
-                    SetStatusLineNormal();
-                    Paint(currentDoc);
-                    InvalidateRect(window, nullptr, false);
-                    break;
-                }
+        Doc * doc;
+        ResultCode result = LoadFile(path, &doc);
+        if (result == RESULT_OK) {
+            result = FinishDocLoad(doc);
+            bool mixed = result == RESULT_OK && GetMappedFile(doc)->mixed && !doc->crlf;
+            if (result == RESULT_OK) {
+                result = InsertDocText(doc, doc->lineCount - 1, 0, L"typed\n", 6);
+            }
+            if (result == RESULT_OK) {
+                result = StartDocSave(doc, savedPath, true);
+            }
+            if (result == RESULT_OK) {
+                bool newPath;
+                result = FinishDocSave(&newPath);
+            }
+            DestroyDoc(doc);
+            if (result == RESULT_OK && !mixed) {
+                PrintBench("FAIL mixed line breaks, %s: the file does not count as mixed", latin1 ? "latin1" : "utf8");
+                failedTestCount++;
             }
-
-            return 0;
         }
 
-        default:
-        {
-            return DefWindowProcW(window, message, wparam, lparam);
+        size_t savedCount;
+        char * saved = result == RESULT_OK ? ReadTestFile(savedPath, &savedCount) : nullptr;
+        if (!saved || savedCount != expectedCount || memcmp(saved, expected, expectedCount) != 0) {
+            PrintBench("FAIL mixed line breaks, %s: the saved file differs", latin1 ? "latin1" : "utf8");
+            failedTestCount++;
         }
+        free(saved);
+        free(expected);
+        DeleteFileW(path);
+        DeleteFileW(savedPath);
+    }
+}
+
+// Runs the tests.
+// Returns the exit code, the number of failures.
+static int RunTests() {
+    if (!OpenBenchOutput()) {
+        return -1;
     }
+    TestTranscoders();
+    TestSearch();
+    TestSearchIndexSync();
+    TestRegex();
+    TestMixedLineBreaks();
+    PrintBench("%u checks failed", failedTestCount);
+    return static_cast<int>(failedTestCount);
 }
 
 int WINAPI wWinMain(HINSTANCE instance, HINSTANCE prevInstance, wchar_t * commandLine, int showCommand) {
@@ -1695,6 +6341,7 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE prevInstance, wchar_t * comman
     docTitleBackgroundBrush = CreateSolidBrush(config.docTitleBackgroundColor);
     promptTextBrush = CreateSolidBrush(config.promptTextColor);
     promptBackgroundBrush = CreateSolidBrush(config.promptBackgroundColor);
+    matchBackgroundBrush = CreateSolidBrush(config.matchBackgroundColor);
 
     currentDoc = CreateEmptyDoc();
     GetCurrentDirectoryW(MAX_PATH, workingFolderPath);
@@ -1721,6 +6368,16 @@ int WINAPI wWinMain(HINSTANCE instance, HINSTANCE prevInstance, wchar_t * comman
         NULL,
         instance,
         NULL);
+    mainWindow = window;
+    if (wcscmp(commandLine, L"-bench") == 0) {
+        return RunBenchmarks();
+    }
+    if (wcsncmp(commandLine, L"-bench-load ", 12) == 0) {
+        return RunLoadBenchmark(commandLine + 12);
+    }
+    if (wcscmp(commandLine, L"-test") == 0) {
+        return RunTests();
+    }
     ShowWindow(window, showCommand);
 
     MSG message;
@@ -0,0 +1,1448 @@
+#include <immintrin.h>
+#include <intrin.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "Regex.h"
+
+#define REGEX_NONE UINT_MAX
+#define REGEX_MAX_REPEAT_COUNT 1000
+#define REGEX_MAX_INSTR_COUNT (64 * 1024)
+#define REGEX_MAX_CLASS_RANGE_COUNT (5 * REGEX_MAX_LENGTH + 8)
+#define REGEX_MAX_SEQUENCE_COUNT 64
+
+//---------
+// Parsing
+
+// A pattern is parsed into a tree of nodes first, which is then compiled forward and backward.
+
+enum RegexNodeType {
+    REGEXNODE_EMPTY,
+    REGEXNODE_SET,
+    REGEXNODE_CONCAT,
+    REGEXNODE_ALTERNATE,
+    REGEXNODE_REPEAT,
+    REGEXNODE_LINE_START,
+    REGEXNODE_LINE_END,
+};
+
+struct RegexNode {
+    RegexNodeType type;
+    uint first; // SET: index of the first range, CONCAT, ALTERNATE and REPEAT: first operand
+    uint second; // SET: range count, CONCAT and ALTERNATE: second operand
+    uint minCount;
+    uint maxCount; // REGEX_NONE for no limit
+};
+
+// Code points from first to last.
+struct RegexRange {
+    ulong first;
+    ulong last;
+};
+
+struct RegexParser {
+    const wchar_t * pattern;
+    size_t length;
+    size_t pos;
+    MkDynArray<RegexNode> nodes;
+    MkDynArray<RegexRange> ranges;
+    RegexRange * classRanges; // of the class being parsed
+    RegexRange * scratchRanges;
+    ResultCode result;
+};
+
+static uint AddNode(RegexParser * parser, RegexNodeType type, uint first, uint second) {
+    RegexNode * node = parser->nodes.Insert(SIZE_MAX, 1);
+    if (!node) {
+        parser->result = RESULT_MEMORY_ERROR;
+        return REGEX_NONE;
+    }
+    node->type = type;
+    node->first = first;
+    node->second = second;
+    node->minCount = 0;
+    node->maxCount = 0;
+    return static_cast<uint>(parser->nodes.count - 1);
+}
+
+static uint SyntaxError(RegexParser * parser) {
+    parser->result = RESULT_SYNTAX_ERROR;
+    return REGEX_NONE;
+}
+
+// Reads the next code point of the pattern, joining surrogate pairs.
+// Returns false on an unpaired surrogate.
+static bool ReadCodePoint(RegexParser * parser, ulong * codePoint) {
+    wchar_t c = parser->pattern[parser->pos++];
+    if (c >= 0xD800 && c <= 0xDBFF && parser->pos != parser->length) {
+        wchar_t low = parser->pattern[parser->pos];
+        if (low >= 0xDC00 && low <= 0xDFFF) {
+            parser->pos++;
+            *codePoint = 0x10000 + ((c - 0xD800) << 10 | (low - 0xDC00));
+            return true;
+        }
+    }
+    if (c >= 0xD800 && c <= 0xDFFF) {
+        return false;
+    }
+    *codePoint = c;
+    return true;
+}
+
+static int CompareRanges(const void * a, const void * b) {
+    ulong first = static_cast<const RegexRange *>(a)->first;
+    ulong second = static_cast<const RegexRange *>(b)->first;
+    return first < second ? -1 : first > second;
+}
+
+// Sorts ranges and joins those overlapping or adjoining.
+// Returns the new count.
+static uint NormalizeRanges(RegexRange * ranges, uint count) {
+    if (count == 0) {
+        return 0;
+    }
+    qsort(ranges, count, sizeof(RegexRange), CompareRanges);
+    uint joinedCount = 1;
+    for (uint i = 1; i != count; i++) {
+        RegexRange * last = &ranges[joinedCount - 1];
+        if (ranges[i].first <= last->last + 1) {
+            if (ranges[i].last > last->last) {
+                last->last = ranges[i].last;
+            }
+        } else {
+            ranges[joinedCount++] = ranges[i];
+        }
+    }
+    return joinedCount;
+}
+
+// Writes the code points missing from normalized ranges, which need one more range at most.
+// Returns the count written.
+static uint ComplementRanges(const RegexRange * ranges, uint count, RegexRange * complement) {
+    uint complementCount = 0;
+    ulong next = 0;
+    for (uint i = 0; i != count; i++) {
+        if (ranges[i].first > next) {
+            complement[complementCount].first = next;
+            complement[complementCount].last = ranges[i].first - 1;
+            complementCount++;
+        }
+        next = ranges[i].last + 1;
+    }
+    if (next <= 0x10FFFF) {
+        complement[complementCount].first = next;
+        complement[complementCount].last = 0x10FFFF;
+        complementCount++;
+    }
+    return complementCount;
+}
+
+// Adds a node for normalized ranges, without the line break and surrogates, which text never
+// matches.
+static uint AddSet(RegexParser * parser, const RegexRange * ranges, uint count) {
+    size_t first = parser->ranges.count;
+    for (uint i = 0; i != count; i++) {
+        const RegexRange excluded[] = { { L'\n', L'\n' }, { 0xD800, 0xDFFF } };
+        ulong start = ranges[i].first;
+        for (uint j = 0; j != 2 && start <= ranges[i].last; j++) {
+            if (excluded[j].last < start || excluded[j].first > ranges[i].last) {
+                continue;
+            }
+            if (excluded[j].first > start) {
+                RegexRange * range = parser->ranges.Insert(SIZE_MAX, 1);
+                if (!range) {
+                    parser->result = RESULT_MEMORY_ERROR;
+                    return REGEX_NONE;
+                }
+                range->first = start;
+                range->last = excluded[j].first - 1;
+            }
+            start = excluded[j].last + 1;
+        }
+        if (start <= ranges[i].last) {
+            RegexRange * range = parser->ranges.Insert(SIZE_MAX, 1);
+            if (!range) {
+                parser->result = RESULT_MEMORY_ERROR;
+                return REGEX_NONE;
+            }
+            range->first = start;
+            range->last = ranges[i].last;
+        }
+    }
+    return AddNode(parser, REGEXNODE_SET, static_cast<uint>(first), static_cast<uint>(parser->ranges.count - first));
+}
+
+// Reads an escape behind a backslash as normalized ranges, five at most.
+// Returns the range count, or 0 for an invalid escape.
+static uint ParseEscape(RegexParser * parser, RegexRange * ranges) {
+    if (parser->pos == parser->length) {
+        return 0;
+    }
+    const RegexRange digits[] = { { L'0', L'9' } };
+    const RegexRange wordChars[] = { { L'0', L'9' }, { L'A', L'Z' }, { L'_', L'_' }, { L'a', L'z' } };
+    const RegexRange spaces[] = { { L'\t', L'\r' }, { L' ', L' ' } };
+    const RegexRange * escaped = nullptr;
+    uint escapedCount = 0;
+    wchar_t c = parser->pattern[parser->pos];
+    switch (c) {
+        case L'd':
+        case L'D':
+        {
+            escaped = digits;
+            escapedCount = 1;
+            break;
+        }
+
+        case L'w':
+        case L'W':
+        {
+            escaped = wordChars;
+            escapedCount = 4;
+            break;
+        }
+
+        case L's':
+        case L'S':
+        {
+            escaped = spaces;
+            escapedCount = 2;
+            break;
+        }
+
+        case L't':
+        {
+            parser->pos++;
+            ranges[0].first = L'\t';
+            ranges[0].last = L'\t';
+            return 1;
+        }
+    }
+
+    if (escaped) {
+        parser->pos++;
+        if (iswupper(c)) {
+            return ComplementRanges(escaped, escapedCount, ranges);
+        }
+        memcpy(ranges, escaped, escapedCount * sizeof(RegexRange));
+        return escapedCount;
+    }
+
+    // Other letters and digits are kept free for escapes to come.
+    if (iswalnum(c)) {
+        return 0;
+    }
+    ulong codePoint;
+    if (!ReadCodePoint(parser, &codePoint)) {
+        return 0;
+    }
+    ranges[0].first = codePoint;
+    ranges[0].last = codePoint;
+    return 1;
+}
+
+// Parses a bracket expression behind the opening bracket.
+static uint ParseClass(RegexParser * parser) {
+    bool negated = false;
+    if (parser->pos != parser->length && parser->pattern[parser->pos] == L'^') {
+        negated = true;
+        parser->pos++;
+    }
+
+    uint count = 0;
+    bool first = true;
+    while (true) {
+        if (parser->pos == parser->length) {
+            return SyntaxError(parser);
+        }
+        wchar_t c = parser->pattern[parser->pos];
+        if (c == L']' && !first) { // a bracket right at the start stands for itself
+            parser->pos++;
+            break;
+        }
+        first = false;
+
+        RegexRange * ranges = parser->classRanges + count;
+        uint rangeCount;
+        if (c == L'\\') {
+            parser->pos++;
+            rangeCount = ParseEscape(parser, ranges);
+            if (rangeCount == 0) {
+                return SyntaxError(parser);
+            }
+        } else {
+            if (!ReadCodePoint(parser, &ranges[0].first)) {
+                return SyntaxError(parser);
+            }
+            ranges[0].last = ranges[0].first;
+            rangeCount = 1;
+        }
+
+        // A hyphen between two single characters makes a range, anywhere else it stands for
+        // itself.
+        if (rangeCount == 1
+            && ranges[0].first == ranges[0].last
+            && parser->length - parser->pos >= 2
+            && parser->pattern[parser->pos] == L'-'
+            && parser->pattern[parser->pos + 1] != L']')
+        {
+            parser->pos++;
+            RegexRange last[5];
+            if (parser->pattern[parser->pos] == L'\\') {
+                parser->pos++;
+                if (ParseEscape(parser, last) != 1 || last[0].first != last[0].last) {
+                    return SyntaxError(parser);
+                }
+            } else if (!ReadCodePoint(parser, &last[0].first)) {
+                return SyntaxError(parser);
+            }
+            if (last[0].first < ranges[0].first) {
+                return SyntaxError(parser);
+            }
+            ranges[0].last = last[0].first;
+        }
+        count += rangeCount;
+    }
+
+    count = NormalizeRanges(parser->classRanges, count);
+    if (negated) {
+        count = ComplementRanges(parser->classRanges, count, parser->scratchRanges);
+        return AddSet(parser, parser->scratchRanges, count);
+    }
+    return AddSet(parser, parser->classRanges, count);
+}
+
+// Parses the counts of a repeat behind the opening brace.
+static bool ParseRepeatCounts(RegexParser * parser, uint * minCount, uint * maxCount) {
+    uint counts[2] = { 0, 0 };
+    uint countIndex = 0;
+    bool digits = false;
+    while (true) {
+        if (parser->pos == parser->length) {
+            parser->result = RESULT_SYNTAX_ERROR;
+            return false;
+        }
+        wchar_t c = parser->pattern[parser->pos++];
+        if (c >= L'0' && c <= L'9') {
+            counts[countIndex] = counts[countIndex] * 10 + (c - L'0');
+            if (counts[countIndex] > REGEX_MAX_REPEAT_COUNT) {
+                parser->result = RESULT_LIMIT_REACHED;
+                return false;
+            }
+            digits = true;
+        } else if (c == L',' && countIndex == 0 && digits) {
+            countIndex = 1;
+            digits = false;
+        } else if (c == L'}' && (digits || countIndex == 1)) {
+            break;
+        } else {
+            parser->result = RESULT_SYNTAX_ERROR;
+            return false;
+        }
+    }
+
+    *minCount = counts[0];
+    if (countIndex == 0) {
+        *maxCount = counts[0];
+    } else if (digits) {
+        *maxCount = counts[1];
+    } else {
+        *maxCount = REGEX_NONE;
+    }
+    if (*maxCount < *minCount) {
+        parser->result = RESULT_SYNTAX_ERROR;
+        return false;
+    }
+    return true;
+}
+
+static uint ParseAlternation(RegexParser * parser);
+
+static uint ParseAtom(RegexParser * parser) {
+    wchar_t c = parser->pattern[parser->pos];
+    switch (c) {
+        case L'(':
+        {
+            parser->pos++;
+            uint node = ParseAlternation(parser);
+            if (node == REGEX_NONE) {
+                return REGEX_NONE;
+            }
+            if (parser->pos == parser->length || parser->pattern[parser->pos] != L')') {
+                return SyntaxError(parser);
+            }
+            parser->pos++;
+            return node;
+        }
+
+        case L'*':
+        case L'+':
+        case L'?':
+        case L'{':
+        case L'}':
+        case L']':
+        {
+            return SyntaxError(parser); // nothing to repeat, or nothing opened
+        }
+
+        case L'.':
+        {
+            parser->pos++;
+            const RegexRange all[] = { { 0, 0x10FFFF } };
+            return AddSet(parser, all, 1);
+        }
+
+        case L'[':
+        {
+            parser->pos++;
+            return ParseClass(parser);
+        }
+
+        case L'^':
+        {
+            parser->pos++;
+            return AddNode(parser, REGEXNODE_LINE_START, 0, 0);
+        }
+
+        case L'$':
+        {
+            parser->pos++;
+            return AddNode(parser, REGEXNODE_LINE_END, 0, 0);
+        }
+
+        case L'\\':
+        {
+            parser->pos++;
+            RegexRange ranges[5];
+            uint count = ParseEscape(parser, ranges);
+            if (count == 0) {
+                return SyntaxError(parser);
+            }
+            return AddSet(parser, ranges, count);
+        }
+
+        default:
+        {
+            RegexRange range;
+            if (!ReadCodePoint(parser, &range.first)) {
+                return SyntaxError(parser);
+            }
+            range.last = range.first;
+            return AddSet(parser, &range, 1);
+        }
+    }
+}
+
+static uint ParseRepeat(RegexParser * parser) {
+    uint node = ParseAtom(parser);
+    while (node != REGEX_NONE && parser->pos != parser->length) {
+        uint minCount = 0;
+        uint maxCount = REGEX_NONE;
+        wchar_t c = parser->pattern[parser->pos];
+        if (c == L'+') {
+            minCount = 1;
+        } else if (c == L'?') {
+            maxCount = 1;
+        } else if (c != L'*' && c != L'{') {
+            break;
+        }
+        parser->pos++;
+        if (c == L'{' && !ParseRepeatCounts(parser, &minCount, &maxCount)) {
+            return REGEX_NONE;
+        }
+
+        node = AddNode(parser, REGEXNODE_REPEAT, node, 0);
+        if (node != REGEX_NONE) {
+            parser->nodes.elems[node].minCount = minCount;
+            parser->nodes.elems[node].maxCount = maxCount;
+        }
+    }
+    return node;
+}
+
+static uint ParseConcatenation(RegexParser * parser) {
+    uint node = AddNode(parser, REGEXNODE_EMPTY, 0, 0);
+    while (node != REGEX_NONE
+        && parser->pos != parser->length
+        && parser->pattern[parser->pos] != L'|'
+        && parser->pattern[parser->pos] != L')')
+    {
+        uint right = ParseRepeat(parser);
+        if (right == REGEX_NONE) {
+            return REGEX_NONE;
+        }
+        node = AddNode(parser, REGEXNODE_CONCAT, node, right);
+    }
+    return node;
+}
+
+static uint ParseAlternation(RegexParser * parser) {
+    uint node = ParseConcatenation(parser);
+    while (node != REGEX_NONE && parser->pos != parser->length && parser->pattern[parser->pos] == L'|') {
+        parser->pos++;
+        uint right = ParseConcatenation(parser);
+        if (right == REGEX_NONE) {
+            return REGEX_NONE;
+        }
+        node = AddNode(parser, REGEXNODE_ALTERNATE, node, right);
+    }
+    return node;
+}
+
+bool GetRegexLiteral(const wchar_t * pattern, size_t length, wchar_t * text, size_t * textLength) {
+    size_t count = 0;
+    for (size_t i = 0; i != length; i++) {
+        wchar_t c = pattern[i];
+        if (c == L'\\') {
+            if (i + 1 == length) {
+                return false;
+            }
+            c = pattern[++i];
+            if (c == L't') {
+                c = L'\t';
+            } else if (iswalnum(c)) {
+                return false;
+            }
+        } else if (wcschr(L".[]()|*+?{}^$", c)) {
+            return false;
+        }
+        text[count++] = c;
+    }
+    *textLength = count;
+    return true;
+}
+
+//-----------
+// Compiling
+
+// The program of a pattern works on UTF-8 bytes: each set of code points becomes alternatives of
+// byte sequences, one for each run of code points whose encodings differ in the last bytes only.
+// The backward program reads the same matches from their end to their start.
+
+enum RegexOp {
+    REGEXOP_BYTES, // a byte from first to last, then next
+    REGEXOP_SPLIT, // both next and alt
+    REGEXOP_LINE_START,
+    REGEXOP_LINE_END,
+    REGEXOP_MATCH,
+};
+
+struct RegexInstr {
+    RegexOp op;
+    uint next;
+    uint alt;
+    unsigned char first;
+    unsigned char last;
+};
+
+struct RegexProgram {
+    MkDynArray<RegexInstr> instrs;
+    uint start;
+};
+
+// Byte ranges matching the UTF-8 encodings of a run of code points.
+struct RegexSequence {
+    unsigned char first[4];
+    unsigned char last[4];
+    uint count;
+};
+
+static uint EncodeUtf8(ulong codePoint, unsigned char * bytes) {
+    if (codePoint < 0x80) {
+        bytes[0] = static_cast<unsigned char>(codePoint);
+        return 1;
+    }
+    if (codePoint < 0x800) {
+        bytes[0] = static_cast<unsigned char>(0xC0 | codePoint >> 6);
+        bytes[1] = static_cast<unsigned char>(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+    if (codePoint < 0x10000) {
+        bytes[0] = static_cast<unsigned char>(0xE0 | codePoint >> 12);
+        bytes[1] = static_cast<unsigned char>(0x80 | (codePoint >> 6 & 0x3F));
+        bytes[2] = static_cast<unsigned char>(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+    bytes[0] = static_cast<unsigned char>(0xF0 | codePoint >> 18);
+    bytes[1] = static_cast<unsigned char>(0x80 | (codePoint >> 12 & 0x3F));
+    bytes[2] = static_cast<unsigned char>(0x80 | (codePoint >> 6 & 0x3F));
+    bytes[3] = static_cast<unsigned char>(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+// Splits a range of code points until the encodings of each part share their length and differ
+// only in byte ranges.
+static void SplitUtf8Range(ulong first, ulong last, RegexSequence * sequences, uint * count) {
+    const ulong lengthLimits[] = { 0x7F, 0x7FF, 0xFFFF };
+    for (uint i = 0; i != 3; i++) {
+        if (first <= lengthLimits[i] && last > lengthLimits[i]) {
+            SplitUtf8Range(first, lengthLimits[i], sequences, count);
+            SplitUtf8Range(lengthLimits[i] + 1, last, sequences, count);
+            return;
+        }
+    }
+    for (uint i = 1; i != 4; i++) {
+        ulong mask = (1ul << (6 * i)) - 1;
+        if ((first & ~mask) != (last & ~mask)) {
+            if ((first & mask) != 0) {
+                SplitUtf8Range(first, first | mask, sequences, count);
+                SplitUtf8Range((first | mask) + 1, last, sequences, count);
+                return;
+            }
+            if ((last & mask) != mask) {
+                SplitUtf8Range(first, (last & ~mask) - 1, sequences, count);
+                SplitUtf8Range(last & ~mask, last, sequences, count);
+                return;
+            }
+        }
+    }
+
+    RegexSequence * sequence = &sequences[(*count)++];
+    sequence->count = EncodeUtf8(first, sequence->first);
+    EncodeUtf8(last, sequence->last);
+}
+
+static uint AddInstr(RegexParser * parser, RegexProgram * program, RegexOp op, uint next, uint alt) {
+    if (program->instrs.count == REGEX_MAX_INSTR_COUNT) {
+        parser->result = RESULT_LIMIT_REACHED;
+        return REGEX_NONE;
+    }
+    RegexInstr * instr = program->instrs.Insert(SIZE_MAX, 1);
+    if (!instr) {
+        parser->result = RESULT_MEMORY_ERROR;
+        return REGEX_NONE;
+    }
+    instr->op = op;
+    instr->next = next;
+    instr->alt = alt;
+    instr->first = 1; // matches nothing
+    instr->last = 0;
+    return static_cast<uint>(program->instrs.count - 1);
+}
+
+static uint AddBytesInstr(RegexParser * parser, RegexProgram * program, unsigned char first, unsigned char last, uint next) {
+    uint instr = AddInstr(parser, program, REGEXOP_BYTES, next, 0);
+    if (instr != REGEX_NONE) {
+        program->instrs.elems[instr].first = first;
+        program->instrs.elems[instr].last = last;
+    }
+    return instr;
+}
+
+static uint CompileSet(RegexParser * parser, RegexProgram * program, const RegexNode * node, uint next, bool backward) {
+    uint start = REGEX_NONE;
+    for (uint i = 0; i != node->second; i++) {
+        const RegexRange * range = &parser->ranges.elems[node->first + i];
+        RegexSequence sequences[REGEX_MAX_SEQUENCE_COUNT];
+        uint sequenceCount = 0;
+        SplitUtf8Range(range->first, range->last, sequences, &sequenceCount);
+        for (uint j = 0; j != sequenceCount; j++) {
+            const RegexSequence * sequence = &sequences[j];
+            uint sequenceStart = next;
+            for (uint k = 0; k != sequence->count && sequenceStart != REGEX_NONE; k++) {
+                uint byteIndex = backward ? k : sequence->count - 1 - k;
+                sequenceStart = AddBytesInstr(parser, program, sequence->first[byteIndex], sequence->last[byteIndex], sequenceStart);
+            }
+            if (start == REGEX_NONE) {
+                start = sequenceStart;
+            } else {
+                start = AddInstr(parser, program, REGEXOP_SPLIT, sequenceStart, start);
+            }
+            if (sequenceStart == REGEX_NONE || start == REGEX_NONE) {
+                return REGEX_NONE;
+            }
+        }
+    }
+    if (start == REGEX_NONE) { // an empty set
+        start = AddInstr(parser, program, REGEXOP_BYTES, next, 0);
+    }
+    return start;
+}
+
+// Compiles a node to run into the next instruction.
+// Returns the instruction to start with, or REGEX_NONE on failure.
+static uint CompileNode(RegexParser * parser, RegexProgram * program, uint nodeIndex, uint next, bool backward) {
+    const RegexNode node = parser->nodes.elems[nodeIndex];
+    switch (node.type) {
+        case REGEXNODE_EMPTY:
+        {
+            return next;
+        }
+
+        case REGEXNODE_SET:
+        {
+            return CompileSet(parser, program, &node, next, backward);
+        }
+
+        case REGEXNODE_CONCAT:
+        {
+            uint first = backward ? node.first : node.second;
+            uint second = backward ? node.second : node.first;
+            uint start = CompileNode(parser, program, first, next, backward);
+            if (start == REGEX_NONE) {
+                return REGEX_NONE;
+            }
+            return CompileNode(parser, program, second, start, backward);
+        }
+
+        case REGEXNODE_ALTERNATE:
+        {
+            uint first = CompileNode(parser, program, node.first, next, backward);
+            if (first == REGEX_NONE) {
+                return REGEX_NONE;
+            }
+            uint second = CompileNode(parser, program, node.second, next, backward);
+            if (second == REGEX_NONE) {
+                return REGEX_NONE;
+            }
+            return AddInstr(parser, program, REGEXOP_SPLIT, first, second);
+        }
+
+        case REGEXNODE_REPEAT:
+        {
+            // x{2,4} runs as x x (x (x)?)? and x{2,} as x x x*.
+            uint start = next;
+            if (node.maxCount == REGEX_NONE) {
+                uint loop = AddInstr(parser, program, REGEXOP_SPLIT, 0, next);
+                if (loop == REGEX_NONE) {
+                    return REGEX_NONE;
+                }
+                uint body = CompileNode(parser, program, node.first, loop, backward);
+                if (body == REGEX_NONE) {
+                    return REGEX_NONE;
+                }
+                program->instrs.elems[loop].next = body;
+                start = loop;
+            } else {
+                for (uint i = node.minCount; i != node.maxCount; i++) {
+                    uint body = CompileNode(parser, program, node.first, start, backward);
+                    if (body == REGEX_NONE) {
+                        return REGEX_NONE;
+                    }
+                    start = AddInstr(parser, program, REGEXOP_SPLIT, body, next);
+                    if (start == REGEX_NONE) {
+                        return REGEX_NONE;
+                    }
+                }
+            }
+            for (uint i = 0; i != node.minCount; i++) {
+                start = CompileNode(parser, program, node.first, start, backward);
+                if (start == REGEX_NONE) {
+                    return REGEX_NONE;
+                }
+            }
+            return start;
+        }
+
+        case REGEXNODE_LINE_START:
+        {
+            return AddInstr(parser, program, backward ? REGEXOP_LINE_END : REGEXOP_LINE_START, next, 0);
+        }
+
+        case REGEXNODE_LINE_END:
+        {
+            return AddInstr(parser, program, backward ? REGEXOP_LINE_START : REGEXOP_LINE_END, next, 0);
+        }
+    }
+    return REGEX_NONE;
+}
+
+static bool CompileProgram(RegexParser * parser, RegexProgram * program, uint root, bool backward) {
+    program->instrs.Init(256);
+    uint match = AddInstr(parser, program, REGEXOP_MATCH, 0, 0);
+    if (match == REGEX_NONE) {
+        return false;
+    }
+    program->start = CompileNode(parser, program, root, match, backward);
+    return program->start != REGEX_NONE;
+}
+
+#define REGEX_MAX_PREFIX_COUNT 16
+
+// Collects the UTF-8 bytes every match starts with, as far as the pattern starts with single
+// characters.
+// Returns whether the whole node is such characters, so the prefix may go on behind it.
+static bool CollectPrefix(RegexParser * parser, uint nodeIndex, char * prefix, uint * prefixCount) {
+    const RegexNode * node = &parser->nodes.elems[nodeIndex];
+    switch (node->type) {
+        case REGEXNODE_EMPTY:
+        {
+            return true;
+        }
+
+        case REGEXNODE_CONCAT:
+        {
+            return CollectPrefix(parser, node->first, prefix, prefixCount)
+                && CollectPrefix(parser, node->second, prefix, prefixCount);
+        }
+
+        case REGEXNODE_SET:
+        {
+            const RegexRange * range = &parser->ranges.elems[node->first];
+            if (node->second != 1 || range->first != range->last) {
+                return false;
+            }
+            unsigned char bytes[4];
+            uint count = EncodeUtf8(range->first, bytes);
+            if (*prefixCount + count > REGEX_MAX_PREFIX_COUNT) {
+                return false;
+            }
+            memcpy(prefix + *prefixCount, bytes, count);
+            *prefixCount += count;
+            return true;
+        }
+
+        default:
+        {
+            // alternatives, repeats and line anchors end the prefix
+            return false;
+        }
+    }
+}
+
+//--------------
+// Lazy Automata
+
+// Each state of an automaton stands for the program positions that are live after the text read so
+// far: byte instructions waiting for their byte, the match, and ends of lines waiting to learn
+// whether the line ends. Starts of lines are decided when a state is made, so a state also records
+// whether it is at the start of a line. Transitions are computed on first use for classes of bytes
+// that every instruction treats alike, and cached in a table with a row for each state.
+//
+// Scanning for a match anywhere adds the program start back after every byte. As a match cannot
+// be seen to end at the end of a line before the line break is read, a state reached through a line
+// break remembers whether a match ended right before it. Where the scan is back at the start with
+// nothing under way and every match starts with the same bytes, it skips ahead to where they occur.
+
+#define REGEX_DFA_TRANSITION_COUNT (64 * 1024)
+#define REGEX_DFA_MAX_STATE_COUNT 4096
+#define REGEX_DFA_SET_COUNT (32 * 1024)
+
+#define REGEXSTATE_LINE_START 1
+#define REGEXSTATE_MATCH_BEFORE 2 // a match ended before the line break leading here
+#define REGEXSTATE_MATCH 4
+#define REGEXSTATE_END_KNOWN 8
+#define REGEXSTATE_END_MATCH 16 // a match ends here if the text ends here
+#define REGEXSTATE_START 32 // nothing but the program start is live
+#define REGEXSTATE_KEY_FLAGS (REGEXSTATE_LINE_START | REGEXSTATE_MATCH_BEFORE)
+
+// States are passed around as the offset of their row of transitions. Transitions hold the same,
+// with the top bits set to leave the fast path: where a match ended, or where the prefix can be
+// skipped to.
+#define REGEX_STATE_STOP 0x80000000u
+#define REGEX_STATE_START 0x40000000u
+#define REGEX_STATE_ROW_MASK 0x3FFFFFFFu
+#define REGEX_STATE_DEAD 0xFFFFFFFEu
+#define REGEX_STATE_UNKNOWN 0xFFFFFFFFu
+
+struct RegexState {
+    uint setStart;
+    uint setCount;
+    uint hash;
+    uint flags;
+};
+
+struct RegexDfa {
+    const RegexProgram * program;
+    bool anywhere; // a match may start at any byte
+    RegexState * states;
+    uint stateCount;
+    uint maxStateCount;
+    uint * sets;
+    uint setCount;
+    uint maxSetCount;
+    uint * transitions; // maxStateCount rows of classCount
+    uint * buckets; // state index + 1, or 0 for none
+    uint bucketMask;
+    uint startStates[2]; // in the middle and at the start of a line
+};
+
+struct Regex {
+    RegexProgram forward;
+    RegexProgram backward;
+    unsigned char classes[256];
+    unsigned char classBytes[256]; // one byte of each class
+    uint classCount;
+    uint lineBreakClass;
+    char prefix[REGEX_MAX_PREFIX_COUNT];
+    uint prefixCount;
+
+    RegexDfa scanDfa; // forward, matches starting anywhere
+    RegexDfa endDfa; // forward, matches starting where matching starts
+    RegexDfa startDfa; // backward, matches ending anywhere
+
+    // for following instructions
+    uint * stack;
+    uint * marks;
+    uint markId;
+    uint maxInstrCount;
+    uint * seeds;
+    uint * closure;
+    uint * lineEndClosure;
+};
+
+static bool InitDfa(Regex * regex, RegexDfa * dfa, const RegexProgram * program, bool anywhere) {
+    dfa->program = program;
+    dfa->anywhere = anywhere;
+    dfa->maxStateCount = REGEX_DFA_TRANSITION_COUNT / regex->classCount;
+    if (dfa->maxStateCount > REGEX_DFA_MAX_STATE_COUNT) {
+        dfa->maxStateCount = REGEX_DFA_MAX_STATE_COUNT;
+    }
+    dfa->maxSetCount = REGEX_DFA_SET_COUNT;
+    if (dfa->maxSetCount < 2 * regex->maxInstrCount) {
+        dfa->maxSetCount = 2 * regex->maxInstrCount;
+    }
+    uint bucketCount = 1;
+    while (bucketCount < 2 * dfa->maxStateCount) {
+        bucketCount *= 2;
+    }
+    dfa->bucketMask = bucketCount - 1;
+
+    dfa->states = static_cast<RegexState *>(malloc(dfa->maxStateCount * sizeof(RegexState)));
+    dfa->sets = static_cast<uint *>(malloc(dfa->maxSetCount * sizeof(uint)));
+    dfa->transitions = static_cast<uint *>(malloc(dfa->maxStateCount * regex->classCount * sizeof(uint)));
+    dfa->buckets = static_cast<uint *>(calloc(bucketCount, sizeof(uint)));
+    dfa->stateCount = 0;
+    dfa->setCount = 0;
+    dfa->startStates[0] = REGEX_STATE_UNKNOWN;
+    dfa->startStates[1] = REGEX_STATE_UNKNOWN;
+    return dfa->states && dfa->sets && dfa->transitions && dfa->buckets;
+}
+
+static void FreeDfa(RegexDfa * dfa) {
+    free(dfa->states);
+    free(dfa->sets);
+    free(dfa->transitions);
+    free(dfa->buckets);
+}
+
+static void ClearDfa(RegexDfa * dfa) {
+    dfa->stateCount = 0;
+    dfa->setCount = 0;
+    memset(dfa->buckets, 0, (dfa->bucketMask + 1) * sizeof(uint));
+    dfa->startStates[0] = REGEX_STATE_UNKNOWN;
+    dfa->startStates[1] = REGEX_STATE_UNKNOWN;
+}
+
+static int CompareUints(const void * a, const void * b) {
+    uint first = *static_cast<const uint *>(a);
+    uint second = *static_cast<const uint *>(b);
+    return first < second ? -1 : first > second;
+}
+
+// Follows the instructions from seeds up to those reading a byte or deciding a match, in order.
+// Returns their count, and whether the match is among them.
+static uint FollowInstrs(Regex * regex, const RegexProgram * program, const uint * seeds, uint seedCount, uint flags, bool lineEnd, uint * set, bool * match) {
+    regex->markId++;
+    if (regex->markId == 0) {
+        memset(regex->marks, 0, regex->maxInstrCount * sizeof(uint));
+        regex->markId = 1;
+    }
+
+    const RegexInstr * instrs = program->instrs.elems;
+    uint * stack = regex->stack;
+    uint depth = 0;
+    for (uint i = seedCount; i != 0; i--) {
+        stack[depth++] = seeds[i - 1];
+    }
+    uint count = 0;
+    *match = false;
+    while (depth != 0) {
+        uint index = stack[--depth];
+        if (regex->marks[index] == regex->markId) {
+            continue;
+        }
+        regex->marks[index] = regex->markId;
+
+        const RegexInstr * instr = &instrs[index];
+        switch (instr->op) {
+            case REGEXOP_SPLIT:
+            {
+                stack[depth++] = instr->alt;
+                stack[depth++] = instr->next;
+                break;
+            }
+
+            case REGEXOP_LINE_START:
+            {
+                if (flags & REGEXSTATE_LINE_START) {
+                    stack[depth++] = instr->next;
+                }
+                break;
+            }
+
+            case REGEXOP_LINE_END:
+            {
+                if (lineEnd) {
+                    stack[depth++] = instr->next;
+                } else {
+                    set[count++] = index;
+                }
+                break;
+            }
+
+            case REGEXOP_MATCH:
+            {
+                *match = true;
+                set[count++] = index;
+                break;
+            }
+
+            default:
+            {
+                set[count++] = index;
+                break;
+            }
+        }
+    }
+    qsort(set, count, sizeof(uint), CompareUints);
+    return count;
+}
+
+// Returns the index of the state for a set, adding it if there is none yet. A full automaton is
+// cleared first.
+static uint AddState(Regex * regex, RegexDfa * dfa, const uint * set, uint count, uint flags) {
+    uint hash = 2166136261u ^ flags;
+    for (uint i = 0; i != count; i++) {
+        hash = (hash ^ set[i]) * 16777619u;
+    }
+
+    uint bucket = hash & dfa->bucketMask;
+    while (dfa->buckets[bucket] != 0) {
+        RegexState * state = &dfa->states[dfa->buckets[bucket] - 1];
+        if (state->hash == hash
+            && (state->flags & REGEXSTATE_KEY_FLAGS) == flags
+            && state->setCount == count
+            && memcmp(dfa->sets + state->setStart, set, count * sizeof(uint)) == 0)
+        {
+            return dfa->buckets[bucket] - 1;
+        }
+        bucket = (bucket + 1) & dfa->bucketMask;
+    }
+
+    if (dfa->stateCount == dfa->maxStateCount || dfa->maxSetCount - dfa->setCount < count) {
+        ClearDfa(dfa);
+        bucket = hash & dfa->bucketMask;
+    }
+
+    uint index = dfa->stateCount++;
+    RegexState * state = &dfa->states[index];
+    state->setStart = dfa->setCount;
+    state->setCount = count;
+    state->hash = hash;
+    state->flags = flags;
+    memcpy(dfa->sets + dfa->setCount, set, count * sizeof(uint));
+    dfa->setCount += count;
+    for (uint i = 0; i != count; i++) {
+        if (dfa->program->instrs.elems[set[i]].op == REGEXOP_MATCH) {
+            state->flags |= REGEXSTATE_MATCH;
+        }
+    }
+    if (count == 1 && set[0] == dfa->program->start && !(flags & REGEXSTATE_MATCH_BEFORE)) {
+        state->flags |= REGEXSTATE_START;
+    }
+    memset(dfa->transitions + index * regex->classCount, 0xFF, regex->classCount * sizeof(uint));
+    dfa->buckets[bucket] = index + 1;
+    return index;
+}
+
+static RegexState * GetState(Regex * regex, RegexDfa * dfa, uint state) {
+    return &dfa->states[state / regex->classCount];
+}
+
+static uint GetStartState(Regex * regex, RegexDfa * dfa, bool lineStart) {
+    if (dfa->startStates[lineStart] == REGEX_STATE_UNKNOWN) {
+        uint flags = lineStart ? REGEXSTATE_LINE_START : 0;
+        bool match;
+        uint count = FollowInstrs(regex, dfa->program, &dfa->program->start, 1, flags, false, regex->closure, &match);
+        uint index = AddState(regex, dfa, regex->closure, count, flags);
+        dfa->startStates[lineStart] = index * regex->classCount;
+    }
+    return dfa->startStates[lineStart];
+}
+
+// Returns whether a match ends in a state if the text or line ends there.
+static bool MatchesAtEnd(Regex * regex, RegexDfa * dfa, uint stateRow) {
+    RegexState * state = GetState(regex, dfa, stateRow);
+    if (!(state->flags & REGEXSTATE_END_KNOWN)) {
+        bool match;
+        FollowInstrs(regex, dfa->program, dfa->sets + state->setStart, state->setCount, state->flags, true, regex->lineEndClosure, &match);
+        state->flags |= REGEXSTATE_END_KNOWN | (match ? REGEXSTATE_END_MATCH : 0);
+    }
+    return (state->flags & REGEXSTATE_END_MATCH) != 0;
+}
+
+// Computes the transition of a state on a class of bytes and caches it.
+// Returns the transition.
+static uint StepDfa(Regex * regex, RegexDfa * dfa, uint stateRow, uint byteClass) {
+    const RegexState * state = GetState(regex, dfa, stateRow);
+    const RegexInstr * instrs = dfa->program->instrs.elems;
+    const uint * set = dfa->sets + state->setStart;
+    uint seedCount = 0;
+    uint flags = 0;
+    if (byteClass == regex->lineBreakClass) {
+        flags = REGEXSTATE_LINE_START;
+        if (MatchesAtEnd(regex, dfa, stateRow)) {
+            flags |= REGEXSTATE_MATCH_BEFORE;
+        }
+    } else {
+        unsigned char b = regex->classBytes[byteClass];
+        for (uint i = 0; i != state->setCount; i++) {
+            const RegexInstr * instr = &instrs[set[i]];
+            if (instr->op == REGEXOP_BYTES && b >= instr->first && b <= instr->last) {
+                regex->seeds[seedCount++] = instr->next;
+            }
+        }
+    }
+    if (dfa->anywhere) {
+        regex->seeds[seedCount++] = dfa->program->start;
+    }
+
+    bool match;
+    uint count = FollowInstrs(regex, dfa->program, regex->seeds, seedCount, flags, false, regex->closure, &match);
+    uint next;
+    if (count == 0 && !dfa->anywhere && !(flags & REGEXSTATE_MATCH_BEFORE)) {
+        next = REGEX_STATE_DEAD;
+    } else {
+        uint stateCount = dfa->stateCount;
+        uint index = AddState(regex, dfa, regex->closure, count, flags);
+        uint nextFlags = dfa->states[index].flags;
+        next = index * regex->classCount;
+        if (nextFlags & (REGEXSTATE_MATCH | REGEXSTATE_MATCH_BEFORE)) {
+            next |= REGEX_STATE_STOP;
+        }
+        if ((nextFlags & REGEXSTATE_START) && dfa->anywhere && regex->prefixCount != 0) {
+            next |= REGEX_STATE_START;
+        }
+        if (dfa->stateCount < stateCount) {
+            return next; // cleared, and the state left behind with it
+        }
+    }
+    dfa->transitions[stateRow + byteClass] = next;
+    return next;
+}
+
+// Returns the offset of the first place from which the text could start with the prefix, which
+// may run past its end.
+static size_t FindPrefix(Regex * regex, const unsigned char * bytes, size_t count) {
+    const uint prefixCount = regex->prefixCount;
+    if (count < prefixCount) {
+        return 0;
+    }
+    const size_t lastOffset = prefixCount - 1;
+    const __m128i first = _mm_set1_epi8(regex->prefix[0]);
+    const __m128i last = _mm_set1_epi8(regex->prefix[lastOffset]);
+    size_t end = count - lastOffset; // of the places with room for it
+    size_t i = 0;
+    for (; end - i >= 16; i += 16) {
+        uint hits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i)), first))
+            & _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i + lastOffset)), last));
+        unsigned long bit;
+        while (_BitScanForward(&bit, hits)) {
+            if (memcmp(bytes + i + bit, regex->prefix, prefixCount) == 0) {
+                return i + bit;
+            }
+            hits &= hits - 1;
+        }
+    }
+    for (; i != end; i++) {
+        if (memcmp(bytes + i, regex->prefix, prefixCount) == 0) {
+            return i;
+        }
+    }
+    return end;
+}
+
+//----------
+// Matching
+
+// Matches that may be empty would otherwise also start between the bytes of a sequence.
+static bool StartsSequence(const unsigned char * bytes, size_t count, size_t i) {
+    return i == count || (bytes[i] & 0xC0) != 0x80;
+}
+
+ResultCode CompileRegex(const wchar_t * pattern, size_t length, Regex ** regex) {
+    if (length > REGEX_MAX_LENGTH) {
+        return RESULT_LIMIT_REACHED;
+    }
+
+    RegexParser parser;
+    parser.pattern = pattern;
+    parser.length = length;
+    parser.pos = 0;
+    parser.nodes.Init(64);
+    parser.ranges.Init(64);
+    parser.classRanges = static_cast<RegexRange *>(malloc(REGEX_MAX_CLASS_RANGE_COUNT * sizeof(RegexRange)));
+    parser.scratchRanges = static_cast<RegexRange *>(malloc(REGEX_MAX_CLASS_RANGE_COUNT * sizeof(RegexRange)));
+    parser.result = RESULT_OK;
+
+    Regex * newRegex = static_cast<Regex *>(calloc(1, sizeof(Regex)));
+    if (!newRegex || !parser.classRanges || !parser.scratchRanges) {
+        free(newRegex);
+        free(parser.classRanges);
+        free(parser.scratchRanges);
+        return RESULT_MEMORY_ERROR;
+    }
+
+    uint root = ParseAlternation(&parser);
+    if (root != REGEX_NONE && parser.pos != parser.length) {
+        root = SyntaxError(&parser); // a closing parenthesis without an opening one
+    }
+    if (root != REGEX_NONE) {
+        CompileProgram(&parser, &newRegex->forward, root, false);
+        if (parser.result == RESULT_OK) {
+            CompileProgram(&parser, &newRegex->backward, root, true);
+        }
+    }
+    if (parser.result == RESULT_OK) {
+        CollectPrefix(&parser, root, newRegex->prefix, &newRegex->prefixCount);
+    }
+    parser.nodes.Clear();
+    parser.ranges.Clear();
+    free(parser.classRanges);
+    free(parser.scratchRanges);
+    if (parser.result != RESULT_OK) {
+        newRegex->forward.instrs.Clear();
+        newRegex->backward.instrs.Clear();
+        free(newRegex);
+        return parser.result;
+    }
+
+    // Bytes are told apart only where some instruction does. Line breaks are always a class of
+    // their own.
+    bool classStarts[257] = {};
+    classStarts['\n'] = true;
+    classStarts['\n' + 1] = true;
+    const RegexProgram * programs[] = { &newRegex->forward, &newRegex->backward };
+    for (uint i = 0; i != 2; i++) {
+        for (size_t j = 0; j != programs[i]->instrs.count; j++) {
+            const RegexInstr * instr = &programs[i]->instrs.elems[j];
+            if (instr->op == REGEXOP_BYTES && instr->first <= instr->last) {
+                classStarts[instr->first] = true;
+                classStarts[instr->last + 1] = true;
+            }
+        }
+    }
+    uint classCount = 0;
+    for (uint b = 0; b != 256; b++) {
+        if (b != 0 && classStarts[b]) {
+            classCount++;
+        }
+        if (b == 0 || classStarts[b]) {
+            newRegex->classBytes[classCount] = static_cast<unsigned char>(b);
+        }
+        newRegex->classes[b] = static_cast<unsigned char>(classCount);
+    }
+    newRegex->classCount = classCount + 1;
+    newRegex->lineBreakClass = newRegex->classes['\n'];
+
+    uint maxInstrCount = static_cast<uint>(newRegex->forward.instrs.count);
+    if (newRegex->backward.instrs.count > maxInstrCount) {
+        maxInstrCount = static_cast<uint>(newRegex->backward.instrs.count);
+    }
+    newRegex->maxInstrCount = maxInstrCount;
+    newRegex->stack = static_cast<uint *>(malloc((3 * maxInstrCount + 2) * sizeof(uint)));
+    newRegex->marks = static_cast<uint *>(calloc(maxInstrCount, sizeof(uint)));
+    newRegex->seeds = static_cast<uint *>(malloc((maxInstrCount + 1) * sizeof(uint)));
+    newRegex->closure = static_cast<uint *>(malloc(maxInstrCount * sizeof(uint)));
+    newRegex->lineEndClosure = static_cast<uint *>(malloc(maxInstrCount * sizeof(uint)));
+    bool initialized = InitDfa(newRegex, &newRegex->scanDfa, &newRegex->forward, true);
+    initialized = InitDfa(newRegex, &newRegex->endDfa, &newRegex->forward, false) && initialized;
+    initialized = InitDfa(newRegex, &newRegex->startDfa, &newRegex->backward, true) && initialized;
+    if (!initialized
+        || !newRegex->stack
+        || !newRegex->marks
+        || !newRegex->seeds
+        || !newRegex->closure
+        || !newRegex->lineEndClosure)
+    {
+        DestroyRegex(newRegex);
+        return RESULT_MEMORY_ERROR;
+    }
+
+    *regex = newRegex;
+    return RESULT_OK;
+}
+
+void DestroyRegex(Regex * regex) {
+    regex->forward.instrs.Clear();
+    regex->backward.instrs.Clear();
+    FreeDfa(&regex->scanDfa);
+    FreeDfa(&regex->endDfa);
+    FreeDfa(&regex->startDfa);
+    free(regex->stack);
+    free(regex->marks);
+    free(regex->seeds);
+    free(regex->closure);
+    free(regex->lineEndClosure);
+    free(regex);
+}
+
+uint StartRegexScan(Regex * regex) {
+    return GetStartState(regex, &regex->scanDfa, true);
+}
+
+bool ScanRegex(Regex * regex, uint * state, const char * bytes, size_t count, size_t * matchEnd) {
+    RegexDfa * dfa = &regex->scanDfa;
+    uint current = *state;
+    RegexState * currentState = GetState(regex, dfa, current);
+    if (currentState->flags & REGEXSTATE_MATCH) {
+        *matchEnd = 0;
+        return true;
+    }
+
+    const unsigned char * start = reinterpret_cast<const unsigned char *>(bytes);
+    const unsigned char * next = start;
+    const unsigned char * end = start + count;
+    if ((currentState->flags & REGEXSTATE_START) && regex->prefixCount != 0) {
+        next += FindPrefix(regex, next, end - next);
+    }
+    const unsigned char * classes = regex->classes;
+    const uint * transitions = dfa->transitions;
+    while (next != end) {
+        uint transition = transitions[current + classes[*next++]];
+        if (transition < REGEX_STATE_START) {
+            current = transition;
+            continue;
+        }
+
+        if (transition == REGEX_STATE_UNKNOWN) {
+            transition = StepDfa(regex, dfa, current, classes[next[-1]]);
+        }
+        current = transition & REGEX_STATE_ROW_MASK;
+        if (transition & REGEX_STATE_STOP) {
+            *state = current;
+            *matchEnd = next - start;
+            if (GetState(regex, dfa, current)->flags & REGEXSTATE_MATCH_BEFORE) {
+                (*matchEnd)--;
+            }
+            return true;
+        }
+        if (transition & REGEX_STATE_START) {
+            next += FindPrefix(regex, next, end - next);
+        }
+    }
+    *state = current;
+    return false;
+}
+
+bool EndRegexScan(Regex * regex, uint state) {
+    return MatchesAtEnd(regex, &regex->scanDfa, state);
+}
+
+// Runs the backward automaton over a line down to an offset, which finds every offset a match
+// starts at, the leftmost one last. Each is marked in a buffer of count + 1 bytes if there is one,
+// and every other offset is cleared.
+static bool FindLineStarts(Regex * regex, const unsigned char * bytes, size_t count, size_t from, char * starts, size_t * start) {
+    RegexDfa * dfa = &regex->startDfa;
+    const unsigned char * classes = regex->classes;
+    uint state = GetStartState(regex, dfa, true);
+    bool found = false;
+    if (GetState(regex, dfa, state)->flags & REGEXSTATE_MATCH) {
+        found = true;
+        *start = count;
+    }
+    if (starts) {
+        starts[count] = found;
+    }
+    size_t i = count;
+    while (i > from) {
+        uint byteClass = classes[bytes[--i]];
+        uint transition = dfa->transitions[state + byteClass];
+        if (transition == REGEX_STATE_UNKNOWN) {
+            transition = StepDfa(regex, dfa, state, byteClass);
+        }
+        state = transition & REGEX_STATE_ROW_MASK;
+        bool stop = (transition & REGEX_STATE_STOP) && StartsSequence(bytes, count, i);
+        if (stop) {
+            found = true;
+            *start = i;
+        }
+        if (starts) {
+            starts[i] = stop;
+        }
+    }
+    if (from == 0 && MatchesAtEnd(regex, dfa, state)) {
+        found = true;
+        *start = 0;
+        if (starts) {
+            starts[0] = true;
+        }
+    }
+    return found;
+}
+
+// Runs the forward automaton from an offset a match starts at until no match can go on, which
+// finds the end of the longest match.
+static size_t FindLineMatchEnd(Regex * regex, const unsigned char * bytes, size_t count, size_t start) {
+    RegexDfa * dfa = &regex->endDfa;
+    const unsigned char * classes = regex->classes;
+    uint state = GetStartState(regex, dfa, start == 0);
+    size_t end = start;
+    size_t i;
+    for (i = start; i != count; i++) {
+        uint byteClass = classes[bytes[i]];
+        uint transition = dfa->transitions[state + byteClass];
+        if (transition == REGEX_STATE_UNKNOWN) {
+            transition = StepDfa(regex, dfa, state, byteClass);
+        }
+        if (transition == REGEX_STATE_DEAD) {
+            break;
+        }
+        state = transition & REGEX_STATE_ROW_MASK;
+        if (transition & REGEX_STATE_STOP) {
+            end = i + 1;
+        }
+    }
+    if (i == count && MatchesAtEnd(regex, dfa, state)) {
+        end = count;
+    }
+    return end;
+}
+
+bool MatchRegexLine(Regex * regex, const char * line, size_t count, size_t from, size_t * start, size_t * end) {
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>(line);
+    if (!FindLineStarts(regex, bytes, count, from, nullptr, start) || *start < from) {
+        return false;
+    }
+    *end = FindLineMatchEnd(regex, bytes, count, *start);
+    return true;
+}
+
+bool MarkRegexLineStarts(Regex * regex, const char * line, size_t count, char * starts) {
+    size_t start;
+    return FindLineStarts(regex, reinterpret_cast<const unsigned char *>(line), count, 0, starts, &start);
+}
+
+size_t MatchRegexLineAt(Regex * regex, const char * line, size_t count, size_t start) {
+    return FindLineMatchEnd(regex, reinterpret_cast<const unsigned char *>(line), count, start);
+}
+
+bool MatchRegexLineBackward(Regex * regex, const char * line, size_t count, size_t before, size_t * start) {
+    RegexDfa * dfa = &regex->startDfa;
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>(line);
+    uint state = GetStartState(regex, dfa, true);
+    if (count < before && (GetState(regex, dfa, state)->flags & REGEXSTATE_MATCH)) {
+        *start = count;
+        return true;
+    }
+    size_t i = count;
+    while (i != 0) {
+        uint byteClass = regex->classes[bytes[--i]];
+        uint transition = dfa->transitions[state + byteClass];
+        if (transition == REGEX_STATE_UNKNOWN) {
+            transition = StepDfa(regex, dfa, state, byteClass);
+        }
+        state = transition & REGEX_STATE_ROW_MASK;
+        if (i < before && (transition & REGEX_STATE_STOP) && StartsSequence(bytes, count, i)) {
+            *start = i;
+            return true;
+        }
+    }
+    if (before != 0 && MatchesAtEnd(regex, dfa, state)) {
+        *start = 0;
+        return true;
+    }
+    return false;
+}
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Base.h"
+
+#define REGEX_MAX_LENGTH 512
+
+// A regular expression compiled into automata over UTF-8 bytes. Patterns use the extended syntax:
+// . [abc] [^a-z] ( ) | * + ? {n} {n,} {n,m} ^ $, the escapes \d \w \s \D \W \S and \t, and a
+// backslash before any other punctuation for the character itself. Matches never cross a line
+// break: the dot and negated classes leave line breaks out, and ^ and $ match at the start and end
+// of every line. The leftmost match is taken, and the longest one starting there.
+//
+// The automata are deterministic and built lazily from the compiled program while matching, one
+// state for each set of program positions met. They live in tables of a fixed size allocated up
+// front, which are cleared whenever they fill up, so matching takes time linear in the text and
+// never allocates. As the states are built while matching, a regex must only be used by one thread
+// at a time.
+struct Regex;
+
+// Compiles a pattern.
+// Returns:
+// - RESULT_OK
+// - RESULT_MEMORY_ERROR
+// - RESULT_LIMIT_REACHED if the pattern is longer than REGEX_MAX_LENGTH or repeats too much
+// - RESULT_SYNTAX_ERROR
+ResultCode CompileRegex(const wchar_t * pattern, size_t length, Regex ** regex);
+
+void DestroyRegex(Regex * regex);
+
+// Returns whether a pattern matches nothing but one text, and the text, which is at most as long.
+bool GetRegexLiteral(const wchar_t * pattern, size_t length, wchar_t * text, size_t * textLength);
+
+// Returns the state to scan text with from the start of a line.
+uint StartRegexScan(Regex * regex);
+
+// Scans text for the end of a match, in a state left by the last call or from StartRegexScan. The
+// text may be split anywhere, and spans any number of lines.
+// Returns whether a match ends within the text, and the offset it ends at. A match at the start of
+// a line ends behind the line break before it.
+bool ScanRegex(Regex * regex, uint * state, const char * bytes, size_t count, size_t * matchEnd);
+
+// Returns whether a match ends at the end of the text scanned.
+bool EndRegexScan(Regex * regex, uint state);
+
+// Finds the leftmost match in a line starting at an offset or behind it, and the longest one
+// starting there. The line holds no line break.
+bool MatchRegexLine(Regex * regex, const char * line, size_t count, size_t from, size_t * start, size_t * end);
+
+// Marks every offset of a line that a match starts at, in a buffer of count + 1 bytes holding
+// whether one starts at each. With MatchRegexLineAt, this finds all the matches of a line in one
+// pass over it, where MatchRegexLine takes one pass for each.
+// Returns whether a match starts anywhere.
+bool MarkRegexLineStarts(Regex * regex, const char * line, size_t count, char * starts);
+
+// Returns the end of the longest match starting at an offset of a line marked by
+// MarkRegexLineStarts.
+size_t MatchRegexLineAt(Regex * regex, const char * line, size_t count, size_t start);
+
+// Finds the last offset of a line before a limit that a match starts at.
+bool MatchRegexLineBackward(Regex * regex, const char * line, size_t count, size_t before, size_t * start);
\ No newline at end of file
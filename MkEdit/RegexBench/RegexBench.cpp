@@ -0,0 +1,138 @@
+// Times the regex engine against std::wregex on the lines MKedit -bench generates. MKedit is built
+// without the C++ standard library and without exceptions, which std::wregex reports errors by, so
+// this program is a project of its own built with /EHsc. It builds Regex.cpp alone and is left out
+// of the solution build: build the RegexBench project and run RegexBench.exe from a console.
+//
+// Each pattern is counted on every line, by both engines, and the counts compared. The engine scans
+// the whole text in UTF-8 as FindDocRegex does and starts over behind each line found, where
+// std::wregex searches the lines one by one in UTF-16, as ECMAScript anchors ^ and $ to the ends of
+// the text searched rather than of every line.
+
+#include <chrono>
+#include <regex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "../Regex.h"
+
+#define BENCH_LINE_COUNT 1000000
+
+// Generates lines of text of about 60 bytes each, all different, as MKedit -bench does, between a
+// first and a last line for the patterns to find.
+// Returns NULL on memory allocation failure.
+static char * GenerateBenchText(size_t lineCount, size_t * count) {
+    const size_t maxLineCount = 64;
+    char * bytes = static_cast<char *>(malloc((lineCount + 2) * maxLineCount + 1));
+    if (!bytes) {
+        return nullptr;
+    }
+    size_t byteCount = snprintf(bytes, maxLineCount + 1, "start of the log\n");
+    for (size_t i = 0; i != lineCount; i++) {
+        byteCount += snprintf(
+            bytes + byteCount,
+            maxLineCount + 1,
+            "%010zu INFO request served in %zu ms by worker %zu\n",
+            i,
+            i % 997,
+            i % 16);
+    }
+    byteCount += snprintf(bytes + byteCount, maxLineCount + 1, "end of the log\n");
+    *count = byteCount;
+    return bytes;
+}
+
+// Returns the seconds passed since a time.
+static double GetBenchSeconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Counts the lines holding a match of a regex, scanning the text for the end of one and starting
+// over behind the line it ends in. The patterns benched match no empty text, so the byte before the
+// end of a match is in its line.
+static size_t CountRegexLines(Regex * regex, const char * bytes, size_t count) {
+    size_t lineCount = 0;
+    size_t pos = 0;
+    uint state = StartRegexScan(regex);
+    size_t matchEnd;
+    while (pos != count && ScanRegex(regex, &state, bytes + pos, count - pos, &matchEnd)) {
+        lineCount++;
+        const char * lineBreak = static_cast<const char *>(memchr(bytes + pos + matchEnd - 1, '\n', count - pos - matchEnd + 1));
+        if (!lineBreak) {
+            return lineCount;
+        }
+        pos = lineBreak + 1 - bytes;
+        state = StartRegexScan(regex);
+    }
+    return lineCount;
+}
+
+// Counts the lines holding a match of a std::wregex, searching them one by one.
+static size_t CountStdRegexLines(const std::wregex * regex, const wchar_t * chars, size_t length) {
+    size_t lineCount = 0;
+    const wchar_t * line = chars;
+    const wchar_t * end = chars + length;
+    while (line != end) {
+        const wchar_t * lineBreak = wmemchr(line, L'\n', end - line);
+        const wchar_t * lineEnd = lineBreak ? lineBreak : end;
+        if (std::regex_search(line, lineEnd, *regex)) {
+            lineCount++;
+        }
+        line = lineBreak ? lineBreak + 1 : end;
+    }
+    return lineCount;
+}
+
+int main() {
+    const wchar_t * patterns[] = {
+        L"worker 1[45]$", L"end of the lo?g$", L"(start|end) of the log", L"^[a-z]+ of the log$", L"in [0-9]+ ms by",
+    };
+    size_t count;
+    char * bytes = GenerateBenchText(BENCH_LINE_COUNT, &count);
+    wchar_t * chars = bytes ? static_cast<wchar_t *>(malloc(count * sizeof(wchar_t))) : nullptr;
+    if (!chars) {
+        printf("regex against std::wregex: out of memory\n");
+        free(bytes);
+        return 1;
+    }
+    for (size_t i = 0; i != count; i++) {
+        chars[i] = static_cast<wchar_t>(bytes[i]); // the text is ASCII
+    }
+
+    int failedCount = 0;
+    for (size_t i = 0; i != sizeof(patterns) / sizeof(patterns[0]); i++) {
+        Regex * regex;
+        if (CompileRegex(patterns[i], wcslen(patterns[i]), &regex) != RESULT_OK) {
+            printf("regex, %ls: failed to compile\n", patterns[i]);
+            failedCount++;
+            continue;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        size_t lineCount = CountRegexLines(regex, bytes, count);
+        double seconds = GetBenchSeconds(start);
+        DestroyRegex(regex);
+
+        std::wregex stdRegex(patterns[i], std::regex_constants::ECMAScript | std::regex_constants::optimize);
+        start = std::chrono::steady_clock::now();
+        size_t stdLineCount = CountStdRegexLines(&stdRegex, chars, count);
+        double stdSeconds = GetBenchSeconds(start);
+
+        printf(
+            "regex, %d lines, %ls: %zu lines in %.1f ms (%.2f GB/s), std::wregex %.1f ms (%.3f GB/s)%s\n",
+            BENCH_LINE_COUNT,
+            patterns[i],
+            lineCount,
+            1e3 * seconds,
+            count / seconds / 1e9,
+            1e3 * stdSeconds,
+            count / stdSeconds / 1e9,
+            lineCount == stdLineCount ? "" : ", counts differ");
+        if (lineCount != stdLineCount) {
+            failedCount++;
+        }
+    }
+    free(bytes);
+    free(chars);
+    return failedCount;
+}